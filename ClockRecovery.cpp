@@ -0,0 +1,312 @@
+// ClockRecovery.cpp -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#include "ClockRecovery.h"
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+// need a few samples spread over some time before trusting the fit
+static const size_t kMinSamples = 8;
+static const int64_t kMinSpanNS = 20 * 1000000LL;
+
+struct LineFit
+{
+	double slope;
+	double meanX;
+	double meanY;
+};
+
+template <typename GetX, typename GetY, typename Container>
+LineFit
+leastSquares( const Container &c, GetX gx, GetY gy )
+{
+	LineFit r;
+	double n = double( c.size() );
+	double sx = 0.0, sy = 0.0;
+	for ( auto &s: c )
+	{
+		sx += gx( s );
+		sy += gy( s );
+	}
+	r.meanX = sx / n;
+	r.meanY = sy / n;
+
+	double sxx = 0.0, sxy = 0.0;
+	for ( auto &s: c )
+	{
+		double dx = gx( s ) - r.meanX;
+		sxx += dx * dx;
+		sxy += dx * ( gy( s ) - r.meanY );
+	}
+	r.slope = sxx > 0.0 ? sxy / sxx : 0.0;
+	return r;
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+namespace USB
+{
+
+
+////////////////////////////////////////
+
+
+ClockRecovery::ClockRecovery( void )
+{
+	mySamples.reserve( kWindow );
+}
+
+
+////////////////////////////////////////
+
+
+void
+ClockRecovery::reset( uint32_t clockFrequency )
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	myFrequency = clockFrequency;
+	mySamples.clear();
+	myNext = 0;
+	myHaveLast = false;
+	myUseSOF = true;
+	myDirty = false;
+	myValid = false;
+	myJitter = 0.0;
+}
+
+
+////////////////////////////////////////
+
+
+void
+ClockRecovery::addSample( uint32_t stc, uint16_t sof, int64_t hostNS )
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+
+	sof &= 0x7FF;
+	Sample s;
+	if ( myHaveLast )
+	{
+		// many devices repeat the same SCR in every payload of a
+		// frame, the first arrival is the one closest to the truth
+		if ( stc == static_cast<uint32_t>( myLast.stc ) )
+			return;
+
+		s.stc = myLast.stc + static_cast<int32_t>( stc - static_cast<uint32_t>( myLast.stc ) );
+
+		// the frame number wraps every 2048ms, use the host clock to
+		// work out how many times it has since the last sample
+		int64_t d = ( sof - myLastRawSOF ) & 0x7FF;
+		double expect = double( hostNS - myLast.host ) * 1e-6;
+		int64_t wraps = static_cast<int64_t>( std::floor( ( expect - double( d ) ) / 2048.0 + 0.5 ) );
+		s.sof = myLast.sof + d + std::max( wraps, int64_t(0) ) * 2048;
+	}
+	else
+	{
+		s.stc = stc;
+		s.sof = sof;
+	}
+	s.host = hostNS;
+
+	myLast = s;
+	myLastRawSOF = sof;
+	myHaveLast = true;
+
+	if ( mySamples.size() < kWindow )
+		mySamples.push_back( s );
+	else
+	{
+		mySamples[myNext] = s;
+		myNext = ( myNext + 1 ) % kWindow;
+	}
+	myDirty = true;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+ClockRecovery::valid( void ) const
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	refit();
+	return myValid;
+}
+
+
+////////////////////////////////////////
+
+
+int64_t
+ClockRecovery::toHost( uint32_t deviceTime ) const
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	refit();
+	if ( ! myValid )
+		return 0;
+
+	double x = double( unwrapSTC( deviceTime ) - myOrigin.stc );
+	double h;
+	if ( myUseSOF )
+		h = myHostFit.slope * ( myDeviceFit.slope * x + myDeviceFit.offset ) + myHostFit.offset;
+	else
+		h = myHostFit.slope * x + myHostFit.offset;
+
+	return myOrigin.host + static_cast<int64_t>( std::llround( h ) );
+}
+
+
+////////////////////////////////////////
+
+
+double
+ClockRecovery::driftPPM( void ) const
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	refit();
+	if ( ! myValid || myFrequency == 0 )
+		return 0.0;
+
+	double nsPerTick = myHostFit.slope;
+	if ( myUseSOF )
+		nsPerTick *= myDeviceFit.slope;
+	if ( nsPerTick <= 0.0 )
+		return 0.0;
+
+	double actual = 1e9 / nsPerTick;
+	return ( actual / double( myFrequency ) - 1.0 ) * 1e6;
+}
+
+
+////////////////////////////////////////
+
+
+double
+ClockRecovery::jitterNS( void ) const
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	refit();
+	return myJitter;
+}
+
+
+////////////////////////////////////////
+
+
+int64_t
+ClockRecovery::unwrapSTC( uint32_t t ) const
+{
+	// nearest to the most recent sample, PTS is never far off
+	return myLast.stc + static_cast<int32_t>( t - static_cast<uint32_t>( myLast.stc ) );
+}
+
+
+////////////////////////////////////////
+
+
+void
+ClockRecovery::refit( void ) const
+{
+	if ( ! myDirty )
+		return;
+	myDirty = false;
+	myValid = false;
+
+	if ( mySamples.size() < kMinSamples )
+		return;
+
+	// oldest sample in the ring
+	const Sample &o = mySamples.size() < kWindow ? mySamples.front() : mySamples[myNext];
+	if ( myLast.host - o.host < kMinSpanNS )
+		return;
+	myOrigin = o;
+
+	// some devices leave the SOF at 0, or otherwise don't move it
+	bool sofMoves = false;
+	for ( const Sample &s: mySamples )
+	{
+		if ( s.sof != o.sof )
+		{
+			sofMoves = true;
+			break;
+		}
+	}
+	myUseSOF = sofMoves;
+
+	auto stcX = [&]( const Sample &s ) { return double( s.stc - o.stc ); };
+	auto sofX = [&]( const Sample &s ) { return double( s.sof - o.sof ); };
+	auto hostY = [&]( const Sample &s ) { return double( s.host - o.host ); };
+
+	LineFit hf;
+	if ( myUseSOF )
+	{
+		LineFit df = leastSquares( mySamples, stcX, sofX );
+		myDeviceFit.slope = df.slope;
+		// the STC is latched somewhere inside the 1ms bus frame, so
+		// on average half a frame past the start the SOF names
+		myDeviceFit.offset = df.meanY - df.slope * df.meanX + 0.5;
+		hf = leastSquares( mySamples, sofX, hostY );
+	}
+	else
+		hf = leastSquares( mySamples, stcX, hostY );
+
+	if ( hf.slope <= 0.0 )
+		return;
+
+	// arrival is only ever late, so rather than the mean, put the
+	// line through the earliest arrivals
+	double minResid = std::numeric_limits<double>::max();
+	double sumSq = 0.0;
+	for ( const Sample &s: mySamples )
+	{
+		double x = myUseSOF ? sofX( s ) : stcX( s );
+		double r = hostY( s ) - ( hf.meanY + hf.slope * ( x - hf.meanX ) );
+		minResid = std::min( minResid, r );
+		sumSq += r * r;
+	}
+	myJitter = std::sqrt( sumSq / double( mySamples.size() ) );
+
+	myHostFit.slope = hf.slope;
+	myHostFit.offset = hf.meanY - hf.slope * hf.meanX + minResid;
+	myValid = true;
+}
+
+
+////////////////////////////////////////
+
+
+} // namespace USB
@@ -0,0 +1,122 @@
+// ClockRecovery.h -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+
+////////////////////////////////////////
+
+
+///
+/// @file ClockRecovery.h
+///
+/// @author Kimball Thurston
+///
+
+namespace USB
+{
+
+///
+/// @brief Class ClockRecovery maps UVC device clock times to host
+/// CLOCK_MONOTONIC time.
+///
+/// Payloads carry an SCR, which samples the device clock (STC) along
+/// with the USB bus frame number (SOF) it was sampled in. The
+/// device to bus relation is exact, so that is fit directly. The bus
+/// to host relation is fit against payload arrival times, which are
+/// late by a varying amount of USB scheduling and event handling, so
+/// the slope comes from a least squares fit over a window, and the
+/// offset from the earliest arrivals (the lower envelope) rather than
+/// the average. Devices that don't fill in the SOF fall back to
+/// fitting the device clock against arrival directly.
+///
+class ClockRecovery
+{
+public:
+	ClockRecovery( void );
+
+	// clears all history, frequency is the device clock (from the
+	// probe, or the VC header for UVC 1.0)
+	void reset( uint32_t clockFrequency );
+
+	// sof is the 11 bit bus frame number from the SCR, hostNS when
+	// the payload carrying it arrived
+	void addSample( uint32_t stc, uint16_t sof, int64_t hostNS );
+
+	bool valid( void ) const;
+
+	// host time corresponding to a device clock value (i.e. a PTS),
+	// 0 if there isn't enough history yet
+	int64_t toHost( uint32_t deviceTime ) const;
+
+	// device clock rate error relative to the host, in ppm
+	double driftPPM( void ) const;
+	// rms of the arrival times around the fit, in ns
+	double jitterNS( void ) const;
+
+private:
+	struct Sample
+	{
+		int64_t stc; // unwrapped
+		int64_t sof; // unwrapped, ms
+		int64_t host;
+	};
+
+	struct Fit
+	{
+		double slope = 0.0;
+		double offset = 0.0;
+	};
+
+	// caller holds the lock
+	void refit( void ) const;
+	int64_t unwrapSTC( uint32_t stc ) const;
+
+	static const size_t kWindow = 256;
+
+	mutable std::mutex myMutex;
+	uint32_t myFrequency = 0;
+
+	std::vector<Sample> mySamples;
+	size_t myNext = 0;
+	bool myHaveLast = false;
+	Sample myLast;
+	uint16_t myLastRawSOF = 0;
+	mutable bool myUseSOF = true;
+
+	mutable bool myDirty = false;
+	mutable bool myValid = false;
+	// stc -> sof (or stc -> host when not using the SOF), then
+	// sof -> host, all relative to the origin sample
+	mutable Fit myDeviceFit;
+	mutable Fit myHostFit;
+	mutable double myJitter = 0.0;
+	mutable Sample myOrigin;
+};
+
+} // namespace USB
@@ -83,7 +83,7 @@ Control::doGet( uint8_t request, T *buf, uint16_t N )
 
 
 void
-Control::init( std::string name, libusb_device_handle *handle, uint8_t endpointNum, uint8_t unit, uint8_t iface, uint16_t term, libusb_context *ctxt )
+Control::init( std::string name, libusb_device_handle *handle, uint8_t endpointNum, uint8_t unit, uint8_t iface, uint16_t term, libusb_context *ctxt, DescriptorCache::Entry *cache )
 {
 	std::swap( myName, name );
 	myContext = ctxt;
@@ -92,6 +92,43 @@ Control::init( std::string name, libusb_device_handle *handle, uint8_t endpointN
 	myUnit = unit;
 	myInterface = iface;
 	myTerminal = term;
+
+	const DescriptorCache::ControlInfo *ci = cache ? cache->findControl( unit, iface, term ) : nullptr;
+	if ( ci )
+	{
+		myLength = ci->length;
+		myReadOnly = ci->readOnly;
+		myMin = ci->min;
+		myMax = ci->max;
+		if ( myLength == 0 )
+			return;
+
+		if ( doGet( UVC_GET_CUR, myRawData, myLength ) == myLength )
+			return;
+
+		// device disagrees with what we remembered, ask it everything
+		// and don't trust the rest of the entry either
+		cache->stale = true;
+	}
+
+	if ( probe() && cache )
+	{
+		DescriptorCache::ControlInfo nci;
+		nci.length = myLength;
+		nci.readOnly = myReadOnly;
+		nci.min = myMin;
+		nci.max = myMax;
+		cache->setControl( unit, iface, term, nci );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+bool
+Control::probe( void )
+{
 	myReadOnly = true;
 	myMin = 0;
 	myMax = 0;
@@ -169,6 +206,10 @@ Control::init( std::string name, libusb_device_handle *handle, uint8_t endpointN
 	{
 		myLength = 0;
 	}
+
+	// a stall means the device doesn't have the control, anything
+	// else (a timeout during bring up, say) is worth asking again
+	return myLength != 0 || e == LIBUSB_ERROR_PIPE;
 }
 
 
@@ -230,7 +271,25 @@ Control::set( uint32_t val )
 			break;
 	}
 
-	std::shared_ptr<ControlTransfer> ctrl = std::make_shared<ControlTransfer>( myContext );
+	std::unique_lock<std::mutex> lk( myMutex );
+
+	// re-use a finished transfer if there is one, only allocating
+	// when all of them are still in flight
+	std::shared_ptr<ControlTransfer> ctrl;
+	for ( auto &x: myActiveTransfers )
+	{
+		if ( x->isComplete() )
+		{
+			ctrl = x;
+			break;
+		}
+	}
+	if ( ! ctrl )
+	{
+		ctrl = std::make_shared<ControlTransfer>( myContext );
+		myActiveTransfers.push_back( ctrl );
+	}
+
 	ctrl->fill( myHandle,
 				Device::endpoint_out( myEndpoint ) | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE, // bmRequestType
 				UVC_SET_CUR, // bRequest
@@ -240,17 +299,6 @@ Control::set( uint32_t val )
 				myRawData );
 	ctrl->submit();
 
-	std::unique_lock<std::mutex> lk( myMutex );
-	for ( size_t x = 0; x != myActiveTransfers.size(); ++x )
-	{
-		if ( myActiveTransfers[x]->isComplete() )
-		{
-			myActiveTransfers.erase( myActiveTransfers.begin() + x );
-			--x;
-		}
-	}
-	myActiveTransfers.push_back( ctrl );
-
 	return get();
 }
 
@@ -279,9 +327,9 @@ void
 Control::coalesce( void )
 {
 	std::unique_lock<std::mutex> lk( myMutex );
+	// leave the transfers for re-use by the next set
 	for ( size_t x = 0; x != myActiveTransfers.size(); ++x )
 		myActiveTransfers[x]->wait();
-	myActiveTransfers.clear();
 }
 
 
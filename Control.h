@@ -33,6 +33,7 @@
 #include <mutex>
 #include <iostream>
 #include "Transfer.h"
+#include "DescriptorCache.h"
 
 
 ////////////////////////////////////////
@@ -56,7 +57,10 @@ public:
 	Control( void );
 	~Control( void );
 
-	void init( std::string name, libusb_device_handle *handle, uint8_t endpointNum, uint8_t unit, uint8_t iface, uint16_t term, libusb_context *ctxt );
+	// if a cache entry is provided, the length and range are taken
+	// from there when known (only the current value is read from the
+	// device), and recorded there when not
+	void init( std::string name, libusb_device_handle *handle, uint8_t endpointNum, uint8_t unit, uint8_t iface, uint16_t term, libusb_context *ctxt, DescriptorCache::Entry *cache = nullptr );
 
 	const std::string &name( void ) const { return myName; }
 
@@ -86,6 +90,9 @@ private:
 	Control &operator=( const Control & ) = delete;
 
 	uint32_t doSetInternal( uint32_t val );
+	// false if the result isn't worth caching, i.e. the control
+	// couldn't be read but the device didn't say it doesn't exist
+	bool probe( void );
 	template <typename T>
 	int doGet( uint8_t type, T *buf, uint16_t N );
 
@@ -0,0 +1,826 @@
+// Debayer.cpp -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#include "Debayer.h"
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+# include <arm_neon.h>
+#endif
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+enum { kRed = 0, kGreen = 1, kBlue = 2 };
+
+// slack at the end of each scratch row for a full vector store
+static const int kPad = 16;
+
+static inline int
+mirror( int i, int n )
+{
+	// reflect by whole pixels so the bayer phase is kept
+	if ( i < 0 )
+		i = -i;
+	if ( i >= n )
+		i = 2 * ( n - 1 ) - i;
+	return std::min( std::max( i, 0 ), n - 1 );
+}
+
+///
+/// The kernels are written once against a small float vector type
+/// (see DebayerKernels.h) and compiled for each instruction set with
+/// one, then picked by what the cpu running us has. ScalarF covers
+/// the image edges and the leftovers at the end of a row, and is the
+/// whole thing when there is nothing better
+///
+struct ScalarF
+{
+	static const int W = 1;
+	float v;
+
+	static inline ScalarF set1( float f ) { return { f }; }
+	static inline ScalarF pattern( float e, float ) { return { e }; }
+	static inline ScalarF load( const uint8_t *p ) { return { float( *p ) }; }
+	static inline ScalarF load( const uint16_t *p ) { return { float( *p ) }; }
+	static inline ScalarF loadEven( const uint8_t *p ) { return load( p ); }
+	static inline ScalarF loadEven( const uint16_t *p ) { return load( p ); }
+	// caller has clamped to the range of uint16_t, rounds to even
+	// like the vector conversions
+	inline void store( uint16_t *p ) const { *p = static_cast<uint16_t>( std::nearbyint( v ) ); }
+
+	friend inline ScalarF operator+( ScalarF a, ScalarF b ) { return { a.v + b.v }; }
+	friend inline ScalarF operator-( ScalarF a, ScalarF b ) { return { a.v - b.v }; }
+	friend inline ScalarF operator*( ScalarF a, ScalarF b ) { return { a.v * b.v }; }
+	friend inline ScalarF vmin( ScalarF a, ScalarF b ) { return { std::min( a.v, b.v ) }; }
+	friend inline ScalarF vmax( ScalarF a, ScalarF b ) { return { std::max( a.v, b.v ) }; }
+	friend inline ScalarF vabs( ScalarF a ) { return { std::fabs( a.v ) }; }
+	// a < b ? x : y
+	static inline ScalarF select( ScalarF a, ScalarF b, ScalarF x, ScalarF y ) { return a.v < b.v ? x : y; }
+};
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+namespace USB
+{
+
+struct DebayerJob
+{
+	void (*rows)( const DebayerJob &j, int y0, int y1, uint16_t *scratch );
+
+	const uint8_t *src; // ROI origin
+	size_t srcStride;
+	int rw, rh; // ROI size
+
+	void *out;
+	size_t outStride; // elements
+	int outW, outH;
+	const void *lut;
+
+	// [row parity][column parity][channel][center, horiz, vert, diag]
+	float k[2][2][3][4];
+	float isG[2][2];
+	// [channel][position in the 2x2 cell]
+	float cell[3][4];
+	const float *fused;
+	float maxIdx;
+
+	int bands;
+	int rowsPerBand;
+};
+
+} // namespace USB
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+using USB::Debayer;
+typedef USB::DebayerJob Job;
+typedef void (*RowsFn)( const Job &, int, int, uint16_t * );
+
+template <typename Out>
+static inline void
+writeRow( const Job &j, const uint16_t *o0, const uint16_t *o1, const uint16_t *o2, int y )
+{
+	const Out *lut = static_cast<const Out *>( j.lut );
+	Out *dst = static_cast<Out *>( j.out ) + static_cast<size_t>( y ) * j.outStride;
+	for ( int x = 0; x < j.outW; ++x )
+	{
+		dst[0] = lut[o0[x]];
+		dst[1] = lut[o1[x]];
+		dst[2] = lut[o2[x]];
+		dst += 3;
+	}
+}
+
+
+////////////////////////////////////////
+
+
+namespace scalar
+{
+
+typedef ScalarF VecF;
+
+#include "DebayerKernels.h"
+
+} // namespace scalar
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#if defined(__clang__)
+# pragma clang attribute push (__attribute__((target("sse4.1"))), apply_to = function)
+#else
+# pragma GCC push_options
+# pragma GCC target("sse4.1")
+#endif
+
+namespace sse41
+{
+
+struct VecF
+{
+	static const int W = 4;
+	__m128 v;
+
+	static inline VecF set1( float f ) { return { _mm_set1_ps( f ) }; }
+	static inline VecF pattern( float e, float o ) { return { _mm_setr_ps( e, o, e, o ) }; }
+	static inline VecF fromInt( __m128i i ) { return { _mm_cvtepi32_ps( i ) }; }
+	static inline VecF load( const uint8_t *p )
+	{
+		int32_t x;
+		memcpy( &x, p, 4 );
+		return fromInt( _mm_cvtepu8_epi32( _mm_cvtsi32_si128( x ) ) );
+	}
+	static inline VecF load( const uint16_t *p )
+	{
+		return fromInt( _mm_cvtepu16_epi32( _mm_loadl_epi64( reinterpret_cast<const __m128i *>( p ) ) ) );
+	}
+	static inline VecF loadEven( const uint8_t *p )
+	{
+		const __m128i m = _mm_setr_epi8( 0, 2, 4, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 );
+		__m128i b = _mm_shuffle_epi8( _mm_loadl_epi64( reinterpret_cast<const __m128i *>( p ) ), m );
+		return fromInt( _mm_cvtepu8_epi32( b ) );
+	}
+	static inline VecF loadEven( const uint16_t *p )
+	{
+		const __m128i m = _mm_setr_epi8( 0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1 );
+		__m128i a = _mm_shuffle_epi8( _mm_loadu_si128( reinterpret_cast<const __m128i *>( p ) ), m );
+		return fromInt( _mm_cvtepu16_epi32( a ) );
+	}
+	inline void store( uint16_t *p ) const
+	{
+		__m128i i = _mm_cvtps_epi32( v );
+		_mm_storel_epi64( reinterpret_cast<__m128i *>( p ), _mm_packus_epi32( i, i ) );
+	}
+
+	static inline VecF select( VecF a, VecF b, VecF x, VecF y )
+	{
+		return { _mm_blendv_ps( y.v, x.v, _mm_cmplt_ps( a.v, b.v ) ) };
+	}
+};
+
+// not friends, gcc leaves in class friend definitions out of the
+// target pragma
+static inline VecF operator+( VecF a, VecF b ) { return { _mm_add_ps( a.v, b.v ) }; }
+static inline VecF operator-( VecF a, VecF b ) { return { _mm_sub_ps( a.v, b.v ) }; }
+static inline VecF operator*( VecF a, VecF b ) { return { _mm_mul_ps( a.v, b.v ) }; }
+static inline VecF vmin( VecF a, VecF b ) { return { _mm_min_ps( a.v, b.v ) }; }
+static inline VecF vmax( VecF a, VecF b ) { return { _mm_max_ps( a.v, b.v ) }; }
+static inline VecF vabs( VecF a ) { return { _mm_andnot_ps( _mm_set1_ps( -0.F ), a.v ) }; }
+
+#include "DebayerKernels.h"
+
+} // namespace sse41
+
+#if defined(__clang__)
+# pragma clang attribute pop
+#else
+# pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+# pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#else
+# pragma GCC push_options
+# pragma GCC target("avx2")
+#endif
+
+namespace avx2
+{
+
+struct VecF
+{
+	static const int W = 8;
+	__m256 v;
+
+	static inline VecF set1( float f ) { return { _mm256_set1_ps( f ) }; }
+	static inline VecF pattern( float e, float o ) { return { _mm256_setr_ps( e, o, e, o, e, o, e, o ) }; }
+	static inline VecF fromInt( __m256i i ) { return { _mm256_cvtepi32_ps( i ) }; }
+	static inline VecF load( const uint8_t *p )
+	{
+		return fromInt( _mm256_cvtepu8_epi32( _mm_loadl_epi64( reinterpret_cast<const __m128i *>( p ) ) ) );
+	}
+	static inline VecF load( const uint16_t *p )
+	{
+		return fromInt( _mm256_cvtepu16_epi32( _mm_loadu_si128( reinterpret_cast<const __m128i *>( p ) ) ) );
+	}
+	static inline VecF loadEven( const uint8_t *p )
+	{
+		const __m128i m = _mm_setr_epi8( 0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1 );
+		__m128i b = _mm_shuffle_epi8( _mm_loadu_si128( reinterpret_cast<const __m128i *>( p ) ), m );
+		return fromInt( _mm256_cvtepu8_epi32( b ) );
+	}
+	static inline VecF loadEven( const uint16_t *p )
+	{
+		const __m128i m = _mm_setr_epi8( 0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1 );
+		__m128i a = _mm_shuffle_epi8( _mm_loadu_si128( reinterpret_cast<const __m128i *>( p ) ), m );
+		__m128i b = _mm_shuffle_epi8( _mm_loadu_si128( reinterpret_cast<const __m128i *>( p + 8 ) ), m );
+		return fromInt( _mm256_cvtepu16_epi32( _mm_unpacklo_epi64( a, b ) ) );
+	}
+	inline void store( uint16_t *p ) const
+	{
+		__m256i i = _mm256_cvtps_epi32( v );
+		__m128i s = _mm_packus_epi32( _mm256_castsi256_si128( i ), _mm256_extracti128_si256( i, 1 ) );
+		_mm_storeu_si128( reinterpret_cast<__m128i *>( p ), s );
+	}
+
+	static inline VecF select( VecF a, VecF b, VecF x, VecF y )
+	{
+		return { _mm256_blendv_ps( y.v, x.v, _mm256_cmp_ps( a.v, b.v, _CMP_LT_OQ ) ) };
+	}
+};
+
+static inline VecF operator+( VecF a, VecF b ) { return { _mm256_add_ps( a.v, b.v ) }; }
+static inline VecF operator-( VecF a, VecF b ) { return { _mm256_sub_ps( a.v, b.v ) }; }
+static inline VecF operator*( VecF a, VecF b ) { return { _mm256_mul_ps( a.v, b.v ) }; }
+static inline VecF vmin( VecF a, VecF b ) { return { _mm256_min_ps( a.v, b.v ) }; }
+static inline VecF vmax( VecF a, VecF b ) { return { _mm256_max_ps( a.v, b.v ) }; }
+static inline VecF vabs( VecF a ) { return { _mm256_andnot_ps( _mm256_set1_ps( -0.F ), a.v ) }; }
+
+#include "DebayerKernels.h"
+
+} // namespace avx2
+
+#if defined(__clang__)
+# pragma clang attribute pop
+#else
+# pragma GCC pop_options
+#endif
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+// always there when the build targets it
+namespace neon
+{
+
+struct VecF
+{
+	static const int W = 4;
+	float32x4_t v;
+
+	static inline VecF set1( float f ) { return { vdupq_n_f32( f ) }; }
+	static inline VecF pattern( float e, float o )
+	{
+		const float t[4] = { e, o, e, o };
+		return { vld1q_f32( t ) };
+	}
+	static inline VecF fromWords( uint16x4_t w ) { return { vcvtq_f32_u32( vmovl_u16( w ) ) }; }
+	static inline VecF load( const uint8_t *p )
+	{
+		uint32_t x;
+		memcpy( &x, p, 4 );
+		return fromWords( vget_low_u16( vmovl_u8( vreinterpret_u8_u32( vdup_n_u32( x ) ) ) ) );
+	}
+	static inline VecF load( const uint16_t *p ) { return fromWords( vld1_u16( p ) ); }
+	static inline VecF loadEven( const uint8_t *p )
+	{
+		uint8x8_t b = vld1_u8( p );
+		return fromWords( vget_low_u16( vmovl_u8( vuzp_u8( b, b ).val[0] ) ) );
+	}
+	static inline VecF loadEven( const uint16_t *p )
+	{
+		uint16x8_t w = vld1q_u16( p );
+		return fromWords( vget_low_u16( vuzpq_u16( w, w ).val[0] ) );
+	}
+	inline void store( uint16_t *p ) const
+	{
+		vst1_u16( p, vmovn_u32( vcvtq_u32_f32( vaddq_f32( v, vdupq_n_f32( 0.5F ) ) ) ) );
+	}
+
+	static inline VecF select( VecF a, VecF b, VecF x, VecF y )
+	{
+		return { vbslq_f32( vcltq_f32( a.v, b.v ), x.v, y.v ) };
+	}
+};
+
+static inline VecF operator+( VecF a, VecF b ) { return { vaddq_f32( a.v, b.v ) }; }
+static inline VecF operator-( VecF a, VecF b ) { return { vsubq_f32( a.v, b.v ) }; }
+static inline VecF operator*( VecF a, VecF b ) { return { vmulq_f32( a.v, b.v ) }; }
+static inline VecF vmin( VecF a, VecF b ) { return { vminq_f32( a.v, b.v ) }; }
+static inline VecF vmax( VecF a, VecF b ) { return { vmaxq_f32( a.v, b.v ) }; }
+static inline VecF vabs( VecF a ) { return { vabsq_f32( a.v ) }; }
+
+#include "DebayerKernels.h"
+
+} // namespace neon
+
+#endif
+
+
+////////////////////////////////////////
+
+
+enum class Kernels
+{
+	SCALAR,
+	SSE41,
+	AVX2,
+	NEON
+};
+
+static Kernels
+detectKernels( void )
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports( "avx2" ) )
+		return Kernels::AVX2;
+	if ( __builtin_cpu_supports( "sse4.1" ) )
+		return Kernels::SSE41;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	return Kernels::NEON;
+#endif
+	return Kernels::SCALAR;
+}
+
+// checked once, the answer doesn't change
+static Kernels
+bestKernels( void )
+{
+	static const Kernels k = detectKernels();
+	return k;
+}
+
+template <typename T, typename Out>
+static void
+pickRows( Debayer::Method m, RowsFn &fn )
+{
+	switch ( bestKernels() )
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		case Kernels::AVX2: avx2::pickRows<T, Out>( m, fn ); return;
+		case Kernels::SSE41: sse41::pickRows<T, Out>( m, fn ); return;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+		case Kernels::NEON: neon::pickRows<T, Out>( m, fn ); return;
+#endif
+		default:
+			break;
+	}
+	scalar::pickRows<T, Out>( m, fn );
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+namespace USB
+{
+
+
+////////////////////////////////////////
+
+
+Debayer::Debayer( void )
+{
+	myWB[0] = myWB[1] = myWB[2] = 1.F;
+	for ( int i = 0; i < 9; ++i )
+		myMatrix[i] = ( i % 4 ) == 0 ? 1.F : 0.F;
+}
+
+
+////////////////////////////////////////
+
+
+Debayer::~Debayer( void )
+{
+	stopWorkers();
+}
+
+
+////////////////////////////////////////
+
+
+void
+Debayer::setWhiteBalance( float r, float g, float b )
+{
+	myWB[0] = r;
+	myWB[1] = g;
+	myWB[2] = b;
+	myTablesDirty = true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+Debayer::setColorMatrix( const float m[9] )
+{
+	for ( int i = 0; i < 9; ++i )
+		myMatrix[i] = m[i];
+	myTablesDirty = true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+Debayer::setGamma( float g )
+{
+	myGamma = g > 0.F ? g : 1.F;
+	myTablesDirty = true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+Debayer::setInputBits( int bits )
+{
+	myInputBits = std::min( std::max( bits, 0 ), 16 );
+	myTablesDirty = true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+Debayer::setThreads( size_t n )
+{
+	if ( n == myThreadCount )
+		return;
+	stopWorkers();
+	myThreadCount = n;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+Debayer::isBayer( ImageBuffer::Format f )
+{
+	switch ( f )
+	{
+		case ImageBuffer::Format::BAYER_GRBG:
+		case ImageBuffer::Format::BAYER_GBRG:
+		case ImageBuffer::Format::BAYER_RGGB:
+		case ImageBuffer::Format::BAYER_BGGR:
+			return true;
+		default:
+			break;
+	}
+	return false;
+}
+
+
+////////////////////////////////////////
+
+
+void
+Debayer::outputSize( const ImageBuffer &img, int &w, int &h ) const
+{
+	w = img.roi().w;
+	h = img.roi().h;
+	if ( myMethod == Method::SUPERPIXEL )
+	{
+		w /= 2;
+		h /= 2;
+	}
+}
+
+
+////////////////////////////////////////
+
+
+bool
+Debayer::process( const ImageBuffer &img, uint8_t *rgb, size_t stride )
+{
+	return run( img, rgb, stride );
+}
+
+
+////////////////////////////////////////
+
+
+bool
+Debayer::process( const ImageBuffer &img, uint16_t *rgb, size_t stride )
+{
+	return run( img, rgb, stride );
+}
+
+
+////////////////////////////////////////
+
+
+void
+Debayer::updateTables( int inBits, bool out16 )
+{
+	if ( ! myTablesDirty && inBits == myTableBits && out16 == myTableOut16 )
+		return;
+
+	// the lut has more steps than 8 bit input so white balance and
+	// gamma don't band
+	int lutBits = inBits <= 8 ? 12 : 16;
+	size_t n = size_t(1) << lutBits;
+	float maxIdx = float( n - 1 );
+	float scale = maxIdx / float( ( 1 << inBits ) - 1 );
+
+	for ( int r = 0; r < 3; ++r )
+		for ( int c = 0; c < 3; ++c )
+			myFused[r * 3 + c] = myMatrix[r * 3 + c] * myWB[c] * scale;
+
+	double outMax = out16 ? 65535.0 : 255.0;
+	double invGamma = 1.0 / double( myGamma );
+	myLUT8.clear();
+	myLUT16.clear();
+	if ( out16 )
+		myLUT16.resize( n );
+	else
+		myLUT8.resize( n );
+	for ( size_t i = 0; i < n; ++i )
+	{
+		double v = double( i ) / double( maxIdx );
+		if ( myGamma != 1.F )
+			v = std::pow( v, invGamma );
+		v = std::floor( v * outMax + 0.5 );
+		if ( out16 )
+			myLUT16[i] = static_cast<uint16_t>( v );
+		else
+			myLUT8[i] = static_cast<uint8_t>( v );
+	}
+
+	myTableBits = inBits;
+	myTableOut16 = out16;
+	myTablesDirty = false;
+}
+
+
+////////////////////////////////////////
+
+
+template <typename Out>
+bool
+Debayer::run( const ImageBuffer &img, Out *rgb, size_t stride )
+{
+	if ( ! isBayer( img.format() ) || ! img.data() )
+		return false;
+
+	int bpp = img.bytesPerPixel();
+	if ( bpp != 1 && bpp != 2 )
+		return false;
+
+	const ROI &roi = img.roi();
+	DebayerJob j;
+	j.rw = roi.w;
+	j.rh = roi.h;
+	outputSize( img, j.outW, j.outH );
+	if ( j.outW <= 0 || j.outH <= 0 )
+		return false;
+
+	int inBits = bpp == 1 ? 8 : ( myInputBits > 0 ? myInputBits : 16 );
+	updateTables( inBits, sizeof(Out) == 2 );
+
+	j.srcStride = static_cast<size_t>( img.stride() );
+	j.src = img.data() + static_cast<size_t>( roi.y ) * j.srcStride + static_cast<size_t>( roi.x ) * bpp;
+	j.out = rgb;
+	j.outStride = stride ? stride : static_cast<size_t>( j.outW ) * 3;
+	j.fused = myFused;
+	j.maxIdx = float( ( size_t(1) << ( inBits <= 8 ? 12 : 16 ) ) - 1 );
+	if ( sizeof(Out) == 2 )
+		j.lut = myLUT16.data();
+	else
+		j.lut = myLUT8.data();
+
+	// 2x2 pattern from the top left of the sensor, shifted to where
+	// the ROI starts
+	static const uint8_t kPatterns[4][4] =
+	{
+		{ kGreen, kRed, kBlue, kGreen }, // GRBG
+		{ kGreen, kBlue, kRed, kGreen }, // GBRG
+		{ kRed, kGreen, kGreen, kBlue }, // RGGB
+		{ kBlue, kGreen, kGreen, kRed } // BGGR
+	};
+	const uint8_t *pat = kPatterns[static_cast<int>( img.format() ) - static_cast<int>( ImageBuffer::Format::BAYER_GRBG )];
+	auto colorAt = [&]( int x, int y ) -> int
+	{
+		return pat[( ( y + roi.y ) & 1 ) * 2 + ( ( x + roi.x ) & 1 )];
+	};
+
+	memset( j.k, 0, sizeof(j.k) );
+	memset( j.cell, 0, sizeof(j.cell) );
+	for ( int rp = 0; rp < 2; ++rp )
+	{
+		for ( int cp = 0; cp < 2; ++cp )
+		{
+			float (&k)[3][4] = j.k[rp][cp];
+			int c = colorAt( cp, rp );
+			j.isG[rp][cp] = c == kGreen ? 1.F : 0.F;
+			if ( c == kGreen )
+			{
+				int hn = colorAt( cp + 1, rp );
+				k[kGreen][0] = 1.F;
+				k[hn][1] = 0.5F;
+				k[hn == kRed ? kBlue : kRed][2] = 0.5F;
+			}
+			else
+			{
+				k[c][0] = 1.F;
+				k[kGreen][1] = k[kGreen][2] = 0.25F;
+				k[c == kRed ? kBlue : kRed][3] = 0.25F;
+			}
+
+			int pos = rp * 2 + cp;
+			j.cell[c][pos] = c == kGreen ? 0.5F : 1.F;
+		}
+	}
+
+	if ( bpp == 1 )
+		pickRows<uint8_t, Out>( myMethod, j.rows );
+	else
+		pickRows<uint16_t, Out>( myMethod, j.rows );
+
+	size_t nThreads = myThreadCount;
+	if ( nThreads == 0 )
+		nThreads = std::max( std::thread::hardware_concurrency(), 1U );
+
+	size_t scratch = 3 * static_cast<size_t>( j.outW + kPad );
+	if ( myScratch.empty() )
+		myScratch.resize( 1 );
+	if ( myScratch[0].size() < scratch )
+		myScratch[0].resize( scratch );
+
+	// not worth waking anyone for a small frame
+	if ( nThreads <= 1 || j.outH < 64 )
+	{
+		j.rows( j, 0, j.outH, myScratch[0].data() );
+		return true;
+	}
+
+	if ( myWorkers.empty() )
+	{
+		myThreadCount = nThreads;
+		startWorkers();
+	}
+	for ( auto &s: myScratch )
+	{
+		if ( s.size() < scratch )
+			s.resize( scratch );
+	}
+
+	// a few bands per thread evens out uneven scheduling
+	j.rowsPerBand = std::max( 16, int( ( size_t( j.outH ) + nThreads * 4 - 1 ) / ( nThreads * 4 ) ) );
+	j.bands = ( j.outH + j.rowsPerBand - 1 ) / j.rowsPerBand;
+	myNextBand.store( 0 );
+
+	{
+		std::unique_lock<std::mutex> lk( myMutex );
+		myJob = &j;
+		++myJobID;
+	}
+	myWake.notify_all();
+
+	runBands( 0 );
+
+	std::unique_lock<std::mutex> lk( myMutex );
+	myDoneCV.wait( lk, [this]{ return myBusy == 0; } );
+	myJob = nullptr;
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+Debayer::startWorkers( void )
+{
+	myShutdown = false;
+	myScratch.resize( myThreadCount );
+	for ( size_t i = 1; i < myThreadCount; ++i )
+		myWorkers.emplace_back( &Debayer::workerLoop, this, i );
+}
+
+
+////////////////////////////////////////
+
+
+void
+Debayer::stopWorkers( void )
+{
+	{
+		std::unique_lock<std::mutex> lk( myMutex );
+		myShutdown = true;
+	}
+	myWake.notify_all();
+	for ( auto &t: myWorkers )
+		t.join();
+	myWorkers.clear();
+}
+
+
+////////////////////////////////////////
+
+
+void
+Debayer::workerLoop( size_t id )
+{
+	uint64_t seen = 0;
+	std::unique_lock<std::mutex> lk( myMutex );
+	while ( true )
+	{
+		myWake.wait( lk, [&]{ return myShutdown || myJobID != seen; } );
+		if ( myShutdown )
+			break;
+		seen = myJobID;
+		// woke up after the frame was already finished
+		if ( ! myJob )
+			continue;
+
+		++myBusy;
+		lk.unlock();
+		runBands( id );
+		lk.lock();
+		if ( --myBusy == 0 )
+			myDoneCV.notify_all();
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+Debayer::runBands( size_t id )
+{
+	// the job stays put until every busy thread is back
+	const DebayerJob &j = *myJob;
+	uint16_t *scratch = myScratch[id].data();
+	while ( true )
+	{
+		int b = myNextBand.fetch_add( 1 );
+		if ( b >= j.bands )
+			break;
+		int y0 = b * j.rowsPerBand;
+		j.rows( j, y0, std::min( y0 + j.rowsPerBand, j.outH ), scratch );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+} // namespace USB
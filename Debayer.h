@@ -0,0 +1,144 @@
+// Debayer.h -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "Stream.h"
+
+
+////////////////////////////////////////
+
+
+///
+/// @file Debayer.h
+///
+/// @author Kimball Thurston
+///
+
+namespace USB
+{
+
+struct DebayerJob;
+
+///
+/// @brief Class Debayer turns the BAYER_* formats into interleaved
+/// RGB.
+///
+/// White balance, the color matrix and gamma are applied in the same
+/// pass as the demosaic, a row at a time, so the intermediate image
+/// never leaves the cache. The frame is split into bands of rows
+/// which are spread over a set of worker threads. The inner loops
+/// use AVX2 or SSE4.1, whichever the cpu has, or NEON when the build
+/// targets it, otherwise plain C++.
+///
+/// Only the ROI of the frame is converted. The settings may not be
+/// changed while process is running in another thread.
+///
+class Debayer
+{
+public:
+	enum class Method
+	{
+		BILINEAR,
+		EDGE_AWARE, ///< green follows the smaller gradient
+		SUPERPIXEL ///< one pixel per 2x2 cell, half size, for preview
+	};
+
+	Debayer( void );
+	~Debayer( void );
+
+	void setMethod( Method m ) { myMethod = m; }
+	Method method( void ) const { return myMethod; }
+
+	// multipliers applied to the raw channels
+	void setWhiteBalance( float r, float g, float b );
+	// row major, applied after white balance
+	void setColorMatrix( const float m[9] );
+	// display gamma, 1 leaves the output linear
+	void setGamma( float g );
+	// significant bits of 16 bit data, 0 to use all of them
+	void setInputBits( int bits );
+
+	// 0 uses one per core, 1 does everything on the calling thread
+	void setThreads( size_t n );
+
+	// size of the output for a frame, the ROI, or half of it for
+	// SUPERPIXEL
+	void outputSize( const ImageBuffer &img, int &w, int &h ) const;
+
+	// stride is in elements (not bytes) between output rows, 0 for
+	// packed. Returns false if img isn't a bayer format
+	bool process( const ImageBuffer &img, uint8_t *rgb, size_t stride = 0 );
+	bool process( const ImageBuffer &img, uint16_t *rgb, size_t stride = 0 );
+
+	static bool isBayer( ImageBuffer::Format f );
+
+private:
+	Debayer( const Debayer & ) = delete;
+	Debayer &operator=( const Debayer & ) = delete;
+
+	template <typename Out>
+	bool run( const ImageBuffer &img, Out *rgb, size_t stride );
+	void updateTables( int inBits, bool out16 );
+	void startWorkers( void );
+	void stopWorkers( void );
+	void workerLoop( size_t id );
+	void runBands( size_t id );
+
+	Method myMethod = Method::BILINEAR;
+	float myWB[3];
+	float myMatrix[9];
+	float myGamma = 1.F;
+	int myInputBits = 0;
+
+	// white balance and matrix folded together, scaled to the lut
+	float myFused[9];
+	std::vector<uint8_t> myLUT8;
+	std::vector<uint16_t> myLUT16;
+	int myTableBits = -1;
+	bool myTableOut16 = false;
+	bool myTablesDirty = true;
+
+	size_t myThreadCount = 0;
+	std::vector<std::thread> myWorkers;
+	// per thread row scratch, index 0 is the calling thread
+	std::vector<std::vector<uint16_t>> myScratch;
+
+	std::mutex myMutex;
+	std::condition_variable myWake;
+	std::condition_variable myDoneCV;
+	DebayerJob *myJob = nullptr;
+	uint64_t myJobID = 0;
+	size_t myBusy = 0;
+	bool myShutdown = false;
+	std::atomic<int> myNextBand{0};
+};
+
+} // namespace USB
@@ -0,0 +1,246 @@
+// DebayerKernels.h -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+// NB: no include guard, Debayer.cpp includes this once per
+// instruction set, inside a namespace that defines VecF and with the
+// matching target enabled, so each copy of the kernels is compiled
+// for it. Nothing else should include it.
+
+
+////////////////////////////////////////
+
+
+///
+/// @file DebayerKernels.h
+///
+/// @author Kimball Thurston
+///
+
+template <typename V>
+struct RowWeights
+{
+	V k[3][4];
+	V isG;
+
+	// vector kernels start on an even column
+	RowWeights( const Job &j, int rp )
+	{
+		for ( int c = 0; c < 3; ++c )
+			for ( int t = 0; t < 4; ++t )
+				k[c][t] = V::pattern( j.k[rp][0][c][t], j.k[rp][1][c][t] );
+		isG = V::pattern( j.isG[rp][0], j.isG[rp][1] );
+	}
+	RowWeights( const Job &j, int rp, int cp )
+	{
+		for ( int c = 0; c < 3; ++c )
+			for ( int t = 0; t < 4; ++t )
+				k[c][t] = V::set1( j.k[rp][cp][c][t] );
+		isG = V::set1( j.isG[rp][cp] );
+	}
+};
+
+
+////////////////////////////////////////
+
+
+// white balance + color matrix, clamped to the lut range
+template <typename V>
+static inline void
+shade( const Job &j, V r, V g, V b, uint16_t *o0, uint16_t *o1, uint16_t *o2 )
+{
+	const float *m = j.fused;
+	const V lo = V::set1( 0.F );
+	const V hi = V::set1( j.maxIdx );
+	V c0 = V::set1( m[0] ) * r + V::set1( m[1] ) * g + V::set1( m[2] ) * b;
+	V c1 = V::set1( m[3] ) * r + V::set1( m[4] ) * g + V::set1( m[5] ) * b;
+	V c2 = V::set1( m[6] ) * r + V::set1( m[7] ) * g + V::set1( m[8] ) * b;
+	vmin( vmax( c0, lo ), hi ).store( o0 );
+	vmin( vmax( c1, lo ), hi ).store( o1 );
+	vmin( vmax( c2, lo ), hi ).store( o2 );
+}
+
+
+////////////////////////////////////////
+
+
+// samples around x, a struct rather than a lambda so it picks up
+// the target of the surrounding code with any compiler
+template <typename V, typename T, bool kMirror>
+struct Taps
+{
+	const Job &j;
+	const T * const *row;
+	int x;
+
+	inline V operator()( int r, int dx ) const
+	{
+		return V::load( row[r] + ( kMirror ? mirror( x + dx, j.rw ) : x + dx ) );
+	}
+};
+
+
+////////////////////////////////////////
+
+
+template <typename V, typename T, bool kMirror, bool kEdge>
+static inline void
+demosaicAt( const Job &j, const T * const *row, int x, const RowWeights<V> &w,
+			uint16_t *o0, uint16_t *o1, uint16_t *o2 )
+{
+	const Taps<V, T, kMirror> at{ j, row, x };
+
+	V c = at( 2, 0 );
+	V l = at( 2, -1 );
+	V rt = at( 2, 1 );
+	V u = at( 1, 0 );
+	V dn = at( 3, 0 );
+	V h = l + rt;
+	V v = u + dn;
+	V d = at( 1, -1 ) + at( 1, 1 ) + at( 3, -1 ) + at( 3, 1 );
+
+	V r = w.k[kRed][0] * c + w.k[kRed][1] * h + w.k[kRed][2] * v + w.k[kRed][3] * d;
+	V g = w.k[kGreen][0] * c + w.k[kGreen][1] * h + w.k[kGreen][2] * v;
+	V b = w.k[kBlue][0] * c + w.k[kBlue][1] * h + w.k[kBlue][2] * v + w.k[kBlue][3] * d;
+
+	if ( kEdge )
+	{
+		// interpolate green along whichever direction changes least,
+		// with a laplacian correction from the center channel
+		const V half = V::set1( 0.5F );
+		const V quarter = V::set1( 0.25F );
+		V c2 = c + c;
+		V lh = c2 - at( 2, -2 ) - at( 2, 2 );
+		V lv = c2 - at( 0, 0 ) - at( 4, 0 );
+		V gh = vabs( l - rt ) + vabs( lh );
+		V gv = vabs( u - dn ) + vabs( lv );
+		V eh = half * h + quarter * lh;
+		V ev = half * v + quarter * lv;
+		V e = V::select( gh, gv, eh, V::select( gv, gh, ev, half * ( eh + ev ) ) );
+		g = w.isG * c + ( V::set1( 1.F ) - w.isG ) * e;
+	}
+
+	shade( j, r, g, b, o0 + x, o1 + x, o2 + x );
+}
+
+
+////////////////////////////////////////
+
+
+template <typename T, typename Out, bool kEdge>
+static void
+demosaicRows( const Job &j, int y0, int y1, uint16_t *scratch )
+{
+	uint16_t *o0 = scratch;
+	uint16_t *o1 = o0 + j.outW + kPad;
+	uint16_t *o2 = o1 + j.outW + kPad;
+
+	for ( int y = y0; y < y1; ++y )
+	{
+		const T *row[5];
+		for ( int k = 0; k < 5; ++k )
+			row[k] = reinterpret_cast<const T *>( j.src + static_cast<size_t>( mirror( y + k - 2, j.rh ) ) * j.srcStride );
+
+		int rp = y & 1;
+		const RowWeights<ScalarF> ws[2] = { RowWeights<ScalarF>( j, rp, 0 ), RowWeights<ScalarF>( j, rp, 1 ) };
+
+		int x = 0;
+		if ( VecF::W > 1 )
+		{
+			const RowWeights<VecF> wv( j, rp );
+			for ( ; x < 2 && x < j.rw; ++x )
+				demosaicAt<ScalarF, T, true, kEdge>( j, row, x, ws[x & 1], o0, o1, o2 );
+			for ( ; x + VecF::W + 2 <= j.rw; x += VecF::W )
+				demosaicAt<VecF, T, false, kEdge>( j, row, x, wv, o0, o1, o2 );
+		}
+		for ( ; x < j.rw; ++x )
+			demosaicAt<ScalarF, T, true, kEdge>( j, row, x, ws[x & 1], o0, o1, o2 );
+
+		writeRow<Out>( j, o0, o1, o2, y );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+template <typename V, typename T>
+static inline void
+superpixelAt( const Job &j, const T *r0, const T *r1, int i, uint16_t *o0, uint16_t *o1, uint16_t *o2 )
+{
+	V p[4] = { V::loadEven( r0 + 2 * i ), V::loadEven( r0 + 2 * i + 1 ),
+			   V::loadEven( r1 + 2 * i ), V::loadEven( r1 + 2 * i + 1 ) };
+	V c[3];
+	for ( int ch = 0; ch < 3; ++ch )
+		c[ch] = V::set1( j.cell[ch][0] ) * p[0] + V::set1( j.cell[ch][1] ) * p[1] +
+			V::set1( j.cell[ch][2] ) * p[2] + V::set1( j.cell[ch][3] ) * p[3];
+
+	shade( j, c[0], c[1], c[2], o0 + i, o1 + i, o2 + i );
+}
+
+
+////////////////////////////////////////
+
+
+template <typename T, typename Out>
+static void
+superpixelRows( const Job &j, int y0, int y1, uint16_t *scratch )
+{
+	uint16_t *o0 = scratch;
+	uint16_t *o1 = o0 + j.outW + kPad;
+	uint16_t *o2 = o1 + j.outW + kPad;
+
+	for ( int y = y0; y < y1; ++y )
+	{
+		const T *r0 = reinterpret_cast<const T *>( j.src + static_cast<size_t>( 2 * y ) * j.srcStride );
+		const T *r1 = reinterpret_cast<const T *>( j.src + static_cast<size_t>( 2 * y + 1 ) * j.srcStride );
+
+		int i = 0;
+		// each vector reads 2W samples from the odd column
+		if ( VecF::W > 1 )
+		{
+			for ( ; 2 * ( i + VecF::W ) < j.rw; i += VecF::W )
+				superpixelAt<VecF, T>( j, r0, r1, i, o0, o1, o2 );
+		}
+		for ( ; i < j.outW; ++i )
+			superpixelAt<ScalarF, T>( j, r0, r1, i, o0, o1, o2 );
+
+		writeRow<Out>( j, o0, o1, o2, y );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+template <typename T, typename Out>
+static void
+pickRows( Debayer::Method m, RowsFn &fn )
+{
+	switch ( m )
+	{
+		case Debayer::Method::BILINEAR: fn = &demosaicRows<T, Out, false>; break;
+		case Debayer::Method::EDGE_AWARE: fn = &demosaicRows<T, Out, true>; break;
+		case Debayer::Method::SUPERPIXEL: fn = &superpixelRows<T, Out>; break;
+	}
+}
@@ -0,0 +1,361 @@
+// DescriptorCache.cpp -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#include "DescriptorCache.h"
+#include "Logger.h"
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <cstdlib>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+static const char *kMagic = "usbpp-descriptor-cache";
+static const int kVersion = 2;
+
+std::mutex theDirMutex;
+bool theDirSet = false;
+std::string theDirectory;
+
+std::string
+defaultDirectory( void )
+{
+	const char *xdg = getenv( "XDG_CACHE_HOME" );
+	if ( xdg && xdg[0] != '\0' )
+		return std::string( xdg ) + "/usbpp";
+	const char *home = getenv( "HOME" );
+	if ( home && home[0] != '\0' )
+		return std::string( home ) + "/.cache/usbpp";
+	return std::string();
+}
+
+bool
+makeDirs( const std::string &dir )
+{
+	for ( size_t p = dir.find( '/', 1 ); ; p = dir.find( '/', p + 1 ) )
+	{
+		std::string cur = dir.substr( 0, p );
+		if ( mkdir( cur.c_str(), 0755 ) != 0 && errno != EEXIST )
+			return false;
+		if ( p == std::string::npos )
+			break;
+	}
+	return true;
+}
+
+void
+writeString( std::ostream &os, const char *tag, const std::string &s )
+{
+	os << tag << ' ' << s.size() << ' ' << s << '\n';
+}
+
+bool
+readString( std::istream &is, std::string &s )
+{
+	size_t len = 0;
+	if ( ! ( is >> len ) || len > 4096 )
+		return false;
+	is.get();
+	s.resize( len );
+	if ( len > 0 )
+		is.read( &s[0], std::streamsize( len ) );
+	return bool( is );
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+namespace USB
+{
+
+
+////////////////////////////////////////
+
+
+const DescriptorCache::ControlInfo *
+DescriptorCache::Entry::findControl( uint8_t unit, uint8_t iface, uint16_t term ) const
+{
+	auto i = controls.find( controlKey( unit, iface, term ) );
+	if ( i == controls.end() )
+		return nullptr;
+	return &( i->second );
+}
+
+
+////////////////////////////////////////
+
+
+void
+DescriptorCache::Entry::setControl( uint8_t unit, uint8_t iface, uint16_t term, const ControlInfo &ci )
+{
+	controls[controlKey( unit, iface, term )] = ci;
+	dirty = true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+DescriptorCache::setDirectory( const std::string &dir )
+{
+	std::unique_lock<std::mutex> lk( theDirMutex );
+	theDirectory = dir;
+	theDirSet = true;
+}
+
+
+////////////////////////////////////////
+
+
+std::string
+DescriptorCache::directory( void )
+{
+	std::unique_lock<std::mutex> lk( theDirMutex );
+	if ( ! theDirSet )
+	{
+		theDirectory = defaultDirectory();
+		theDirSet = true;
+	}
+	return theDirectory;
+}
+
+
+////////////////////////////////////////
+
+
+std::string
+DescriptorCache::fileName( const struct libusb_device_descriptor &desc, const std::string &serial )
+{
+	std::string dir = directory();
+	if ( dir.empty() )
+		return dir;
+
+	std::stringstream fn;
+	fn << dir << '/' << std::hex << std::setfill( '0' )
+	   << std::setw( 4 ) << desc.idVendor << '_'
+	   << std::setw( 4 ) << desc.idProduct << '_'
+	   << std::setw( 4 ) << desc.bcdDevice << '_';
+	if ( serial.empty() )
+		fn << "noserial";
+	for ( char c: serial )
+	{
+		if ( isalnum( static_cast<unsigned char>( c ) ) || c == '-' || c == '_' || c == '.' )
+			fn << c;
+		else
+			fn << '%' << std::setw( 2 ) << int( static_cast<unsigned char>( c ) );
+	}
+	fn << ".cache";
+	return fn.str();
+}
+
+
+////////////////////////////////////////
+
+
+std::shared_ptr<DescriptorCache::Entry>
+DescriptorCache::load( const struct libusb_device_descriptor &desc, const std::string &serial )
+{
+	std::shared_ptr<Entry> retval = std::make_shared<Entry>();
+
+	std::string fn = fileName( desc, serial );
+	if ( fn.empty() )
+		return retval;
+
+	std::ifstream in( fn, std::ios::binary );
+	if ( ! in )
+		return retval;
+
+	std::string magic;
+	int ver = 0;
+	if ( ! ( in >> magic >> ver ) || magic != kMagic || ver > kVersion )
+	{
+		warning() << "Ignoring descriptor cache " << fn << ": unknown format" << send;
+		return retval;
+	}
+	// older versions could have remembered controls that failed for
+	// no good reason, just start over
+	if ( ver != kVersion )
+		return retval;
+
+	Entry e;
+	bool ok = true;
+	std::string tag;
+	while ( ok && ( in >> tag ) )
+	{
+		if ( tag == "manufacturer" )
+			ok = readString( in, e.manufacturer );
+		else if ( tag == "product" )
+			ok = readString( in, e.product );
+		else if ( tag == "strings" )
+			e.haveStrings = true;
+		else if ( tag == "bos" )
+		{
+			size_t len = 0;
+			ok = bool( in >> len ) && len <= 65535;
+			e.bos.resize( ok ? len : 0 );
+			for ( size_t i = 0; ok && i < len; ++i )
+			{
+				unsigned int b = 0;
+				ok = bool( in >> std::hex >> b >> std::dec ) && b <= 0xFF;
+				e.bos[i] = static_cast<uint8_t>( b );
+			}
+			e.haveBOS = ok;
+		}
+		else if ( tag == "control" )
+		{
+			uint32_t key = 0, len = 0, ro = 0;
+			ControlInfo ci;
+			ok = bool( in >> std::hex >> key >> std::dec >> len >> ro >> ci.min >> ci.max );
+			if ( ok )
+			{
+				ci.length = static_cast<uint8_t>( len );
+				ci.readOnly = ro != 0;
+				e.controls[key] = ci;
+			}
+		}
+		else
+			ok = false;
+	}
+
+	if ( ! ok )
+	{
+		warning() << "Ignoring corrupt descriptor cache " << fn << send;
+		return retval;
+	}
+
+	*retval = e;
+	return retval;
+}
+
+
+////////////////////////////////////////
+
+
+void
+DescriptorCache::save( const struct libusb_device_descriptor &desc, const std::string &serial, Entry &e )
+{
+	if ( ! e.dirty )
+		return;
+	e.dirty = false;
+
+	std::string dir = directory();
+	std::string fn = fileName( desc, serial );
+	if ( fn.empty() )
+		return;
+
+	if ( ! makeDirs( dir ) )
+	{
+		warning() << "Unable to create descriptor cache directory " << dir << send;
+		return;
+	}
+
+	// write then rename so a concurrent reader or a crash never sees
+	// half a file. The temp name has to be unique, bring up workers
+	// can save the same key at once (i.e. identical devices without a
+	// serial number)
+	std::vector<char> tmpName( fn.begin(), fn.end() );
+	const char kSuffix[] = ".tmp.XXXXXX";
+	tmpName.insert( tmpName.end(), kSuffix, kSuffix + sizeof(kSuffix) );
+	int fd = ::mkstemp( tmpName.data() );
+	if ( fd < 0 )
+	{
+		warning() << "Unable to create descriptor cache " << fn << ": " << strerror( errno ) << send;
+		return;
+	}
+	::close( fd );
+	std::string tmp = tmpName.data();
+	{
+		std::ofstream out( tmp, std::ios::binary | std::ios::trunc );
+		out << kMagic << ' ' << kVersion << '\n';
+		if ( e.haveStrings )
+		{
+			out << "strings\n";
+			writeString( out, "manufacturer", e.manufacturer );
+			writeString( out, "product", e.product );
+		}
+		if ( e.haveBOS )
+		{
+			out << "bos " << e.bos.size() << std::hex;
+			for ( uint8_t b: e.bos )
+				out << ' ' << int( b );
+			out << std::dec << '\n';
+		}
+		for ( auto &c: e.controls )
+		{
+			out << "control " << std::hex << c.first << std::dec << ' '
+				<< int( c.second.length ) << ' ' << ( c.second.readOnly ? 1 : 0 ) << ' '
+				<< c.second.min << ' ' << c.second.max << '\n';
+		}
+		out.flush();
+		if ( ! out )
+		{
+			warning() << "Unable to write descriptor cache " << tmp << send;
+			out.close();
+			::unlink( tmp.c_str() );
+			return;
+		}
+	}
+
+	if ( ::rename( tmp.c_str(), fn.c_str() ) != 0 )
+	{
+		warning() << "Unable to update descriptor cache " << fn << send;
+		::unlink( tmp.c_str() );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+DescriptorCache::invalidate( const struct libusb_device_descriptor &desc, const std::string &serial )
+{
+	std::string fn = fileName( desc, serial );
+	if ( ! fn.empty() )
+		::unlink( fn.c_str() );
+}
+
+
+////////////////////////////////////////
+
+
+} // namespace USB
@@ -0,0 +1,113 @@
+// DescriptorCache.h -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <map>
+#include <memory>
+#include <vector>
+#include "libusb-1.0/libusb.h"
+
+
+////////////////////////////////////////
+
+
+///
+/// @file DescriptorCache.h
+///
+/// @author Kimball Thurston
+///
+
+namespace USB
+{
+
+///
+/// @brief Class DescriptorCache remembers what we learned about a
+/// device the last time we opened it.
+///
+/// Strings and control ranges each cost one or more synchronous
+/// control transfers to query, which dominates bringing up a device
+/// like a camera with dozens of controls. Entries are keyed by
+/// vendor, product, bcdDevice and serial number, so a firmware
+/// update invalidates them.
+///
+class DescriptorCache
+{
+public:
+	struct ControlInfo
+	{
+		uint8_t length = 0;
+		bool readOnly = true;
+		uint32_t min = 0;
+		uint32_t max = 0;
+	};
+
+	struct Entry
+	{
+		bool haveStrings = false;
+		std::string manufacturer;
+		std::string product;
+
+		// the raw BOS descriptor, empty if the device doesn't have one
+		bool haveBOS = false;
+		std::vector<uint8_t> bos;
+
+		// keyed by controlKey
+		std::map<uint32_t, ControlInfo> controls;
+
+		// set when something was added and the entry should be saved
+		bool dirty = false;
+		// set when a cached value didn't match the device, so none of
+		// it can be trusted (see invalidate)
+		bool stale = false;
+
+		const ControlInfo *findControl( uint8_t unit, uint8_t iface, uint16_t term ) const;
+		void setControl( uint8_t unit, uint8_t iface, uint16_t term, const ControlInfo &ci );
+	};
+
+	static inline uint32_t controlKey( uint8_t unit, uint8_t iface, uint16_t term )
+	{
+		return ( uint32_t( term ) << 16 ) | ( uint32_t( iface ) << 8 ) | unit;
+	}
+
+	// defaults to $XDG_CACHE_HOME/usbpp (or ~/.cache/usbpp), an empty
+	// directory disables the cache
+	static void setDirectory( const std::string &dir );
+	static std::string directory( void );
+
+	// never fails, returns an empty entry if there is no cache file
+	// or it can't be read
+	static std::shared_ptr<Entry> load( const struct libusb_device_descriptor &desc, const std::string &serial );
+	// writes the entry (if dirty) and clears the dirty flag
+	static void save( const struct libusb_device_descriptor &desc, const std::string &serial, Entry &e );
+	// removes the cache file, i.e. when a cached value turns out stale
+	static void invalidate( const struct libusb_device_descriptor &desc, const std::string &serial );
+
+private:
+	static std::string fileName( const struct libusb_device_descriptor &desc, const std::string &serial );
+};
+
+} // namespace USB
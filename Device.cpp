@@ -41,12 +41,103 @@
 #include "Util.h"
 #include "Logger.h"
 #include <functional>
+#include <algorithm>
+#include <cstdlib>
 #include <unistd.h>
 
 
 ////////////////////////////////////////
 
 
+namespace
+{
+
+// the BOS descriptor as the device sends it, empty if it doesn't
+// have one. False if that couldn't be found out
+static bool
+fetchBOS( libusb_device_handle *h, std::vector<uint8_t> &raw )
+{
+	raw.clear();
+
+	// just the header first, for the total length
+	uint8_t hdr[5];
+	int r = libusb_get_descriptor( h, LIBUSB_DT_BOS, 0, hdr, sizeof(hdr) );
+	if ( r == LIBUSB_ERROR_PIPE )
+		return true;
+	if ( r < int( sizeof(hdr) ) || hdr[1] != LIBUSB_DT_BOS )
+		return false;
+
+	size_t total = size_t( hdr[2] ) | ( size_t( hdr[3] ) << 8 );
+	if ( total < sizeof(hdr) )
+		return false;
+	raw.resize( total );
+	r = libusb_get_descriptor( h, LIBUSB_DT_BOS, 0, raw.data(), int( total ) );
+	if ( r != int( total ) )
+	{
+		raw.clear();
+		return false;
+	}
+	return true;
+}
+
+// the same structure libusb_get_bos_descriptor builds, so the libusb
+// capability parsers work on it, but it has to go back through
+// freeBOS
+static libusb_bos_descriptor *
+parseBOS( const std::vector<uint8_t> &raw )
+{
+	if ( raw.size() < 5 || raw[0] < 5 || raw[1] != LIBUSB_DT_BOS )
+		return nullptr;
+
+	uint8_t n = raw[4];
+	libusb_bos_descriptor *bos = static_cast<libusb_bos_descriptor *>(
+		calloc( 1, sizeof(libusb_bos_descriptor) + n * sizeof(libusb_bos_dev_capability_descriptor *) ) );
+	if ( ! bos )
+		return nullptr;
+	bos->bLength = raw[0];
+	bos->bDescriptorType = raw[1];
+	bos->wTotalLength = static_cast<uint16_t>( raw[2] | ( raw[3] << 8 ) );
+
+	// stop at anything malformed, keeping the capabilities before it
+	size_t off = raw[0];
+	uint8_t i = 0;
+	for ( ; i < n && off + LIBUSB_DT_DEVICE_CAPABILITY_SIZE <= raw.size(); ++i )
+	{
+		uint8_t len = raw[off];
+		if ( len < LIBUSB_DT_DEVICE_CAPABILITY_SIZE || off + len > raw.size() ||
+			 raw[off + 1] != LIBUSB_DT_DEVICE_CAPABILITY )
+			break;
+
+		size_t dataLen = len - LIBUSB_DT_DEVICE_CAPABILITY_SIZE;
+		libusb_bos_dev_capability_descriptor *c = static_cast<libusb_bos_dev_capability_descriptor *>(
+			malloc( sizeof(libusb_bos_dev_capability_descriptor) + dataLen ) );
+		if ( ! c )
+			break;
+		c->bLength = len;
+		c->bDescriptorType = raw[off + 1];
+		c->bDevCapabilityType = raw[off + 2];
+		memcpy( c->dev_capability_data, raw.data() + off + LIBUSB_DT_DEVICE_CAPABILITY_SIZE, dataLen );
+		bos->dev_capability[i] = c;
+		off += len;
+	}
+	bos->bNumDeviceCaps = i;
+	return bos;
+}
+
+static void
+freeBOS( libusb_bos_descriptor *bos )
+{
+	for ( uint8_t i = 0; i < bos->bNumDeviceCaps; ++i )
+		free( bos->dev_capability[i] );
+	free( bos );
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
 namespace USB
 {
 
@@ -170,6 +261,117 @@ Device::claimInterfaces( void )
 			}
 		}
 	}
+
+	saveCache();
+}
+
+
+////////////////////////////////////////
+
+
+void
+Device::saveCache( void )
+{
+	if ( ! myCache )
+		return;
+
+	if ( myCache->stale )
+	{
+		// the device changed without bcdDevice moving, forget all of
+		// it so the next open asks the device again
+		DescriptorCache::invalidate( myDescriptor, mySerialNumber );
+		myCache = std::make_shared<DescriptorCache::Entry>();
+		return;
+	}
+
+	DescriptorCache::save( myDescriptor, mySerialNumber, *myCache );
+}
+
+
+////////////////////////////////////////
+
+
+uint32_t
+Device::maxStreams( uint8_t endPoint ) const
+{
+	const struct libusb_endpoint_descriptor *ep = findEndpoint( endPoint );
+	if ( ! ep || ( ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK ) != LIBUSB_TRANSFER_TYPE_BULK )
+		return 0;
+
+	auto x = mySSEndpointCompanion.find( endPoint );
+	if ( x == mySSEndpointCompanion.end() )
+		return 0;
+
+	// bulk endpoints encode MaxStreams as a power of 2 in bits 0-4
+	uint8_t ms = x->second->bmAttributes & 0x1F;
+	if ( ms == 0 )
+		return 0;
+	return uint32_t(1) << ms;
+}
+
+
+////////////////////////////////////////
+
+
+int
+Device::allocStreams( uint32_t numStreams, const std::vector<uint8_t> &endPoints )
+{
+	if ( ! myHandle )
+		throw std::runtime_error( "Device must be opened prior to allocating streams" );
+	if ( endPoints.empty() || numStreams == 0 )
+		return 0;
+
+	for ( uint8_t ep: endPoints )
+	{
+		uint32_t ms = maxStreams( ep );
+		if ( ms == 0 )
+			throw std::runtime_error( "Endpoint does not support bulk streams" );
+		numStreams = std::min( numStreams, ms );
+	}
+
+	freeStreams();
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000103)
+	std::vector<uint8_t> eps = endPoints;
+	int n = check_error( libusb_alloc_streams( myHandle, numStreams, eps.data(), int(eps.size()) ) );
+	myStreamEndpoints.swap( eps );
+	return n;
+#else
+	throw usb_error( LIBUSB_ERROR_NOT_SUPPORTED );
+#endif
+}
+
+
+////////////////////////////////////////
+
+
+void
+Device::freeStreams( void )
+{
+	if ( myStreamEndpoints.empty() )
+		return;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000103)
+	if ( myHandle )
+		libusb_free_streams( myHandle, myStreamEndpoints.data(), int(myStreamEndpoints.size()) );
+#endif
+	myStreamEndpoints.clear();
+}
+
+
+////////////////////////////////////////
+
+
+std::shared_ptr<BulkStreamTransfer>
+Device::createStreamTransfer( uint8_t endPoint, uint32_t streamID, size_t bufSize )
+{
+	if ( std::find( myStreamEndpoints.begin(), myStreamEndpoints.end(), endPoint ) == myStreamEndpoints.end() )
+		throw std::runtime_error( "No streams allocated on endpoint" );
+
+	std::shared_ptr<BulkStreamTransfer> xfer = std::make_shared<BulkStreamTransfer>( myContext, streamID, bufSize );
+	xfer->setBufferMode( myBufferMode );
+	xfer->init( myHandle, endPoint );
+	return xfer;
 }
 
 
@@ -239,6 +441,18 @@ Device::setLanguageID( uint16_t id )
 ////////////////////////////////////////
 
 
+BufferStats
+Device::bufferStats( void ) const
+{
+	BufferStats s;
+	collectBufferStats( s );
+	return s;
+}
+
+
+////////////////////////////////////////
+
+
 void
 Device::dumpInfo( std::ostream &os )
 {
@@ -420,7 +634,10 @@ Device::createTransfer( const struct libusb_endpoint_descriptor &epDesc )
 	}
 
 	if ( xfer )
+	{
+		xfer->setBufferMode( myBufferMode );
 		xfer->init( myHandle, epDesc.bEndpointAddress );
+	}
 
 	return xfer;
 }
@@ -447,6 +664,17 @@ Device::dumpExtraInterfaceInfo( std::ostream &os, const struct libusb_interface_
 ////////////////////////////////////////
 
 
+void
+Device::collectBufferStats( BufferStats &s ) const
+{
+	for ( const std::shared_ptr<AsyncTransfer> &xfer: myInputs )
+		s.add( xfer->requestedBufferMode(), xfer->bufferMode(), xfer->bufferSize() );
+}
+
+
+////////////////////////////////////////
+
+
 void
 Device::dispatchEvent( libusb_transfer *xfer )
 {
@@ -467,6 +695,33 @@ Device::dispatchEvent( libusb_transfer *xfer )
 ////////////////////////////////////////
 
 
+const struct libusb_endpoint_descriptor *
+Device::findEndpoint( uint8_t endPoint ) const
+{
+	if ( myConfigs.empty() )
+		return nullptr;
+
+	const struct libusb_config_descriptor &conf = *(myConfigs[myCurConfig]);
+	for ( size_t iface = 0; iface < conf.bNumInterfaces; ++iface )
+	{
+		const struct libusb_interface &curIface = conf.interface[iface];
+		for ( int curset = 0; curset < curIface.num_altsetting; ++curset )
+		{
+			const struct libusb_interface_descriptor &iFaceDesc = curIface.altsetting[curset];
+			for ( int ep = 0, nep = int(iFaceDesc.bNumEndpoints); ep < nep; ++ep )
+			{
+				if ( iFaceDesc.endpoint[ep].bEndpointAddress == endPoint )
+					return &(iFaceDesc.endpoint[ep]);
+			}
+		}
+	}
+	return nullptr;
+}
+
+
+////////////////////////////////////////
+
+
 void
 Device::openHandle( void )
 {
@@ -478,9 +733,23 @@ Device::openHandle( void )
 
 	libusb_set_auto_detach_kernel_driver( myHandle, 1 );
 
-	myManufacturer = pullString( myDescriptor.iManufacturer );
-	myProduct = pullString( myDescriptor.iProduct );
+	// the serial number is part of the cache key, so always ask
 	mySerialNumber = pullString( myDescriptor.iSerialNumber );
+	myCache = DescriptorCache::load( myDescriptor, mySerialNumber );
+	if ( myCache->haveStrings )
+	{
+		myManufacturer = myCache->manufacturer;
+		myProduct = myCache->product;
+	}
+	else
+	{
+		myManufacturer = pullString( myDescriptor.iManufacturer );
+		myProduct = pullString( myDescriptor.iProduct );
+		myCache->manufacturer = myManufacturer;
+		myCache->product = myProduct;
+		myCache->haveStrings = true;
+		myCache->dirty = true;
+	}
 
 	for ( uint8_t c = 0; c < myDescriptor.bNumConfigurations; ++c )
 	{
@@ -523,7 +792,17 @@ Device::openHandle( void )
 		}
 	}
 
-	libusb_get_bos_descriptor( myHandle, &myBOS );
+	// BOS arrived with USB 2.01, older devices just stall the request
+	if ( myDescriptor.bcdUSB >= 0x0201 )
+	{
+		if ( ! myCache->haveBOS && fetchBOS( myHandle, myCache->bos ) )
+		{
+			myCache->haveBOS = true;
+			myCache->dirty = true;
+		}
+		if ( ! myCache->bos.empty() )
+			myBOS = parseBOS( myCache->bos );
+	}
 
 	if ( myBOS && myContext )
 	{
@@ -566,6 +845,8 @@ Device::closeHandle( void )
 	}
 	myInputs.clear();
 
+	freeStreams();
+
 	for ( auto &i: mySSEndpointCompanion )
 		libusb_free_ss_endpoint_companion_descriptor( i.second );
 	mySSEndpointCompanion.clear();
@@ -582,7 +863,7 @@ Device::closeHandle( void )
 	}
 	if ( myBOS )
 	{
-		libusb_free_bos_descriptor( myBOS );
+		freeBOS( myBOS );
 		myBOS = nullptr;
 	}
 
@@ -594,6 +875,9 @@ Device::closeHandle( void )
 		libusb_free_config_descriptor( myConfigs[i] );
 	myConfigs.clear();
 
+	saveCache();
+	myCache.reset();
+
 	libusb_close( myHandle );
 	myHandle = nullptr;
 }
@@ -30,6 +30,7 @@
 #include <functional>
 #include "Exception.h"
 #include "Transfer.h"
+#include "DescriptorCache.h"
 #include <iostream>
 #include <vector>
 #include <map>
@@ -83,12 +84,29 @@ public:
 
 	void claimInterfaces( void );
 
+	// number of USB 3 bulk streams the endpoint companion descriptor
+	// advertises, 0 if the endpoint does not support streams
+	uint32_t maxStreams( uint8_t endPoint ) const;
+	// allocates streams (IDs 1 - N) on bulk endpoints that support
+	// them, returns the number actually allocated, which may be less
+	// than asked for
+	int allocStreams( uint32_t numStreams, const std::vector<uint8_t> &endPoints );
+	void freeStreams( void );
+	// builds a transfer for stream ID on the endpoint, ready to submit
+	std::shared_ptr<BulkStreamTransfer> createStreamTransfer( uint8_t endPoint, uint32_t streamID, size_t bufSize );
+
 	void startEventHandling( void );
 	void stopEventHandling( void );
 	void shutdown( void );
 
 	void setLanguageID( uint16_t langID = 0 );
 
+	// how transfer buffers get allocated, applies to transfers
+	// created after the call (i.e. on the next claim / stream start)
+	void setBufferMode( BufferMode m ) { myBufferMode = m; }
+	BufferMode getBufferMode( void ) const { return myBufferMode; }
+	BufferStats bufferStats( void ) const;
+
 	void dumpInfo( std::ostream &os );
 
 	void dispatchEvent( libusb_transfer *xfer );
@@ -108,11 +126,19 @@ protected:
 
 	virtual void dumpExtraInterfaceInfo( std::ostream &os, const struct libusb_interface_descriptor &iface );
 
+	virtual void collectBufferStats( BufferStats &s ) const;
+
+	const struct libusb_endpoint_descriptor *findEndpoint( uint8_t endPoint ) const;
+
 	void openHandle( void );
 	virtual void closeHandle( void );
 
 	std::string pullString( uint8_t desc_idx );
 
+	// writes back anything learned while claiming, called at the end
+	// of claimInterfaces
+	void saveCache( void );
+
 	libusb_context *myContext = nullptr;
 	libusb_device *myDevice = nullptr;
 	libusb_device_handle *myHandle = nullptr;
@@ -127,11 +153,15 @@ protected:
 
 	size_t myCurConfig = 0;
 	std::vector<uint8_t> myClaimedInterfaces;
+	std::vector<uint8_t> myStreamEndpoints;
 	std::vector< std::shared_ptr<AsyncTransfer> > myInputs;
 	std::string myManufacturer;
 	std::string myProduct;
 	std::string mySerialNumber;
 	uint16_t myLangID = 0;
+	// valid while the handle is open
+	std::shared_ptr<DescriptorCache::Entry> myCache;
+	BufferMode myBufferMode = BufferMode::HOST;
 };
 
 } // namespace USB
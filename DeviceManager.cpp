@@ -25,9 +25,18 @@
 #include "DeviceManager.h"
 #include "Exception.h"
 #include <mutex>
+#include <algorithm>
+#include <chrono>
 #include "Logger.h"
 #include "Transfer.h"
 #include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#ifdef __linux__
+# include <sys/epoll.h>
+# include <sys/eventfd.h>
+#endif
 
 
 ////////////////////////////////////////
@@ -36,6 +45,19 @@
 namespace
 {
 
+#ifdef __linux__
+uint32_t
+toEpoll( short events )
+{
+	uint32_t r = 0;
+	if ( events & POLLIN )
+		r |= EPOLLIN;
+	if ( events & POLLOUT )
+		r |= EPOLLOUT;
+	return r;
+}
+#endif
+
 } // empty namespace
 
 
@@ -69,8 +91,13 @@ void
 DeviceManager::registerDevice( uint16_t vendor, uint16_t prod,
 							   const FactoryFunction &factory )
 {
-	std::unique_lock<std::mutex> lk( myMutex );
-	mySpecificFactories[std::make_pair(vendor, prod)] = factory;
+	FactoryRule r;
+	r.kind = FactoryRule::PRODUCT;
+	r.vendor = vendor;
+	r.product = prod;
+	r.classID = 0;
+	r.factory = factory;
+	addRule( r );
 }
 
 
@@ -80,8 +107,29 @@ DeviceManager::registerDevice( uint16_t vendor, uint16_t prod,
 void
 DeviceManager::registerClass( uint8_t classID, const FactoryFunction &factory )
 {
-	std::unique_lock<std::mutex> lk( myMutex );
-	myClassFactories[classID] = factory;
+	FactoryRule r;
+	r.kind = FactoryRule::DEVICE_CLASS;
+	r.vendor = 0;
+	r.product = 0;
+	r.classID = classID;
+	r.factory = factory;
+	addRule( r );
+}
+
+
+////////////////////////////////////////
+
+
+void
+DeviceManager::registerInterfaceClass( uint8_t classID, const FactoryFunction &factory )
+{
+	FactoryRule r;
+	r.kind = FactoryRule::INTERFACE_CLASS;
+	r.vendor = 0;
+	r.product = 0;
+	r.classID = classID;
+	r.factory = factory;
+	addRule( r );
 }
 
 
@@ -91,8 +139,24 @@ DeviceManager::registerClass( uint8_t classID, const FactoryFunction &factory )
 void
 DeviceManager::registerVendor( uint16_t vendID, const FactoryFunction &factory )
 {
-	std::unique_lock<std::mutex> lk( myMutex );
-	myVendorFactories[vendID] = factory;
+	FactoryRule r;
+	r.kind = FactoryRule::VENDOR;
+	r.vendor = vendID;
+	r.product = 0;
+	r.classID = 0;
+	r.factory = factory;
+	addRule( r );
+}
+
+
+////////////////////////////////////////
+
+
+bool
+DeviceManager::FactoryRule::sameKey( const FactoryRule &o ) const
+{
+	return kind == o.kind && vendor == o.vendor &&
+		product == o.product && classID == o.classID;
 }
 
 
@@ -100,43 +164,192 @@ DeviceManager::registerVendor( uint16_t vendID, const FactoryFunction &factory )
 
 
 void
-DeviceManager::start( const NewDeviceFunction &newFunc, const DeadDeviceFunction &deadFunc )
+DeviceManager::addRule( const FactoryRule &r )
 {
 	std::unique_lock<std::mutex> lk( myMutex );
+	// re-registering replaces the previous factory
+	for ( FactoryRule &cur: myRules )
+	{
+		if ( cur.sameKey( r ) )
+		{
+			cur.factory = r.factory;
+			return;
+		}
+	}
+	myRules.push_back( r );
+}
 
-	myQuitFlag = false;
-	myNewDeviceFunc = newFunc;
-	myDeadDeviceFunc = deadFunc;
 
-	if ( myContext )
-		return;
+////////////////////////////////////////
 
-	libusb_init( &myContext );
-	
-//		libusb_set_debug( myContext, LIBUSB_LOG_LEVEL_DEBUG );
-	if ( libusb_has_capability( LIBUSB_CAP_HAS_HOTPLUG ) )
+
+void
+DeviceManager::compileRules( void )
+{
+	// caller has the lock
+	myMatchTable = myRules;
+	std::stable_sort( myMatchTable.begin(), myMatchTable.end(),
+					  []( const FactoryRule &a, const FactoryRule &b ) { return a.kind < b.kind; } );
+
+	myMatchInterfaces = false;
+	for ( const FactoryRule &r: myMatchTable )
+		if ( r.kind == FactoryRule::INTERFACE_CLASS )
+			myMatchInterfaces = true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+DeviceManager::registerHotplug( void )
+{
+	// caller has the lock. hotplug can only filter on the device
+	// descriptor, so an interface class rule means we have to see
+	// everything, otherwise ask for just the devices that have a rule
+	std::vector<std::pair<int, int>> vendProd;
+	std::vector<int> classes;
+	if ( myMatchInterfaces )
 	{
-		libusb_hotplug_callback_handle plugHandle = 0;
-		libusb_hotplug_event ev = LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
-		ev = static_cast<libusb_hotplug_event>( ev | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT );
+		vendProd.push_back( std::make_pair( LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY ) );
+	}
+	else
+	{
+		std::set<uint16_t> vendors;
+		for ( const FactoryRule &r: myMatchTable )
+		{
+			switch ( r.kind )
+			{
+				case FactoryRule::VENDOR:
+					vendors.insert( r.vendor );
+					vendProd.push_back( std::make_pair( int( r.vendor ), LIBUSB_HOTPLUG_MATCH_ANY ) );
+					break;
+				case FactoryRule::PRODUCT:
+					// sorted first, so check the vendors separately below
+					vendProd.push_back( std::make_pair( int( r.vendor ), int( r.product ) ) );
+					break;
+				case FactoryRule::DEVICE_CLASS:
+					classes.push_back( r.classID );
+					break;
+				case FactoryRule::INTERFACE_CLASS:
+					break;
+			}
+		}
 
-		// The callback is called prior to return from here, so temporarily
-		// unlock....
-		lk.unlock();
+		// a vendor rule already covers all that vendor's products
+		vendProd.erase( std::remove_if( vendProd.begin(), vendProd.end(),
+										[&]( const std::pair<int, int> &vp )
+										{
+											return vp.second != LIBUSB_HOTPLUG_MATCH_ANY &&
+												vendors.find( uint16_t( vp.first ) ) != vendors.end();
+										} ),
+						vendProd.end() );
+	}
+
+	libusb_hotplug_event ev = LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
+	ev = static_cast<libusb_hotplug_event>( ev | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT );
+
+	std::vector<libusb_hotplug_callback_handle> handles;
+	auto reg = [&]( int vendor, int product, int devClass )
+	{
+		libusb_hotplug_callback_handle plugHandle = 0;
 		check_error(
 			libusb_hotplug_register_callback( myContext,
 											  ev,
 											  LIBUSB_HOTPLUG_ENUMERATE,
-											  LIBUSB_HOTPLUG_MATCH_ANY,
-											  LIBUSB_HOTPLUG_MATCH_ANY,
-											  LIBUSB_HOTPLUG_MATCH_ANY,
+											  vendor,
+											  product,
+											  devClass,
 											  &DeviceManager::hotplug_cb,
 											  this,
 											  &plugHandle )
 					);
+		handles.push_back( plugHandle );
+	};
 
-		lk.lock();
-		myPlugHandle = plugHandle;
+	// The callback is called prior to return from here, so temporarily
+	// unlock.... a device matching more than one filter is reported to
+	// each, add and remove don't mind being called twice
+	myMutex.unlock();
+	try
+	{
+		for ( auto &vp: vendProd )
+			reg( vp.first, vp.second, LIBUSB_HOTPLUG_MATCH_ANY );
+		for ( int c: classes )
+			reg( LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, c );
+	}
+	catch ( ... )
+	{
+		myMutex.lock();
+		myPlugHandles.insert( myPlugHandles.end(), handles.begin(), handles.end() );
+		throw;
+	}
+	myMutex.lock();
+
+	myPlugHandles.insert( myPlugHandles.end(), handles.begin(), handles.end() );
+}
+
+
+////////////////////////////////////////
+
+
+void
+DeviceManager::setBringUpConcurrency( size_t n )
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	myBringUpConcurrency = std::max( n, size_t(1) );
+}
+
+
+////////////////////////////////////////
+
+
+void
+DeviceManager::start( const NewDeviceFunction &newFunc, const DeadDeviceFunction &deadFunc, bool runEventThread )
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+
+	myQuitFlag = false;
+	myNewDeviceFunc = newFunc;
+	myDeadDeviceFunc = deadFunc;
+
+	if ( myContext )
+		return;
+
+	libusb_init( &myContext );
+
+	for ( size_t i = 0; i < myBringUpConcurrency; ++i )
+		myBringUpThreads.push_back( std::thread( &DeviceManager::bringUpLoop, this ) );
+
+#ifdef __linux__
+	// set this up before hotplug registration, since that can end up
+	// submitting transfers
+	myEpollFD = epoll_create1( EPOLL_CLOEXEC );
+	myWakeFD = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+	if ( myEpollFD < 0 || myWakeFD < 0 )
+		throw std::runtime_error( "Unable to create event descriptors" );
+
+	struct epoll_event wev;
+	wev.events = EPOLLIN;
+	wev.data.fd = myWakeFD;
+	epoll_ctl( myEpollFD, EPOLL_CTL_ADD, myWakeFD, &wev );
+
+	libusb_set_pollfd_notifiers( myContext, &DeviceManager::pollfd_added,
+								 &DeviceManager::pollfd_removed, this );
+	const struct libusb_pollfd **fds = libusb_get_pollfds( myContext );
+	if ( fds )
+	{
+		for ( const struct libusb_pollfd **f = fds; *f; ++f )
+			pollfd_added( (*f)->fd, (*f)->events, this );
+		libusb_free_pollfds( fds );
+	}
+#endif
+	
+//		libusb_set_debug( myContext, LIBUSB_LOG_LEVEL_DEBUG );
+	compileRules();
+	if ( libusb_has_capability( LIBUSB_CAP_HAS_HOTPLUG ) )
+	{
+		registerHotplug();
 	}
 	else
 	{
@@ -144,7 +357,8 @@ DeviceManager::start( const NewDeviceFunction &newFunc, const DeadDeviceFunction
 		myProbeThread = std::thread( &DeviceManager::probeLoop, this );
 	}
 
-	myEventThread = std::thread( &DeviceManager::eventLoop, this );
+	if ( runEventThread )
+		myEventThread = std::thread( &DeviceManager::eventLoop, this );
 }
 
 
@@ -157,12 +371,26 @@ DeviceManager::shutdown( void )
 	std::unique_lock<std::mutex> lk( myMutex );
 	myQuitFlag = true;
 	
-	if ( myPlugHandle != 0 )
+	for ( libusb_hotplug_callback_handle h: myPlugHandles )
+		libusb_hotplug_deregister_callback( myContext, h );
+	myPlugHandles.clear();
+
+	if ( ! myBringUpThreads.empty() )
 	{
-		libusb_hotplug_deregister_callback( myContext, myPlugHandle );
-		myPlugHandle = 0;
+		myBringUpNotify.notify_all();
+		lk.unlock();
+		for ( std::thread &t: myBringUpThreads )
+			t.join();
+		lk.lock();
+		myBringUpThreads.clear();
 	}
 
+	for ( PendingDevice &pd: myBringUpQueue )
+		libusb_unref_device( pd.dev );
+	myBringUpQueue.clear();
+	myPendingDevices.clear();
+	myCancelledDevices.clear();
+
 	if ( myProbeThread.joinable() )
 	{
 		myProbeNotify.notify_all();
@@ -174,7 +402,7 @@ DeviceManager::shutdown( void )
 
 	if ( myEventThread.joinable() )
 	{
-		myEventNotify.notify_all();
+		wake();
 		lk.unlock();
 		myEventThread.join();
 		lk.lock();
@@ -189,13 +417,26 @@ DeviceManager::shutdown( void )
 		devs.push_back( i->first );
 	}
 	myDevices.clear();
+	publishRegistry();
 
 	for ( libusb_device *d: devs )
 		libusb_unref_device( d );
 
 	if ( myContext )
+	{
+#ifdef __linux__
+		libusb_set_pollfd_notifiers( myContext, nullptr, nullptr, nullptr );
+#endif
 		libusb_exit( myContext );
+	}
 	myContext = nullptr;
+
+	if ( myEpollFD >= 0 )
+		::close( myEpollFD );
+	myEpollFD = -1;
+	if ( myWakeFD >= 0 )
+		::close( myWakeFD );
+	myWakeFD = -1;
 }
 
 
@@ -246,6 +487,7 @@ DeviceManager::probeLoop( void )
 
 			libusb_free_device_list( list, 1 );
 		}
+		publishRegistry();
 
 		if ( ! oldDevs.empty() )
 		{
@@ -279,12 +521,23 @@ DeviceManager::probeLoop( void )
 void
 DeviceManager::eventLoop( void )
 {
-	std::unique_lock<std::mutex> lk( myMutex );
-
 	while ( ! myQuitFlag )
 	{
-		lk.unlock();
-
+#ifdef __linux__
+		// sleep until libusb or a quit request has something for us,
+		// libusb uses a timerfd for its timeouts on linux so there
+		// is no need to wake up periodically
+		struct epoll_event evs[8];
+		int n = epoll_wait( myEpollFD, evs, 8, nextTimeout() );
+		if ( n < 0 && errno != EINTR )
+		{
+			warning() << "Error waiting for events: " << strerror( errno ) << send;
+			break;
+		}
+		if ( myQuitFlag )
+			break;
+		handleReady();
+#else
 		struct timeval tv = { 0, 10000 };
 		int ec = libusb_handle_events_timeout( myContext, &tv );
 
@@ -304,11 +557,11 @@ DeviceManager::eventLoop( void )
 				break;
 			}
 		}
-
-		lk.lock();
+#endif
 	}
 
 	// make sure all event handling is stopped
+	std::unique_lock<std::mutex> lk( myMutex );
 	for ( auto &dev: myDevices )
 		dev.second->stopEventHandling();
 }
@@ -317,12 +570,137 @@ DeviceManager::eventLoop( void )
 ////////////////////////////////////////
 
 
+std::vector< std::pair<int, short> >
+DeviceManager::pollFds( void ) const
+{
+	std::vector< std::pair<int, short> > retval;
+#ifdef __linux__
+	if ( myEpollFD >= 0 )
+		retval.push_back( std::make_pair( myEpollFD, short(POLLIN) ) );
+#else
+	if ( myContext )
+	{
+		const struct libusb_pollfd **fds = libusb_get_pollfds( myContext );
+		if ( fds )
+		{
+			for ( const struct libusb_pollfd **f = fds; *f; ++f )
+				retval.push_back( std::make_pair( (*f)->fd, (*f)->events ) );
+			libusb_free_pollfds( fds );
+		}
+	}
+#endif
+	return retval;
+}
+
+
+////////////////////////////////////////
+
+
+int
+DeviceManager::nextTimeout( void ) const
+{
+	if ( ! myContext || libusb_pollfds_handle_timeouts( myContext ) )
+		return -1;
+
+	struct timeval tv;
+	int r = libusb_get_next_timeout( myContext, &tv );
+	if ( r <= 0 )
+		return -1;
+	return int( tv.tv_sec * 1000 + ( tv.tv_usec + 999 ) / 1000 );
+}
+
+
+////////////////////////////////////////
+
+
+void
+DeviceManager::handleReady( void )
+{
+#ifdef __linux__
+	uint64_t v;
+	while ( ::read( myWakeFD, &v, sizeof(v) ) == sizeof(v) )
+		;
+#endif
+
+	struct timeval tv = { 0, 0 };
+	int ec = libusb_handle_events_timeout_completed( myContext, &tv, nullptr );
+
+	switch ( ec )
+	{
+		case LIBUSB_SUCCESS:
+		case LIBUSB_ERROR_INTERRUPTED:
+		case LIBUSB_ERROR_TIMEOUT:
+			break;
+
+		default:
+		{
+			libusb_error err = static_cast<libusb_error>( ec );
+			warning() << "Error while handling events: " << ec << " "
+					  << libusb_error_name( err ) << " - "
+					  << libusb_strerror( err ) << send;
+			break;
+		}
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+DeviceManager::wake( void )
+{
+#ifdef __linux__
+	if ( myWakeFD >= 0 )
+	{
+		uint64_t v = 1;
+		if ( ::write( myWakeFD, &v, sizeof(v) ) < 0 )
+			warning() << "Unable to wake event loop: " << strerror( errno ) << send;
+	}
+#endif
+}
+
+
+////////////////////////////////////////
+
+
+void
+DeviceManager::pollfd_added( int fd, short events, void *user_data )
+{
+#ifdef __linux__
+	DeviceManager *devMgr = reinterpret_cast<DeviceManager *>( user_data );
+	struct epoll_event ev;
+	ev.events = toEpoll( events );
+	ev.data.fd = fd;
+	if ( epoll_ctl( devMgr->myEpollFD, EPOLL_CTL_ADD, fd, &ev ) < 0 && errno == EEXIST )
+		epoll_ctl( devMgr->myEpollFD, EPOLL_CTL_MOD, fd, &ev );
+#endif
+}
+
+
+////////////////////////////////////////
+
+
+void
+DeviceManager::pollfd_removed( int fd, void *user_data )
+{
+#ifdef __linux__
+	DeviceManager *devMgr = reinterpret_cast<DeviceManager *>( user_data );
+	epoll_ctl( devMgr->myEpollFD, EPOLL_CTL_DEL, fd, nullptr );
+#endif
+}
+
+
+////////////////////////////////////////
+
+
 std::shared_ptr<Device>
 DeviceManager::findDevice( uint16_t v, uint16_t p )
 {
-	for ( auto i = myDevices.begin(); i != myDevices.end(); ++i )
-		if ( i->second->matches( v, p ) )
-			return i->second;
+	std::shared_ptr<const Registry> reg = registry();
+	auto i = reg->byProduct.find( productKey( v, p ) );
+	if ( i != reg->byProduct.end() )
+		return i->second.front();
 
 	return std::shared_ptr<Device>();
 }
@@ -334,9 +712,10 @@ DeviceManager::findDevice( uint16_t v, uint16_t p )
 std::shared_ptr<Device>
 DeviceManager::findDevice( uint16_t v )
 {
-	for ( auto i = myDevices.begin(); i != myDevices.end(); ++i )
-		if ( i->second->matches( v ) )
-			return i->second;
+	std::shared_ptr<const Registry> reg = registry();
+	auto i = reg->byVendor.find( v );
+	if ( i != reg->byVendor.end() )
+		return i->second.front();
 
 	return std::shared_ptr<Device>();
 }
@@ -348,12 +727,7 @@ DeviceManager::findDevice( uint16_t v )
 std::vector<std::shared_ptr<Device>>
 DeviceManager::getAllDevices( void )
 {
-	std::vector<std::shared_ptr<Device>> retval;
-
-	for ( auto i = myDevices.begin(); i != myDevices.end(); ++i )
-		retval.push_back( i->second );
-
-	return retval;
+	return registry()->all;
 }
 
 
@@ -363,13 +737,12 @@ DeviceManager::getAllDevices( void )
 std::vector<std::shared_ptr<Device>>
 DeviceManager::findAllDevices( uint16_t v, uint16_t p )
 {
-	std::vector<std::shared_ptr<Device>> retval;
+	std::shared_ptr<const Registry> reg = registry();
+	auto i = reg->byProduct.find( productKey( v, p ) );
+	if ( i != reg->byProduct.end() )
+		return i->second;
 
-	for ( auto i = myDevices.begin(); i != myDevices.end(); ++i )
-		if ( i->second->matches( v, p ) )
-			retval.push_back( i->second );
-
-	return retval;
+	return std::vector<std::shared_ptr<Device>>();
 }
 
 
@@ -379,11 +752,60 @@ DeviceManager::findAllDevices( uint16_t v, uint16_t p )
 std::vector<std::shared_ptr<Device>>
 DeviceManager::findAllDevices( uint16_t v )
 {
-	std::vector<std::shared_ptr<Device>> retval;
+	std::shared_ptr<const Registry> reg = registry();
+	auto i = reg->byVendor.find( v );
+	if ( i != reg->byVendor.end() )
+		return i->second;
 
-	for ( auto i = myDevices.begin(); i != myDevices.end(); ++i )
-		if ( i->second->matches( v ) )
-			retval.push_back( i->second );
+	return std::vector<std::shared_ptr<Device>>();
+}
+
+
+////////////////////////////////////////
+
+
+std::shared_ptr<Device>
+DeviceManager::findDeviceBySerial( const std::string &serial )
+{
+	std::shared_ptr<const Registry> reg = registry();
+	auto i = reg->bySerial.find( serial );
+	if ( i != reg->bySerial.end() )
+		return i->second;
+
+	return std::shared_ptr<Device>();
+}
+
+
+////////////////////////////////////////
+
+
+std::shared_ptr<Device>
+DeviceManager::findDeviceByPort( const std::string &path )
+{
+	std::shared_ptr<const Registry> reg = registry();
+	auto i = reg->byPort.find( path );
+	if ( i != reg->byPort.end() )
+		return i->second;
+
+	return std::shared_ptr<Device>();
+}
+
+
+////////////////////////////////////////
+
+
+std::string
+DeviceManager::portPath( libusb_device *dev )
+{
+	std::string retval = std::to_string( int( libusb_get_bus_number( dev ) ) );
+
+	uint8_t ports[8];
+	int n = libusb_get_port_numbers( dev, ports, 8 );
+	for ( int i = 0; i < n; ++i )
+	{
+		retval.push_back( i == 0 ? '-' : '.' );
+		retval.append( std::to_string( int( ports[i] ) ) );
+	}
 
 	return retval;
 }
@@ -392,6 +814,48 @@ DeviceManager::findAllDevices( uint16_t v )
 ////////////////////////////////////////
 
 
+std::shared_ptr<const DeviceManager::Registry>
+DeviceManager::registry( void ) const
+{
+	std::shared_ptr<const Registry> reg = std::atomic_load( &myRegistry );
+	if ( ! reg )
+	{
+		static const std::shared_ptr<const Registry> theEmpty = std::make_shared<Registry>();
+		return theEmpty;
+	}
+	return reg;
+}
+
+
+////////////////////////////////////////
+
+
+void
+DeviceManager::publishRegistry( void )
+{
+	std::shared_ptr<Registry> reg = std::make_shared<Registry>();
+
+	reg->all.reserve( myDevices.size() );
+	for ( auto &d: myDevices )
+	{
+		const std::shared_ptr<Device> &dev = d.second;
+		const struct libusb_device_descriptor &desc = dev->desc();
+
+		reg->all.push_back( dev );
+		reg->byProduct[productKey( desc.idVendor, desc.idProduct )].push_back( dev );
+		reg->byVendor[desc.idVendor].push_back( dev );
+		if ( ! dev->getSerialNumber().empty() )
+			reg->bySerial.insert( std::make_pair( dev->getSerialNumber(), dev ) );
+		reg->byPort[portPath( d.first )] = dev;
+	}
+
+	std::atomic_store( &myRegistry, std::shared_ptr<const Registry>( std::move( reg ) ) );
+}
+
+
+////////////////////////////////////////
+
+
 void
 DeviceManager::add( libusb_device *dev )
 {
@@ -409,29 +873,119 @@ DeviceManager::add( libusb_device *dev )
 void
 DeviceManager::add( libusb_device *dev, const struct libusb_device_descriptor &desc )
 {
-	// caller has the lock
-	std::pair<uint16_t, uint16_t> devId = std::make_pair( desc.idVendor, desc.idProduct );
+	// caller has the lock, this only decides whether we care about
+	// the device and queues it, the actual bring-up (which can take
+	// seconds) happens on the bring-up workers
+	if ( myQuitFlag || myDevices.find( dev ) != myDevices.end() ||
+		 myPendingDevices.find( dev ) != myPendingDevices.end() )
+		return;
 
-	std::shared_ptr<Device> newDev;
+	PendingDevice pd;
+	pd.dev = dev;
+	pd.desc = desc;
 
-	try
+	// only look at the configuration if someone cares, it may
+	// involve talking to the device on some platforms
+	std::set<uint8_t> ifaceClasses;
+	if ( myMatchInterfaces )
 	{
-		auto f = mySpecificFactories.find( devId );
-		if ( f != mySpecificFactories.end() )
-			newDev = f->second( dev, desc );
+		struct libusb_config_descriptor *cfg = nullptr;
+		if ( libusb_get_active_config_descriptor( dev, &cfg ) == LIBUSB_SUCCESS && cfg )
+		{
+			for ( int i = 0; i < int( cfg->bNumInterfaces ); ++i )
+			{
+				const struct libusb_interface &iface = cfg->interface[i];
+				for ( int a = 0; a < iface.num_altsetting; ++a )
+					ifaceClasses.insert( iface.altsetting[a].bInterfaceClass );
+			}
+			libusb_free_config_descriptor( cfg );
+		}
+	}
 
-		if ( ! newDev )
+	for ( const FactoryRule &r: myMatchTable )
+	{
+		bool match = false;
+		switch ( r.kind )
 		{
-			auto v = myVendorFactories.find( desc.idVendor );
-			if ( v != myVendorFactories.end() )
-				newDev = v->second( dev, desc );
+			case FactoryRule::PRODUCT:
+				match = desc.idVendor == r.vendor && desc.idProduct == r.product;
+				break;
+			case FactoryRule::VENDOR:
+				match = desc.idVendor == r.vendor;
+				break;
+			case FactoryRule::DEVICE_CLASS:
+				match = desc.bDeviceClass == r.classID;
+				break;
+			case FactoryRule::INTERFACE_CLASS:
+				match = ifaceClasses.find( r.classID ) != ifaceClasses.end();
+				break;
 		}
+		if ( match )
+			pd.factories.push_back( r.factory );
+	}
+
+	if ( pd.factories.empty() )
+		return;
+
+	libusb_ref_device( dev );
+	myPendingDevices.insert( dev );
+	myBringUpQueue.push_back( pd );
+	myBringUpNotify.notify_all();
+}
+
+
+////////////////////////////////////////
 
-		if ( ! newDev )
+
+void
+DeviceManager::bringUpLoop( void )
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	while ( ! myQuitFlag )
+	{
+		if ( myBringUpQueue.empty() )
 		{
-			auto c = myClassFactories.find( desc.idVendor );
-			if ( c != myClassFactories.end() )
-				newDev = c->second( dev, desc );
+			myBringUpNotify.wait( lk );
+			continue;
+		}
+
+		PendingDevice pd = myBringUpQueue.front();
+		myBringUpQueue.pop_front();
+
+		lk.unlock();
+		bringUp( pd );
+		lk.lock();
+	}
+}
+
+
+////////////////////////////////////////
+
+
+bool
+DeviceManager::bringUpCancelled( libusb_device *dev )
+{
+	// caller has the lock
+	return myQuitFlag || myCancelledDevices.find( dev ) != myCancelledDevices.end();
+}
+
+
+////////////////////////////////////////
+
+
+void
+DeviceManager::bringUp( const PendingDevice &pd )
+{
+	libusb_device *dev = pd.dev;
+	std::shared_ptr<Device> newDev;
+
+	try
+	{
+		for ( const FactoryFunction &f: pd.factories )
+		{
+			newDev = f( dev, pd.desc );
+			if ( newDev )
+				break;
 		}
 	}
 	catch ( usb_error &e )
@@ -447,14 +1001,11 @@ DeviceManager::add( libusb_device *dev, const struct libusb_device_descriptor &d
 		error() << "Creating device for specific product: " << e.what() << send;
 	}
 
+	bool ready = false;
 	if ( newDev )
 	{
-		libusb_ref_device( dev );
-
 		try
 		{
-			myDevices[dev] = newDev;
-
 			newDev->setContext( myContext );
 //			newDev->dumpInfo( std::cout );
 
@@ -462,30 +1013,32 @@ DeviceManager::add( libusb_device *dev, const struct libusb_device_descriptor &d
 			// initialize, so the claimInterfaces returns BUSY, but if
 			// you wait for things to not be busy, that never happens
 			info() << "Initializing new USB device..." << send;
-			int count = 0;
-			while ( count < 10 )
+			int delayMS = 50;
+			for ( int attempt = 0; attempt < 8; ++attempt )
 			{
 				try
 				{
 					newDev->claimInterfaces();
+					ready = true;
 					break;
 				}
 				catch ( ... )
 				{
-					error() << "Error claiming interfaces, pausing and retrying..." << send;
+					error() << "Error claiming interfaces, pausing " << delayMS << "ms and retrying..." << send;
 					newDev->shutdown();
-					usleep( 500*1024 );
-					++count;
 				}
-			}
-			if ( count >= 10 )
-			{
-				throw std::runtime_error( "Unable to initialize device" );
+
+				std::unique_lock<std::mutex> lk( myMutex );
+				if ( myBringUpNotify.wait_for( lk, std::chrono::milliseconds( delayMS ),
+											   [&]() { return bringUpCancelled( dev ); } ) )
+					break;
+				delayMS = std::min( delayMS * 2, 2000 );
 			}
 
-			newDev->startEventHandling();
-			if ( myNewDeviceFunc )
-				myNewDeviceFunc( newDev );
+			if ( ready )
+				newDev->startEventHandling();
+			else
+				error() << "Unable to initialize device" << send;
 		}
 		catch ( usb_error &e )
 		{
@@ -494,15 +1047,39 @@ DeviceManager::add( libusb_device *dev, const struct libusb_device_descriptor &d
 			error() << "Initializing USB device: "
 					  << libusb_error_name( err ) << " - "
 					  << libusb_strerror( ec ) << send;
-
-			libusb_unref_device( dev );
+			ready = false;
 		}
 		catch ( std::exception &e )
 		{
 			error() << "Initializing device: " << e.what() << send;
-			libusb_unref_device( dev );
+			ready = false;
 		}
 	}
+
+	std::unique_lock<std::mutex> lk( myMutex );
+	bool cancelled = bringUpCancelled( dev );
+	myCancelledDevices.erase( dev );
+	myPendingDevices.erase( dev );
+
+	if ( ready && ! cancelled )
+	{
+		myDevices[dev] = newDev;
+		publishRegistry();
+		NewDeviceFunction newFunc = myNewDeviceFunc;
+		lk.unlock();
+
+		if ( newFunc )
+			newFunc( newDev );
+		return;
+	}
+	lk.unlock();
+
+	if ( newDev )
+	{
+		newDev->stopEventHandling();
+		newDev->shutdown();
+	}
+	libusb_unref_device( dev );
 }
 
 
@@ -512,6 +1089,26 @@ DeviceManager::add( libusb_device *dev, const struct libusb_device_descriptor &d
 void
 DeviceManager::remove( libusb_device *dev )
 {
+	// caller has the lock
+	if ( myPendingDevices.find( dev ) != myPendingDevices.end() )
+	{
+		for ( auto q = myBringUpQueue.begin(); q != myBringUpQueue.end(); ++q )
+		{
+			if ( q->dev == dev )
+			{
+				myBringUpQueue.erase( q );
+				myPendingDevices.erase( dev );
+				libusb_unref_device( dev );
+				return;
+			}
+		}
+
+		// a worker has it, let it know to back out
+		myCancelledDevices.insert( dev );
+		myBringUpNotify.notify_all();
+		return;
+	}
+
 	auto i = myDevices.find( dev );
 	if ( i != myDevices.end() )
 	{
@@ -519,6 +1116,7 @@ DeviceManager::remove( libusb_device *dev )
 		devPtr->stopEventHandling();
 		devPtr->shutdown();
 		myDevices.erase( i );
+		publishRegistry();
 
 		if ( myDeadDeviceFunc )
 			myDeadDeviceFunc( devPtr );
@@ -28,9 +28,16 @@
 #include <functional>
 #include <memory>
 #include <map>
+#include <unordered_map>
+#include <string>
+#include <set>
+#include <deque>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
+#include <atomic>
+#include <vector>
+#include <utility>
 #include "libusb-1.0/libusb.h"
 #include "Device.h"
 
@@ -63,16 +70,39 @@ public:
 	~DeviceManager( void );
 
 	// Register any devices you care about prior to starting
-	// the manager
+	// the manager. When several rules match a device, they are tried
+	// in order vendor/product, vendor, device class, interface class
+	// until a factory returns a device
 	void registerDevice( uint16_t vendor, uint16_t prod, const FactoryFunction &factory );
-	// Generic class handler
+	// Generic class handler, matches bDeviceClass
 	void registerClass( uint8_t classID, const FactoryFunction &factory );
+	// matches any interface of the active configuration, needed for
+	// composite devices such as UVC cameras which report a
+	// miscellaneous device class
+	void registerInterfaceClass( uint8_t classID, const FactoryFunction &factory );
 	void registerVendor( uint16_t vendID, const FactoryFunction &factory );
 
-	void start( const NewDeviceFunction &newFunc, const DeadDeviceFunction &deadFunc );
+	// devices are opened and claimed on a pool of worker threads so
+	// a slow device never holds up the event thread, this sets how
+	// many can be brought up at once. Set prior to start. NB: the
+	// new device callback is called from one of these workers
+	void setBringUpConcurrency( size_t n );
+
+	// if runEventThread is false, the application is responsible for
+	// calling handleReady whenever pollFds signal (or nextTimeout
+	// expires), i.e. from its own reactor
+	void start( const NewDeviceFunction &newFunc, const DeadDeviceFunction &deadFunc, bool runEventThread = true );
 	void shutdown( void );
 
-protected:
+	// descriptors (and poll events) to wait on. On linux this is a
+	// single epoll descriptor covering everything libusb needs, so it
+	// does not change while running
+	std::vector< std::pair<int, short> > pollFds( void ) const;
+	// milliseconds until libusb needs servicing regardless of the
+	// descriptors, -1 for no timeout
+	int nextTimeout( void ) const;
+	// processes whatever is pending without blocking
+	void handleReady( void );
 
 	std::vector<std::shared_ptr<Device>> getAllDevices( void );
 	
@@ -91,20 +121,83 @@ protected:
 
 	std::vector<std::shared_ptr<Device>> findAllDevices( uint16_t vendor );
 
+	// serial number as reported by the device string descriptor
+	std::shared_ptr<Device> findDeviceBySerial( const std::string &serial );
+	// port path in sysfs form, i.e. "<bus>-<port>.<port>..." (e.g. "3-1.4")
+	std::shared_ptr<Device> findDeviceByPort( const std::string &path );
+
+protected:
+	static std::string portPath( libusb_device *dev );
+
 private:
+	// immutable view of the published devices, rebuilt and swapped in
+	// whenever the device set changes so lookups never take myMutex
+	struct Registry
+	{
+		typedef std::vector<std::shared_ptr<Device>> DeviceList;
+
+		DeviceList all;
+		std::unordered_map<uint32_t, DeviceList> byProduct;
+		std::unordered_map<uint16_t, DeviceList> byVendor;
+		std::unordered_map<std::string, std::shared_ptr<Device>> bySerial;
+		std::unordered_map<std::string, std::shared_ptr<Device>> byPort;
+	};
+	static inline uint32_t productKey( uint16_t v, uint16_t p ) { return ( uint32_t( v ) << 16 ) | p; }
+	std::shared_ptr<const Registry> registry( void ) const;
+	// caller has the lock
+	void publishRegistry( void );
+
 	void probeLoop( void );
 	void probeDevices( void );
 
 	void eventLoop( void );
+	void wake( void );
+
+	static void pollfd_added( int fd, short events, void *user_data );
+	static void pollfd_removed( int fd, void *user_data );
+
+	struct FactoryRule
+	{
+		// in priority order
+		enum Kind
+		{
+			PRODUCT,
+			VENDOR,
+			DEVICE_CLASS,
+			INTERFACE_CLASS
+		};
+
+		Kind kind;
+		uint16_t vendor;
+		uint16_t product;
+		uint8_t classID;
+		FactoryFunction factory;
+
+		bool sameKey( const FactoryRule &o ) const;
+	};
+	void addRule( const FactoryRule &r );
+	void compileRules( void );
+	void registerHotplug( void );
 
 	void add( libusb_device *dev );
 	void add( libusb_device *dev, const struct libusb_device_descriptor &desc );
 	void remove( libusb_device *dev );
 
+	struct PendingDevice
+	{
+		libusb_device *dev;
+		struct libusb_device_descriptor desc;
+		// candidates in priority order, first to return a device wins
+		std::vector<FactoryFunction> factories;
+	};
+	void bringUpLoop( void );
+	void bringUp( const PendingDevice &pd );
+	bool bringUpCancelled( libusb_device *dev );
+
 	static int hotplug_cb( struct libusb_context *ctx, struct libusb_device *dev, libusb_hotplug_event, void *user_data );
 
 	libusb_context *myContext = nullptr;
-	libusb_hotplug_callback_handle myPlugHandle = 0;
+	std::vector<libusb_hotplug_callback_handle> myPlugHandles;
 
 	NewDeviceFunction myNewDeviceFunc;
 	DeadDeviceFunction myDeadDeviceFunc;
@@ -115,14 +208,28 @@ private:
 
 	std::mutex myEventMutex;
 	std::thread myEventThread;
-	std::condition_variable myEventNotify;
 
-	std::map< libusb_device *, std::shared_ptr<Device> > myDevices;
-	bool myQuitFlag = false;
+	std::vector<std::thread> myBringUpThreads;
+	std::condition_variable myBringUpNotify;
+	std::deque<PendingDevice> myBringUpQueue;
+	// queued or in progress, and those unplugged while in progress
+	std::set<libusb_device *> myPendingDevices;
+	std::set<libusb_device *> myCancelledDevices;
+	size_t myBringUpConcurrency = 4;
 
-	std::map<std::pair<uint16_t, uint16_t>, FactoryFunction> mySpecificFactories;
-	std::map<uint8_t, FactoryFunction> myClassFactories;
-	std::map<uint16_t, FactoryFunction> myVendorFactories;
+	int myEpollFD = -1;
+	int myWakeFD = -1;
+
+	// authoritative device set, only touched with myMutex held
+	std::map< libusb_device *, std::shared_ptr<Device> > myDevices;
+	// only accessed via std::atomic_load / atomic_store
+	std::shared_ptr<const Registry> myRegistry;
+	std::atomic<bool> myQuitFlag{false};
+
+	// as registered, and the priority-ordered copy built by start
+	std::vector<FactoryRule> myRules;
+	std::vector<FactoryRule> myMatchTable;
+	bool myMatchInterfaces = false;
 };
 
 } // namespace usbpp
@@ -0,0 +1,654 @@
+// DisplayStretch.cpp -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#include "DisplayStretch.h"
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+using USB::SampleFormat;
+
+// how to get from a raw sample to the full 16 bit range: byteswap,
+// mask off the junk, move the data to the top, then copy the top
+// bits into the bottom so full scale stays full scale
+struct Unpack
+{
+	bool swap;
+	uint16_t mask;
+	int up;
+	int fill;
+};
+
+static Unpack
+unpackFor( const SampleFormat &f )
+{
+	Unpack u;
+	int bits = std::min( std::max( f.bits, 8 ), 16 );
+	u.swap = f.bigEndian;
+	if ( f.msbAligned )
+	{
+		u.mask = static_cast<uint16_t>( 0xFFFF << ( 16 - bits ) );
+		u.up = 0;
+	}
+	else
+	{
+		u.mask = static_cast<uint16_t>( ( 1 << bits ) - 1 );
+		u.up = 16 - bits;
+	}
+	u.fill = bits;
+	return u;
+}
+
+static inline uint16_t
+unpack( const Unpack &u, uint16_t v )
+{
+	if ( u.swap )
+		v = static_cast<uint16_t>( ( v << 8 ) | ( v >> 8 ) );
+	uint32_t x = static_cast<uint32_t>( v & u.mask ) << u.up;
+	return static_cast<uint16_t>( x | ( x >> u.fill ) );
+}
+
+// one 16 bit sample per pixel. YUY2 and the like are two bytes a
+// pixel too, but not samples
+static bool
+isSampleFormat( const USB::ImageBuffer &img )
+{
+	if ( img.bytesPerPixel() != 2 || ! img.data() )
+		return false;
+
+	switch ( img.format() )
+	{
+		case USB::ImageBuffer::Format::MONO_16:
+		case USB::ImageBuffer::Format::BAYER_GRBG:
+		case USB::ImageBuffer::Format::BAYER_GBRG:
+		case USB::ImageBuffer::Format::BAYER_RGGB:
+		case USB::ImageBuffer::Format::BAYER_BGGR:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static inline uint16_t
+loadSample( const uint8_t *p )
+{
+	// the samples needn't be aligned
+	uint16_t v;
+	memcpy( &v, p, 2 );
+	return v;
+}
+
+
+////////////////////////////////////////
+
+
+struct StretchKernels
+{
+	int (*normalizeRow)( const Unpack &, const uint8_t *, int, uint16_t * );
+	int (*linearRow)( const uint16_t *, int, uint16_t, uint16_t, uint8_t * );
+};
+
+namespace scalar
+{
+
+static int normalizeRow( const Unpack &, const uint8_t *, int, uint16_t * ) { return 0; }
+static int linearRow( const uint16_t *, int, uint16_t, uint16_t, uint8_t * ) { return 0; }
+
+} // namespace scalar
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#if defined(__clang__)
+# pragma clang attribute push (__attribute__((target("sse2"))), apply_to = function)
+#else
+# pragma GCC push_options
+# pragma GCC target("sse2")
+#endif
+
+namespace sse2
+{
+
+struct Vec
+{
+	static const int N = 8;
+	typedef __m128i V;
+
+	static inline V load( const void *p ) { return _mm_loadu_si128( reinterpret_cast<const __m128i *>( p ) ); }
+	static inline void store( void *p, V v ) { _mm_storeu_si128( reinterpret_cast<__m128i *>( p ), v ); }
+	static inline V set16( uint16_t x ) { return _mm_set1_epi16( static_cast<int16_t>( x ) ); }
+	static inline V and_( V a, V b ) { return _mm_and_si128( a, b ); }
+	static inline V or_( V a, V b ) { return _mm_or_si128( a, b ); }
+	static inline V sll16( V a, int n ) { return _mm_sll_epi16( a, _mm_cvtsi32_si128( n ) ); }
+	static inline V srl16( V a, int n ) { return _mm_srl_epi16( a, _mm_cvtsi32_si128( n ) ); }
+	static inline V subsu16( V a, V b ) { return _mm_subs_epu16( a, b ); }
+	static inline V addsu16( V a, V b ) { return _mm_adds_epu16( a, b ); }
+	static inline V mulhiu16( V a, V b ) { return _mm_mulhi_epu16( a, b ); }
+	static inline V packus16( V a, V b ) { return _mm_packus_epi16( a, b ); }
+};
+
+#include "DisplayStretchKernels.h"
+
+} // namespace sse2
+
+#if defined(__clang__)
+# pragma clang attribute pop
+#else
+# pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+# pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#else
+# pragma GCC push_options
+# pragma GCC target("avx2")
+#endif
+
+namespace avx2
+{
+
+struct Vec
+{
+	static const int N = 16;
+	typedef __m256i V;
+
+	static inline V load( const void *p ) { return _mm256_loadu_si256( reinterpret_cast<const __m256i *>( p ) ); }
+	static inline void store( void *p, V v ) { _mm256_storeu_si256( reinterpret_cast<__m256i *>( p ), v ); }
+	static inline V set16( uint16_t x ) { return _mm256_set1_epi16( static_cast<int16_t>( x ) ); }
+	static inline V and_( V a, V b ) { return _mm256_and_si256( a, b ); }
+	static inline V or_( V a, V b ) { return _mm256_or_si256( a, b ); }
+	static inline V sll16( V a, int n ) { return _mm256_sll_epi16( a, _mm_cvtsi32_si128( n ) ); }
+	static inline V srl16( V a, int n ) { return _mm256_srl_epi16( a, _mm_cvtsi32_si128( n ) ); }
+	static inline V subsu16( V a, V b ) { return _mm256_subs_epu16( a, b ); }
+	static inline V addsu16( V a, V b ) { return _mm256_adds_epu16( a, b ); }
+	static inline V mulhiu16( V a, V b ) { return _mm256_mulhi_epu16( a, b ); }
+	static inline V packus16( V a, V b ) { return _mm256_permute4x64_epi64( _mm256_packus_epi16( a, b ), 0xD8 ); }
+};
+
+#include "DisplayStretchKernels.h"
+
+} // namespace avx2
+
+#if defined(__clang__)
+# pragma clang attribute pop
+#else
+# pragma GCC pop_options
+#endif
+
+#endif
+
+
+////////////////////////////////////////
+
+
+static const StretchKernels kScalar = { &scalar::normalizeRow, &scalar::linearRow };
+#if defined(__x86_64__) || defined(__i386__)
+static const StretchKernels kSSE2 = { &sse2::normalizeRow, &sse2::linearRow };
+static const StretchKernels kAVX2 = { &avx2::normalizeRow, &avx2::linearRow };
+#endif
+
+static const StretchKernels *
+detectKernels( void )
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports( "avx2" ) )
+		return &kAVX2;
+	if ( __builtin_cpu_supports( "sse2" ) )
+		return &kSSE2;
+#endif
+	return &kScalar;
+}
+
+// checked once, the answer doesn't change
+static const StretchKernels *
+bestKernels( void )
+{
+	static const StretchKernels *k = detectKernels();
+	return k;
+}
+
+
+////////////////////////////////////////
+
+
+static void
+normalizeRow( const Unpack &u, const uint8_t *src, int w, uint16_t *dst )
+{
+	int x = bestKernels()->normalizeRow( u, src, w, dst );
+	for ( ; x < w; ++x )
+		dst[x] = unpack( u, loadSample( src + x * 2 ) );
+}
+
+
+////////////////////////////////////////
+
+
+// (v - black) * scale / 65536, capped at 255
+static void
+linearRow( const uint16_t *src, int w, uint16_t black, uint16_t scale, uint8_t *dst )
+{
+	int x = bestKernels()->linearRow( src, w, black, scale, dst );
+	for ( ; x < w; ++x )
+	{
+		uint32_t d = src[x] > black ? uint32_t( src[x] - black ) : 0;
+		dst[x] = static_cast<uint8_t>( std::min( ( d * scale ) >> 16, uint32_t(255) ) );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+static inline double
+asinhCurve( double x, double s )
+{
+	return s > 0.0 ? std::asinh( s * x ) / std::asinh( s ) : x;
+}
+
+// strength at which the asinh curve takes x to target
+static float
+solveStrength( double x, double target )
+{
+	if ( x <= 0.0 || x >= target )
+		return 0.F;
+
+	double lo = std::log( 1e-3 );
+	double hi = std::log( 1e6 );
+	if ( asinhCurve( x, std::exp( hi ) ) < target )
+		return float( std::exp( hi ) );
+	for ( int i = 0; i < 50; ++i )
+	{
+		double mid = 0.5 * ( lo + hi );
+		if ( asinhCurve( x, std::exp( mid ) ) < target )
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return float( std::exp( 0.5 * ( lo + hi ) ) );
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+namespace USB
+{
+
+
+////////////////////////////////////////
+
+
+Histogram::Histogram( void )
+		: myCounts( kBins * kTables, 0 )
+{
+}
+
+
+////////////////////////////////////////
+
+
+void
+Histogram::clear( void )
+{
+	std::fill( myCounts.begin(), myCounts.end(), 0 );
+}
+
+
+////////////////////////////////////////
+
+
+void
+Histogram::decay( float keep )
+{
+	if ( keep <= 0.F )
+	{
+		clear();
+		return;
+	}
+	for ( auto &c: myCounts )
+		c = static_cast<uint32_t>( float( c ) * keep );
+}
+
+
+////////////////////////////////////////
+
+
+void
+Histogram::add( const uint16_t *src, size_t stride, int w, int h, int step )
+{
+	step = std::max( step, 1 );
+	for ( int y = 0; y < h; y += step )
+		addRow( src + static_cast<size_t>( y ) * stride, w, step );
+}
+
+
+////////////////////////////////////////
+
+
+void
+Histogram::addRow( const uint16_t *src, int w, int step )
+{
+	step = std::max( step, 1 );
+	uint32_t *c0 = myCounts.data();
+	uint32_t *c1 = c0 + kBins;
+	uint32_t *c2 = c1 + kBins;
+	uint32_t *c3 = c2 + kBins;
+	int x = 0;
+	for ( ; x + 3 * step < w; x += 4 * step )
+	{
+		++c0[src[x] >> kShift];
+		++c1[src[x + step] >> kShift];
+		++c2[src[x + 2 * step] >> kShift];
+		++c3[src[x + 3 * step] >> kShift];
+	}
+	for ( ; x < w; x += step )
+		++c0[src[x] >> kShift];
+}
+
+
+////////////////////////////////////////
+
+
+uint32_t
+Histogram::bin( int i ) const
+{
+	uint32_t n = 0;
+	for ( int t = 0; t < kTables; ++t )
+		n += myCounts[t * kBins + i];
+	return n;
+}
+
+
+////////////////////////////////////////
+
+
+uint64_t
+Histogram::total( void ) const
+{
+	uint64_t n = 0;
+	for ( auto c: myCounts )
+		n += c;
+	return n;
+}
+
+
+////////////////////////////////////////
+
+
+uint16_t
+Histogram::percentile( double p ) const
+{
+	uint64_t n = total();
+	if ( n == 0 )
+		return 0;
+
+	double want = std::min( std::max( p, 0.0 ), 1.0 ) * double( n );
+	uint64_t sum = 0;
+	for ( int i = 0; i < kBins; ++i )
+	{
+		sum += bin( i );
+		if ( double( sum ) >= want )
+			return static_cast<uint16_t>( ( i << kShift ) | ( 1 << ( kShift - 1 ) ) );
+	}
+	return 65535;
+}
+
+
+////////////////////////////////////////
+
+
+DisplayStretch::DisplayStretch( void )
+{
+}
+
+
+////////////////////////////////////////
+
+
+void
+DisplayStretch::setMode( Mode m )
+{
+	myMode = m;
+	myLUTValid = false;
+}
+
+
+////////////////////////////////////////
+
+
+void
+DisplayStretch::setLevels( uint16_t black, uint16_t white )
+{
+	myUserBlack = black;
+	myUserWhite = std::max( white, static_cast<uint16_t>( black + 1 ) );
+	myLUTValid = false;
+}
+
+
+////////////////////////////////////////
+
+
+void
+DisplayStretch::setAsinhStrength( float s )
+{
+	myUserStrength = std::max( s, 0.F );
+	myLUTValid = false;
+}
+
+
+////////////////////////////////////////
+
+
+void
+DisplayStretch::setAutoClip( double low, double high, double target )
+{
+	myClipLow = low;
+	myClipHigh = high;
+	myTarget = target;
+	myLUTValid = false;
+}
+
+
+////////////////////////////////////////
+
+
+void
+DisplayStretch::normalize( const uint8_t *src, size_t srcStride, int w, int h,
+						   const SampleFormat &f, uint16_t *dst, size_t dstStride )
+{
+	Unpack u = unpackFor( f );
+	for ( int y = 0; y < h; ++y )
+		normalizeRow( u, src + static_cast<size_t>( y ) * srcStride, w,
+					  dst + static_cast<size_t>( y ) * dstStride );
+}
+
+
+////////////////////////////////////////
+
+
+void
+DisplayStretch::byteSwap( const uint8_t *src, size_t srcStride, int w, int h,
+						  uint16_t *dst, size_t dstStride )
+{
+	SampleFormat f;
+	f.bigEndian = true;
+	normalize( src, srcStride, w, h, f, dst, dstStride );
+}
+
+
+////////////////////////////////////////
+
+
+bool
+DisplayStretch::normalize( const ImageBuffer &img, uint16_t *dst, size_t dstStride ) const
+{
+	if ( ! isSampleFormat( img ) )
+		return false;
+
+	const ROI &roi = img.roi();
+	const uint8_t *src = img.data() + static_cast<size_t>( roi.y ) * img.stride() + static_cast<size_t>( roi.x ) * 2;
+	normalize( src, img.stride(), roi.w, roi.h, myFormat, dst, dstStride ? dstStride : roi.w );
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+DisplayStretch::prepare( void )
+{
+	uint16_t black = myUserBlack;
+	uint16_t white = myUserWhite;
+	float s = myMode == Mode::ASINH ? myUserStrength : 0.F;
+
+	if ( myMode == Mode::AUTO && myHistogram.total() > 0 )
+	{
+		black = myHistogram.percentile( myClipLow );
+		white = std::max( myHistogram.percentile( myClipHigh ), static_cast<uint16_t>( black + 1 ) );
+		double med = double( myHistogram.percentile( 0.5 ) );
+		s = solveStrength( ( med - black ) / double( white - black ), myTarget );
+
+		// the histogram moves a little every frame, don't rebuild the
+		// table for changes nobody can see
+		if ( myLUTValid && black == myBlack && white == myWhite &&
+			 std::fabs( s - myStrength ) <= 0.02F * std::max( s, myStrength ) )
+			return;
+	}
+	else if ( myLUTValid )
+		return;
+
+	myBlack = black;
+	myWhite = white;
+	myStrength = s;
+	myLUTValid = true;
+
+	// anything narrower than 8 bits needs more than the 16 bit
+	// multiplier can give, so goes through the table too
+	myLinear = s <= 0.F && ( white - black ) >= 256;
+	if ( myLinear )
+		return;
+
+	myLUT.resize( 65536 );
+	double range = double( white - black );
+	for ( int v = 0; v < 65536; ++v )
+	{
+		double x = std::min( std::max( ( double( v ) - black ) / range, 0.0 ), 1.0 );
+		myLUT[v] = static_cast<uint8_t>( std::floor( asinhCurve( x, s ) * 255.0 + 0.5 ) );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+DisplayStretch::previewRow( const uint16_t *row, int w, uint8_t *dst )
+{
+	if ( myLinear )
+	{
+		uint32_t scale = static_cast<uint32_t>( 255.5 * 65536.0 / double( myWhite - myBlack ) );
+		linearRow( row, w, myBlack, static_cast<uint16_t>( std::min( scale, uint32_t(65535) ) ), dst );
+	}
+	else
+	{
+		const uint8_t *lut = myLUT.data();
+		for ( int x = 0; x < w; ++x )
+			dst[x] = lut[row[x]];
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+DisplayStretch::preview( const uint8_t *src, size_t srcStride, int w, int h,
+						 uint8_t *dst, size_t dstStride )
+{
+	Unpack u = unpackFor( myFormat );
+	if ( myRow.size() < static_cast<size_t>( w ) )
+		myRow.resize( w );
+	uint16_t *row = myRow.data();
+
+	// with nothing to go on yet, take a look at the frame first
+	bool primed = false;
+	if ( myMode == Mode::AUTO && myHistogram.total() == 0 )
+	{
+		for ( int y = 0; y < h; y += myHistStep )
+		{
+			normalizeRow( u, src + static_cast<size_t>( y ) * srcStride, w, row );
+			myHistogram.addRow( row, w, myHistStep );
+		}
+		primed = true;
+	}
+
+	prepare();
+
+	if ( ! primed )
+		myHistogram.decay( myHistDecay );
+
+	for ( int y = 0; y < h; ++y )
+	{
+		normalizeRow( u, src + static_cast<size_t>( y ) * srcStride, w, row );
+		if ( ! primed && ( y % myHistStep ) == 0 )
+			myHistogram.addRow( row, w, myHistStep );
+		previewRow( row, w, dst + static_cast<size_t>( y ) * dstStride );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+bool
+DisplayStretch::preview( const ImageBuffer &img, uint8_t *dst, size_t dstStride )
+{
+	if ( ! isSampleFormat( img ) )
+		return false;
+
+	const ROI &roi = img.roi();
+	const uint8_t *src = img.data() + static_cast<size_t>( roi.y ) * img.stride() + static_cast<size_t>( roi.x ) * 2;
+	preview( src, img.stride(), roi.w, roi.h, dst, dstStride ? dstStride : roi.w );
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+} // namespace USB
@@ -0,0 +1,182 @@
+// DisplayStretch.h -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "Stream.h"
+
+
+////////////////////////////////////////
+
+
+///
+/// @file DisplayStretch.h
+///
+/// @author Kimball Thurston
+///
+
+namespace USB
+{
+
+///
+/// @brief Struct SampleFormat describes how a device packs fewer than
+/// 16 significant bits into each 16 bit sample.
+///
+struct SampleFormat
+{
+	int bits = 16;
+	bool msbAligned = false; ///< data in the top bits, rest is junk
+	bool bigEndian = false;
+};
+
+///
+/// @brief Class Histogram counts normalized 16 bit samples in 4096
+/// bins.
+///
+/// It can be fed a few rows at a time as they become available, and
+/// decayed between frames instead of cleared, so levels computed
+/// from it follow a live stream without a separate pass over each
+/// frame.
+///
+class Histogram
+{
+public:
+	static const int kBins = 4096;
+	static const int kShift = 4;
+
+	Histogram( void );
+
+	void clear( void );
+	// scales the counts so far, 0 is the same as clear
+	void decay( float keep );
+
+	// every step'th sample of every step'th row, stride in elements
+	void add( const uint16_t *src, size_t stride, int w, int h, int step = 1 );
+	void addRow( const uint16_t *src, int w, int step = 1 );
+
+	uint64_t total( void ) const;
+	uint32_t bin( int i ) const;
+	// normalized value below which a fraction p of the samples fall
+	uint16_t percentile( double p ) const;
+
+private:
+	// several tables so runs of the same value don't stall on the
+	// previous increment, summed when read
+	static const int kTables = 4;
+	std::vector<uint32_t> myCounts;
+};
+
+///
+/// @brief Class DisplayStretch normalizes high bit depth mono (or raw
+/// bayer) frames, and makes 8 bit previews of them.
+///
+/// Normalizing byteswaps if needed, and scales the significant bits up
+/// to the full 16 bit range. The preview runs a row at a time:
+/// normalize, bin the row into the histogram, then map to 8 bits.
+/// LINEAR maps the black to white levels straight across, ASINH
+/// applies an asinh curve of the given strength between them, and
+/// AUTO takes the levels from the histogram percentiles and picks the
+/// asinh strength to put the median at the target brightness. AUTO
+/// uses the histogram as it stood before the frame, which is
+/// accumulated as it goes, so live preview costs one walk over the
+/// frame.
+///
+class DisplayStretch
+{
+public:
+	enum class Mode
+	{
+		LINEAR,
+		ASINH,
+		AUTO
+	};
+
+	DisplayStretch( void );
+
+	void setFormat( const SampleFormat &f ) { myFormat = f; }
+	const SampleFormat &format( void ) const { return myFormat; }
+
+	void setMode( Mode m );
+	Mode mode( void ) const { return myMode; }
+	// in normalized units, used by LINEAR and ASINH
+	void setLevels( uint16_t black, uint16_t white );
+	void setAsinhStrength( float s );
+	// fraction of samples clipped at each end, and where the median
+	// should land, for AUTO
+	void setAutoClip( double low, double high, double target = 0.25 );
+	// histogram sampling and how much of the last frames to keep
+	void setHistogramStep( int step ) { myHistStep = step < 1 ? 1 : step; }
+	void setHistogramDecay( float keep ) { myHistDecay = keep; }
+
+	Histogram &histogram( void ) { return myHistogram; }
+	const Histogram &histogram( void ) const { return myHistogram; }
+
+	// levels and strength used by the last preview
+	uint16_t black( void ) const { return myBlack; }
+	uint16_t white( void ) const { return myWhite; }
+	float strength( void ) const { return myStrength; }
+
+	// src stride in bytes, dst stride in elements. dst may be src
+	static void normalize( const uint8_t *src, size_t srcStride, int w, int h,
+						   const SampleFormat &f, uint16_t *dst, size_t dstStride );
+	static void byteSwap( const uint8_t *src, size_t srcStride, int w, int h,
+						  uint16_t *dst, size_t dstStride );
+	// the ROI of a 16 bit frame, false for other formats
+	bool normalize( const ImageBuffer &img, uint16_t *dst, size_t dstStride = 0 ) const;
+
+	void preview( const uint8_t *src, size_t srcStride, int w, int h,
+				  uint8_t *dst, size_t dstStride );
+	bool preview( const ImageBuffer &img, uint8_t *dst, size_t dstStride = 0 );
+
+private:
+	void prepare( void );
+	void previewRow( const uint16_t *row, int w, uint8_t *dst );
+
+	SampleFormat myFormat;
+	Mode myMode = Mode::AUTO;
+	uint16_t myUserBlack = 0;
+	uint16_t myUserWhite = 65535;
+	float myUserStrength = 0.F;
+	double myClipLow = 0.001;
+	double myClipHigh = 0.9995;
+	double myTarget = 0.25;
+	int myHistStep = 2;
+	float myHistDecay = 0.5F;
+
+	Histogram myHistogram;
+
+	// what the lut was built for
+	uint16_t myBlack = 0;
+	uint16_t myWhite = 65535;
+	float myStrength = 0.F;
+	bool myLinear = true;
+	bool myLUTValid = false;
+	std::vector<uint8_t> myLUT;
+	std::vector<uint16_t> myRow;
+};
+
+} // namespace USB
@@ -0,0 +1,75 @@
+// DisplayStretchKernels.h -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+// NB: no include guard, DisplayStretch.cpp includes this once per
+// instruction set, inside a namespace that defines Vec and with the
+// matching target enabled. Nothing else should include it.
+
+
+////////////////////////////////////////
+
+
+///
+/// @file DisplayStretchKernels.h
+///
+/// @author Kimball Thurston
+///
+
+// both return how many pixels they did, the caller finishes the
+// tail of the row
+static int
+normalizeRow( const Unpack &u, const uint8_t *src, int w, uint16_t *dst )
+{
+	int x = 0;
+	const Vec::V mask = Vec::set16( u.mask );
+	for ( ; x + Vec::N <= w; x += Vec::N )
+	{
+		Vec::V v = Vec::load( src + x * 2 );
+		if ( u.swap )
+			v = Vec::or_( Vec::sll16( v, 8 ), Vec::srl16( v, 8 ) );
+		v = Vec::sll16( Vec::and_( v, mask ), u.up );
+		Vec::store( dst + x, Vec::or_( v, Vec::srl16( v, u.fill ) ) );
+	}
+	return x;
+}
+
+static int
+linearRow( const uint16_t *src, int w, uint16_t black, uint16_t scale, uint8_t *dst )
+{
+	int x = 0;
+	const Vec::V b = Vec::set16( black );
+	const Vec::V s = Vec::set16( scale );
+	// saturating add then subtract caps at 255 without needing the
+	// unsigned min from SSE4.1
+	const Vec::V cap = Vec::set16( 0xFF00 );
+	for ( ; x + 2 * Vec::N <= w; x += 2 * Vec::N )
+	{
+		Vec::V v0 = Vec::mulhiu16( Vec::subsu16( Vec::load( src + x ), b ), s );
+		Vec::V v1 = Vec::mulhiu16( Vec::subsu16( Vec::load( src + x + Vec::N ), b ), s );
+		v0 = Vec::subsu16( Vec::addsu16( v0, cap ), cap );
+		v1 = Vec::subsu16( Vec::addsu16( v1, cap ), cap );
+		Vec::store( dst + x, Vec::packus16( v0, v1 ) );
+	}
+	return x;
+}
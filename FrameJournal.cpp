@@ -0,0 +1,620 @@
+// FrameJournal.cpp -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#include "FrameJournal.h"
+#include <algorithm>
+#include <stdexcept>
+#include <cstddef>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <nmmintrin.h>
+#endif
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+static const size_t kPage = 4096;
+static const char kMagic[8] = { 'U', 'S', 'B', 'J', 'R', 'N', 'L', '1' };
+static const uint32_t kVersion = 2;
+
+struct JournalHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t entryBytes;
+	uint64_t slotBytes;
+	uint64_t slotCount;
+	uint64_t indexOffset;
+	uint64_t dataOffset;
+};
+
+// one per slot, serial is 0 while the slot is being written and
+// is stored last
+struct JournalEntry
+{
+	uint64_t serial;
+	uint64_t sequence;
+	int64_t captureNS;
+	int64_t firstPayloadNS;
+	int64_t lastPayloadNS;
+	uint64_t bytes;
+	uint32_t pts;
+	uint32_t flags;
+	uint32_t format;
+	int32_t width;
+	int32_t height;
+	int32_t bytesPerLine;
+	int32_t bytesPerPixel;
+	int32_t roi[4];
+	uint32_t slot;
+	uint32_t dataCRC; ///< CRC32C of the frame data
+	uint8_t reserved[20];
+	uint64_t checksum;
+};
+
+static_assert( sizeof(JournalEntry) == 128, "journal entries are expected to be 128 bytes" );
+
+inline size_t
+roundUp( size_t n, size_t a )
+{
+	return ( ( n + a - 1 ) / a ) * a;
+}
+
+// FNV-1a over everything ahead of the checksum
+inline uint64_t
+checksum( const JournalEntry &e )
+{
+	const uint8_t *p = reinterpret_cast<const uint8_t *>( &e );
+	uint64_t h = 14695981039346656037ULL;
+	for ( size_t i = 0; i < offsetof( JournalEntry, checksum ); ++i )
+	{
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// CRC32C, the same polynomial the SSE4.2 instruction uses
+static uint32_t crcTable[256];
+
+static void
+initCRCTable( void )
+{
+	for ( uint32_t i = 0; i < 256; ++i )
+	{
+		uint32_t c = i;
+		for ( int k = 0; k < 8; ++k )
+			c = ( c & 1 ) ? ( c >> 1 ) ^ 0x82F63B78U : c >> 1;
+		crcTable[i] = c;
+	}
+}
+
+static uint32_t
+crcScalar( uint32_t crc, const uint8_t *p, size_t n )
+{
+	for ( size_t i = 0; i < n; ++i )
+		crc = crcTable[( crc ^ p[i] ) & 0xFF] ^ ( crc >> 8 );
+	return crc;
+}
+
+#if defined(__x86_64__)
+
+#if defined(__clang__)
+# pragma clang attribute push (__attribute__((target("sse4.2"))), apply_to = function)
+#else
+# pragma GCC push_options
+# pragma GCC target("sse4.2")
+#endif
+
+static uint32_t
+crcSSE42( uint32_t crc, const uint8_t *p, size_t n )
+{
+	uint64_t c = crc;
+	for ( ; n >= 8; n -= 8, p += 8 )
+	{
+		uint64_t v;
+		memcpy( &v, p, 8 );
+		c = _mm_crc32_u64( c, v );
+	}
+	crc = static_cast<uint32_t>( c );
+	for ( ; n > 0; --n, ++p )
+		crc = _mm_crc32_u8( crc, *p );
+	return crc;
+}
+
+#if defined(__clang__)
+# pragma clang attribute pop
+#else
+# pragma GCC pop_options
+#endif
+
+#endif
+
+typedef uint32_t (*CRCFn)( uint32_t, const uint8_t *, size_t );
+
+static CRCFn
+detectCRC( void )
+{
+	initCRCTable();
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports( "sse4.2" ) )
+		return &crcSSE42;
+#endif
+	return &crcScalar;
+}
+
+// runs in the producer as each payload is copied in, so it has to
+// keep up with the camera. Pass ~0 to start, and invert the result
+inline uint32_t
+crc32c( uint32_t crc, const uint8_t *p, size_t n )
+{
+	static const CRCFn fn = detectCRC();
+	return fn( crc, p, n );
+}
+
+// a consistent copy of a valid entry, or false
+inline bool
+readEntry( const JournalEntry *src, JournalEntry &e )
+{
+	uint64_t serial = __atomic_load_n( &src->serial, __ATOMIC_ACQUIRE );
+	if ( serial == 0 )
+		return false;
+	memcpy( &e, src, sizeof(e) );
+	std::atomic_thread_fence( std::memory_order_acquire );
+	return e.serial == serial && e.checksum == checksum( e ) &&
+		__atomic_load_n( &src->serial, __ATOMIC_RELAXED ) == serial;
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+namespace USB
+{
+
+
+////////////////////////////////////////
+
+
+FrameJournal::FrameJournal( void )
+{
+}
+
+
+////////////////////////////////////////
+
+
+FrameJournal::~FrameJournal( void )
+{
+	close();
+}
+
+
+////////////////////////////////////////
+
+
+void
+FrameJournal::create( const std::string &path, size_t slotBytes, size_t count )
+{
+	close();
+
+	if ( slotBytes == 0 || count == 0 )
+		throw std::runtime_error( "Invalid journal size" );
+
+	mySlotBytes = roundUp( slotBytes, kPage );
+	mySlotCount = count;
+	myIndexOffset = kPage;
+	myDataOffset = myIndexOffset + roundUp( count * sizeof(JournalEntry), kPage );
+	size_t len = myDataOffset + mySlotBytes * mySlotCount;
+
+	int fd = ::open( path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+	if ( fd < 0 )
+		throw std::runtime_error( "Unable to create " + path + ": " + strerror( errno ) );
+
+	// real blocks, not a sparse file, so writing a frame never has
+	// to wait for the filesystem to find space
+	int err = -1;
+#ifdef __linux__
+	err = fallocate( fd, 0, 0, static_cast<off_t>( len ) );
+#endif
+	if ( err != 0 )
+		err = ftruncate( fd, static_cast<off_t>( len ) );
+	if ( err != 0 )
+	{
+		std::string msg = strerror( errno );
+		::close( fd );
+		throw std::runtime_error( "Unable to allocate " + path + ": " + msg );
+	}
+
+	map( fd, len, false );
+
+	JournalHeader h;
+	memset( &h, 0, sizeof(h) );
+	memcpy( h.magic, kMagic, sizeof(kMagic) );
+	h.version = kVersion;
+	h.entryBytes = sizeof(JournalEntry);
+	h.slotBytes = mySlotBytes;
+	h.slotCount = mySlotCount;
+	h.indexOffset = myIndexOffset;
+	h.dataOffset = myDataOffset;
+	memcpy( myMap, &h, sizeof(h) );
+	msync( myMap, kPage, MS_ASYNC );
+
+	mySlot = 0;
+	mySerial = 0;
+}
+
+
+////////////////////////////////////////
+
+
+void
+FrameJournal::open( const std::string &path, bool readOnly )
+{
+	close();
+
+	int fd = ::open( path.c_str(), readOnly ? O_RDONLY : O_RDWR );
+	if ( fd < 0 )
+		throw std::runtime_error( "Unable to open " + path + ": " + strerror( errno ) );
+
+	JournalHeader h;
+	struct stat st;
+	if ( pread( fd, &h, sizeof(h), 0 ) != static_cast<ssize_t>( sizeof(h) ) ||
+		 fstat( fd, &st ) != 0 ||
+		 memcmp( h.magic, kMagic, sizeof(kMagic) ) != 0 ||
+		 h.version != kVersion || h.entryBytes != sizeof(JournalEntry) ||
+		 h.slotCount == 0 || h.slotBytes == 0 ||
+		 h.dataOffset < h.indexOffset + h.slotCount * sizeof(JournalEntry) ||
+		 uint64_t( st.st_size ) < h.dataOffset + h.slotBytes * h.slotCount )
+	{
+		::close( fd );
+		throw std::runtime_error( path + " is not a usable frame journal" );
+	}
+
+	mySlotBytes = static_cast<size_t>( h.slotBytes );
+	mySlotCount = static_cast<size_t>( h.slotCount );
+	myIndexOffset = static_cast<size_t>( h.indexOffset );
+	myDataOffset = static_cast<size_t>( h.dataOffset );
+	map( fd, myDataOffset + mySlotBytes * mySlotCount, readOnly );
+
+	recover();
+}
+
+
+////////////////////////////////////////
+
+
+void
+FrameJournal::close( void )
+{
+	abort();
+	if ( myMap )
+	{
+		if ( ! myReadOnly )
+			msync( myMap, myMapBytes, MS_ASYNC );
+		munmap( myMap, myMapBytes );
+		myMap = nullptr;
+		myMapBytes = 0;
+	}
+	if ( myFD >= 0 )
+	{
+		::close( myFD );
+		myFD = -1;
+	}
+}
+
+
+////////////////////////////////////////
+
+
+std::vector<FrameJournal::Record>
+FrameJournal::records( void ) const
+{
+	std::vector<Record> ret;
+	if ( ! myMap )
+		return ret;
+
+	const JournalEntry *idx = reinterpret_cast<const JournalEntry *>( myMap + myIndexOffset );
+	for ( size_t i = 0; i < mySlotCount; ++i )
+	{
+		JournalEntry e;
+		if ( ! readEntry( idx + i, e ) || e.slot != i || e.bytes > mySlotBytes )
+			continue;
+		// frame data the kernel never wrote back, or that is being
+		// overwritten right now
+		const uint8_t *data = myMap + myDataOffset + i * mySlotBytes;
+		if ( ~crc32c( ~0U, data, static_cast<size_t>( e.bytes ) ) != e.dataCRC )
+			continue;
+
+		Record r;
+		r.serial = e.serial;
+		r.sequence = e.sequence;
+		r.captureNS = e.captureNS;
+		r.firstPayloadNS = e.firstPayloadNS;
+		r.lastPayloadNS = e.lastPayloadNS;
+		r.bytes = e.bytes;
+		r.pts = e.pts;
+		r.flags = e.flags;
+		r.format = static_cast<ImageBuffer::Format>( e.format );
+		r.width = e.width;
+		r.height = e.height;
+		r.bytesPerLine = e.bytesPerLine;
+		r.bytesPerPixel = e.bytesPerPixel;
+		r.roi.x = e.roi[0];
+		r.roi.y = e.roi[1];
+		r.roi.w = e.roi[2];
+		r.roi.h = e.roi[3];
+		r.slot = i;
+		ret.push_back( r );
+	}
+
+	std::sort( ret.begin(), ret.end(), []( const Record &a, const Record &b ) { return a.serial < b.serial; } );
+	return ret;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+FrameJournal::copyFrame( const Record &r, std::vector<uint8_t> &out ) const
+{
+	if ( ! myMap || r.slot >= mySlotCount || r.bytes > mySlotBytes )
+		return false;
+
+	const JournalEntry *e = reinterpret_cast<const JournalEntry *>( myMap + myIndexOffset ) + r.slot;
+	if ( __atomic_load_n( &e->serial, __ATOMIC_ACQUIRE ) != r.serial )
+		return false;
+
+	out.resize( static_cast<size_t>( r.bytes ) );
+	memcpy( out.data(), myMap + myDataOffset + r.slot * mySlotBytes, out.size() );
+
+	// the producer clears the serial before touching the slot
+	std::atomic_thread_fence( std::memory_order_acquire );
+	return __atomic_load_n( &e->serial, __ATOMIC_RELAXED ) == r.serial;
+}
+
+
+////////////////////////////////////////
+
+
+const uint8_t *
+FrameJournal::frameData( const Record &r ) const
+{
+	if ( ! myMap || r.slot >= mySlotCount || r.bytes > mySlotBytes )
+		return nullptr;
+
+	const JournalEntry *e = reinterpret_cast<const JournalEntry *>( myMap + myIndexOffset ) + r.slot;
+	if ( __atomic_load_n( &e->serial, __ATOMIC_ACQUIRE ) != r.serial )
+		return nullptr;
+	return myMap + myDataOffset + r.slot * mySlotBytes;
+}
+
+
+////////////////////////////////////////
+
+
+void
+FrameJournal::beginFrame( ImageBuffer::Format fmt, int w, int h, int bpl, int bpp, const ROI &roi, uint64_t sequence, int64_t firstNS )
+{
+	if ( ! myMap || myReadOnly )
+		return;
+
+	abort();
+
+	JournalEntry *e = reinterpret_cast<JournalEntry *>( myMap + myIndexOffset ) + mySlot;
+	__atomic_store_n( &e->serial, uint64_t( 0 ), __ATOMIC_RELEASE );
+	// keep the data stores after the serial is cleared
+	std::atomic_thread_fence( std::memory_order_seq_cst );
+
+	myCur = Record();
+	myCur.sequence = sequence;
+	myCur.firstPayloadNS = firstNS;
+	myCur.lastPayloadNS = firstNS;
+	myCur.format = fmt;
+	myCur.width = w;
+	myCur.height = h;
+	myCur.bytesPerLine = bpl;
+	myCur.bytesPerPixel = bpp;
+	myCur.roi = roi;
+	myCur.slot = mySlot;
+	myCRC = ~0U;
+	myOpenFrame = true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+FrameJournal::addData( const uint8_t *buf, size_t len )
+{
+	if ( ! myOpenFrame || len == 0 )
+		return;
+
+	size_t left = mySlotBytes - static_cast<size_t>( myCur.bytes );
+	if ( len > left )
+	{
+		if ( ( myCur.flags & FrameInfo::ERR_OVERRUN ) == 0 )
+			myTruncated.fetch_add( 1, std::memory_order_relaxed );
+		myCur.flags |= FrameInfo::ERR_OVERRUN;
+		len = left;
+	}
+
+	memcpy( myMap + myDataOffset + myCur.slot * mySlotBytes + myCur.bytes, buf, len );
+	myCRC = crc32c( myCRC, buf, len );
+	myCur.bytes += len;
+}
+
+
+////////////////////////////////////////
+
+
+void
+FrameJournal::commit( const FrameInfo *info )
+{
+	if ( ! myOpenFrame )
+		return;
+	myOpenFrame = false;
+	if ( myCur.bytes == 0 )
+		return;
+
+	if ( info )
+	{
+		myCur.captureNS = info->captureNS;
+		myCur.lastPayloadNS = info->lastPayloadNS;
+		myCur.pts = info->pts;
+		myCur.flags |= info->flags;
+	}
+
+	JournalEntry e;
+	memset( &e, 0, sizeof(e) );
+	e.serial = ++mySerial;
+	e.sequence = myCur.sequence;
+	e.captureNS = myCur.captureNS;
+	e.firstPayloadNS = myCur.firstPayloadNS;
+	e.lastPayloadNS = myCur.lastPayloadNS;
+	e.bytes = myCur.bytes;
+	e.pts = myCur.pts;
+	e.flags = myCur.flags;
+	e.format = static_cast<uint32_t>( myCur.format );
+	e.width = myCur.width;
+	e.height = myCur.height;
+	e.bytesPerLine = myCur.bytesPerLine;
+	e.bytesPerPixel = myCur.bytesPerPixel;
+	e.roi[0] = myCur.roi.x;
+	e.roi[1] = myCur.roi.y;
+	e.roi[2] = myCur.roi.w;
+	e.roi[3] = myCur.roi.h;
+	e.slot = static_cast<uint32_t>( myCur.slot );
+	e.dataCRC = ~myCRC;
+	e.checksum = checksum( e );
+
+	// everything but the serial, which makes it valid
+	JournalEntry *dst = reinterpret_cast<JournalEntry *>( myMap + myIndexOffset ) + myCur.slot;
+	memcpy( reinterpret_cast<uint8_t *>( dst ) + sizeof(e.serial),
+			reinterpret_cast<const uint8_t *>( &e ) + sizeof(e.serial),
+			sizeof(e) - sizeof(e.serial) );
+	__atomic_store_n( &dst->serial, e.serial, __ATOMIC_RELEASE );
+
+	if ( mySync )
+	{
+		uint8_t *data = myMap + myDataOffset + myCur.slot * mySlotBytes;
+		msync( data, roundUp( static_cast<size_t>( myCur.bytes ), kPage ), MS_ASYNC );
+		uintptr_t ep = reinterpret_cast<uintptr_t>( dst ) & ~uintptr_t( kPage - 1 );
+		msync( reinterpret_cast<void *>( ep ), kPage, MS_ASYNC );
+	}
+
+	mySlot = ( myCur.slot + 1 ) % mySlotCount;
+	myCommitted.fetch_add( 1, std::memory_order_relaxed );
+}
+
+
+////////////////////////////////////////
+
+
+void
+FrameJournal::abort( void )
+{
+	// the slot was already invalidated by beginFrame
+	myOpenFrame = false;
+}
+
+
+////////////////////////////////////////
+
+
+FrameJournal::Stats
+FrameJournal::stats( void ) const
+{
+	Stats s;
+	s.committed = myCommitted.load( std::memory_order_relaxed );
+	s.truncated = myTruncated.load( std::memory_order_relaxed );
+	return s;
+}
+
+
+////////////////////////////////////////
+
+
+void
+FrameJournal::map( int fd, size_t len, bool readOnly )
+{
+	int flags = MAP_SHARED;
+#ifdef __linux__
+	// fault it all in now rather than mid capture, readers only
+	// touch what they look at
+	if ( ! readOnly )
+		flags |= MAP_POPULATE;
+#endif
+	int prot = readOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+	void *m = mmap( nullptr, len, prot, flags, fd, 0 );
+	if ( m == MAP_FAILED )
+	{
+		std::string msg = strerror( errno );
+		::close( fd );
+		throw std::runtime_error( "Unable to map journal: " + msg );
+	}
+
+	myFD = fd;
+	myMap = static_cast<uint8_t *>( m );
+	myMapBytes = len;
+	myReadOnly = readOnly;
+}
+
+
+////////////////////////////////////////
+
+
+void
+FrameJournal::recover( void )
+{
+	mySerial = 0;
+	mySlot = 0;
+	std::vector<Record> recs = records();
+	if ( recs.empty() )
+		return;
+
+	mySerial = recs.back().serial;
+	mySlot = ( recs.back().slot + 1 ) % mySlotCount;
+}
+
+
+////////////////////////////////////////
+
+
+} // namespace USB
@@ -0,0 +1,159 @@
+// FrameJournal.h -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <atomic>
+#include "Stream.h"
+
+
+////////////////////////////////////////
+
+
+///
+/// @file FrameJournal.h
+///
+/// @author Kimball Thurston
+///
+
+namespace USB
+{
+
+///
+/// @brief Class FrameJournal keeps the most recent frames in a ring
+/// of fixed size slots in a memory mapped file.
+///
+/// The file is allocated up front, so capture never waits on the
+/// filesystem for space, and payloads are copied straight into the
+/// mapped slot as they arrive (see UVCDevice::setJournal). Each slot
+/// has an index entry with the sequence, times, format and ROI,
+/// which is only marked valid (with a checksum of the entry and a
+/// CRC32C of the frame data) once the frame is complete. If the
+/// process dies, opening the file again recovers every complete
+/// frame; anything the kernel hadn't written back by a power failure
+/// fails the checks rather than coming back torn.
+///
+/// Frame data is the ROI rows back to back as the device sent them,
+/// or the compressed frame.
+///
+class FrameJournal
+{
+public:
+	struct Record
+	{
+		uint64_t serial = 0; ///< order frames were committed to the journal
+		uint64_t sequence = 0; ///< FrameInfo::sequence
+		int64_t captureNS = 0;
+		int64_t firstPayloadNS = 0;
+		int64_t lastPayloadNS = 0;
+		uint64_t bytes = 0;
+		uint32_t pts = 0;
+		uint32_t flags = 0; ///< FrameInfo::Flags
+		ImageBuffer::Format format = ImageBuffer::Format::UNKNOWN;
+		int width = 0;
+		int height = 0;
+		int bytesPerLine = 0;
+		int bytesPerPixel = 0;
+		ROI roi;
+		size_t slot = 0;
+	};
+
+	struct Stats
+	{
+		uint64_t committed = 0;
+		uint64_t truncated = 0; ///< bigger than a slot
+	};
+
+	FrameJournal( void );
+	~FrameJournal( void );
+
+	// creates (replacing) a journal of count slots, each rounded up
+	// to a whole number of pages. Throws on failure
+	void create( const std::string &path, size_t slotBytes, size_t count );
+	// maps an existing journal keeping what is in it, new frames
+	// go after the newest one found. Read only journals can be
+	// looked at but not written. Throws if it isn't a journal
+	void open( const std::string &path, bool readOnly = false );
+	void close( void );
+	bool isOpen( void ) const { return myMap != nullptr; }
+
+	size_t slotBytes( void ) const { return mySlotBytes; }
+	size_t slotCount( void ) const { return mySlotCount; }
+
+	// start writeback of each frame as it is committed (msync with
+	// MS_ASYNC), narrowing what a power failure can take
+	void setSyncOnCommit( bool on ) { mySync = on; }
+
+	// the valid frames, oldest first. Reads every frame to check
+	// its data
+	std::vector<Record> records( void ) const;
+	// copies out the frame, false if it was overwritten (or is being
+	// overwritten) in the meantime
+	bool copyFrame( const Record &r, std::vector<uint8_t> &out ) const;
+	// the frame in place in the mapping, nullptr if it has been
+	// overwritten. Only stable while nothing is writing the journal
+	const uint8_t *frameData( const Record &r ) const;
+
+	// producer side, all on the thread assembling frames. data
+	// outside a begin / commit is ignored. commit takes the frame's
+	// info, if there is one, abort drops the frame
+	void beginFrame( ImageBuffer::Format fmt, int w, int h, int bpl, int bpp, const ROI &roi, uint64_t sequence, int64_t firstNS );
+	void addData( const uint8_t *buf, size_t len );
+	void commit( const FrameInfo *info = nullptr );
+	void abort( void );
+
+	Stats stats( void ) const;
+
+private:
+	FrameJournal( const FrameJournal & ) = delete;
+	FrameJournal &operator=( const FrameJournal & ) = delete;
+
+	void map( int fd, size_t len, bool readOnly );
+	void recover( void );
+
+	int myFD = -1;
+	uint8_t *myMap = nullptr;
+	size_t myMapBytes = 0;
+	size_t mySlotBytes = 0;
+	size_t mySlotCount = 0;
+	size_t myIndexOffset = 0;
+	size_t myDataOffset = 0;
+	bool myReadOnly = false;
+	bool mySync = false;
+
+	// producer state
+	bool myOpenFrame = false;
+	size_t mySlot = 0;
+	uint64_t mySerial = 0;
+	uint32_t myCRC = 0;
+	Record myCur;
+
+	std::atomic<uint64_t> myCommitted{0};
+	std::atomic<uint64_t> myTruncated{0};
+};
+
+} // namespace USB
@@ -0,0 +1,440 @@
+// MJPEGDecoder.cpp -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#include "MJPEGDecoder.h"
+#include "Logger.h"
+#include <algorithm>
+
+// libjpeg-turbo is optional. The build can set USBPP_HAVE_TURBOJPEG
+// either way, otherwise it is used when the header can be found
+#if !defined(USBPP_HAVE_TURBOJPEG)
+# if defined(__has_include)
+#  if __has_include(<turbojpeg.h>)
+#   define USBPP_HAVE_TURBOJPEG 1
+#  endif
+# endif
+#endif
+#if USBPP_HAVE_TURBOJPEG
+# include <turbojpeg.h>
+#endif
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+#if USBPP_HAVE_TURBOJPEG
+static inline int
+pixelFormat( USB::MJPEGDecoder::Output o )
+{
+	switch ( o )
+	{
+		case USB::MJPEGDecoder::Output::BGRA: return TJPF_BGRA;
+		case USB::MJPEGDecoder::Output::MONO: return TJPF_GRAY;
+		case USB::MJPEGDecoder::Output::RGB: break;
+	}
+	return TJPF_RGB;
+}
+#endif
+
+static inline USB::ImageBuffer::Format
+imageFormat( USB::MJPEGDecoder::Output o, int &bpp )
+{
+	switch ( o )
+	{
+		case USB::MJPEGDecoder::Output::BGRA:
+			bpp = 4;
+			return USB::ImageBuffer::Format::BGRA_32;
+		case USB::MJPEGDecoder::Output::MONO:
+			bpp = 1;
+			return USB::ImageBuffer::Format::MONO_8;
+		case USB::MJPEGDecoder::Output::RGB:
+			break;
+	}
+	bpp = 3;
+	return USB::ImageBuffer::Format::RGB_24;
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+namespace USB
+{
+
+
+////////////////////////////////////////
+
+
+MJPEGDecoder::MJPEGDecoder( void )
+{
+}
+
+
+////////////////////////////////////////
+
+
+MJPEGDecoder::~MJPEGDecoder( void )
+{
+	stop();
+	stopWorkers();
+}
+
+
+////////////////////////////////////////
+
+
+bool
+MJPEGDecoder::available( void )
+{
+#if USBPP_HAVE_TURBOJPEG
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+////////////////////////////////////////
+
+
+void
+MJPEGDecoder::setThreads( size_t n )
+{
+	if ( n == myThreadCount && ! myWorkers.empty() )
+		return;
+
+	stopWorkers();
+	myThreadCount = n;
+}
+
+
+////////////////////////////////////////
+
+
+void
+MJPEGDecoder::setCallback( const DecodedCallback &cb )
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	myCallback = cb;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+MJPEGDecoder::submit( const FrameRef &frame )
+{
+	if ( ! frame )
+		return false;
+	if ( ! available() )
+	{
+		myRefused.fetch_add( 1, std::memory_order_relaxed );
+		return false;
+	}
+
+	if ( myWorkers.empty() )
+		startWorkers();
+
+	{
+		std::unique_lock<std::mutex> lk( myMutex );
+		size_t maxQ = myMaxQueued.load( std::memory_order_relaxed );
+		if ( maxQ == 0 )
+			maxQ = myWorkers.size() * 2;
+		if ( myJobs.size() >= maxQ )
+		{
+			myRefused.fetch_add( 1, std::memory_order_relaxed );
+			return false;
+		}
+
+		myJobs.emplace_back();
+		myJobs.back().in = frame;
+	}
+	mySubmitted.fetch_add( 1, std::memory_order_relaxed );
+	myWake.notify_one();
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+MJPEGDecoder::flush( void )
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	myIdle.wait( lk, [this]{ return myJobs.empty() || myWorkers.empty(); } );
+}
+
+
+////////////////////////////////////////
+
+
+void
+MJPEGDecoder::stop( void )
+{
+	{
+		std::unique_lock<std::mutex> lk( myMutex );
+		// anything already running finishes, into a stream that is
+		// off so it goes nowhere
+		myJobs.erase( myJobs.begin() + static_cast<std::ptrdiff_t>( myFirstPending ), myJobs.end() );
+	}
+
+	std::unique_lock<std::mutex> lk( myStreamMutex );
+	myStream.clear();
+	myStreamW = 0;
+	myStreamH = 0;
+}
+
+
+////////////////////////////////////////
+
+
+MJPEGDecoder::Stats
+MJPEGDecoder::stats( void ) const
+{
+	Stats s;
+	s.submitted = mySubmitted.load( std::memory_order_relaxed );
+	s.decoded = myDecoded.load( std::memory_order_relaxed );
+	s.refused = myRefused.load( std::memory_order_relaxed );
+	s.dropped = myDropped.load( std::memory_order_relaxed );
+	s.errors = myErrors.load( std::memory_order_relaxed );
+	return s;
+}
+
+
+////////////////////////////////////////
+
+
+void
+MJPEGDecoder::resetStats( void )
+{
+	mySubmitted.store( 0, std::memory_order_relaxed );
+	myDecoded.store( 0, std::memory_order_relaxed );
+	myRefused.store( 0, std::memory_order_relaxed );
+	myDropped.store( 0, std::memory_order_relaxed );
+	myErrors.store( 0, std::memory_order_relaxed );
+}
+
+
+////////////////////////////////////////
+
+
+void
+MJPEGDecoder::startWorkers( void )
+{
+	size_t nThreads = myThreadCount;
+	if ( nThreads == 0 )
+		nThreads = std::max( std::thread::hardware_concurrency(), 1U );
+
+	// each worker has a frame being decoded, and finished ones wait
+	// for the older frames, on top of what the consumer holds
+	myStream.setDepth( nThreads + 2, nThreads * 2 + 4 );
+
+	std::unique_lock<std::mutex> lk( myMutex );
+	myShutdown = false;
+	for ( size_t i = 0; i < nThreads; ++i )
+		myWorkers.emplace_back( &MJPEGDecoder::workerLoop, this );
+}
+
+
+////////////////////////////////////////
+
+
+void
+MJPEGDecoder::stopWorkers( void )
+{
+	{
+		std::unique_lock<std::mutex> lk( myMutex );
+		myShutdown = true;
+	}
+	myWake.notify_all();
+	for ( auto &t: myWorkers )
+		t.join();
+	myWorkers.clear();
+	// anyone in flush gives up, the pending jobs wait for the next
+	// set of workers
+	myIdle.notify_all();
+}
+
+
+////////////////////////////////////////
+
+
+void
+MJPEGDecoder::workerLoop( void )
+{
+#if USBPP_HAVE_TURBOJPEG
+	tjhandle tj = tjInitDecompress();
+	if ( ! tj )
+	{
+		error() << "MJPEGDecoder: Unable to create decompressor" << send;
+		return;
+	}
+
+	std::unique_lock<std::mutex> lk( myMutex );
+	while ( true )
+	{
+		myWake.wait( lk, [this]{ return myShutdown || myFirstPending < myJobs.size(); } );
+		if ( myShutdown )
+			break;
+
+		Job &j = myJobs[myFirstPending++];
+		j.state = JobState::RUNNING;
+		lk.unlock();
+		decode( tj, j );
+		lk.lock();
+		j.state = JobState::DONE;
+		deliver( lk );
+	}
+	lk.unlock();
+
+	tjDestroy( tj );
+#endif
+}
+
+
+////////////////////////////////////////
+
+
+#if USBPP_HAVE_TURBOJPEG
+void
+MJPEGDecoder::decode( void *tj, Job &j )
+{
+	const ImageBuffer &in = *j.in;
+	unsigned long len = static_cast<unsigned long>( in.filled() );
+	int w = 0, h = 0, subsamp = 0, colorspace = 0;
+	if ( len == 0 || tjDecompressHeader3( tj, in.data(), len, &w, &h, &subsamp, &colorspace ) != 0 )
+	{
+		myErrors.fetch_add( 1, std::memory_order_relaxed );
+		return;
+	}
+
+	Output o = myOutputType.load( std::memory_order_relaxed );
+	j.out = acquireOutput( w, h, o );
+	if ( ! j.out )
+	{
+		myDropped.fetch_add( 1, std::memory_order_relaxed );
+		return;
+	}
+
+	ImageBuffer &out = *j.out;
+	int flags = 0;
+	if ( myFast.load( std::memory_order_relaxed ) )
+		flags |= TJFLAG_FASTDCT | TJFLAG_FASTUPSAMPLE;
+
+	out.info() = in.info();
+	if ( tjDecompress2( tj, in.data(), len, out.fillData(), w, out.stride(), h, pixelFormat( o ), flags ) != 0 )
+	{
+		myErrors.fetch_add( 1, std::memory_order_relaxed );
+		// warnings (i.e. a truncated scan) still produce a frame
+		if ( tjGetErrorCode( tj ) != TJERR_WARNING )
+		{
+			j.out.reset();
+			return;
+		}
+		out.info().flags |= FrameInfo::ERR_DECODE;
+	}
+	out.complete();
+	myDecoded.fetch_add( 1, std::memory_order_relaxed );
+}
+#endif
+
+
+////////////////////////////////////////
+
+
+FrameRef
+MJPEGDecoder::acquireOutput( int w, int h, Output o )
+{
+	std::unique_lock<std::mutex> lk( myStreamMutex );
+	if ( w != myStreamW || h != myStreamH || o != myStreamType )
+	{
+		int bpp = 1;
+		ImageBuffer::Format fmt = imageFormat( o, bpp );
+		myStream.reset( w, h, w * bpp, bpp, fmt );
+		ROI roi;
+		roi.x = 0;
+		roi.y = 0;
+		roi.w = w;
+		roi.h = h;
+		myStream.setROI( roi );
+		myStreamW = w;
+		myStreamH = h;
+		myStreamType = o;
+	}
+	return myStream.acquire();
+}
+
+
+////////////////////////////////////////
+
+
+void
+MJPEGDecoder::deliver( std::unique_lock<std::mutex> &lk )
+{
+	if ( myDelivering )
+		return;
+
+	myDelivering = true;
+	while ( ! myJobs.empty() && myJobs.front().state == JobState::DONE )
+	{
+		Job j = std::move( myJobs.front() );
+		myJobs.pop_front();
+		--myFirstPending;
+		DecodedCallback cb = myCallback;
+		lk.unlock();
+
+		if ( cb )
+		{
+			{
+				std::unique_lock<std::mutex> slk( myStreamMutex );
+				myStream.done( j.out );
+			}
+			cb( j.in, j.out );
+		}
+		else if ( j.out )
+		{
+			std::unique_lock<std::mutex> slk( myStreamMutex );
+			myStream.publish( j.out );
+		}
+		j.in.reset();
+		j.out.reset();
+
+		lk.lock();
+	}
+	myDelivering = false;
+	myIdle.notify_all();
+}
+
+
+////////////////////////////////////////
+
+
+} // namespace USB
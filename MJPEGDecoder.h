@@ -0,0 +1,183 @@
+// MJPEGDecoder.h -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include "Stream.h"
+
+
+////////////////////////////////////////
+
+
+///
+/// @file MJPEGDecoder.h
+///
+/// @author Kimball Thurston
+///
+
+namespace USB
+{
+
+///
+/// @brief Class MJPEGDecoder decompresses MJPEG frames on a set of
+/// worker threads, handing them on in the order they were submitted.
+///
+/// Frames are decoded straight out of the buffer they were assembled
+/// in, into buffers from the decoder's own stream, so nothing is
+/// copied on the way. Decoding uses libjpeg-turbo, which fills in the
+/// standard huffman tables most cameras leave out of their frames.
+/// The library is optional; built without it, available() is false
+/// and every frame is refused.
+///
+/// When the decoder falls behind, submit refuses frames past the
+/// queue limit rather than letting the latency grow.
+///
+class MJPEGDecoder
+{
+public:
+	enum class Output
+	{
+		RGB, ///< ImageBuffer::Format::RGB_24
+		BGRA, ///< ImageBuffer::Format::BGRA_32
+		MONO ///< ImageBuffer::Format::MONO_8
+	};
+
+	// called in frame order, on whichever worker finished the oldest
+	// frame. decoded is empty if the frame could not be decoded or
+	// there was no buffer for it
+	typedef std::function<void (const FrameRef &compressed, const FrameRef &decoded)> DecodedCallback;
+
+	struct Stats
+	{
+		uint64_t submitted = 0;
+		uint64_t decoded = 0;
+		uint64_t refused = 0; ///< queue was full
+		uint64_t dropped = 0; ///< no output buffer available
+		uint64_t errors = 0; ///< corrupt frames, including ones decoded anyway
+	};
+
+	MJPEGDecoder( void );
+	~MJPEGDecoder( void );
+
+	// false if the library was built without libjpeg-turbo
+	static bool available( void );
+
+	// the settings apply to frames decoded from then on
+	void setOutput( Output o ) { myOutputType = o; }
+	Output output( void ) const { return myOutputType; }
+	// faster, slightly less accurate, IDCT and chroma upsampling
+	void setFastDecode( bool on ) { myFast = on; }
+
+	// 0 uses one per core. Starting the workers sets the depth of
+	// stream() to suit, change it after the first submit if needed
+	void setThreads( size_t n );
+	// frames waiting or being decoded before submit refuses more, 0
+	// for twice the number of threads
+	void setMaxQueued( size_t n ) { myMaxQueued = n; }
+
+	// without a callback, decoded frames are published to stream()
+	void setCallback( const DecodedCallback &cb = DecodedCallback() );
+
+	// holds a reference to frame until it is handed on, returns
+	// false if it was refused
+	bool submit( const FrameRef &frame );
+	// waits for everything submitted to be handed on
+	void flush( void );
+	// discards anything not yet started and turns the stream off
+	void stop( void );
+
+	VideoStream &stream( void ) { return myStream; }
+
+	Stats stats( void ) const;
+	void resetStats( void );
+
+private:
+	MJPEGDecoder( const MJPEGDecoder & ) = delete;
+	MJPEGDecoder &operator=( const MJPEGDecoder & ) = delete;
+
+	enum class JobState
+	{
+		PENDING,
+		RUNNING,
+		DONE
+	};
+
+	struct Job
+	{
+		FrameRef in;
+		FrameRef out;
+		JobState state = JobState::PENDING;
+	};
+
+	void startWorkers( void );
+	void stopWorkers( void );
+	void workerLoop( void );
+	void decode( void *tj, Job &j );
+	FrameRef acquireOutput( int w, int h, Output o );
+	// called with myMutex held, hands on any finished jobs at the
+	// front of the queue, unless another thread already is
+	void deliver( std::unique_lock<std::mutex> &lk );
+
+	std::atomic<Output> myOutputType{Output::RGB};
+	std::atomic<bool> myFast{false};
+	std::atomic<size_t> myMaxQueued{0};
+
+	size_t myThreadCount = 0;
+	std::vector<std::thread> myWorkers;
+
+	std::mutex myMutex;
+	std::condition_variable myWake;
+	std::condition_variable myIdle;
+	// submit order, everything before myFirstPending is running or
+	// done. references stay valid as jobs are added and removed at
+	// the ends
+	std::deque<Job> myJobs;
+	size_t myFirstPending = 0;
+	bool myDelivering = false;
+	bool myShutdown = false;
+	DecodedCallback myCallback;
+
+	// the stream only has one producer at a time
+	std::mutex myStreamMutex;
+	VideoStream myStream;
+	int myStreamW = 0;
+	int myStreamH = 0;
+	Output myStreamType = Output::RGB;
+
+	std::atomic<uint64_t> mySubmitted{0};
+	std::atomic<uint64_t> myDecoded{0};
+	std::atomic<uint64_t> myRefused{0};
+	std::atomic<uint64_t> myDropped{0};
+	std::atomic<uint64_t> myErrors{0};
+};
+
+} // namespace USB
@@ -0,0 +1,320 @@
+// PackedRaw.cpp -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#include "PackedRaw.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <tmmintrin.h>
+#endif
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+static inline uint16_t
+widen( uint16_t v, int bits, bool fullRange )
+{
+	if ( ! fullRange )
+		return v;
+	return static_cast<uint16_t>( ( v << ( 16 - bits ) ) | ( v >> ( 2 * bits - 16 ) ) );
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#if defined(__clang__)
+# pragma clang attribute push (__attribute__((target("ssse3"))), apply_to = function)
+#else
+# pragma GCC push_options
+# pragma GCC target("ssse3")
+#endif
+
+static inline __m128i
+load( const uint8_t *p )
+{
+	return _mm_loadu_si128( reinterpret_cast<const __m128i *>( p ) );
+}
+
+static inline __m128i
+widen( __m128i v, int bits, bool fullRange )
+{
+	if ( ! fullRange )
+		return v;
+	return _mm_or_si128( _mm_sll_epi16( v, _mm_cvtsi32_si128( 16 - bits ) ),
+						 _mm_srl_epi16( v, _mm_cvtsi32_si128( 2 * bits - 16 ) ) );
+}
+
+static int
+unpack10SSSE3( const uint8_t *src, int n, uint16_t *dst, bool fullRange )
+{
+	int x = 0;
+	size_t bytes = ( ( static_cast<size_t>( n ) + 3 ) / 4 ) * 5;
+	// 8 pixels from 10 bytes: pair each high byte with the byte of
+	// low bits for its group, then pull that pixel's 2 bits out by
+	// multiplying them up to a common position
+	const __m128i gather = _mm_setr_epi8( 4, 0, 4, 1, 4, 2, 4, 3, 9, 5, 9, 6, 9, 7, 9, 8 );
+	const __m128i lowScale = _mm_setr_epi16( 64, 16, 4, 1, 64, 16, 4, 1 );
+	const __m128i hiMask = _mm_set1_epi16( 0x3FC );
+	const __m128i byteMask = _mm_set1_epi16( 0xFF );
+	const __m128i lowMask = _mm_set1_epi16( 0x3 );
+	for ( ; x + 8 <= n && static_cast<size_t>( x / 4 ) * 5 + 16 <= bytes; x += 8 )
+	{
+		__m128i w = _mm_shuffle_epi8( load( src + ( x / 4 ) * 5 ), gather );
+		__m128i hi = _mm_and_si128( _mm_srli_epi16( w, 6 ), hiMask );
+		__m128i lo = _mm_mullo_epi16( _mm_and_si128( w, byteMask ), lowScale );
+		lo = _mm_and_si128( _mm_srli_epi16( lo, 6 ), lowMask );
+		_mm_storeu_si128( reinterpret_cast<__m128i *>( dst + x ), widen( _mm_or_si128( hi, lo ), 10, fullRange ) );
+	}
+	return x;
+}
+
+static int
+unpack12SSSE3( const uint8_t *src, int n, uint16_t *dst, bool fullRange )
+{
+	int x = 0;
+	size_t bytes = ( ( static_cast<size_t>( n ) + 1 ) / 2 ) * 3;
+	// 8 pixels from 12 bytes, each high byte paired with the shared
+	// byte of low nibbles, even pixels want the low nibble of that,
+	// odd ones the high
+	const __m128i gather = _mm_setr_epi8( 2, 0, 2, 1, 5, 3, 5, 4, 8, 6, 8, 7, 11, 9, 11, 10 );
+	const __m128i hiMask = _mm_setr_epi16( 0xFF0, 0xFFF, 0xFF0, 0xFFF, 0xFF0, 0xFFF, 0xFF0, 0xFFF );
+	const __m128i loMask = _mm_setr_epi16( 0xF, 0, 0xF, 0, 0xF, 0, 0xF, 0 );
+	for ( ; x + 8 <= n && static_cast<size_t>( x / 2 ) * 3 + 16 <= bytes; x += 8 )
+	{
+		__m128i w = _mm_shuffle_epi8( load( src + ( x / 2 ) * 3 ), gather );
+		__m128i v = _mm_or_si128( _mm_and_si128( _mm_srli_epi16( w, 4 ), hiMask ), _mm_and_si128( w, loMask ) );
+		_mm_storeu_si128( reinterpret_cast<__m128i *>( dst + x ), widen( v, 12, fullRange ) );
+	}
+	return x;
+}
+
+static int
+preview10SSSE3( const uint8_t *src, int n, uint8_t *dst )
+{
+	int x = 0;
+	size_t bytes = ( ( static_cast<size_t>( n ) + 3 ) / 4 ) * 5;
+	// 12 pixels from 15 bytes, skipping the low bits
+	const __m128i gather = _mm_setr_epi8( 0, 1, 2, 3, 5, 6, 7, 8, 10, 11, 12, 13, -1, -1, -1, -1 );
+	for ( ; x + 12 <= n && static_cast<size_t>( x / 4 ) * 5 + 16 <= bytes; x += 12 )
+	{
+		__m128i v = _mm_shuffle_epi8( load( src + ( x / 4 ) * 5 ), gather );
+		_mm_storel_epi64( reinterpret_cast<__m128i *>( dst + x ), v );
+		int32_t tail = _mm_cvtsi128_si32( _mm_srli_si128( v, 8 ) );
+		memcpy( dst + x + 8, &tail, 4 );
+	}
+	return x;
+}
+
+static int
+preview12SSSE3( const uint8_t *src, int n, uint8_t *dst )
+{
+	int x = 0;
+	size_t bytes = ( ( static_cast<size_t>( n ) + 1 ) / 2 ) * 3;
+	// 10 pixels from 15 bytes
+	const __m128i gather = _mm_setr_epi8( 0, 1, 3, 4, 6, 7, 9, 10, 12, 13, -1, -1, -1, -1, -1, -1 );
+	for ( ; x + 10 <= n && static_cast<size_t>( x / 2 ) * 3 + 16 <= bytes; x += 10 )
+	{
+		__m128i v = _mm_shuffle_epi8( load( src + ( x / 2 ) * 3 ), gather );
+		_mm_storel_epi64( reinterpret_cast<__m128i *>( dst + x ), v );
+		int16_t tail = static_cast<int16_t>( _mm_extract_epi16( v, 4 ) );
+		memcpy( dst + x + 8, &tail, 2 );
+	}
+	return x;
+}
+
+#if defined(__clang__)
+# pragma clang attribute pop
+#else
+# pragma GCC pop_options
+#endif
+
+static bool
+detectSSSE3( void )
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports( "ssse3" ) != 0;
+}
+
+// checked once, the answer doesn't change
+static bool
+haveSSSE3( void )
+{
+	static const bool has = detectSSSE3();
+	return has;
+}
+
+#endif
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+namespace USB
+{
+
+
+////////////////////////////////////////
+
+
+void
+PackedRaw::unpack10( const uint8_t *src, int n, uint16_t *dst, bool fullRange )
+{
+	int x = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	if ( haveSSSE3() )
+		x = unpack10SSSE3( src, n, dst, fullRange );
+#endif
+	for ( ; x < n; ++x )
+	{
+		const uint8_t *g = src + ( x / 4 ) * 5;
+		int j = x & 3;
+		uint16_t v = static_cast<uint16_t>( ( g[j] << 2 ) | ( ( g[4] >> ( 2 * j ) ) & 0x3 ) );
+		dst[x] = widen( v, 10, fullRange );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+PackedRaw::unpack12( const uint8_t *src, int n, uint16_t *dst, bool fullRange )
+{
+	int x = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	if ( haveSSSE3() )
+		x = unpack12SSSE3( src, n, dst, fullRange );
+#endif
+	for ( ; x < n; ++x )
+	{
+		const uint8_t *g = src + ( x / 2 ) * 3;
+		uint16_t v;
+		if ( x & 1 )
+			v = static_cast<uint16_t>( ( g[1] << 4 ) | ( g[2] >> 4 ) );
+		else
+			v = static_cast<uint16_t>( ( g[0] << 4 ) | ( g[2] & 0xF ) );
+		dst[x] = widen( v, 12, fullRange );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+PackedRaw::preview10( const uint8_t *src, int n, uint8_t *dst )
+{
+	int x = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	if ( haveSSSE3() )
+		x = preview10SSSE3( src, n, dst );
+#endif
+	for ( ; x < n; ++x )
+		dst[x] = src[( x / 4 ) * 5 + ( x & 3 )];
+}
+
+
+////////////////////////////////////////
+
+
+void
+PackedRaw::preview12( const uint8_t *src, int n, uint8_t *dst )
+{
+	int x = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	if ( haveSSSE3() )
+		x = preview12SSSE3( src, n, dst );
+#endif
+	for ( ; x < n; ++x )
+		dst[x] = src[( x / 2 ) * 3 + ( x & 1 )];
+}
+
+
+////////////////////////////////////////
+
+
+bool
+PackedRaw::unpack( const ImageBuffer &img, uint16_t *dst, size_t dstStride, bool fullRange )
+{
+	int bits = ImageBuffer::packedBits( img.format() );
+	if ( bits == 0 || ! img.data() )
+		return false;
+
+	const ROI &roi = img.roi();
+	const uint8_t *src = img.data() + static_cast<size_t>( roi.y ) * img.stride() +
+		ImageBuffer::rowBytes( img.format(), 0, roi.x );
+	if ( dstStride == 0 )
+		dstStride = static_cast<size_t>( roi.w );
+
+	for ( int y = 0; y < roi.h; ++y )
+	{
+		const uint8_t *s = src + static_cast<size_t>( y ) * img.stride();
+		uint16_t *d = dst + static_cast<size_t>( y ) * dstStride;
+		if ( bits == 10 )
+			unpack10( s, roi.w, d, fullRange );
+		else
+			unpack12( s, roi.w, d, fullRange );
+	}
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+PackedRaw::preview( const ImageBuffer &img, uint8_t *dst, size_t dstStride )
+{
+	int bits = ImageBuffer::packedBits( img.format() );
+	if ( bits == 0 || ! img.data() )
+		return false;
+
+	const ROI &roi = img.roi();
+	const uint8_t *src = img.data() + static_cast<size_t>( roi.y ) * img.stride() +
+		ImageBuffer::rowBytes( img.format(), 0, roi.x );
+	if ( dstStride == 0 )
+		dstStride = static_cast<size_t>( roi.w );
+
+	for ( int y = 0; y < roi.h; ++y )
+	{
+		const uint8_t *s = src + static_cast<size_t>( y ) * img.stride();
+		uint8_t *d = dst + static_cast<size_t>( y ) * dstStride;
+		if ( bits == 10 )
+			preview10( s, roi.w, d );
+		else
+			preview12( s, roi.w, d );
+	}
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+} // namespace USB
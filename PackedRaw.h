@@ -0,0 +1,70 @@
+// PackedRaw.h -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include "Stream.h"
+
+
+////////////////////////////////////////
+
+
+///
+/// @file PackedRaw.h
+///
+/// @author Kimball Thurston
+///
+
+namespace USB
+{
+
+///
+/// @brief Class PackedRaw unpacks the MIPI packed 10 and 12 bit
+/// formats.
+///
+/// Unpacked rows are 16 bit, either with the value in the low bits,
+/// or scaled to the full range (as DisplayStretch::normalize does)
+/// so they can go straight to anything expecting 16 bit data. The
+/// preview versions keep just the top 8 bits of each pixel, which is
+/// a byte shuffle with no arithmetic. Uses SSSE3 when the cpu has
+/// it.
+///
+class PackedRaw
+{
+public:
+	// n pixels of a single row
+	static void unpack10( const uint8_t *src, int n, uint16_t *dst, bool fullRange = false );
+	static void unpack12( const uint8_t *src, int n, uint16_t *dst, bool fullRange = false );
+	static void preview10( const uint8_t *src, int n, uint8_t *dst );
+	static void preview12( const uint8_t *src, int n, uint8_t *dst );
+
+	// the ROI of a packed frame, strides are in elements, 0 for
+	// packed. Returns false for formats that aren't packed
+	static bool unpack( const ImageBuffer &img, uint16_t *dst, size_t dstStride = 0, bool fullRange = false );
+	static bool preview( const ImageBuffer &img, uint8_t *dst, size_t dstStride = 0 );
+};
+
+} // namespace USB
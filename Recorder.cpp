@@ -0,0 +1,684 @@
+// Recorder.cpp -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#include "Recorder.h"
+#include "Logger.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+// written a whole buffer at a time, a multiple of any block size
+static const size_t kStageBytes = 8 * 1024 * 1024;
+static const size_t kStageAlign = 4096;
+
+// OpenDML splits the file into RIFF lists, the first one is what
+// players without OpenDML support see
+static const uint64_t kSegmentBytes = 1024ULL * 1024ULL * 1024ULL;
+static const uint32_t kSuperIndexEntries = 256;
+
+static const uint32_t AVIF_HASINDEX = 0x10;
+static const uint32_t AVIIF_KEYFRAME = 0x10;
+
+inline void
+put16( std::vector<uint8_t> &v, uint16_t x )
+{
+	v.push_back( uint8_t( x ) );
+	v.push_back( uint8_t( x >> 8 ) );
+}
+
+inline void
+put32( std::vector<uint8_t> &v, uint32_t x )
+{
+	put16( v, uint16_t( x ) );
+	put16( v, uint16_t( x >> 16 ) );
+}
+
+inline void
+put64( std::vector<uint8_t> &v, uint64_t x )
+{
+	put32( v, uint32_t( x ) );
+	put32( v, uint32_t( x >> 32 ) );
+}
+
+inline void
+putFCC( std::vector<uint8_t> &v, const char *fcc )
+{
+	v.insert( v.end(), fcc, fcc + 4 );
+}
+
+inline void
+putZero( std::vector<uint8_t> &v, size_t n )
+{
+	v.insert( v.end(), n, uint8_t( 0 ) );
+}
+
+// any NAL unit of type 7 (sequence parameter set)
+bool
+hasSPS( const uint8_t *p, size_t n )
+{
+	for ( size_t i = 0; i + 3 < n; ++i )
+	{
+		if ( p[i] == 0 && p[i + 1] == 0 && p[i + 2] == 1 && ( p[i + 3] & 0x1F ) == 7 )
+			return true;
+	}
+	return false;
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+namespace USB
+{
+
+
+////////////////////////////////////////
+
+
+Recorder::Recorder( void )
+{
+}
+
+
+////////////////////////////////////////
+
+
+Recorder::~Recorder( void )
+{
+	close();
+}
+
+
+////////////////////////////////////////
+
+
+Recorder::Container
+Recorder::containerFor( ImageBuffer::Format f )
+{
+	switch ( f )
+	{
+		case ImageBuffer::Format::MJPEG: return Container::AVI;
+		case ImageBuffer::Format::H264: return Container::ANNEXB;
+		default:
+			break;
+	}
+	throw std::runtime_error( "Recorder only handles compressed formats" );
+}
+
+
+////////////////////////////////////////
+
+
+void
+Recorder::open( const std::string &path, ImageBuffer::Format fmt, int w, int h, uint32_t frameInterval )
+{
+	close();
+
+	myContainer = containerFor( fmt );
+	myFormat = fmt;
+	myWidth = w;
+	myHeight = h;
+	myFrameInterval = frameInterval > 0 ? frameInterval : 333333;
+
+	myFD = ::open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if ( myFD < 0 )
+		throw std::runtime_error( "Unable to create " + path + ": " + strerror( errno ) );
+
+	void *stage = nullptr;
+	if ( posix_memalign( &stage, kStageAlign, kStageBytes ) != 0 )
+	{
+		::close( myFD );
+		myFD = -1;
+		throw std::runtime_error( "Unable to allocate recording buffer" );
+	}
+	myStage = static_cast<uint8_t *>( stage );
+	myStagePos = 0;
+	myFlushed = 0;
+	myFailed = false;
+	mySeenSPS = false;
+
+	myFirstSegment = true;
+	myIndex.clear();
+	mySuperIndex.clear();
+	myTotalFrames = 0;
+	myFirstSegmentFrames = 0;
+	myLargestFrame = 0;
+
+	myFrames = 0;
+	myBytes = 0;
+	myDropped = 0;
+	mySkipped = 0;
+
+	if ( myContainer == Container::AVI )
+		beginSegment();
+
+	{
+		std::unique_lock<std::mutex> lk( myMutex );
+		myClosing = false;
+		myOpen = true;
+	}
+	myWriter = std::thread( &Recorder::writerLoop, this );
+}
+
+
+////////////////////////////////////////
+
+
+void
+Recorder::close( void )
+{
+	if ( ! myWriter.joinable() )
+		return;
+
+	{
+		std::unique_lock<std::mutex> lk( myMutex );
+		myClosing = true;
+		myOpen = false;
+	}
+	myWake.notify_all();
+	myWriter.join();
+
+	finish();
+}
+
+
+////////////////////////////////////////
+
+
+bool
+Recorder::write( const FrameRef &frame )
+{
+	if ( ! frame )
+		return false;
+
+	{
+		std::unique_lock<std::mutex> lk( myMutex );
+		if ( myOpen && ! myClosing && myQueue.size() < myMaxQueued )
+		{
+			myQueue.push_back( frame );
+			lk.unlock();
+			myWake.notify_one();
+			return true;
+		}
+	}
+
+	myDropped.fetch_add( 1, std::memory_order_relaxed );
+	return false;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+Recorder::isOpen( void ) const
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	return myOpen;
+}
+
+
+////////////////////////////////////////
+
+
+Recorder::Stats
+Recorder::stats( void ) const
+{
+	Stats s;
+	s.frames = myFrames.load( std::memory_order_relaxed );
+	s.bytes = myBytes.load( std::memory_order_relaxed );
+	s.dropped = myDropped.load( std::memory_order_relaxed );
+	s.skipped = mySkipped.load( std::memory_order_relaxed );
+	return s;
+}
+
+
+////////////////////////////////////////
+
+
+void
+Recorder::writerLoop( void )
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	while ( true )
+	{
+		myWake.wait( lk, [this]{ return myClosing || ! myQueue.empty(); } );
+		if ( myQueue.empty() )
+			break;
+
+		FrameRef f = std::move( myQueue.front() );
+		myQueue.pop_front();
+		lk.unlock();
+
+		if ( myFailed )
+			myDropped.fetch_add( 1, std::memory_order_relaxed );
+		else
+			writeFrame( *f );
+		f.reset();
+
+		lk.lock();
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+Recorder::writeFrame( const ImageBuffer &img )
+{
+	size_t len = img.filled();
+	if ( img.format() != myFormat || img.info().hasErrors() || len == 0 )
+	{
+		mySkipped.fetch_add( 1, std::memory_order_relaxed );
+		return;
+	}
+
+	if ( myContainer == Container::ANNEXB )
+	{
+		// a decoder can't start until it has the parameter sets
+		if ( ! mySeenSPS )
+		{
+			mySeenSPS = hasSPS( img.data(), len );
+			if ( ! mySeenSPS )
+			{
+				mySkipped.fetch_add( 1, std::memory_order_relaxed );
+				return;
+			}
+		}
+		append( img.data(), len );
+	}
+	else
+	{
+		if ( len > 0xFFFFFFF0 )
+		{
+			mySkipped.fetch_add( 1, std::memory_order_relaxed );
+			return;
+		}
+		uint32_t size = static_cast<uint32_t>( len );
+		uint32_t padded = size + ( size & 1 );
+
+		// leave room for this segment's indices
+		uint64_t indexBytes = 32 + 8 * ( myIndex.size() + 1 );
+		if ( myFirstSegment )
+			indexBytes += 8 + 16 * ( myIndex.size() + 1 );
+		if ( ! myIndex.empty() && tell() + 8 + padded + indexBytes - myRiffStart > kSegmentBytes )
+		{
+			if ( mySuperIndex.size() + 1 >= kSuperIndexEntries )
+			{
+				error() << "Recorder: AVI index full, no more frames will be recorded" << send;
+				myFailed = true;
+				myDropped.fetch_add( 1, std::memory_order_relaxed );
+				return;
+			}
+			endSegment();
+			beginSegment();
+		}
+
+		IndexEntry e;
+		e.offset = tell();
+		e.size = size;
+		myIndex.push_back( e );
+
+		std::vector<uint8_t> hdr;
+		putFCC( hdr, "00dc" );
+		put32( hdr, size );
+		append( hdr.data(), hdr.size() );
+		append( img.data(), len );
+		if ( padded != size )
+		{
+			uint8_t z = 0;
+			append( &z, 1 );
+		}
+
+		++myTotalFrames;
+		myLargestFrame = std::max( myLargestFrame, padded );
+	}
+
+	if ( ! myFailed )
+	{
+		myFrames.fetch_add( 1, std::memory_order_relaxed );
+		myBytes.fetch_add( len, std::memory_order_relaxed );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+Recorder::finish( void )
+{
+	if ( myContainer == Container::AVI && ! myFailed )
+	{
+		endSegment();
+
+		patch32( myAvihOff + 16, myFirstSegmentFrames );
+		patch32( myAvihOff + 28, myLargestFrame );
+		patch32( myStrhOff + 32, static_cast<uint32_t>( myTotalFrames ) );
+		patch32( myStrhOff + 36, myLargestFrame );
+		patch32( myDmlhOff, static_cast<uint32_t>( myTotalFrames ) );
+
+		std::vector<uint8_t> sup;
+		for ( const SuperEntry &s: mySuperIndex )
+		{
+			put64( sup, s.offset );
+			put32( sup, s.size );
+			put32( sup, s.frames );
+		}
+		patch32( myIndxOff + 4, static_cast<uint32_t>( mySuperIndex.size() ) );
+		if ( ! sup.empty() )
+			patch( myIndxOff + 24, sup.data(), sup.size() );
+	}
+
+	flushStage();
+
+	if ( myFD >= 0 )
+	{
+		if ( ::close( myFD ) != 0 )
+			error() << "Recorder: Error closing file: " << strerror( errno ) << send;
+		myFD = -1;
+	}
+	free( myStage );
+	myStage = nullptr;
+	myStagePos = 0;
+}
+
+
+////////////////////////////////////////
+
+
+void
+Recorder::beginSegment( void )
+{
+	myRiffStart = tell();
+
+	std::vector<uint8_t> riff;
+	putFCC( riff, "RIFF" );
+	put32( riff, 0 );
+	putFCC( riff, myFirstSegment ? "AVI " : "AVIX" );
+	append( riff.data(), riff.size() );
+
+	if ( myFirstSegment )
+		writeHeaders();
+
+	myMoviStart = tell();
+	std::vector<uint8_t> movi;
+	putFCC( movi, "LIST" );
+	put32( movi, 0 );
+	putFCC( movi, "movi" );
+	append( movi.data(), movi.size() );
+
+	myIndex.clear();
+}
+
+
+////////////////////////////////////////
+
+
+void
+Recorder::endSegment( void )
+{
+	uint32_t n = static_cast<uint32_t>( myIndex.size() );
+
+	// standard index for the chunks in this segment, offsets are to
+	// the chunk data from the start of the movi list
+	SuperEntry s;
+	s.offset = tell();
+	s.size = 8 + 24 + 8 * n;
+	s.frames = n;
+
+	std::vector<uint8_t> ix;
+	putFCC( ix, "ix00" );
+	put32( ix, s.size - 8 );
+	put16( ix, 2 );
+	ix.push_back( 0 );
+	ix.push_back( 1 );
+	put32( ix, n );
+	putFCC( ix, "00dc" );
+	put64( ix, myMoviStart );
+	put32( ix, 0 );
+	for ( const IndexEntry &e: myIndex )
+	{
+		put32( ix, static_cast<uint32_t>( e.offset + 8 - myMoviStart ) );
+		put32( ix, e.size );
+	}
+	append( ix.data(), ix.size() );
+	mySuperIndex.push_back( s );
+
+	patch32( myMoviStart + 4, static_cast<uint32_t>( tell() - myMoviStart - 8 ) );
+
+	if ( myFirstSegment )
+	{
+		// the old style index, offsets from the movi fourcc
+		std::vector<uint8_t> idx;
+		putFCC( idx, "idx1" );
+		put32( idx, 16 * n );
+		for ( const IndexEntry &e: myIndex )
+		{
+			putFCC( idx, "00dc" );
+			put32( idx, AVIIF_KEYFRAME );
+			put32( idx, static_cast<uint32_t>( e.offset - ( myMoviStart + 8 ) ) );
+			put32( idx, e.size );
+		}
+		append( idx.data(), idx.size() );
+		myFirstSegmentFrames = n;
+	}
+
+	patch32( myRiffStart + 4, static_cast<uint32_t>( tell() - myRiffStart - 8 ) );
+	myFirstSegment = false;
+}
+
+
+////////////////////////////////////////
+
+
+void
+Recorder::writeHeaders( void )
+{
+	const uint32_t indxSize = 24 + 16 * kSuperIndexEntries;
+	const uint32_t strlSize = 4 + ( 8 + 56 ) + ( 8 + 40 ) + ( 8 + indxSize );
+	const uint32_t odmlSize = 4 + 8 + 248;
+	const uint32_t hdrlSize = 4 + ( 8 + 56 ) + ( 8 + strlSize ) + ( 8 + odmlSize );
+
+	uint64_t base = tell();
+	std::vector<uint8_t> h;
+	putFCC( h, "LIST" );
+	put32( h, hdrlSize );
+	putFCC( h, "hdrl" );
+
+	putFCC( h, "avih" );
+	put32( h, 56 );
+	myAvihOff = base + h.size();
+	put32( h, myFrameInterval / 10 );
+	put32( h, 0 );
+	put32( h, 0 );
+	put32( h, AVIF_HASINDEX );
+	put32( h, 0 ); // total frames, first segment
+	put32( h, 0 );
+	put32( h, 1 );
+	put32( h, 0 ); // suggested buffer size
+	put32( h, uint32_t( myWidth ) );
+	put32( h, uint32_t( myHeight ) );
+	putZero( h, 16 );
+
+	putFCC( h, "LIST" );
+	put32( h, strlSize );
+	putFCC( h, "strl" );
+
+	putFCC( h, "strh" );
+	put32( h, 56 );
+	myStrhOff = base + h.size();
+	putFCC( h, "vids" );
+	putFCC( h, "MJPG" );
+	put32( h, 0 );
+	put16( h, 0 );
+	put16( h, 0 );
+	put32( h, 0 );
+	put32( h, myFrameInterval );
+	put32( h, 10000000 );
+	put32( h, 0 );
+	put32( h, 0 ); // length
+	put32( h, 0 ); // suggested buffer size
+	put32( h, 0xFFFFFFFF );
+	put32( h, 0 );
+	put16( h, 0 );
+	put16( h, 0 );
+	put16( h, uint16_t( myWidth ) );
+	put16( h, uint16_t( myHeight ) );
+
+	putFCC( h, "strf" );
+	put32( h, 40 );
+	put32( h, 40 );
+	put32( h, uint32_t( myWidth ) );
+	put32( h, uint32_t( myHeight ) );
+	put16( h, 1 );
+	put16( h, 24 );
+	putFCC( h, "MJPG" );
+	put32( h, uint32_t( myWidth * myHeight * 3 ) );
+	putZero( h, 16 );
+
+	// super index, filled in as segments finish
+	putFCC( h, "indx" );
+	put32( h, indxSize );
+	myIndxOff = base + h.size();
+	put16( h, 4 );
+	h.push_back( 0 );
+	h.push_back( 0 );
+	put32( h, 0 );
+	putFCC( h, "00dc" );
+	putZero( h, 12 );
+	putZero( h, 16 * kSuperIndexEntries );
+
+	putFCC( h, "LIST" );
+	put32( h, odmlSize );
+	putFCC( h, "odml" );
+	putFCC( h, "dmlh" );
+	put32( h, 248 );
+	myDmlhOff = base + h.size();
+	putZero( h, 248 );
+
+	append( h.data(), h.size() );
+}
+
+
+////////////////////////////////////////
+
+
+void
+Recorder::append( const void *data, size_t n )
+{
+	const uint8_t *p = static_cast<const uint8_t *>( data );
+	while ( n > 0 )
+	{
+		size_t c = std::min( n, kStageBytes - myStagePos );
+		memcpy( myStage + myStagePos, p, c );
+		myStagePos += c;
+		p += c;
+		n -= c;
+		if ( myStagePos == kStageBytes )
+			flushStage();
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+Recorder::patch( uint64_t off, const void *data, size_t n )
+{
+	const uint8_t *p = static_cast<const uint8_t *>( data );
+	// the part already on disk
+	if ( off < myFlushed )
+	{
+		size_t c = static_cast<size_t>( std::min( uint64_t( n ), myFlushed - off ) );
+		if ( myFD >= 0 && pwrite( myFD, p, c, static_cast<off_t>( off ) ) != static_cast<ssize_t>( c ) )
+		{
+			error() << "Recorder: Error updating file: " << strerror( errno ) << send;
+			myFailed = true;
+		}
+		off += c;
+		p += c;
+		n -= c;
+	}
+	if ( n > 0 )
+		memcpy( myStage + ( off - myFlushed ), p, n );
+}
+
+
+////////////////////////////////////////
+
+
+void
+Recorder::patch32( uint64_t off, uint32_t v )
+{
+	std::vector<uint8_t> b;
+	put32( b, v );
+	patch( off, b.data(), b.size() );
+}
+
+
+////////////////////////////////////////
+
+
+void
+Recorder::flushStage( void )
+{
+	size_t done = 0;
+	while ( done < myStagePos && myFD >= 0 && ! myFailed )
+	{
+		ssize_t w = ::write( myFD, myStage + done, myStagePos - done );
+		if ( w < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+			error() << "Recorder: Error writing file: " << strerror( errno ) << send;
+			myFailed = true;
+			break;
+		}
+		done += static_cast<size_t>( w );
+	}
+	myFlushed += myStagePos;
+	myStagePos = 0;
+}
+
+
+////////////////////////////////////////
+
+
+} // namespace USB
@@ -0,0 +1,173 @@
+// Recorder.h -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "Stream.h"
+
+
+////////////////////////////////////////
+
+
+///
+/// @file Recorder.h
+///
+/// @author Kimball Thurston
+///
+
+namespace USB
+{
+
+///
+/// @brief Class Recorder writes compressed frames to disk as they
+/// arrived, without decoding them.
+///
+/// MJPEG goes in an AVI (OpenDML, so there is no 4GB limit), H.264
+/// access units are written one after another as an annex B
+/// elementary stream, starting from the first one with an SPS.
+/// write only queues a reference to the frame, a writer thread
+/// gathers frames into a large page aligned buffer that goes to the
+/// file a whole buffer at a time. Frames with errors are skipped.
+///
+class Recorder
+{
+public:
+	enum class Container
+	{
+		AVI, ///< for MJPEG
+		ANNEXB ///< for H264
+	};
+
+	struct Stats
+	{
+		uint64_t frames = 0; ///< written to the file
+		uint64_t bytes = 0; ///< of frame data written
+		uint64_t dropped = 0; ///< queue was full or the file failed
+		uint64_t skipped = 0; ///< had errors, or came before the first SPS
+	};
+
+	Recorder( void );
+	~Recorder( void );
+
+	// the container a compressed format is written to, throws for
+	// formats that aren't compressed
+	static Container containerFor( ImageBuffer::Format f );
+
+	// frameInterval is in 100ns units, as in the UVC descriptors,
+	// and only matters to AVI. Throws if the file can't be created
+	void open( const std::string &path, ImageBuffer::Format fmt, int w, int h, uint32_t frameInterval );
+	// writes out everything queued and finishes the file
+	void close( void );
+	bool isOpen( void ) const;
+
+	// frames waiting for the writer before write refuses more
+	void setMaxQueued( size_t n ) { myMaxQueued = n; }
+
+	// holds a reference to the frame until it is written, returns
+	// false if it was dropped
+	bool write( const FrameRef &frame );
+
+	Stats stats( void ) const;
+
+private:
+	Recorder( const Recorder & ) = delete;
+	Recorder &operator=( const Recorder & ) = delete;
+
+	struct IndexEntry
+	{
+		uint64_t offset; ///< of the chunk header
+		uint32_t size;
+	};
+
+	struct SuperEntry
+	{
+		uint64_t offset;
+		uint32_t size;
+		uint32_t frames;
+	};
+
+	void writerLoop( void );
+	void writeFrame( const ImageBuffer &img );
+	void finish( void );
+
+	void beginSegment( void );
+	void endSegment( void );
+	void writeHeaders( void );
+
+	inline uint64_t tell( void ) const { return myFlushed + myStagePos; }
+	void append( const void *data, size_t n );
+	void patch( uint64_t off, const void *data, size_t n );
+	void patch32( uint64_t off, uint32_t v );
+	void flushStage( void );
+
+	Container myContainer = Container::AVI;
+	ImageBuffer::Format myFormat = ImageBuffer::Format::UNKNOWN;
+	int myWidth = 0;
+	int myHeight = 0;
+	uint32_t myFrameInterval = 0;
+
+	std::thread myWriter;
+	mutable std::mutex myMutex;
+	std::condition_variable myWake;
+	std::deque<FrameRef> myQueue;
+	size_t myMaxQueued = 64;
+	bool myOpen = false;
+	bool myClosing = false;
+
+	// only touched by the writer thread while open
+	int myFD = -1;
+	bool myFailed = false;
+	bool mySeenSPS = false;
+	uint8_t *myStage = nullptr;
+	size_t myStagePos = 0;
+	uint64_t myFlushed = 0;
+
+	uint64_t myRiffStart = 0;
+	uint64_t myMoviStart = 0;
+	bool myFirstSegment = true;
+	std::vector<IndexEntry> myIndex;
+	std::vector<SuperEntry> mySuperIndex;
+	uint64_t myTotalFrames = 0;
+	uint32_t myFirstSegmentFrames = 0;
+	uint32_t myLargestFrame = 0;
+	uint64_t myAvihOff = 0;
+	uint64_t myStrhOff = 0;
+	uint64_t myIndxOff = 0;
+	uint64_t myDmlhOff = 0;
+
+	std::atomic<uint64_t> myFrames{0};
+	std::atomic<uint64_t> myBytes{0};
+	std::atomic<uint64_t> myDropped{0};
+	std::atomic<uint64_t> mySkipped{0};
+};
+
+} // namespace USB
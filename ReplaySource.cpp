@@ -0,0 +1,641 @@
+// ReplaySource.cpp -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#include "ReplaySource.h"
+#include "SERWriter.h"
+#include "Logger.h"
+#include <chrono>
+#include <stdexcept>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+static const size_t kSERHeaderBytes = 178;
+// .NET ticks (100ns) at the unix epoch
+static const int64_t kTicksAtEpoch = 621355968000000000LL;
+
+inline int64_t
+nowNS( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return int64_t( ts.tv_sec ) * 1000000000LL + int64_t( ts.tv_nsec );
+}
+
+inline uint32_t
+get32( const uint8_t *p )
+{
+	uint32_t v = 0;
+	for ( int i = 3; i >= 0; --i )
+		v = ( v << 8 ) | p[i];
+	return v;
+}
+
+inline uint64_t
+get64( const uint8_t *p )
+{
+	uint64_t v = 0;
+	for ( int i = 7; i >= 0; --i )
+		v = ( v << 8 ) | p[i];
+	return v;
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+namespace USB
+{
+
+
+////////////////////////////////////////
+
+
+ReplaySource::ReplaySource( void )
+{
+	// frames are views of the mapping, never copies
+	myStream.setViewOnly( true );
+}
+
+
+////////////////////////////////////////
+
+
+ReplaySource::~ReplaySource( void )
+{
+	close();
+}
+
+
+////////////////////////////////////////
+
+
+void
+ReplaySource::open( const std::string &path )
+{
+	int fd = ::open( path.c_str(), O_RDONLY );
+	if ( fd < 0 )
+		throw std::runtime_error( "Unable to open " + path + ": " + strerror( errno ) );
+	char magic[14];
+	ssize_t n = pread( fd, magic, sizeof(magic), 0 );
+	::close( fd );
+
+	if ( n == static_cast<ssize_t>( sizeof(magic) ) && memcmp( magic, "LUCAM-RECORDER", sizeof(magic) ) == 0 )
+		openSER( path );
+	else
+		openJournal( path );
+}
+
+
+////////////////////////////////////////
+
+
+void
+ReplaySource::openSER( const std::string &path )
+{
+	close();
+	map( path, kSERHeaderBytes );
+
+	const uint8_t *hdr = myMap;
+	if ( memcmp( hdr, "LUCAM-RECORDER", 14 ) != 0 )
+	{
+		close();
+		throw std::runtime_error( path + " is not a SER file" );
+	}
+
+	// the LittleEndian field is unreliable (the spec and every
+	// writer disagree), 16 bit data is taken as little endian
+	int color = int( get32( hdr + 18 ) );
+	int w = int( get32( hdr + 26 ) );
+	int h = int( get32( hdr + 30 ) );
+	int depth = int( get32( hdr + 34 ) );
+	size_t count = get32( hdr + 38 );
+
+	static const ImageBuffer::Format kFormats[] =
+	{
+		ImageBuffer::Format::MONO_8,
+		ImageBuffer::Format::BAYER_RGGB,
+		ImageBuffer::Format::BAYER_GRBG,
+		ImageBuffer::Format::BAYER_GBRG,
+		ImageBuffer::Format::BAYER_BGGR,
+		ImageBuffer::Format::RGB_24,
+		ImageBuffer::Format::BGR_24
+	};
+	bool found = false;
+	ImageBuffer::Format fmt = ImageBuffer::Format::MONO_8;
+	for ( ImageBuffer::Format f: kFormats )
+	{
+		if ( SERWriter::colorID( f ) == color )
+		{
+			fmt = f;
+			found = true;
+			break;
+		}
+	}
+	int bpp = depth > 8 ? 2 : 1;
+	if ( fmt == ImageBuffer::Format::MONO_8 && depth > 8 )
+		fmt = ImageBuffer::Format::MONO_16;
+	if ( fmt == ImageBuffer::Format::RGB_24 || fmt == ImageBuffer::Format::BGR_24 )
+	{
+		found = found && depth <= 8;
+		bpp = 3;
+	}
+	if ( ! found || w <= 0 || h <= 0 || depth <= 0 || depth > 16 )
+	{
+		close();
+		throw std::runtime_error( path + ": unsupported SER color / depth " + std::to_string( color ) + " / " + std::to_string( depth ) );
+	}
+
+	size_t bpl = size_t( w ) * size_t( bpp );
+	size_t frameBytes = bpl * size_t( h );
+	size_t avail = ( myMapBytes - kSERHeaderBytes ) / frameBytes;
+	if ( avail < count )
+	{
+		warning() << "ReplaySource: " << path << " is truncated, " << avail << " of " << count << " frames" << send;
+		count = avail;
+	}
+
+	// the timestamp trailer is optional
+	const uint8_t *times = myMap + kSERHeaderBytes + count * frameBytes;
+	myHaveTimes = count > 0 && myMapBytes >= kSERHeaderBytes + count * ( frameBytes + 8 );
+
+	myFrames.resize( count );
+	for ( size_t i = 0; i != count; ++i )
+	{
+		Frame &f = myFrames[i];
+		f.data = myMap + kSERHeaderBytes + i * frameBytes;
+		f.bytes = frameBytes;
+		f.format = fmt;
+		f.width = w;
+		f.height = h;
+		f.bytesPerLine = int( bpl );
+		f.bytesPerPixel = bpp;
+		f.stride = int( bpl );
+		f.roi.x = 0;
+		f.roi.y = 0;
+		f.roi.w = w;
+		f.roi.h = h;
+		f.sequence = i;
+		if ( myHaveTimes )
+			f.timeNS = ( int64_t( get64( times + i * 8 ) ) - kTicksAtEpoch ) * 100;
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+ReplaySource::openJournal( const std::string &path )
+{
+	close();
+	myJournal.open( path, true );
+
+	std::vector<FrameJournal::Record> recs = myJournal.records();
+	myHaveTimes = ! recs.empty();
+	myFrames.reserve( recs.size() );
+	for ( const FrameJournal::Record &r: recs )
+	{
+		Frame f;
+		f.data = myJournal.frameData( r );
+		if ( ! f.data )
+			continue;
+
+		f.format = r.format;
+		f.bytesPerPixel = r.bytesPerPixel;
+		if ( ImageBuffer::isCompressed( r.format ) )
+		{
+			f.width = r.width;
+			f.height = r.height;
+			f.bytesPerLine = r.bytesPerLine;
+		}
+		else
+		{
+			// only the ROI was kept, so that is the whole frame now
+			f.width = r.roi.w;
+			f.height = r.roi.h;
+			f.bytesPerLine = int( ImageBuffer::rowBytes( r.format, r.bytesPerPixel, r.roi.w ) );
+			if ( size_t( f.bytesPerLine ) * size_t( f.height ) > myJournal.slotBytes() )
+				continue;
+		}
+		if ( f.width <= 0 || f.height <= 0 || f.bytesPerLine <= 0 )
+			continue;
+		f.bytes = static_cast<size_t>( r.bytes );
+		f.stride = f.bytesPerLine;
+		f.roi.x = 0;
+		f.roi.y = 0;
+		f.roi.w = f.width;
+		f.roi.h = f.height;
+		f.timeNS = r.captureNS ? r.captureNS : r.firstPayloadNS;
+		f.sequence = r.sequence;
+		f.pts = r.pts;
+		f.flags = r.flags;
+		if ( f.timeNS == 0 )
+			myHaveTimes = false;
+		myFrames.push_back( f );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+ReplaySource::openRaw( const std::string &path, ImageBuffer::Format fmt, int w, int h, int bpp, size_t headerBytes )
+{
+	close();
+
+	size_t bpl = ImageBuffer::rowBytes( fmt, bpp, w );
+	if ( w <= 0 || h <= 0 || bpl == 0 || ImageBuffer::isCompressed( fmt ) )
+		throw std::runtime_error( "Invalid raw frame geometry for " + path );
+
+	map( path, headerBytes );
+
+	size_t frameBytes = bpl * size_t( h );
+	size_t count = ( myMapBytes - headerBytes ) / frameBytes;
+	myHaveTimes = false;
+	myFrames.resize( count );
+	for ( size_t i = 0; i != count; ++i )
+	{
+		Frame &f = myFrames[i];
+		f.data = myMap + headerBytes + i * frameBytes;
+		f.bytes = frameBytes;
+		f.format = fmt;
+		f.width = w;
+		f.height = h;
+		f.bytesPerLine = int( bpl );
+		f.bytesPerPixel = bpp;
+		f.stride = int( bpl );
+		f.roi.x = 0;
+		f.roi.y = 0;
+		f.roi.w = w;
+		f.roi.h = h;
+		f.sequence = i;
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+ReplaySource::close( void )
+{
+	stop();
+
+	// anything still queued points into the mapping
+	myStream.clear();
+	myHaveGeometry = false;
+	myFrames.clear();
+	myHaveTimes = false;
+	myJournal.close();
+	if ( myMap )
+	{
+		munmap( myMap, myMapBytes );
+		myMap = nullptr;
+		myMapBytes = 0;
+	}
+
+	std::unique_lock<std::mutex> lk( myMutex );
+	myNext = 0;
+	myReschedule = true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+ReplaySource::setPacing( Pacing p, double fps )
+{
+	if ( p == Pacing::UNTHROTTLED )
+		myStream.setDropPolicy( VideoStream::DropPolicy::BLOCK, 100 );
+	else
+		myStream.setDropPolicy( VideoStream::DropPolicy::DROP_NEWEST );
+
+	std::unique_lock<std::mutex> lk( myMutex );
+	myPacing = p;
+	if ( fps > 0.0 )
+		myInterval = int64_t( 1e9 / fps + 0.5 );
+	myReschedule = true;
+	myWake.notify_all();
+}
+
+
+////////////////////////////////////////
+
+
+void
+ReplaySource::seek( size_t frame )
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	myNext = frame;
+	myReschedule = true;
+	myWake.notify_all();
+}
+
+
+////////////////////////////////////////
+
+
+void
+ReplaySource::setImageCallback( const ImageReceivedCallback &cb )
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	myImageCB = cb;
+}
+
+
+////////////////////////////////////////
+
+
+void
+ReplaySource::start( void )
+{
+	if ( ! isOpen() )
+		throw std::runtime_error( "ReplaySource: nothing to play" );
+
+	std::unique_lock<std::mutex> lk( myMutex );
+	if ( myRunning.load( std::memory_order_relaxed ) )
+		return;
+	if ( myThread.joinable() )
+		myThread.join();
+
+	myStop = false;
+	myReschedule = true;
+	myDelivered.store( 0, std::memory_order_relaxed );
+	myDropped.store( 0, std::memory_order_relaxed );
+	myLate.store( 0, std::memory_order_relaxed );
+	myLoops.store( 0, std::memory_order_relaxed );
+	myStartNS.store( 0, std::memory_order_relaxed );
+	myLastNS.store( 0, std::memory_order_relaxed );
+	myRunning.store( true, std::memory_order_relaxed );
+	myThread = std::thread( &ReplaySource::run, this );
+}
+
+
+////////////////////////////////////////
+
+
+void
+ReplaySource::stop( void )
+{
+	{
+		std::unique_lock<std::mutex> lk( myMutex );
+		myStop = true;
+	}
+	myWake.notify_all();
+	if ( myThread.joinable() )
+		myThread.join();
+}
+
+
+////////////////////////////////////////
+
+
+void
+ReplaySource::wait( void )
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	while ( myRunning.load( std::memory_order_relaxed ) )
+		myWake.wait( lk );
+}
+
+
+////////////////////////////////////////
+
+
+ReplaySource::Stats
+ReplaySource::stats( void ) const
+{
+	Stats ret;
+	ret.delivered = myDelivered.load( std::memory_order_relaxed );
+	ret.dropped = myDropped.load( std::memory_order_relaxed );
+	ret.late = myLate.load( std::memory_order_relaxed );
+	ret.loops = myLoops.load( std::memory_order_relaxed );
+	int64_t span = myLastNS.load( std::memory_order_relaxed ) - myStartNS.load( std::memory_order_relaxed );
+	if ( ret.delivered > 1 && span > 0 )
+		ret.fps = double( ret.delivered - 1 ) * 1e9 / double( span );
+	return ret;
+}
+
+
+////////////////////////////////////////
+
+
+void
+ReplaySource::map( const std::string &path, size_t minBytes )
+{
+	int fd = ::open( path.c_str(), O_RDONLY );
+	if ( fd < 0 )
+		throw std::runtime_error( "Unable to open " + path + ": " + strerror( errno ) );
+
+	struct stat st;
+	if ( fstat( fd, &st ) != 0 || st.st_size <= 0 || size_t( st.st_size ) < minBytes )
+	{
+		::close( fd );
+		throw std::runtime_error( path + " is too short to play" );
+	}
+
+	size_t len = static_cast<size_t>( st.st_size );
+	void *m = mmap( nullptr, len, PROT_READ, MAP_SHARED, fd, 0 );
+	std::string msg = strerror( errno );
+	::close( fd );
+	if ( m == MAP_FAILED )
+		throw std::runtime_error( "Unable to map " + path + ": " + msg );
+
+	// frames are played in order, let the kernel read ahead
+	madvise( m, len, MADV_SEQUENTIAL );
+	myMap = static_cast<uint8_t *>( m );
+	myMapBytes = len;
+}
+
+
+////////////////////////////////////////
+
+
+void
+ReplaySource::run( void )
+{
+	// when the first frame since (re)starting the schedule is due,
+	// and its offset in the recorded (or fixed rate) time line
+	int64_t originNS = 0;
+	int64_t baseNS = 0;
+	int64_t prevOffset = 0;
+	size_t count = 0;
+
+	std::unique_lock<std::mutex> lk( myMutex );
+	while ( ! myStop )
+	{
+		if ( myNext >= myFrames.size() )
+		{
+			if ( ! myLoop.load( std::memory_order_relaxed ) || myFrames.empty() )
+				break;
+			myNext = 0;
+			myReschedule = true;
+			myLoops.fetch_add( 1, std::memory_order_relaxed );
+		}
+
+		const Frame &f = myFrames[myNext];
+		Pacing pacing = myPacing;
+		bool recorded = pacing == Pacing::RECORDED && myHaveTimes;
+		int64_t now = nowNS();
+		int64_t due = now;
+		if ( pacing != Pacing::UNTHROTTLED )
+		{
+			if ( myReschedule )
+			{
+				myReschedule = false;
+				originNS = now;
+				baseNS = recorded ? f.timeNS : 0;
+				prevOffset = 0;
+				count = 0;
+			}
+			int64_t offset = recorded ? f.timeNS - baseNS : int64_t( count ) * myInterval;
+			if ( offset < prevOffset )
+			{
+				// the recorded times went backwards, carry on from here
+				originNS = now;
+				baseNS = f.timeNS;
+				offset = 0;
+			}
+			int64_t gap = recorded ? offset - prevOffset : myInterval;
+			due = originNS + offset;
+
+			if ( due > now )
+			{
+				myWake.wait_for( lk, std::chrono::nanoseconds( due - now ) );
+				// woken early to stop, seek or change the pacing,
+				// otherwise check the time again
+				continue;
+			}
+			if ( count > 0 && now - due > gap )
+			{
+				// behind, drop the backlog of schedule rather than
+				// sending a burst of frames to catch up
+				myLate.fetch_add( 1, std::memory_order_relaxed );
+				originNS += now - due;
+				due = now;
+			}
+			prevOffset = offset;
+			++count;
+		}
+		else
+			myReschedule = false;
+
+		++myNext;
+		ImageReceivedCallback cb = myImageCB;
+		lk.unlock();
+		deliver( f, pacing, due, cb );
+		lk.lock();
+	}
+
+	myRunning.store( false, std::memory_order_relaxed );
+	myWake.notify_all();
+}
+
+
+////////////////////////////////////////
+
+
+bool
+ReplaySource::deliver( const Frame &f, Pacing pacing, int64_t dueNS, const ImageReceivedCallback &cb )
+{
+	if ( ! myHaveGeometry ||
+		 f.format != myGeometry.format ||
+		 f.width != myGeometry.width || f.height != myGeometry.height ||
+		 f.bytesPerLine != myGeometry.bytesPerLine ||
+		 f.bytesPerPixel != myGeometry.bytesPerPixel )
+	{
+		myStream.setROI( f.roi );
+		myStream.reset( f.width, f.height, f.bytesPerLine, f.bytesPerPixel, f.format );
+		myGeometry = f;
+		myHaveGeometry = true;
+	}
+
+	FrameRef img = myStream.acquireView( f.data, f.stride );
+	if ( ! img && pacing == Pacing::UNTHROTTLED )
+	{
+		// the stream blocks for a while each try, keep waiting for
+		// the consumer unless asked to stop
+		while ( ! img && ! myStream.off() )
+		{
+			{
+				std::unique_lock<std::mutex> lk( myMutex );
+				if ( myStop )
+					break;
+			}
+			img = myStream.acquireView( f.data, f.stride );
+		}
+	}
+	if ( ! img )
+	{
+		myDropped.fetch_add( 1, std::memory_order_relaxed );
+		return false;
+	}
+
+	img->complete( f.bytes );
+	int64_t now = nowNS();
+	FrameInfo &info = img->info();
+	info.sequence = f.sequence;
+	info.pts = f.pts;
+	info.flags = f.flags;
+	// the frames appear to have been captured when they are due, so
+	// the intervals are the recorded ones whatever the jitter here
+	info.captureNS = dueNS;
+	info.firstPayloadNS = now;
+	info.lastPayloadNS = now;
+
+	if ( myDelivered.fetch_add( 1, std::memory_order_relaxed ) == 0 )
+		myStartNS.store( now, std::memory_order_relaxed );
+	myLastNS.store( now, std::memory_order_relaxed );
+
+	if ( cb )
+	{
+		myStream.done( img );
+		cb( img );
+	}
+	else
+		myStream.publish( img );
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+} // namespace USB
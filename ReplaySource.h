@@ -0,0 +1,182 @@
+// ReplaySource.h -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include "Stream.h"
+#include "FrameJournal.h"
+
+
+////////////////////////////////////////
+
+
+///
+/// @file ReplaySource.h
+///
+/// @author Kimball Thurston
+///
+
+namespace USB
+{
+
+///
+/// @brief Class ReplaySource plays back recorded frames as if they
+/// were coming from a camera.
+///
+/// SER files, frame journals and headerless raw dumps are mapped
+/// rather than read, and each frame is handed out as a view of the
+/// mapping, so nothing is copied. Frames go to the image callback
+/// (the same signature as UVCDevice::ImageReceivedCallback) if one is
+/// set, otherwise they are published to videoStream() for next(),
+/// and are paced at the recorded rate, a fixed rate or as fast as
+/// the consumer takes them.
+///
+/// Frames are only valid while the source is open, so release them
+/// before calling close (or opening another file).
+///
+class ReplaySource
+{
+public:
+	enum class Pacing
+	{
+		RECORDED, ///< the recorded frame times, or the fixed rate if there are none
+		FIXED, ///< the rate given to setPacing
+		UNTHROTTLED ///< as fast as the frames are released
+	};
+
+	typedef std::function<void (const FrameRef &imgBuf)> ImageReceivedCallback;
+
+	struct Stats
+	{
+		uint64_t delivered = 0;
+		uint64_t dropped = 0; ///< no buffer free when the frame was due
+		uint64_t late = 0; ///< more than a frame behind the schedule
+		uint64_t loops = 0;
+		double fps = 0.0; ///< achieved rate
+	};
+
+	ReplaySource( void );
+	~ReplaySource( void );
+
+	// picks SER or frame journal from the file contents, throws if
+	// it is neither
+	void open( const std::string &path );
+	void openSER( const std::string &path );
+	void openJournal( const std::string &path );
+	// a file of back to back frames of the same geometry, after
+	// headerBytes of whatever. Rows are rowBytes( fmt, bpp, w ) apart
+	void openRaw( const std::string &path, ImageBuffer::Format fmt, int w, int h, int bpp, size_t headerBytes = 0 );
+	void close( void );
+	bool isOpen( void ) const { return myMap != nullptr || myJournal.isOpen(); }
+
+	size_t frameCount( void ) const { return myFrames.size(); }
+
+	// fps is the fixed rate, and the recorded rate for files without
+	// frame times. UNTHROTTLED switches the stream to the BLOCK drop
+	// policy so frames wait for the consumer, the others to
+	// DROP_NEWEST like a camera
+	void setPacing( Pacing p, double fps = 30.0 );
+	void setLoop( bool on ) { myLoop.store( on, std::memory_order_relaxed ); }
+	// next frame to play
+	void seek( size_t frame );
+
+	void setImageCallback( const ImageReceivedCallback &cb = ImageReceivedCallback() );
+	VideoStream &videoStream( void ) { return myStream; }
+
+	void start( void );
+	// stops after the frame being delivered, if any
+	void stop( void );
+	bool running( void ) const { return myRunning.load( std::memory_order_relaxed ); }
+	// waits for playback to reach the end (never when looping)
+	void wait( void );
+
+	Stats stats( void ) const;
+
+private:
+	ReplaySource( const ReplaySource & ) = delete;
+	ReplaySource &operator=( const ReplaySource & ) = delete;
+
+	struct Frame
+	{
+		const uint8_t *data = nullptr;
+		size_t bytes = 0;
+		ImageBuffer::Format format = ImageBuffer::Format::MONO_8;
+		int width = 0;
+		int height = 0;
+		int bytesPerLine = 0;
+		int bytesPerPixel = 0;
+		int stride = 0;
+		ROI roi;
+		int64_t timeNS = 0; ///< recorded time, 0 if unknown
+		uint64_t sequence = 0;
+		uint32_t pts = 0;
+		uint32_t flags = 0;
+	};
+
+	void map( const std::string &path, size_t minBytes );
+	void run( void );
+	bool deliver( const Frame &f, Pacing pacing, int64_t dueNS, const ImageReceivedCallback &cb );
+
+	uint8_t *myMap = nullptr;
+	size_t myMapBytes = 0;
+	FrameJournal myJournal;
+	std::vector<Frame> myFrames;
+	bool myHaveTimes = false;
+
+	VideoStream myStream;
+
+	std::mutex myMutex;
+	std::condition_variable myWake;
+	std::thread myThread;
+	bool myStop = false;
+	// the schedule starts over from the next frame
+	bool myReschedule = true;
+	size_t myNext = 0;
+	Pacing myPacing = Pacing::RECORDED;
+	int64_t myInterval = 33333333;
+	ImageReceivedCallback myImageCB;
+	std::atomic<bool> myLoop{false};
+	std::atomic<bool> myRunning{false};
+
+	// playback thread only, the frame the stream geometry came from
+	Frame myGeometry;
+	bool myHaveGeometry = false;
+
+	std::atomic<uint64_t> myDelivered{0};
+	std::atomic<uint64_t> myDropped{0};
+	std::atomic<uint64_t> myLate{0};
+	std::atomic<uint64_t> myLoops{0};
+	std::atomic<int64_t> myStartNS{0};
+	std::atomic<int64_t> myLastNS{0};
+};
+
+} // namespace USB
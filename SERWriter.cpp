@@ -0,0 +1,650 @@
+// SERWriter.cpp -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#include "SERWriter.h"
+#include "PackedRaw.h"
+#include "Logger.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+static const size_t kBlockBytes = 8 * 1024 * 1024;
+// O_DIRECT wants the buffer, length and offset aligned to the
+// device's logical block size, a page covers any of those
+static const size_t kAlign = 4096;
+static const size_t kHeaderBytes = 178;
+
+enum SERColor
+{
+	SER_MONO = 0,
+	SER_BAYER_RGGB = 8,
+	SER_BAYER_GRBG = 9,
+	SER_BAYER_GBRG = 10,
+	SER_BAYER_BGGR = 11,
+	SER_RGB = 100,
+	SER_BGR = 101
+};
+
+// .NET ticks (100ns) at the unix epoch
+static const int64_t kTicksAtEpoch = 621355968000000000LL;
+
+inline int64_t
+clockNS( clockid_t c )
+{
+	struct timespec ts;
+	clock_gettime( c, &ts );
+	return int64_t( ts.tv_sec ) * 1000000000LL + int64_t( ts.tv_nsec );
+}
+
+inline void
+put32( uint8_t *p, uint32_t v )
+{
+	for ( int i = 0; i < 4; ++i )
+		p[i] = uint8_t( v >> ( 8 * i ) );
+}
+
+inline void
+put64( uint8_t *p, uint64_t v )
+{
+	for ( int i = 0; i < 8; ++i )
+		p[i] = uint8_t( v >> ( 8 * i ) );
+}
+
+inline void
+putString( uint8_t *p, const std::string &s )
+{
+	memset( p, 0, 40 );
+	memcpy( p, s.data(), std::min( s.size(), size_t( 40 ) ) );
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+namespace USB
+{
+
+
+////////////////////////////////////////
+
+
+SERWriter::SERWriter( void )
+{
+}
+
+
+////////////////////////////////////////
+
+
+SERWriter::~SERWriter( void )
+{
+	detach();
+	close();
+	for ( Block &b: myBlocks )
+		free( b.data );
+}
+
+
+////////////////////////////////////////
+
+
+int
+SERWriter::colorID( ImageBuffer::Format f )
+{
+	switch ( ImageBuffer::unpackedFormat( f ) )
+	{
+		case ImageBuffer::Format::MONO_8:
+		case ImageBuffer::Format::MONO_16:
+			return SER_MONO;
+		case ImageBuffer::Format::BAYER_RGGB: return SER_BAYER_RGGB;
+		case ImageBuffer::Format::BAYER_GRBG: return SER_BAYER_GRBG;
+		case ImageBuffer::Format::BAYER_GBRG: return SER_BAYER_GBRG;
+		case ImageBuffer::Format::BAYER_BGGR: return SER_BAYER_BGGR;
+		case ImageBuffer::Format::RGB_24: return SER_RGB;
+		case ImageBuffer::Format::BGR_24:
+		case ImageBuffer::Format::BGRA_32:
+			return SER_BGR;
+		default:
+			break;
+	}
+	return -1;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SERWriter::open( const std::string &path, const Metadata &meta )
+{
+	detach();
+	close();
+
+	myPath = path;
+	myMeta = meta;
+
+	myDirect = false;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+	myFD = ::open( path.c_str(), flags | O_DIRECT, 0644 );
+	if ( myFD >= 0 )
+		myDirect = true;
+#endif
+	if ( myFD < 0 )
+		myFD = ::open( path.c_str(), flags, 0644 );
+	if ( myFD < 0 )
+		throw std::runtime_error( "Unable to create " + path + ": " + strerror( errno ) );
+#if ! defined(O_DIRECT) && defined(F_NOCACHE)
+	fcntl( myFD, F_NOCACHE, 1 );
+#endif
+
+	for ( Block &b: myBlocks )
+	{
+		void *p = nullptr;
+		if ( ! b.data && posix_memalign( &p, kAlign, kBlockBytes ) == 0 )
+			b.data = static_cast<uint8_t *>( p );
+		if ( ! b.data )
+		{
+			::close( myFD );
+			myFD = -1;
+			throw std::runtime_error( "Unable to allocate recording buffers" );
+		}
+		b.used = 0;
+		b.offset = 0;
+		b.full = false;
+	}
+
+	// the header goes in last, once the frame count is known
+	memset( myBlocks[0].data, 0, kHeaderBytes );
+	myBlocks[0].used = kHeaderBytes;
+	myFillBlock = 0;
+	myNextIO = 0;
+	myFileSize = kHeaderBytes;
+
+	myFailed = false;
+	myStarted = false;
+	myFrameCount = 0;
+	myTimes.clear();
+	myClockOffset = clockNS( CLOCK_REALTIME ) - clockNS( CLOCK_MONOTONIC );
+
+	myFrames = 0;
+	myBytes = 0;
+	myDropped = 0;
+	mySkipped = 0;
+	myFirstWriteNS = 0;
+	myLastWriteNS = 0;
+	myRecentRate = 0;
+
+	myIOStop = false;
+	myIO = std::thread( &SERWriter::ioLoop, this );
+	{
+		std::unique_lock<std::mutex> lk( myMutex );
+		myClosing = false;
+		myOpen = true;
+	}
+	myWriter = std::thread( &SERWriter::writerLoop, this );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SERWriter::close( void )
+{
+	if ( ! myWriter.joinable() )
+		return;
+
+	{
+		std::unique_lock<std::mutex> lk( myMutex );
+		myClosing = true;
+		myOpen = false;
+	}
+	myWake.notify_all();
+	myWriter.join();
+
+	finish();
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SERWriter::write( const FrameRef &frame )
+{
+	if ( ! frame )
+		return false;
+
+	{
+		std::unique_lock<std::mutex> lk( myMutex );
+		if ( myOpen && ! myClosing && myQueue.size() < myMaxQueued )
+		{
+			myQueue.push_back( frame );
+			lk.unlock();
+			myWake.notify_one();
+			return true;
+		}
+	}
+
+	myDropped.fetch_add( 1, std::memory_order_relaxed );
+	return false;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SERWriter::attach( VideoStream &s )
+{
+	detach();
+	myPumpStop = false;
+	myPump = std::thread( &SERWriter::pumpLoop, this, &s );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SERWriter::detach( void )
+{
+	if ( ! myPump.joinable() )
+		return;
+	myPumpStop = true;
+	myPump.join();
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SERWriter::isOpen( void ) const
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	return myOpen;
+}
+
+
+////////////////////////////////////////
+
+
+SERWriter::Stats
+SERWriter::stats( void ) const
+{
+	Stats s;
+	s.frames = myFrames.load( std::memory_order_relaxed );
+	s.bytes = myBytes.load( std::memory_order_relaxed );
+	s.dropped = myDropped.load( std::memory_order_relaxed );
+	s.skipped = mySkipped.load( std::memory_order_relaxed );
+	{
+		std::unique_lock<std::mutex> lk( myMutex );
+		s.queuedFrames = myQueue.size();
+	}
+	{
+		std::unique_lock<std::mutex> lk( myIOMutex );
+		s.pendingBlocks = size_t( myBlocks[0].full ) + size_t( myBlocks[1].full );
+	}
+
+	int64_t first = myFirstWriteNS.load( std::memory_order_relaxed );
+	int64_t last = myLastWriteNS.load( std::memory_order_relaxed );
+	if ( last > first )
+		s.sustainedMBps = double( s.bytes ) / ( double( last - first ) * 1e-9 ) / ( 1024.0 * 1024.0 );
+	s.recentMBps = double( myRecentRate.load( std::memory_order_relaxed ) ) / ( 1024.0 * 1024.0 );
+	return s;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SERWriter::pumpLoop( VideoStream *s )
+{
+	while ( ! myPumpStop.load( std::memory_order_relaxed ) )
+	{
+		FrameRef f = s->next( 100 );
+		if ( f )
+			write( f );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+SERWriter::writerLoop( void )
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	while ( true )
+	{
+		myWake.wait( lk, [this]{ return myClosing || ! myQueue.empty(); } );
+		if ( myQueue.empty() )
+			break;
+
+		FrameRef f = std::move( myQueue.front() );
+		myQueue.pop_front();
+		lk.unlock();
+
+		if ( myFailed )
+			myDropped.fetch_add( 1, std::memory_order_relaxed );
+		else
+			writeFrame( *f );
+		f.reset();
+
+		lk.lock();
+	}
+}
+
+
+////////////////////////////////////////
+
+
+bool
+SERWriter::startFile( const ImageBuffer &img )
+{
+	myColorID = colorID( img.format() );
+	if ( myColorID < 0 )
+	{
+		error() << "SERWriter: Unable to record format " << int(img.format()) << send;
+		return false;
+	}
+
+	myFormat = img.format();
+	myWidth = img.roi().w;
+	myHeight = img.roi().h;
+
+	int pbits = ImageBuffer::packedBits( myFormat );
+	if ( pbits > 0 )
+		myBytesPerPixel = 2;
+	else if ( myFormat == ImageBuffer::Format::BGRA_32 )
+		myBytesPerPixel = 3;
+	else
+		myBytesPerPixel = img.bytesPerPixel();
+
+	if ( myColorID >= SER_RGB )
+		myDepth = 8;
+	else if ( pbits > 0 )
+		myDepth = pbits;
+	else if ( myBytesPerPixel == 2 && mySampleBits > 8 && mySampleBits <= 16 )
+		myDepth = mySampleBits;
+	else
+		myDepth = myBytesPerPixel * 8;
+
+	myRow.resize( size_t( myWidth ) * 4 );
+	myStarted = true;
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SERWriter::writeFrame( const ImageBuffer &img )
+{
+	if ( ! myStarted && ! startFile( img ) )
+	{
+		mySkipped.fetch_add( 1, std::memory_order_relaxed );
+		return;
+	}
+
+	const ROI &roi = img.roi();
+	if ( img.format() != myFormat || roi.w != myWidth || roi.h != myHeight ||
+		 img.partial() || ! img.data() )
+	{
+		mySkipped.fetch_add( 1, std::memory_order_relaxed );
+		return;
+	}
+
+	int pbits = ImageBuffer::packedBits( myFormat );
+	size_t outRow = size_t( myWidth ) * size_t( myBytesPerPixel );
+	const uint8_t *src = img.data() + size_t( roi.y ) * size_t( img.stride() ) +
+		ImageBuffer::rowBytes( myFormat, img.bytesPerPixel(), roi.x );
+	for ( int y = 0; y < myHeight; ++y, src += img.stride() )
+	{
+		if ( pbits == 10 )
+		{
+			PackedRaw::unpack10( src, myWidth, reinterpret_cast<uint16_t *>( myRow.data() ) );
+			append( myRow.data(), outRow );
+		}
+		else if ( pbits == 12 )
+		{
+			PackedRaw::unpack12( src, myWidth, reinterpret_cast<uint16_t *>( myRow.data() ) );
+			append( myRow.data(), outRow );
+		}
+		else if ( myFormat == ImageBuffer::Format::BGRA_32 )
+		{
+			uint8_t *d = myRow.data();
+			for ( int x = 0; x < myWidth; ++x, d += 3 )
+				memcpy( d, src + x * 4, 3 );
+			append( myRow.data(), outRow );
+		}
+		else
+			append( src, outRow );
+	}
+
+	const FrameInfo &info = img.info();
+	int64_t ns = info.captureNS;
+	if ( ns == 0 )
+		ns = info.lastPayloadNS;
+	if ( ns == 0 )
+		ns = clockNS( CLOCK_MONOTONIC );
+	myTimes.push_back( ( ns + myClockOffset ) / 100 + kTicksAtEpoch );
+
+	++myFrameCount;
+	myFrames.fetch_add( 1, std::memory_order_relaxed );
+}
+
+
+////////////////////////////////////////
+
+
+void
+SERWriter::append( const void *data, size_t n )
+{
+	const uint8_t *p = static_cast<const uint8_t *>( data );
+	while ( n > 0 )
+	{
+		Block &b = myBlocks[myFillBlock];
+		size_t c = std::min( n, kBlockBytes - b.used );
+		memcpy( b.data + b.used, p, c );
+		b.used += c;
+		p += c;
+		n -= c;
+		myFileSize += c;
+		if ( b.used == kBlockBytes )
+			submitBlock();
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+SERWriter::submitBlock( void )
+{
+	std::unique_lock<std::mutex> lk( myIOMutex );
+	myBlocks[myFillBlock].full = true;
+	myIOWake.notify_one();
+
+	// the other one has to have made it to disk before it is reused
+	myFillBlock ^= 1;
+	myIODone.wait( lk, [this]{ return ! myBlocks[myFillBlock].full; } );
+	Block &b = myBlocks[myFillBlock];
+	b.used = 0;
+	b.offset = myFileSize;
+}
+
+
+////////////////////////////////////////
+
+
+void
+SERWriter::ioLoop( void )
+{
+	std::unique_lock<std::mutex> lk( myIOMutex );
+	while ( true )
+	{
+		myIOWake.wait( lk, [this]{ return myIOStop || myBlocks[myNextIO].full; } );
+		if ( ! myBlocks[myNextIO].full )
+			break;
+
+		Block &b = myBlocks[myNextIO];
+		lk.unlock();
+
+		// only the last block is short, and it is cut back to size
+		// once the file is closed
+		size_t len = b.used;
+		if ( myDirect )
+			len = ( ( len + kAlign - 1 ) / kAlign ) * kAlign;
+		size_t done = 0;
+		while ( done < len && ! myFailed )
+		{
+			ssize_t w = pwrite( myFD, b.data + done, len - done, static_cast<off_t>( b.offset + done ) );
+			if ( w < 0 )
+			{
+				if ( errno == EINTR )
+					continue;
+#ifdef O_DIRECT
+				// not every filesystem takes direct I/O
+				if ( errno == EINVAL && myDirect )
+				{
+					warning() << "SERWriter: Direct I/O not supported, using buffered writes" << send;
+					fcntl( myFD, F_SETFL, fcntl( myFD, F_GETFL ) & ~O_DIRECT );
+					myDirect = false;
+					continue;
+				}
+#endif
+				error() << "SERWriter: Error writing " << myPath << ": " << strerror( errno ) << send;
+				myFailed = true;
+				break;
+			}
+			done += static_cast<size_t>( w );
+		}
+
+		int64_t now = clockNS( CLOCK_MONOTONIC );
+		int64_t last = myLastWriteNS.exchange( now, std::memory_order_relaxed );
+		if ( myFirstWriteNS.load( std::memory_order_relaxed ) == 0 )
+			myFirstWriteNS.store( now, std::memory_order_relaxed );
+		else if ( now > last )
+		{
+			int64_t sample = int64_t( double( b.used ) / ( double( now - last ) * 1e-9 ) );
+			int64_t avg = myRecentRate.load( std::memory_order_relaxed );
+			avg = avg == 0 ? sample : avg + ( sample - avg ) / 8;
+			myRecentRate.store( avg, std::memory_order_relaxed );
+		}
+		myBytes.fetch_add( std::min( b.used, done ), std::memory_order_relaxed );
+
+		lk.lock();
+		b.full = false;
+		myNextIO ^= 1;
+		myIODone.notify_all();
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+SERWriter::finish( void )
+{
+	// the timestamp trailer, then out with whatever is left
+	for ( int64_t t: myTimes )
+	{
+		uint8_t b[8];
+		put64( b, uint64_t( t ) );
+		append( b, 8 );
+	}
+	if ( myBlocks[myFillBlock].used > 0 )
+		submitBlock();
+
+	{
+		std::unique_lock<std::mutex> lk( myIOMutex );
+		myIOStop = true;
+	}
+	myIOWake.notify_all();
+	myIO.join();
+
+	::close( myFD );
+	myFD = -1;
+
+	uint8_t hdr[kHeaderBytes];
+	memset( hdr, 0, sizeof(hdr) );
+	memcpy( hdr, "LUCAM-RECORDER", 14 );
+	put32( hdr + 14, 0 );
+	put32( hdr + 18, uint32_t( myColorID ) );
+	// the spec says 1 for little endian, but everything writes and
+	// expects 0 for that
+	put32( hdr + 22, 0 );
+	put32( hdr + 26, uint32_t( myWidth ) );
+	put32( hdr + 30, uint32_t( myHeight ) );
+	put32( hdr + 34, uint32_t( myDepth ) );
+	put32( hdr + 38, myFrameCount );
+	putString( hdr + 42, myMeta.observer );
+	putString( hdr + 82, myMeta.instrument );
+	putString( hdr + 122, myMeta.telescope );
+
+	int64_t utc = myTimes.empty() ? clockNS( CLOCK_REALTIME ) / 100 + kTicksAtEpoch : myTimes.front();
+	time_t secs = time_t( ( utc - kTicksAtEpoch ) / 10000000 );
+	struct tm lt;
+	localtime_r( &secs, &lt );
+	put64( hdr + 162, uint64_t( utc + int64_t( lt.tm_gmtoff ) * 10000000 ) );
+	put64( hdr + 170, uint64_t( utc ) );
+
+	int fd = ::open( myPath.c_str(), O_WRONLY );
+	if ( fd < 0 ||
+		 ftruncate( fd, static_cast<off_t>( myFileSize ) ) != 0 ||
+		 pwrite( fd, hdr, sizeof(hdr), 0 ) != static_cast<ssize_t>( sizeof(hdr) ) )
+	{
+		error() << "SERWriter: Error finishing " << myPath << ": " << strerror( errno ) << send;
+	}
+	if ( fd >= 0 )
+		::close( fd );
+}
+
+
+////////////////////////////////////////
+
+
+} // namespace USB
@@ -0,0 +1,190 @@
+// SERWriter.h -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "Stream.h"
+
+
+////////////////////////////////////////
+
+
+///
+/// @file SERWriter.h
+///
+/// @author Kimball Thurston
+///
+
+namespace USB
+{
+
+///
+/// @brief Class SERWriter records raw frames to a SER file, the
+/// usual format for planetary (lucky) imaging.
+///
+/// Frames are queued by reference and laid out by a writer thread
+/// into one of two large page aligned blocks, while an I/O thread
+/// writes the other with O_DIRECT, so recording neither blocks the
+/// thread producing frames nor fills the page cache. Packed formats
+/// are unpacked to 16 bits on the way. The per frame UTC timestamp
+/// trailer is appended and the header updated on close.
+///
+/// The first frame fixes the geometry and format, frames that don't
+/// match it are skipped.
+///
+class SERWriter
+{
+public:
+	struct Metadata
+	{
+		std::string observer;
+		std::string instrument;
+		std::string telescope;
+	};
+
+	struct Stats
+	{
+		uint64_t frames = 0; ///< laid out for writing
+		uint64_t bytes = 0; ///< on disk so far
+		uint64_t dropped = 0; ///< queue was full or the file failed
+		uint64_t skipped = 0; ///< didn't match the first frame
+		size_t queuedFrames = 0; ///< waiting for the writer thread
+		size_t pendingBlocks = 0; ///< full, waiting for the disk
+		double sustainedMBps = 0.0; ///< since the first write
+		double recentMBps = 0.0; ///< moving average over recent blocks
+	};
+
+	SERWriter( void );
+	~SERWriter( void );
+
+	// SER color id for a format, -1 if it can't be stored
+	static int colorID( ImageBuffer::Format f );
+
+	// significant bits of 16 bit data for the header, 0 for the
+	// format's own. Applies from the next open
+	void setSampleBits( int bits ) { mySampleBits = bits; }
+	// frames waiting for the writer before write refuses more
+	void setMaxQueued( size_t n ) { myMaxQueued = n; }
+
+	// throws if the file can't be created
+	void open( const std::string &path, const Metadata &meta = Metadata() );
+	// writes out everything queued, the timestamps and the header
+	void close( void );
+	bool isOpen( void ) const;
+
+	// holds a reference to the frame until it is written, returns
+	// false if it was dropped
+	bool write( const FrameRef &frame );
+
+	// records everything arriving on a stream, on a thread of its
+	// own, as that stream's consumer
+	void attach( VideoStream &s );
+	void detach( void );
+
+	Stats stats( void ) const;
+
+private:
+	SERWriter( const SERWriter & ) = delete;
+	SERWriter &operator=( const SERWriter & ) = delete;
+
+	struct Block
+	{
+		uint8_t *data = nullptr;
+		size_t used = 0;
+		uint64_t offset = 0;
+		bool full = false;
+	};
+
+	void writerLoop( void );
+	void ioLoop( void );
+	void pumpLoop( VideoStream *s );
+
+	bool startFile( const ImageBuffer &img );
+	void writeFrame( const ImageBuffer &img );
+	void append( const void *data, size_t n );
+	void submitBlock( void );
+	void finish( void );
+
+	std::string myPath;
+	Metadata myMeta;
+	int mySampleBits = 0;
+	size_t myMaxQueued = 64;
+
+	std::thread myWriter;
+	mutable std::mutex myMutex;
+	std::condition_variable myWake;
+	std::deque<FrameRef> myQueue;
+	bool myOpen = false;
+	bool myClosing = false;
+
+	std::thread myPump;
+	std::atomic<bool> myPumpStop{false};
+
+	// the I/O thread takes full blocks in order
+	std::thread myIO;
+	mutable std::mutex myIOMutex;
+	std::condition_variable myIOWake;
+	std::condition_variable myIODone;
+	Block myBlocks[2];
+	size_t myFillBlock = 0;
+	size_t myNextIO = 0;
+	bool myIOStop = false;
+
+	// writer thread state
+	int myFD = -1;
+	bool myDirect = false;
+	std::atomic<bool> myFailed{false};
+	bool myStarted = false;
+	ImageBuffer::Format myFormat = ImageBuffer::Format::UNKNOWN;
+	int myWidth = 0;
+	int myHeight = 0;
+	int myBytesPerPixel = 0;
+	int myDepth = 0;
+	int myColorID = 0;
+	uint64_t myFileSize = 0;
+	uint32_t myFrameCount = 0;
+	std::vector<int64_t> myTimes;
+	std::vector<uint8_t> myRow;
+	// CLOCK_REALTIME - CLOCK_MONOTONIC, in ns
+	int64_t myClockOffset = 0;
+
+	std::atomic<uint64_t> myFrames{0};
+	std::atomic<uint64_t> myBytes{0};
+	std::atomic<uint64_t> myDropped{0};
+	std::atomic<uint64_t> mySkipped{0};
+	std::atomic<int64_t> myFirstWriteNS{0};
+	std::atomic<int64_t> myLastWriteNS{0};
+	// bytes per second, moving average
+	std::atomic<int64_t> myRecentRate{0};
+};
+
+} // namespace USB
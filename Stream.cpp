@@ -24,6 +24,166 @@
 
 #include "Stream.h"
 #include <algorithm>
+#include <stdexcept>
+#include <chrono>
+#include <condition_variable>
+#include <climits>
+#include <string.h>
+#include <stdlib.h>
+#ifdef __linux__
+# include <linux/futex.h>
+# include <sys/syscall.h>
+# include <sys/mman.h>
+# include <unistd.h>
+# include <time.h>
+#endif
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+// past this the frame won't fit in cache anyway, so filling it with
+// regular stores just evicts whatever the consumer is working on
+static const size_t kStreamCopyThreshold = 1024 * 1024;
+
+inline void
+streamCopy( uint8_t *dest, const uint8_t *src, size_t n )
+{
+#if defined(__SSE2__)
+	if ( n >= 256 )
+	{
+		size_t head = ( 16 - ( reinterpret_cast<uintptr_t>( dest ) & 15 ) ) & 15;
+		memcpy( dest, src, head );
+		dest += head;
+		src += head;
+		n -= head;
+
+		size_t nv = n / 64;
+		for ( size_t i = 0; i < nv; ++i )
+		{
+			__m128i a = _mm_loadu_si128( reinterpret_cast<const __m128i *>( src ) );
+			__m128i b = _mm_loadu_si128( reinterpret_cast<const __m128i *>( src + 16 ) );
+			__m128i c = _mm_loadu_si128( reinterpret_cast<const __m128i *>( src + 32 ) );
+			__m128i d = _mm_loadu_si128( reinterpret_cast<const __m128i *>( src + 48 ) );
+			_mm_stream_si128( reinterpret_cast<__m128i *>( dest ), a );
+			_mm_stream_si128( reinterpret_cast<__m128i *>( dest + 16 ), b );
+			_mm_stream_si128( reinterpret_cast<__m128i *>( dest + 32 ), c );
+			_mm_stream_si128( reinterpret_cast<__m128i *>( dest + 48 ), d );
+			src += 64;
+			dest += 64;
+		}
+		n -= nv * 64;
+		// streaming stores are weakly ordered, make sure they are
+		// visible before the buffer is handed off
+		_mm_sfence();
+	}
+#endif
+	memcpy( dest, src, n );
+}
+
+static const size_t kRowAlign = 64;
+static const size_t kPageSize = 4096;
+static const size_t kHugePageSize = 2 * 1024 * 1024;
+
+inline size_t
+roundUp( size_t n, size_t a )
+{
+	return ( ( n + a - 1 ) / a ) * a;
+}
+
+inline int
+effectiveStride( int bpl, int stride )
+{
+	if ( stride > 0 )
+		return std::max( stride, bpl );
+	return static_cast<int>( roundUp( static_cast<size_t>( std::max( bpl, 0 ) ), kRowAlign ) );
+}
+
+// returns page aligned, prefaulted memory of at least n bytes,
+// mapped is set to the mapping length (0 if it is from the heap)
+uint8_t *
+allocFrame( size_t n, bool huge, bool lock, size_t &capacity, size_t &mapped, bool &locked )
+{
+	uint8_t *p = nullptr;
+	capacity = 0;
+	mapped = 0;
+	locked = false;
+
+#ifdef __linux__
+	if ( huge )
+	{
+		// explicit huge pages need hugetlbfs pages reserved by the
+		// admin, so this fails quietly on most systems
+		size_t hn = roundUp( n, kHugePageSize );
+		void *m = mmap( nullptr, hn, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0 );
+		if ( m != MAP_FAILED )
+		{
+			p = static_cast<uint8_t *>( m );
+			mapped = hn;
+		}
+	}
+
+	if ( ! p )
+	{
+		size_t pn = roundUp( n, huge ? kHugePageSize : kPageSize );
+		void *m = mmap( nullptr, pn, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+		if ( m != MAP_FAILED )
+		{
+			p = static_cast<uint8_t *>( m );
+			mapped = pn;
+			// has to happen before the pages are touched
+			if ( huge )
+				madvise( p, pn, MADV_HUGEPAGE );
+			for ( size_t i = 0; i < pn; i += kPageSize )
+				p[i] = 0;
+		}
+	}
+
+	if ( p )
+	{
+		capacity = mapped;
+		if ( lock && mlock( p, mapped ) == 0 )
+			locked = true;
+		return p;
+	}
+#endif
+
+	void *m = nullptr;
+	size_t an = roundUp( n, kRowAlign );
+	if ( posix_memalign( &m, kPageSize, an ) != 0 || ! m )
+		throw std::bad_alloc();
+	p = static_cast<uint8_t *>( m );
+	memset( p, 0, an );
+	capacity = an;
+	return p;
+}
+
+void
+freeFrame( uint8_t *p, size_t mapped, bool locked )
+{
+	if ( ! p )
+		return;
+#ifdef __linux__
+	if ( mapped )
+	{
+		if ( locked )
+			munlock( p, mapped );
+		munmap( p, mapped );
+		return;
+	}
+#endif
+	free( p );
+}
+
+} // empty namespace
 
 
 ////////////////////////////////////////
@@ -50,6 +210,99 @@ ImageBuffer::ImageBuffer( void )
 
 ImageBuffer::~ImageBuffer( void )
 {
+	freeMemory();
+}
+
+
+////////////////////////////////////////
+
+
+void
+ImageBuffer::freeMemory( void )
+{
+	if ( ! myView )
+		freeFrame( myData, myMapped, myLocked );
+	myView = false;
+	myData = nullptr;
+	mySize = 0;
+	myCapacity = 0;
+	myMapped = 0;
+	myLocked = false;
+}
+
+
+////////////////////////////////////////
+
+
+int
+ImageBuffer::packedBits( Format f )
+{
+	switch ( f )
+	{
+		case Format::MONO_10P:
+		case Format::BAYER_GRBG_10P:
+		case Format::BAYER_GBRG_10P:
+		case Format::BAYER_RGGB_10P:
+		case Format::BAYER_BGGR_10P:
+			return 10;
+		case Format::MONO_12P:
+		case Format::BAYER_GRBG_12P:
+		case Format::BAYER_GBRG_12P:
+		case Format::BAYER_RGGB_12P:
+		case Format::BAYER_BGGR_12P:
+			return 12;
+		default:
+			break;
+	}
+	return 0;
+}
+
+
+////////////////////////////////////////
+
+
+ImageBuffer::Format
+ImageBuffer::unpackedFormat( Format f )
+{
+	switch ( f )
+	{
+		case Format::MONO_10P:
+		case Format::MONO_12P:
+			return Format::MONO_16;
+		case Format::BAYER_GRBG_10P:
+		case Format::BAYER_GRBG_12P:
+			return Format::BAYER_GRBG;
+		case Format::BAYER_GBRG_10P:
+		case Format::BAYER_GBRG_12P:
+			return Format::BAYER_GBRG;
+		case Format::BAYER_RGGB_10P:
+		case Format::BAYER_RGGB_12P:
+			return Format::BAYER_RGGB;
+		case Format::BAYER_BGGR_10P:
+		case Format::BAYER_BGGR_12P:
+			return Format::BAYER_BGGR;
+		default:
+			break;
+	}
+	return f;
+}
+
+
+////////////////////////////////////////
+
+
+size_t
+ImageBuffer::rowBytes( Format f, int bpp, int n )
+{
+	// packed rows are padded out to a whole group of pixels
+	size_t count = static_cast<size_t>( std::max( n, 0 ) );
+	switch ( packedBits( f ) )
+	{
+		case 10: return ( ( count + 3 ) / 4 ) * 5;
+		case 12: return ( ( count + 1 ) / 2 ) * 3;
+		default: break;
+	}
+	return count * static_cast<size_t>( bpp );
 }
 
 
@@ -59,24 +312,27 @@ ImageBuffer::~ImageBuffer( void )
 bool
 ImageBuffer::addData( const uint8_t *buf, int &len )
 {
+	if ( myContiguous )
+		return addContiguous( buf, len );
+
 	while ( len > 0 )
 	{
-		int leftInLine = ( myROI.w - myCurX ) * myBytesPerPixel;
+		int leftInLine = myROIBytes - myCurX;
 		int nToCopy = std::min( len, leftInLine );
 
 		if ( nToCopy <= 0 )
 			return true;
 
-		uint8_t *dest = myBuffer.data();
-		dest += ( myROI.y + myCurY ) * myBytesPerLine;
-		dest += ( myROI.x + myCurX ) * myBytesPerPixel;
+		uint8_t *dest = myData;
+		dest += ( myROI.y + myCurY ) * myStride;
+		dest += myROIOffset + myCurX;
 		std::copy( buf, buf + nToCopy, dest );
 
 		buf += nToCopy;
 		len -= nToCopy;
 
-		myCurX += nToCopy / myBytesPerPixel;
-		if ( myCurX == myROI.w )
+		myCurX += nToCopy;
+		if ( myCurX == myROIBytes )
 		{
 			myCurX = 0;
 			++myCurY;
@@ -92,24 +348,423 @@ ImageBuffer::addData( const uint8_t *buf, int &len )
 ////////////////////////////////////////
 
 
+bool
+ImageBuffer::addContiguous( const uint8_t *buf, int &len )
+{
+	size_t left = myFillEnd - myFillPos;
+	if ( left == 0 )
+		return true;
+
+	size_t nToCopy = std::min( left, static_cast<size_t>( std::max( len, 0 ) ) );
+	uint8_t *dest = myData + myFillPos;
+	if ( myStreamCopy )
+		streamCopy( dest, buf, nToCopy );
+	else
+		memcpy( dest, buf, nToCopy );
+
+	myFillPos += nToCopy;
+	len -= static_cast<int>( nToCopy );
+
+	// keep the line / pixel position up to date for empty / partial
+	size_t lineOff = myFillPos - myFillStart;
+	myCurY = static_cast<int>( lineOff / myStride );
+	myCurX = static_cast<int>( lineOff % myStride );
+
+	return myFillPos == myFillEnd;
+}
+
+
+////////////////////////////////////////
+
+
+size_t
+ImageBuffer::filled( void ) const
+{
+	if ( myContiguous )
+		return myFillPos - myFillStart;
+	return static_cast<size_t>( myCurY ) * static_cast<size_t>( myROIBytes ) + static_cast<size_t>( myCurX );
+}
+
+
+////////////////////////////////////////
+
+
+void
+ImageBuffer::complete( size_t n )
+{
+	if ( isCompressed( myFormat ) )
+		myFillPos = myFillStart + std::min( n, myFillEnd - myFillStart );
+	else
+		myFillPos = myFillEnd;
+
+	if ( myContiguous && myStride > 0 )
+	{
+		size_t lineOff = myFillPos - myFillStart;
+		myCurY = static_cast<int>( lineOff / myStride );
+		myCurX = static_cast<int>( lineOff % myStride );
+	}
+	else
+	{
+		myCurY = myROI.h;
+		myCurX = 0;
+	}
+}
+
+
+////////////////////////////////////////
+
+
 void
-ImageBuffer::reset( Format fmt, int w, int h, int bpl, int bpp, const ROI &roi )
+ImageBuffer::reset( Format fmt, int w, int h, int bpl, int bpp, const ROI &roi, int stride, const uint8_t *view )
 {
 	if ( ( roi.x + roi.w ) > w || ( roi.y + roi.h ) > h )
 		throw std::runtime_error( "Invalid ROI" );
+	// packed rows can only be split between groups of pixels
+	int pbits = packedBits( fmt );
+	if ( pbits > 0 && ( ( roi.x * pbits ) % 8 ) != 0 )
+		throw std::runtime_error( "Invalid ROI" );
 
 	myFormat = fmt;
 	myWidth = w;
 	myHeight = h;
 	myBytesPerLine = bpl;
 	myBytesPerPixel = bpp;
+	myStride = std::max( stride, bpl );
 
 	myROI = roi;
+	myInfo = FrameInfo();
 
 	myCurX = 0;
 	myCurY = 0;
+	myROIOffset = static_cast<int>( rowBytes( fmt, bpp, roi.x ) );
+	myROIBytes = static_cast<int>( rowBytes( fmt, bpp, roi.w ) );
+
+	// keep what we have unless it is too small, much too big, or was
+	// allocated with different options
+	mySize = static_cast<size_t>( myStride ) * static_cast<size_t>( std::max( myHeight, 0 ) );
+	if ( view )
+	{
+		size_t n = mySize;
+		freeMemory();
+		mySize = n;
+		myData = const_cast<uint8_t *>( view );
+		myView = true;
+	}
+	else if ( myView || mySize > myCapacity || myCapacity > mySize * 2 ||
+			  myAllocHuge != myHugePages || myAllocLock != myLockMemory )
+	{
+		size_t n = mySize;
+		freeMemory();
+		mySize = n;
+		if ( mySize > 0 )
+		{
+			myData = allocFrame( mySize, myHugePages, myLockMemory, myCapacity, myMapped, myLocked );
+			myAllocHuge = myHugePages;
+			myAllocLock = myLockMemory;
+		}
+	}
+
+	myContiguous = ( myROI.x == 0 && myROI.w == myWidth &&
+					 myStride == myROIBytes &&
+					 myStride > 0 );
+	myFillStart = static_cast<size_t>( myROI.y ) * myStride;
+	myFillEnd = myFillStart + static_cast<size_t>( myROI.h ) * myStride;
+	if ( isCompressed( fmt ) )
+	{
+		// no lines, just the one run of whatever arrives
+		myContiguous = true;
+		myFillStart = 0;
+		myFillEnd = mySize;
+	}
+	myFillPos = myFillStart;
+	myStreamCopy = mySize >= kStreamCopyThreshold;
+}
+
+
+////////////////////////////////////////
+
+
+///
+/// @brief Class WaitPoint lets one side sleep until the other bumps
+/// a sequence number.
+///
+/// The signalling side only makes a syscall (or takes a lock, off
+/// linux) when someone is actually waiting.
+///
+class WaitPoint
+{
+public:
+	uint32_t sequence( void ) const { return mySequence.load(); }
+
+	void signal( void )
+	{
+		mySequence.fetch_add( 1 );
+		if ( myWaiters.load() == 0 )
+			return;
+#ifdef __linux__
+		syscall( SYS_futex, reinterpret_cast<uint32_t *>( &mySequence ),
+				 FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0 );
+#else
+		std::unique_lock<std::mutex> lk( myWaitMutex );
+		myWaitNotify.notify_all();
+#endif
+	}
+
+	// returns once the sequence moves past seq or the timeout (in
+	// ms, < 0 for none) expires
+	void wait( uint32_t seq, int timeoutMS )
+	{
+		myWaiters.fetch_add( 1 );
+#ifdef __linux__
+		struct timespec ts;
+		struct timespec *tsp = nullptr;
+		if ( timeoutMS >= 0 )
+		{
+			ts.tv_sec = timeoutMS / 1000;
+			ts.tv_nsec = long( timeoutMS % 1000 ) * 1000000L;
+			tsp = &ts;
+		}
+		syscall( SYS_futex, reinterpret_cast<uint32_t *>( &mySequence ),
+				 FUTEX_WAIT_PRIVATE, seq, tsp, nullptr, 0 );
+#else
+		std::unique_lock<std::mutex> lk( myWaitMutex );
+		auto pred = [&]() { return mySequence.load() != seq; };
+		if ( timeoutMS < 0 )
+			myWaitNotify.wait( lk, pred );
+		else
+			myWaitNotify.wait_for( lk, std::chrono::milliseconds( timeoutMS ), pred );
+#endif
+		myWaiters.fetch_sub( 1 );
+	}
+
+private:
+	std::atomic<uint32_t> mySequence{0};
+	std::atomic<int> myWaiters{0};
+#ifndef __linux__
+	std::mutex myWaitMutex;
+	std::condition_variable myWaitNotify;
+#endif
+};
+
+
+////////////////////////////////////////
+
+
+///
+/// @brief Class FramePool holds the buffers and ready ring for a
+/// VideoStream.
+///
+/// It is reference counted by the stream and every buffer it has
+/// allocated, so frames still held by a consumer when the stream goes
+/// away clean up after themselves.
+///
+class FramePool
+{
+public:
+	FramePool( void )
+	{
+		for ( size_t i = 0; i != VideoStream::kMaxFrames; ++i )
+			myRing[i].store( nullptr, std::memory_order_relaxed );
+	}
+
+	// producer side
+	ImageBuffer *take( void )
+	{
+		if ( ! myProdFree )
+			myProdFree = myFree.exchange( nullptr, std::memory_order_acquire );
+		ImageBuffer *b = myProdFree;
+		if ( b )
+		{
+			myProdFree = b->myNextFree;
+			b->myNextFree = nullptr;
+		}
+		return b;
+	}
+
+	ImageBuffer *create( void )
+	{
+		ImageBuffer *b = new ImageBuffer;
+		b->myPool = this;
+		myRefs.fetch_add( 1, std::memory_order_relaxed );
+		myLive.fetch_add( 1, std::memory_order_relaxed );
+		return b;
+	}
+
+	size_t live( void ) const { return myLive.load( std::memory_order_relaxed ); }
+
+	// any thread, frees the buffers that have been returned but not
+	// yet picked up by the producer
+	void releaseIdle( void )
+	{
+		drain();
+	}
+
+	// producer side, frees idle buffers until at most n are left
+	void trim( size_t n = 0 )
+	{
+		while ( live() > n )
+		{
+			ImageBuffer *b = take();
+			if ( ! b )
+				break;
+			destroy( b );
+		}
+	}
+
+	// producer side, false when the ring is full
+	bool push( ImageBuffer *b )
+	{
+		size_t t = myTail.load( std::memory_order_relaxed );
+		if ( t - myHead.load( std::memory_order_acquire ) >= VideoStream::kMaxFrames )
+			return false;
+		myRing[t % VideoStream::kMaxFrames].store( b, std::memory_order_relaxed );
+		myTail.store( t + 1, std::memory_order_release );
+		myReady.signal();
+		return true;
+	}
+
+	// normally the consumer, but the producer also takes back the
+	// oldest frame for LATEST_WINS, hence the CAS on the head
+	ImageBuffer *pop( void )
+	{
+		size_t h = myHead.load( std::memory_order_acquire );
+		while ( h != myTail.load( std::memory_order_acquire ) )
+		{
+			ImageBuffer *b = myRing[h % VideoStream::kMaxFrames].load( std::memory_order_relaxed );
+			if ( myHead.compare_exchange_weak( h, h + 1, std::memory_order_acq_rel,
+											   std::memory_order_acquire ) )
+				return b;
+		}
+		return nullptr;
+	}
+
+	bool queued( void ) const
+	{
+		return myHead.load( std::memory_order_acquire ) != myTail.load( std::memory_order_acquire );
+	}
+
+	WaitPoint &ready( void ) { return myReady; }
+	WaitPoint &returned( void ) { return myReturned; }
+
+	int64_t latency( void ) const { return myLatency.load( std::memory_order_relaxed ); }
+	void clearLatency( void ) { myLatency.store( 0, std::memory_order_relaxed ); }
+
+	// any thread, the last reference to a buffer was dropped
+	void release( ImageBuffer *b )
+	{
+		// once b is on the free list a racing close can destroy it,
+		// and with it the buffer's reference on the pool, so hold
+		// one of our own until done
+		myRefs.fetch_add( 1, std::memory_order_relaxed );
+
+		if ( b->myDoneTime != 0 )
+		{
+			// not exact if two threads release at once, but this is
+			// only used to size the pool
+			int64_t sample = nowNS() - b->myDoneTime;
+			int64_t avg = myLatency.load( std::memory_order_relaxed );
+			avg = avg == 0 ? sample : avg + ( sample - avg ) / 8;
+			myLatency.store( avg, std::memory_order_relaxed );
+			b->myDoneTime = 0;
+		}
+
+		if ( myClosed.load() )
+		{
+			destroy( b );
+			unref();
+			return;
+		}
+
+		ImageBuffer *head = myFree.load( std::memory_order_relaxed );
+		do
+		{
+			b->myNextFree = head;
+		} while ( ! myFree.compare_exchange_weak( head, b, std::memory_order_release,
+												  std::memory_order_relaxed ) );
+
+		// raced with close, make sure it doesn't get stranded
+		if ( myClosed.load() )
+			drain();
+		else
+			myReturned.signal();
+		unref();
+	}
+
+	// the owning stream is going away, no producer or consumer is
+	// running at this point
+	void close( void )
+	{
+		myClosed.store( true );
+		while ( ImageBuffer *b = pop() )
+			b->unref();
+		trim();
+		drain();
+		unref();
+	}
+
+	static int64_t nowNS( void )
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch() ).count();
+	}
+
+private:
+	void drain( void )
+	{
+		ImageBuffer *b = myFree.exchange( nullptr, std::memory_order_acquire );
+		while ( b )
+		{
+			ImageBuffer *n = b->myNextFree;
+			destroy( b );
+			b = n;
+		}
+	}
+
+	void destroy( ImageBuffer *b )
+	{
+		delete b;
+		myLive.fetch_sub( 1, std::memory_order_relaxed );
+		unref();
+	}
+
+	void unref( void )
+	{
+		if ( myRefs.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+			delete this;
+	}
+
+	std::atomic<int> myRefs{1};
+	std::atomic<bool> myClosed{false};
+	std::atomic<size_t> myLive{0};
+	std::atomic<int64_t> myLatency{0};
+
+	// returned buffers, pushed from any thread, the producer takes
+	// the whole list at once so it never loops on a CAS
+	std::atomic<ImageBuffer *> myFree{nullptr};
+	ImageBuffer *myProdFree = nullptr;
+
+	std::atomic<ImageBuffer *> myRing[VideoStream::kMaxFrames];
+	std::atomic<size_t> myHead{0};
+	std::atomic<size_t> myTail{0};
+
+	WaitPoint myReady;
+	WaitPoint myReturned;
+};
+
+
+////////////////////////////////////////
 
-	myBuffer.resize( myBytesPerLine * myHeight );
+
+void
+ImageBuffer::unref( void )
+{
+	if ( myRefCount.fetch_sub( 1, std::memory_order_acq_rel ) != 1 )
+		return;
+
+	if ( myPool )
+		myPool->release( this );
+	else
+		delete this;
 }
 
 
@@ -117,7 +772,13 @@ ImageBuffer::reset( Format fmt, int w, int h, int bpl, int bpp, const ROI &roi )
 
 
 VideoStream::VideoStream( void )
+		: myPool( new FramePool )
 {
+	myROI.x = 0;
+	myROI.y = 0;
+	myROI.w = 0;
+	myROI.h = 0;
+	myProdROI = myROI;
 }
 
 
@@ -126,48 +787,291 @@ VideoStream::VideoStream( void )
 
 VideoStream::~VideoStream( void )
 {
+	{
+		std::unique_lock<std::mutex> lk( myGrowMutex );
+		myGrowStop = true;
+	}
+	myGrowWake.notify_all();
+	if ( myGrower.joinable() )
+		myGrower.join();
+
+	myPool->close();
 }
 
 
 ////////////////////////////////////////
 
 
-std::shared_ptr<ImageBuffer>
-VideoStream::get( void )
+void
+VideoStream::setStride( int stride )
 {
 	std::unique_lock<std::mutex> lk( myMutex );
+	myStride = std::max( stride, 0 );
+}
 
-	std::shared_ptr<ImageBuffer> ret;
 
-	if ( off_locked() )
-		return ret;
+////////////////////////////////////////
+
+
+void
+VideoStream::setHugePages( bool on )
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	myHugePages = on;
+}
 
-	while ( ! ret )
+
+////////////////////////////////////////
+
+
+void
+VideoStream::setLockMemory( bool on )
+{
+	std::unique_lock<std::mutex> lk( myMutex );
+	myLockMemory = on;
+}
+
+
+////////////////////////////////////////
+
+
+void
+VideoStream::setDropPolicy( DropPolicy p, int blockTimeoutMS )
+{
+	myBlockTimeout.store( std::max( blockTimeoutMS, 0 ), std::memory_order_relaxed );
+	myPolicy.store( p, std::memory_order_relaxed );
+}
+
+
+////////////////////////////////////////
+
+
+void
+VideoStream::setDepth( size_t minN, size_t maxN )
+{
+	maxN = std::min( std::max( maxN, size_t(1) ), size_t( kMaxFrames ) );
+	minN = std::min( std::max( minN, size_t(1) ), maxN );
+	myMinDepth.store( minN, std::memory_order_relaxed );
+	myMaxDepth.store( maxN, std::memory_order_relaxed );
+	// an active stream may now be short of buffers
+	if ( ! off() && ! myViewOnly.load( std::memory_order_relaxed ) )
 	{
-		if ( myMaxBuffers == 0 || myWidth <= 0 || myHeight <= 0 )
-			break;
+		startGrower();
+		requestGrowth();
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+VideoStream::setViewOnly( bool on )
+{
+	myViewOnly.store( on, std::memory_order_relaxed );
+}
+
+
+////////////////////////////////////////
+
+
+VideoStream::Stats
+VideoStream::stats( void ) const
+{
+	Stats s;
+	s.delivered = myDelivered.load( std::memory_order_relaxed );
+	s.dropped = myDropped.load( std::memory_order_relaxed );
+	s.overwritten = myOverwritten.load( std::memory_order_relaxed );
+	s.late = myLate.load( std::memory_order_relaxed );
+	s.depth = myPool->live();
+	s.consumerLatencyMS = double( myPool->latency() ) * 1e-6;
+	s.frameIntervalMS = double( myFrameInterval.load( std::memory_order_relaxed ) ) * 1e-6;
+	return s;
+}
+
+
+////////////////////////////////////////
+
+
+void
+VideoStream::resetStats( void )
+{
+	myDelivered.store( 0, std::memory_order_relaxed );
+	myDropped.store( 0, std::memory_order_relaxed );
+	myOverwritten.store( 0, std::memory_order_relaxed );
+	myLate.store( 0, std::memory_order_relaxed );
+}
+
+
+////////////////////////////////////////
+
+
+size_t
+VideoStream::targetDepth( void ) const
+{
+	size_t mn = myMinDepth.load( std::memory_order_relaxed );
+	size_t mx = myMaxDepth.load( std::memory_order_relaxed );
+	if ( mn >= mx )
+		return mx;
+
+	// one being filled, enough to cover what the consumer holds
+	// on to at the current frame rate, and one queued
+	int64_t iv = myFrameInterval.load( std::memory_order_relaxed );
+	int64_t lat = myPool->latency();
+	size_t held = 1;
+	if ( iv > 0 && lat > 0 )
+		held = size_t( ( lat + iv - 1 ) / iv );
+
+	return std::min( std::max( held + 2, mn ), mx );
+}
+
+
+////////////////////////////////////////
 
-		if ( ! myBuffers.empty() )
+
+FrameRef
+VideoStream::acquire( void )
+{
+	return take( nullptr, 0 );
+}
+
+
+////////////////////////////////////////
+
+
+FrameRef
+VideoStream::acquireView( const uint8_t *data, int stride )
+{
+	return take( data, stride );
+}
+
+
+////////////////////////////////////////
+
+
+FrameRef
+VideoStream::take( const uint8_t *view, int viewStride )
+{
+	uint32_t gen = myGeneration.load( std::memory_order_acquire );
+	if ( gen != myProdGeneration )
+	{
 		{
-			ret = myBuffers.back();
-			myBuffers.pop_back();
-			break;
+			std::unique_lock<std::mutex> lk( myMutex );
+			gen = myGeneration.load( std::memory_order_relaxed );
+			myProdGeneration = gen;
+			myProdROI = myROI;
+			myProdWidth = myWidth;
+			myProdHeight = myHeight;
+			myProdBytesPerLine = myBytesPerLine;
+			myProdBytesPerPixel = myBytesPerPixel;
+			myProdStride = effectiveStride( myBytesPerLine, myStride );
+			myProdHugePages = myHugePages;
+			myProdLockMemory = myLockMemory;
+			myProdFormat = myFormat;
 		}
+		myPool->clearLatency();
+		myFrameInterval.store( 0, std::memory_order_relaxed );
+		myLastDone = 0;
+		myProdLost = 0;
+	}
+
+	if ( off() || myProdWidth <= 0 || myProdHeight <= 0 )
+		return FrameRef();
 
-		if ( myLiveBuffers < myMaxBuffers )
+	size_t depth = targetDepth();
+	if ( myPool->live() > depth )
+		myPool->trim( depth );
+
+	// allocating (and faulting in) a frame takes far too long for
+	// the event thread, more buffers arrive from the grower. A view
+	// has no memory of its own, so that's only a header to make here
+	bool viewOnly = myViewOnly.load( std::memory_order_relaxed );
+	if ( myPool->live() < depth && ! viewOnly )
+		requestGrowth();
+
+	bool stolen = false;
+	ImageBuffer *b = myPool->take();
+	if ( ! b && viewOnly && myPool->live() < depth )
+		b = myPool->create();
+
+	if ( ! b )
+	{
+		switch ( myPolicy.load( std::memory_order_relaxed ) )
 		{
-			ret = std::make_shared<ImageBuffer>();
-			++myLiveBuffers;
-			break;
+			case DropPolicy::LATEST_WINS:
+				b = myPool->pop();
+				if ( b )
+				{
+					stolen = true;
+					myOverwritten.fetch_add( 1, std::memory_order_relaxed );
+					// the consumer never sees it or the ones it
+					// stood in for, the next frame out reports them
+					if ( b->myGeneration == gen )
+						myProdLost += b->myInfo.skipped + 1;
+				}
+				break;
+
+			case DropPolicy::BLOCK:
+			{
+				int timeoutMS = myBlockTimeout.load( std::memory_order_relaxed );
+				auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds( timeoutMS );
+				while ( ! b )
+				{
+					uint32_t seq = myPool->returned().sequence();
+					b = myPool->take();
+					if ( b )
+						break;
+					auto left = std::chrono::duration_cast<std::chrono::milliseconds>( deadline - std::chrono::steady_clock::now() ).count();
+					if ( left <= 0 || off() )
+						break;
+					myPool->returned().wait( seq, int( left ) );
+				}
+				break;
+			}
+
+			case DropPolicy::DROP_NEWEST:
+				break;
 		}
+	}
 
-		myHasBufferNotify.wait( lk );
+	if ( ! b )
+	{
+		myDropped.fetch_add( 1, std::memory_order_relaxed );
+		return FrameRef();
 	}
 
-	if ( ret )
-		ret->reset( myFormat, myWidth, myHeight, myBytesPerLine, myBytesPerPixel, myROI );
+	b->myGeneration = gen;
+	b->myDoneTime = 0;
+	b->myHugePages = myProdHugePages;
+	b->myLockMemory = myProdLockMemory;
+	if ( view )
+		b->reset( myProdFormat, myProdWidth, myProdHeight, myProdBytesPerLine, myProdBytesPerPixel, myProdROI, viewStride, view );
+	else
+		b->reset( myProdFormat, myProdWidth, myProdHeight, myProdBytesPerLine, myProdBytesPerPixel, myProdROI, myProdStride );
+	// a frame taken back from the queue comes with the queue's reference
+	return stolen ? FrameRef::adopt( b ) : FrameRef( b );
+}
+
+
+////////////////////////////////////////
+
+
+void
+VideoStream::done( FrameRef &buf )
+{
+	if ( ! buf )
+		return;
 
-	return ret;
+	int64_t now = FramePool::nowNS();
+	if ( myLastDone != 0 )
+	{
+		int64_t sample = now - myLastDone;
+		int64_t avg = myFrameInterval.load( std::memory_order_relaxed );
+		avg = avg == 0 ? sample : avg + ( sample - avg ) / 8;
+		myFrameInterval.store( avg, std::memory_order_relaxed );
+	}
+	myLastDone = now;
+	buf->myDoneTime = now;
 }
 
 
@@ -175,17 +1079,81 @@ VideoStream::get( void )
 
 
 void
-VideoStream::put( std::shared_ptr<ImageBuffer> &buf )
+VideoStream::publish( FrameRef &buf )
 {
-	std::unique_lock<std::mutex> lk( myMutex );
+	done( buf );
 
-	if ( ! buf || off_locked() )
+	ImageBuffer *b = buf.release();
+	if ( ! b )
 		return;
 
-	if ( myBuffers.size() < myMaxBuffers )
-		myBuffers.push_back( buf );
-	buf.reset();
-	myHasBufferNotify.notify_one();
+	b->myInfo.skipped += myProdLost;
+
+	// can only be full if a consumer is holding on to everything
+	// else as well, in which case there is no one to give it to
+	if ( myPool->push( b ) )
+		myProdLost = 0;
+	else
+	{
+		myProdLost = b->myInfo.skipped + 1;
+		myDropped.fetch_add( 1, std::memory_order_relaxed );
+		b->unref();
+	}
+}
+
+
+////////////////////////////////////////
+
+
+FrameRef
+VideoStream::next( int timeoutMS )
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds( std::max( timeoutMS, 0 ) );
+
+	while ( true )
+	{
+		uint32_t seq = myPool->ready().sequence();
+
+		while ( ImageBuffer *b = myPool->pop() )
+		{
+			FrameRef r = FrameRef::adopt( b );
+			if ( b->myGeneration == myGeneration.load( std::memory_order_acquire ) )
+			{
+				myDelivered.fetch_add( 1, std::memory_order_relaxed );
+				if ( myPool->queued() )
+					myLate.fetch_add( 1, std::memory_order_relaxed );
+				return r;
+			}
+		}
+
+		if ( timeoutMS == 0 || off() )
+			break;
+
+		int waitMS = -1;
+		if ( timeoutMS > 0 )
+		{
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>( deadline - std::chrono::steady_clock::now() ).count();
+			if ( left <= 0 )
+				break;
+			waitMS = int( left );
+		}
+		myPool->ready().wait( seq, waitMS );
+	}
+
+	return FrameRef();
+}
+
+
+////////////////////////////////////////
+
+
+void
+VideoStream::changed( void )
+{
+	myGeneration.fetch_add( 1, std::memory_order_release );
+	// kick anyone waiting so they notice
+	myPool->ready().signal();
+	myPool->returned().signal();
 }
 
 
@@ -198,6 +1166,7 @@ VideoStream::setROI( const ROI &roi )
 	std::unique_lock<std::mutex> lk( myMutex );
 
 	myROI = roi;
+	changed();
 }
 
 
@@ -205,7 +1174,7 @@ VideoStream::setROI( const ROI &roi )
 
 
 void
-VideoStream::reset( int w, int h, int bpl, int bpp, ImageBuffer::Format fmt, size_t maxN )
+VideoStream::reset( int w, int h, int bpl, int bpp, ImageBuffer::Format fmt )
 {
 	std::unique_lock<std::mutex> lk( myMutex );
 
@@ -214,7 +1183,116 @@ VideoStream::reset( int w, int h, int bpl, int bpp, ImageBuffer::Format fmt, siz
 	myBytesPerLine = bpl;
 	myBytesPerPixel = bpp;
 	myFormat = fmt;
-	myMaxBuffers = maxN;
+	myActive = true;
+	changed();
+	if ( myViewOnly.load( std::memory_order_relaxed ) )
+		return;
+	preallocate( myMinDepth.load( std::memory_order_relaxed ) );
+	if ( myMinDepth.load( std::memory_order_relaxed ) < myMaxDepth.load( std::memory_order_relaxed ) )
+		startGrower();
+}
+
+
+////////////////////////////////////////
+
+
+void
+VideoStream::preallocate( size_t want )
+{
+	// caller holds myMutex. Allocate (and fault in) the pool now
+	// rather than as frames arrive. Anything already idle in the pool
+	// gets resized when the producer picks it up
+	if ( myWidth <= 0 || myHeight <= 0 )
+		return;
+
+	int stride = effectiveStride( myBytesPerLine, myStride );
+	// the ROI may not be set for the new size yet, it doesn't matter
+	// for sizing the buffer
+	ROI full;
+	full.x = 0;
+	full.y = 0;
+	full.w = myWidth;
+	full.h = myHeight;
+	while ( myPool->live() < want )
+	{
+		ImageBuffer *b = myPool->create();
+		b->myHugePages = myHugePages;
+		b->myLockMemory = myLockMemory;
+		try
+		{
+			b->reset( myFormat, myWidth, myHeight, myBytesPerLine, myBytesPerPixel, full, stride );
+		}
+		catch ( ... )
+		{
+			myPool->release( b );
+			throw;
+		}
+		myPool->release( b );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+VideoStream::requestGrowth( void )
+{
+	// producer side, only the first request until the grower gets to
+	// it takes the lock
+	if ( myGrowRequested.exchange( true, std::memory_order_acq_rel ) )
+		return;
+
+	{
+		std::unique_lock<std::mutex> lk( myGrowMutex );
+		myGrowPending = true;
+	}
+	myGrowWake.notify_one();
+}
+
+
+////////////////////////////////////////
+
+
+void
+VideoStream::startGrower( void )
+{
+	std::unique_lock<std::mutex> lk( myGrowMutex );
+	if ( ! myGrower.joinable() && ! myGrowStop )
+		myGrower = std::thread( &VideoStream::grow, this );
+}
+
+
+////////////////////////////////////////
+
+
+void
+VideoStream::grow( void )
+{
+	std::unique_lock<std::mutex> lk( myGrowMutex );
+	while ( true )
+	{
+		while ( ! myGrowPending && ! myGrowStop )
+			myGrowWake.wait( lk );
+		if ( myGrowStop )
+			break;
+		myGrowPending = false;
+		lk.unlock();
+
+		try
+		{
+			std::unique_lock<std::mutex> glk( myMutex );
+			if ( ! off() )
+				preallocate( targetDepth() );
+		}
+		catch ( ... )
+		{
+			// out of memory, carry on with the buffers there are
+		}
+		myGrowRequested.store( false, std::memory_order_release );
+
+		lk.lock();
+	}
 }
 
 
@@ -235,20 +1313,9 @@ VideoStream::clear( void )
 	myBytesPerLine = 0;
 	myBytesPerPixel = 0;
 	myFormat = ImageBuffer::Format::MONO_8;
-	myMaxBuffers = 0;
-	myLiveBuffers = 0;
-	myBuffers.clear();
-}
-
-
-////////////////////////////////////////
-
-
-bool
-VideoStream::off( void ) const
-{
-	std::unique_lock<std::mutex> lk( myMutex );
-	return off_locked();
+	myActive = false;
+	changed();
+	myPool->releaseIdle();
 }
 
 
@@ -26,8 +26,11 @@
 
 #include <mutex>
 #include <condition_variable>
+#include <thread>
 #include <vector>
 #include <memory>
+#include <atomic>
+#include <cstdint>
 
 
 ////////////////////////////////////////
@@ -48,6 +51,43 @@ struct ROI
 	int w, h;
 };
 
+///
+/// @brief Struct FrameInfo is what we know about how a frame arrived.
+///
+/// Device times are in the device clock (dwClockFrequency from the
+/// probe), host times are CLOCK_MONOTONIC nanoseconds.
+///
+struct FrameInfo
+{
+	enum Flags
+	{
+		ERR_STREAM = 1 << 0, ///< a payload had the error bit set
+		ERR_SHORT = 1 << 1, ///< frame ended before the ROI was filled
+		ERR_OVERRUN = 1 << 2, ///< more data arrived than the frame holds
+		ERR_DECODE = 1 << 3, ///< the compressed frame was corrupt
+		HAS_PTS = 1 << 8,
+		HAS_SCR = 1 << 9
+	};
+
+	uint64_t sequence = 0; ///< counts every frame started on the wire
+	uint32_t skipped = 0; ///< frames lost since the previous delivered one
+	uint32_t flags = 0;
+	uint32_t payloads = 0;
+
+	uint32_t pts = 0; ///< presentation time
+	uint32_t scrSTC = 0; ///< source clock, from the last payload with an SCR
+	uint16_t scrSOF = 0; ///< bus frame number of that SCR
+	int64_t scrHostNS = 0; ///< host time of the payload the SCR came in
+	int64_t captureNS = 0; ///< host time of the PTS, 0 if not yet known
+
+	int64_t firstPayloadNS = 0;
+	int64_t lastPayloadNS = 0;
+
+	inline bool hasErrors( void ) const { return ( flags & ( ERR_STREAM | ERR_SHORT | ERR_OVERRUN | ERR_DECODE ) ) != 0; }
+};
+
+class FramePool;
+
 class ImageBuffer
 {
 public:
@@ -61,19 +101,60 @@ public:
 		MONO_16,
 		YUY2,
 		UYVY,
+		// MIPI style packing, 10 bit is 4 pixels in 5 bytes, the top
+		// 8 bits of each then a byte of the low 2 bits, 12 bit is 2
+		// pixels in 3 bytes
+		MONO_10P,
+		MONO_12P,
+		BAYER_GRBG_10P,
+		BAYER_GBRG_10P,
+		BAYER_RGGB_10P,
+		BAYER_BGGR_10P,
+		BAYER_GRBG_12P,
+		BAYER_GBRG_12P,
+		BAYER_RGGB_12P,
+		BAYER_BGGR_12P,
+		// interleaved 8 bit, what compressed formats decode to
+		RGB_24,
+		BGRA_32,
+		// variable length frames, ending with the payload that has
+		// the EOF bit set rather than at a byte count. bytesPerLine
+		// times height is just the largest frame expected
+		MJPEG,
+		H264, ///< annex B access units
+		// interleaved 8 bit like RGB_24, here so the formats above
+		// keep the numbers they have in recorded journals
+		BGR_24,
 		UNKNOWN
 	};
 
+	// bits per pixel of the packed formats, 0 for the rest
+	static int packedBits( Format f );
+	// the 16 bit format a packed one unpacks to, f for the rest
+	static Format unpackedFormat( Format f );
+	// bytes taken up by n pixels of a row, packed formats have a
+	// bytesPerPixel of 0
+	static size_t rowBytes( Format f, int bpp, int n );
+	static inline bool isCompressed( Format f ) { return f == Format::MJPEG || f == Format::H264; }
+
 	ImageBuffer( void );
 	~ImageBuffer( void );
 
-	// returns true when full
+	// returns true when full, len is updated to what was not consumed
 	bool addData( const uint8_t *buf, int &len );
 
-	void reset( Format fmt, int w, int h, int bpl, int bpp, const ROI &roi );
+	// stride is the distance between rows in the buffer, 0 to use bpl.
+	// With view the buffer points at that memory (i.e. a mapped file)
+	// instead of owning any, which has to outlive the frame and is
+	// not to be written through fillData or addData
+	void reset( Format fmt, int w, int h, int bpl, int bpp, const ROI &roi, int stride = 0, const uint8_t *view = nullptr );
 
-	bool empty( void ) const { return myCurX == myROI.x && myCurY == myROI.y; }
-	bool partial( void ) const { return myCurY < myROI.h; }
+	bool empty( void ) const { return myCurX == 0 && myCurY == 0; }
+	// compressed frames are never partial, only the decoder can tell
+	bool partial( void ) const { return ! isCompressed( myFormat ) && myCurY < myROI.h; }
+	// bytes received so far, the length of the data for compressed
+	// formats
+	size_t filled( void ) const;
 
 	inline const ROI &roi( void ) const { return myROI; }
 
@@ -82,50 +163,250 @@ public:
 	inline int height( void ) const { return myHeight; }
 	inline int bytesPerLine( void ) const { return myBytesPerLine; }
 	inline int bytesPerPixel( void ) const { return myBytesPerPixel; }
+	// row pitch of data(), >= bytesPerLine
+	inline int stride( void ) const { return myStride; }
+
+	// cleared by reset, filled in by whoever is assembling the frame
+	inline FrameInfo &info( void ) { return myInfo; }
+	inline const FrameInfo &info( void ) const { return myInfo; }
+
+	inline const uint8_t *data( void ) const { return myData; }
+
+	// for producers writing the frame in place instead of through
+	// addData (i.e. a decoder), complete then marks the ROI filled,
+	// or n bytes of it for compressed formats
+	inline uint8_t *fillData( void ) { return myData; }
+	void complete( size_t n = 0 );
+
+	// intrusive reference count, see FrameRef. When the last
+	// reference goes away a pooled buffer goes back to its pool
+	inline void ref( void ) { myRefCount.fetch_add( 1, std::memory_order_relaxed ); }
+	void unref( void );
 
-	inline const uint8_t *data( void ) const { return myBuffer.data(); }
 private:
+	friend class FramePool;
+	friend class VideoStream;
+
+	std::atomic<int> myRefCount{0};
+	FramePool *myPool = nullptr;
+	ImageBuffer *myNextFree = nullptr;
+	uint32_t myGeneration = 0;
+	// steady clock ns when the frame was completed, 0 while filling
+	int64_t myDoneTime = 0;
+
 	ROI myROI;
+	FrameInfo myInfo;
 
 	Format myFormat = Format::MONO_8;
 	int myWidth = 0;
 	int myHeight = 0;
 	int myBytesPerLine = 0;
 	int myBytesPerPixel = 0;
+	int myStride = 0;
 
+	// fill position, myCurX is in bytes from the start of the ROI
 	int myCurX = 0;
 	int myCurY = 0;
+	int myROIOffset = 0;
+	int myROIBytes = 0;
+
+	bool addContiguous( const uint8_t *buf, int &len );
+	void freeMemory( void );
+
+	// set by the owning stream, applies on the next allocation
+	bool myHugePages = false;
+	bool myLockMemory = false;
 
-	std::vector<uint8_t> myBuffer;
+	// ROI covers whole lines with no padding, so it is one run of
+	// bytes in the buffer and can be filled with a copy per payload
+	bool myContiguous = false;
+	size_t myFillStart = 0;
+	size_t myFillPos = 0;
+	size_t myFillEnd = 0;
+	// frames big enough that the copy should bypass the cache
+	bool myStreamCopy = false;
+
+	uint8_t *myData = nullptr;
+	size_t mySize = 0;
+	size_t myCapacity = 0;
+	// non-zero when myData is an mmap of that length
+	size_t myMapped = 0;
+	bool myLocked = false;
+	// myData belongs to someone else
+	bool myView = false;
+	bool myAllocHuge = false;
+	bool myAllocLock = false;
 };
 
 ///
-/// @brief Class Stream provides...
+/// @brief Class FrameRef is a counted reference to an ImageBuffer.
+///
+/// Unlike shared_ptr there is no separate control block, the count
+/// lives in the buffer itself, and dropping the last reference
+/// recycles the buffer into the stream it came from.
+///
+class FrameRef
+{
+public:
+	FrameRef( void ) = default;
+	explicit FrameRef( ImageBuffer *b ) : myBuf( b ) { if ( myBuf ) myBuf->ref(); }
+	FrameRef( const FrameRef &o ) : myBuf( o.myBuf ) { if ( myBuf ) myBuf->ref(); }
+	FrameRef( FrameRef &&o ) : myBuf( o.myBuf ) { o.myBuf = nullptr; }
+	~FrameRef( void ) { reset(); }
+
+	FrameRef &operator=( const FrameRef &o )
+	{
+		if ( o.myBuf )
+			o.myBuf->ref();
+		reset();
+		myBuf = o.myBuf;
+		return *this;
+	}
+	FrameRef &operator=( FrameRef &&o )
+	{
+		if ( this != &o )
+		{
+			reset();
+			myBuf = o.myBuf;
+			o.myBuf = nullptr;
+		}
+		return *this;
+	}
+
+	inline void reset( void )
+	{
+		if ( myBuf )
+		{
+			ImageBuffer *b = myBuf;
+			myBuf = nullptr;
+			b->unref();
+		}
+	}
+
+	inline ImageBuffer *get( void ) const { return myBuf; }
+	inline ImageBuffer *operator->( void ) const { return myBuf; }
+	inline ImageBuffer &operator*( void ) const { return *myBuf; }
+	explicit operator bool( void ) const { return myBuf != nullptr; }
+
+	// gives up ownership of the reference without dropping it
+	inline ImageBuffer *release( void ) { ImageBuffer *b = myBuf; myBuf = nullptr; return b; }
+	// takes over a reference someone else already holds
+	static inline FrameRef adopt( ImageBuffer *b ) { FrameRef r; r.myBuf = b; return r; }
+
+private:
+	ImageBuffer *myBuf = nullptr;
+};
+
+///
+/// @brief Class VideoStream hands frames from the thread assembling
+/// them (usually the libusb event thread) to a single consumer.
+///
+/// Frames come from a bounded pool and are passed through a
+/// single-producer / single-consumer ring, so neither side takes a
+/// lock while streaming. What happens when the consumer falls behind
+/// and every buffer is in use is up to the DropPolicy, by default the
+/// incoming frame is skipped so the producer never waits. The
+/// consumer may block in next(), which sleeps on a futex on linux.
 ///
 class VideoStream
 {
 public:
-	
+	static const size_t kMaxFrames = 32;
+
+	enum class DropPolicy
+	{
+		DROP_NEWEST, ///< skip the incoming frame
+		LATEST_WINS, ///< recycle the oldest frame not yet picked up
+		BLOCK ///< wait (up to a timeout) for the consumer to return one
+	};
+
+	struct Stats
+	{
+		uint64_t delivered = 0; ///< frames handed to next()
+		uint64_t dropped = 0; ///< incoming frames skipped, no buffer
+		uint64_t overwritten = 0; ///< queued frames recycled by LATEST_WINS
+		uint64_t late = 0; ///< delivered with a newer frame already queued
+		size_t depth = 0; ///< buffers currently allocated
+		double consumerLatencyMS = 0.0; ///< avg completion to release
+		double frameIntervalMS = 0.0; ///< avg time between completions
+	};
+
 	VideoStream( void );
 	~VideoStream( void );
 
-	std::shared_ptr<ImageBuffer> get( void );
-	void put( std::shared_ptr<ImageBuffer> &buf );
+	// frame memory is page aligned, prefaulted when allocated and
+	// rows start 64 byte aligned unless a stride is given (0 for
+	// bytes per line rounded up to 64). Huge pages (on by default)
+	// come from hugetlbfs when available, otherwise transparent huge
+	// pages are requested. Locking keeps frames from being paged
+	// out. Applies from the next reset
+	void setStride( int stride );
+	void setHugePages( bool on );
+	void setLockMemory( bool on );
+
+	// NB: BLOCK stalls whichever thread fills frames, usually the
+	// libusb event thread, so keep the timeout short
+	void setDropPolicy( DropPolicy p, int blockTimeoutMS = 5 );
+	DropPolicy dropPolicy( void ) const { return myPolicy.load( std::memory_order_relaxed ); }
+
+	// number of buffers to use. If minN < maxN, the depth follows how
+	// long the consumer holds frames relative to the frame rate. The
+	// minimum is allocated by reset, growing beyond that happens on a
+	// background thread so the producer never waits on an allocation
+	void setDepth( size_t minN, size_t maxN );
+	// for a producer that only ever uses acquireView. No frame memory
+	// is allocated, reset skips preallocating and there's no grower,
+	// the producer adds (cheap) frame headers as it needs them
+	void setViewOnly( bool on );
+
+	Stats stats( void ) const;
+	void resetStats( void );
+
+	// producer side, returns an empty reference if no buffer is
+	// available (per the drop policy)
+	FrameRef acquire( void );
+	// producer side, as acquire but the frame is a view of data,
+	// with rows stride bytes apart, rather than a buffer to fill.
+	// data has to stay valid until the frame is released
+	FrameRef acquireView( const uint8_t *data, int stride );
+	// producer side, queues a completed frame for the consumer and
+	// drops the caller's reference to it
+	void publish( FrameRef &buf );
+	// producer side, marks the frame complete without queuing it, for
+	// frames handed straight to a callback instead
+	void done( FrameRef &buf );
+
+	// consumer side, waits up to timeoutMS (-1 forever, 0 to poll)
+	// for the next frame, empty if none arrived or the stream is off
+	FrameRef next( int timeoutMS = -1 );
 
 	int width( void ) const { return myWidth; }
 	int height( void ) const { return myHeight; }
 	const ROI &roi( void ) const { return myROI; }
 
+	// these change the frame geometry, frames already queued or in
+	// flight with the old geometry are discarded by next()
 	void setROI( const ROI &roi );
-	void reset( int w, int h, int bpl, int bpp, ImageBuffer::Format fmt, size_t maxN );
+	void reset( int w, int h, int bpl, int bpp, ImageBuffer::Format fmt );
 	void clear( void );
-	bool off( void ) const;
+	bool off( void ) const { return ! myActive.load( std::memory_order_relaxed ); }
 
 private:
-	inline bool off_locked( void ) const { return myMaxBuffers == 0; }
+	VideoStream( const VideoStream & ) = delete;
+	VideoStream &operator=( const VideoStream & ) = delete;
 
+	// caller holds myMutex
+	void changed( void );
+	void preallocate( size_t want );
+	void requestGrowth( void );
+	void startGrower( void );
+	void grow( void );
+	FrameRef take( const uint8_t *view, int viewStride );
+	size_t targetDepth( void ) const;
+
+	// guards the geometry against concurrent reset / setROI, the
+	// producer only takes it when the generation changes
 	mutable std::mutex myMutex;
-	std::condition_variable myHasBufferNotify;
 
 	ROI myROI;
 	int myWidth = 0;
@@ -133,10 +414,50 @@ private:
 	int myBytesPerLine = 0;
 	int myBytesPerPixel = 1;
 	ImageBuffer::Format myFormat = ImageBuffer::Format::MONO_8;
+	int myStride = 0;
+	bool myHugePages = true;
+	bool myLockMemory = false;
+	std::atomic<size_t> myMinDepth{2};
+	std::atomic<size_t> myMaxDepth{8};
+	std::atomic<bool> myViewOnly{false};
+	std::atomic<bool> myActive{false};
+	std::atomic<uint32_t> myGeneration{0};
+
+	std::atomic<DropPolicy> myPolicy{DropPolicy::DROP_NEWEST};
+	std::atomic<int> myBlockTimeout{5};
+
+	std::atomic<uint64_t> myDelivered{0};
+	std::atomic<uint64_t> myDropped{0};
+	std::atomic<uint64_t> myOverwritten{0};
+	std::atomic<uint64_t> myLate{0};
+	// ns, exponential moving average, producer updated
+	std::atomic<int64_t> myFrameInterval{0};
+	int64_t myLastDone = 0;
+
+	// producer private copy of the above
+	uint32_t myProdGeneration = 0;
+	ROI myProdROI;
+	int myProdWidth = 0;
+	int myProdHeight = 0;
+	int myProdBytesPerLine = 0;
+	int myProdBytesPerPixel = 1;
+	int myProdStride = 0;
+	bool myProdHugePages = true;
+	bool myProdLockMemory = false;
+	ImageBuffer::Format myProdFormat = ImageBuffer::Format::MONO_8;
+	// frames overwritten or that didn't fit in the queue since the
+	// last one queued, added to the next one's FrameInfo::skipped
+	uint32_t myProdLost = 0;
+
+	FramePool *myPool = nullptr;
 
-	size_t myMaxBuffers = 0;
-	size_t myLiveBuffers = 0;
-	std::vector<std::shared_ptr<ImageBuffer>> myBuffers;
+	// adds buffers up to the target depth when the producer asks
+	std::thread myGrower;
+	std::mutex myGrowMutex;
+	std::condition_variable myGrowWake;
+	bool myGrowPending = false;
+	bool myGrowStop = false;
+	std::atomic<bool> myGrowRequested{false};
 };
 
 } // namespace usb
@@ -28,6 +28,8 @@
 #include <iomanip>
 #include "DeviceManager.h"
 #include <algorithm>
+#include <stdlib.h>
+#include <unistd.h>
 
 
 ////////////////////////////////////////
@@ -40,6 +42,31 @@ namespace USB
 ////////////////////////////////////////
 
 
+void
+BufferStats::add( BufferMode requested, BufferMode actual, size_t bytes )
+{
+	if ( bytes == 0 )
+		return;
+
+	if ( actual == BufferMode::DEVICE )
+	{
+		++deviceBuffers;
+		deviceBytes += bytes;
+	}
+	else
+	{
+		++hostBuffers;
+		hostBytes += bytes;
+	}
+
+	if ( requested != actual )
+		++fallbacks;
+}
+
+
+////////////////////////////////////////
+
+
 AsyncTransfer::AsyncTransfer( libusb_context *ctxt, int numPackets )
 		: myContext( ctxt ), myXfer( libusb_alloc_transfer( numPackets ) )
 {
@@ -55,6 +82,7 @@ AsyncTransfer::~AsyncTransfer( void )
 	wait();
 
 	libusb_free_transfer( myXfer );
+	freeBuffer();
 }
 
 
@@ -82,7 +110,13 @@ AsyncTransfer::submit( void )
 
 	myComplete = 0;
 	myAmountTransferred = 0;
-	check_error( libusb_submit_transfer( myXfer ) );
+	int err = libusb_submit_transfer( myXfer );
+	if ( err < 0 )
+	{
+		// never made it to the device, so nothing will complete it
+		myComplete = 1;
+		check_error( err );
+	}
 }
 
 
@@ -191,6 +225,67 @@ AsyncTransfer::handleCallback( void )
 ////////////////////////////////////////
 
 
+uint8_t *
+AsyncTransfer::allocBuffer( libusb_device_handle *handle, size_t n )
+{
+	// a buffer that already fell back to host memory is kept, no
+	// point in asking for device memory again on every re-init
+	if ( myData && myDataSize >= n && myDataRequested == myBufferMode &&
+		 ( myDataMode == BufferMode::HOST || myDataHandle == handle ) )
+		return myData;
+
+	freeBuffer();
+	myDataRequested = myBufferMode;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if ( myBufferMode == BufferMode::DEVICE && handle )
+	{
+		myData = libusb_dev_mem_alloc( handle, n );
+		if ( myData )
+		{
+			myDataSize = n;
+			myDataHandle = handle;
+			myDataMode = BufferMode::DEVICE;
+			return myData;
+		}
+	}
+#endif
+
+	void *mem = nullptr;
+	if ( posix_memalign( &mem, size_t( sysconf( _SC_PAGESIZE ) ), n ) != 0 )
+		throw std::bad_alloc();
+	myData = reinterpret_cast<uint8_t *>( mem );
+	myDataSize = n;
+	myDataMode = BufferMode::HOST;
+	return myData;
+}
+
+
+////////////////////////////////////////
+
+
+void
+AsyncTransfer::freeBuffer( void )
+{
+	if ( myData )
+	{
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+		if ( myDataMode == BufferMode::DEVICE )
+			libusb_dev_mem_free( myDataHandle, myData, myDataSize );
+		else
+#endif
+			free( myData );
+	}
+	myData = nullptr;
+	myDataSize = 0;
+	myDataHandle = nullptr;
+	myDataMode = BufferMode::HOST;
+}
+
+
+////////////////////////////////////////
+
+
 ControlTransfer::ControlTransfer( libusb_context *ctxt )
 		: AsyncTransfer( ctxt )
 {
@@ -202,8 +297,6 @@ ControlTransfer::ControlTransfer( libusb_context *ctxt )
 
 ControlTransfer::~ControlTransfer( void )
 {
-	if ( myData )
-		free( myData );
 }
 
 
@@ -218,13 +311,9 @@ ControlTransfer::fill( libusb_device_handle *handle,
 {
 	bool needReinit = false;
 	size_t bytesNeeded = LIBUSB_CONTROL_SETUP_SIZE + wLength;
-	if ( myDataLen < bytesNeeded )
+	if ( myDataSize < bytesNeeded )
 	{
-		if ( myData )
-			free( myData );
-
-		myData = reinterpret_cast<uint8_t *>( malloc( bytesNeeded ) );
-		myDataLen = bytesNeeded;
+		allocBuffer( handle, bytesNeeded );
 		needReinit = true;
 	}
 
@@ -297,8 +386,6 @@ InterruptTransfer::InterruptTransfer( libusb_context *ctxt, uint16_t maxPacket )
 
 InterruptTransfer::~InterruptTransfer( void )
 {
-	// we told the transfer to delete our data buffer
-	// when it is freed...
 }
 
 
@@ -310,14 +397,14 @@ InterruptTransfer::init( libusb_device_handle *handle, uint8_t endPoint )
 {
 	uint8_t endPointNum = (endPoint & 0xF);
 
-	myData = (uint8_t *)malloc( myMaxPacketSize );
+	allocBuffer( handle, myMaxPacketSize );
 	libusb_fill_interrupt_transfer( myXfer, handle,
 									( endPointNum | LIBUSB_ENDPOINT_IN ),
 									myData,
 									int(myMaxPacketSize),
 									&AsyncTransfer::transfer_callback,
 									this, 0 );
-	myXfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	myXfer->flags = 0;
 }
 
 
@@ -329,11 +416,10 @@ InterruptTransfer::fill( libusb_device_handle *handle, uint8_t endPoint,
 						 unsigned char *buffer, int length,
 						 unsigned int timeout )
 {
-	if ( ! myData )
-		myData = (uint8_t *)malloc( myMaxPacketSize );
+	allocBuffer( handle, myMaxPacketSize );
 	std::copy( buffer, buffer + std::min( length, int(myMaxPacketSize) ), myData );
 	if ( length < myMaxPacketSize )
-		std::fill( buffer + length, buffer + myMaxPacketSize, uint8_t(0) );
+		std::fill( myData + length, myData + myMaxPacketSize, uint8_t(0) );
 
 	libusb_fill_interrupt_transfer( myXfer, handle,
 									endPoint,
@@ -341,7 +427,7 @@ InterruptTransfer::fill( libusb_device_handle *handle, uint8_t endPoint,
 									int(myMaxPacketSize),
 									&AsyncTransfer::transfer_callback,
 									this, timeout );
-	myXfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	myXfer->flags = 0;
 }
 
 
@@ -383,14 +469,14 @@ void
 BulkTransfer::init( libusb_device_handle *handle, uint8_t endPoint )
 {
 	uint8_t endPointNum = (endPoint & 0xF);
-	myData = (uint8_t *)malloc( myBufSize );
+	allocBuffer( handle, myBufSize );
 	libusb_fill_bulk_transfer( myXfer, handle,
 							   ( endPointNum | LIBUSB_ENDPOINT_IN ),
 							   myData,
 							   int(myBufSize),
 							   &AsyncTransfer::transfer_callback,
 							   this, 0 );
-	myXfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	myXfer->flags = 0;
 }
 
 
@@ -418,6 +504,58 @@ BulkTransfer::send( libusb_device_handle *handle,
 ////////////////////////////////////////
 
 
+BulkStreamTransfer::BulkStreamTransfer( libusb_context *ctxt, uint32_t streamID, size_t bufSize )
+		: AsyncTransfer( ctxt ), myStreamID( streamID ), myBufSize( bufSize )
+{
+}
+
+
+////////////////////////////////////////
+
+
+BulkStreamTransfer::~BulkStreamTransfer( void )
+{
+}
+
+
+////////////////////////////////////////
+
+
+void
+BulkStreamTransfer::init( libusb_device_handle *handle, uint8_t endPoint )
+{
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000103)
+	allocBuffer( handle, myBufSize );
+	libusb_fill_bulk_stream_transfer( myXfer, handle, endPoint, myStreamID,
+									  myData,
+									  int(myBufSize),
+									  &AsyncTransfer::transfer_callback,
+									  this, 0 );
+	myXfer->flags = 0;
+#else
+	throw usb_error( LIBUSB_ERROR_NOT_SUPPORTED );
+#endif
+}
+
+
+////////////////////////////////////////
+
+
+void
+BulkStreamTransfer::send( const unsigned char *buffer, int length )
+{
+	if ( length > static_cast<int>( myBufSize ) || ! myData )
+		throw std::runtime_error( "Send buffer too large for stream transfer" );
+
+	std::copy( buffer, buffer + length, myData );
+	myXfer->length = length;
+	submit();
+}
+
+
+////////////////////////////////////////
+
+
 ISOTransfer::ISOTransfer( libusb_context *ctxt, int numPackets, size_t bufSize, size_t maxPacket )
 		: AsyncTransfer( ctxt, numPackets ),
 		  myNumPackets( numPackets ), myBufSize( bufSize ), myMaxPacketSize( maxPacket )
@@ -440,7 +578,7 @@ void
 ISOTransfer::init( libusb_device_handle *handle, uint8_t endPoint )
 {
 	uint8_t endPointNum = (endPoint & 0xF);
-	myData = (uint8_t *)malloc( myBufSize );
+	allocBuffer( handle, myBufSize );
 	libusb_fill_iso_transfer( myXfer, handle,
 							  ( endPointNum | LIBUSB_ENDPOINT_IN ),
 							  myData,
@@ -449,7 +587,194 @@ ISOTransfer::init( libusb_device_handle *handle, uint8_t endPoint )
 							  &AsyncTransfer::transfer_callback,
 							  this, 0 );
 	libusb_set_iso_packet_lengths( myXfer, myMaxPacketSize );
-	myXfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	myXfer->flags = 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+
+TransferPool::TransferPool( libusb_context *ctxt )
+		: myContext( ctxt )
+{
+}
+
+
+////////////////////////////////////////
+
+
+TransferPool::~TransferPool( void )
+{
+	clear();
+}
+
+
+////////////////////////////////////////
+
+
+bool
+TransferPool::reserveBulk( libusb_device_handle *handle, uint8_t endPoint,
+						   size_t n, size_t bufSize, const Callback &cb )
+{
+	Entry &e = prepare( handle, endPoint, LIBUSB_TRANSFER_TYPE_BULK,
+						bufSize, 0, 0 );
+	bool allocated = false;
+	while ( e.transfers.size() < n )
+	{
+		std::shared_ptr<AsyncTransfer> x = std::make_shared<BulkTransfer>( myContext, bufSize );
+		x->setBufferMode( myBufferMode );
+		x->init( handle, endPoint );
+		x->setCallback( cb );
+		e.transfers.push_back( x );
+		allocated = true;
+	}
+	e.active = n;
+	return allocated;
+}
+
+
+////////////////////////////////////////
+
+
+bool
+TransferPool::reserveISO( libusb_device_handle *handle, uint8_t endPoint,
+						  size_t n, int nPackets, size_t maxPacketSize,
+						  const Callback &cb )
+{
+	size_t bufSize = size_t(nPackets) * maxPacketSize;
+	Entry &e = prepare( handle, endPoint, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS,
+						bufSize, nPackets, maxPacketSize );
+	bool allocated = false;
+	while ( e.transfers.size() < n )
+	{
+		std::shared_ptr<AsyncTransfer> x = std::make_shared<ISOTransfer>( myContext, nPackets, bufSize, maxPacketSize );
+		x->setBufferMode( myBufferMode );
+		x->init( handle, endPoint );
+		x->setCallback( cb );
+		e.transfers.push_back( x );
+		allocated = true;
+	}
+	e.active = n;
+	return allocated;
+}
+
+
+////////////////////////////////////////
+
+
+void
+TransferPool::submitAll( uint8_t endPoint )
+{
+	auto i = myEndpoints.find( endPoint );
+	if ( i == myEndpoints.end() )
+		return;
+
+	Entry &e = i->second;
+	for ( size_t x = 0; x < e.active; ++x )
+		e.transfers[x]->submit();
+}
+
+
+////////////////////////////////////////
+
+
+void
+TransferPool::cancelAll( uint8_t endPoint )
+{
+	auto i = myEndpoints.find( endPoint );
+	if ( i != myEndpoints.end() )
+		cancelEntry( i->second );
+}
+
+
+////////////////////////////////////////
+
+
+void
+TransferPool::cancelAll( void )
+{
+	for ( auto &i: myEndpoints )
+		cancelEntry( i.second );
+}
+
+
+////////////////////////////////////////
+
+
+size_t
+TransferPool::size( uint8_t endPoint ) const
+{
+	auto i = myEndpoints.find( endPoint );
+	if ( i == myEndpoints.end() )
+		return 0;
+	return i->second.active;
+}
+
+
+////////////////////////////////////////
+
+
+void
+TransferPool::addStats( BufferStats &s ) const
+{
+	for ( auto &i: myEndpoints )
+	{
+		for ( auto &x: i.second.transfers )
+			s.add( x->requestedBufferMode(), x->bufferMode(), x->bufferSize() );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+TransferPool::clear( void )
+{
+	cancelAll();
+	myEndpoints.clear();
+}
+
+
+////////////////////////////////////////
+
+
+TransferPool::Entry &
+TransferPool::prepare( libusb_device_handle *handle, uint8_t endPoint, int type,
+					   size_t bufSize, int nPackets, size_t maxPacketSize )
+{
+	Entry &e = myEndpoints[endPoint];
+	if ( e.handle != handle || e.type != type || e.bufSize != bufSize ||
+		 e.numPackets != nPackets || e.maxPacketSize != maxPacketSize ||
+		 e.mode != myBufferMode )
+	{
+		cancelEntry( e );
+		e.transfers.clear();
+		e.handle = handle;
+		e.type = type;
+		e.bufSize = bufSize;
+		e.numPackets = nPackets;
+		e.maxPacketSize = maxPacketSize;
+		e.mode = myBufferMode;
+	}
+	e.active = 0;
+	return e;
+}
+
+
+////////////////////////////////////////
+
+
+void
+TransferPool::cancelEntry( Entry &e )
+{
+	// cancel everything up front so the cancellations overlap
+	// instead of waiting on each one in turn
+	for ( auto &x: e.transfers )
+		x->cancel();
+	for ( auto &x: e.transfers )
+		x->wait();
 }
 
 
@@ -26,6 +26,9 @@
 
 #include "libusb-1.0/libusb.h"
 #include <functional>
+#include <memory>
+#include <vector>
+#include <map>
 
 
 ////////////////////////////////////////
@@ -40,6 +43,33 @@
 namespace USB
 {
 
+///
+/// @brief How transfer data buffers are allocated
+///
+/// DEVICE asks the kernel for memory it can hand straight to the host
+/// controller (usbfs mmap via libusb_dev_mem_alloc) so URBs do not get
+/// bounced through a copy. If that is not available (older libusb,
+/// non-linux, out of usbfs memory), it falls back to page-aligned host
+/// memory.
+///
+enum class BufferMode
+{
+	HOST,
+	DEVICE
+};
+
+struct BufferStats
+{
+	size_t deviceBuffers = 0;
+	size_t deviceBytes = 0;
+	size_t hostBuffers = 0;
+	size_t hostBytes = 0;
+	// buffers that asked for DEVICE memory but ended up in host memory
+	size_t fallbacks = 0;
+
+	void add( BufferMode requested, BufferMode actual, size_t bytes );
+};
+
 ///
 /// @brief Class Transfer provides async transfer...
 ///
@@ -70,6 +100,13 @@ public:
 	bool isComplete( void ) const { return myComplete == 1; }
 	int *getCompleterReference( void ) { return &myComplete; }
 
+	// takes effect the next time the buffer is (re)allocated
+	void setBufferMode( BufferMode m ) { myBufferMode = m; }
+	BufferMode requestedBufferMode( void ) const { return myBufferMode; }
+	// what the current buffer actually is
+	BufferMode bufferMode( void ) const { return myDataMode; }
+	size_t bufferSize( void ) const { return myDataSize; }
+
 protected:
 	virtual const char *type( void ) const = 0;
 
@@ -79,11 +116,22 @@ protected:
 	// status, etc. or just decorate
 	virtual void handleCallback( void );
 
+	// the data buffer is owned by the transfer and kept across
+	// re-initialization, only growing when more space is requested
+	// (or the buffer mode changes)
+	uint8_t *allocBuffer( libusb_device_handle *handle, size_t n );
+	void freeBuffer( void );
+
 	libusb_context *myContext = nullptr;
 	int myComplete = 1;
 	int myAmountTransferred = 0;
 	libusb_transfer *myXfer = nullptr;
 	uint8_t *myData = nullptr;
+	size_t myDataSize = 0;
+	libusb_device_handle *myDataHandle = nullptr;
+	BufferMode myBufferMode = BufferMode::HOST;
+	BufferMode myDataMode = BufferMode::HOST;
+	BufferMode myDataRequested = BufferMode::HOST;
 	std::function<void (libusb_transfer *)> myCallBack;
 };
 
@@ -106,8 +154,6 @@ protected:
 	virtual void handleCallback( void );
 
 private:
-	uint8_t *myData = nullptr;
-	size_t myDataLen = 0;
 	size_t myDestLen = 0;
 	void *myDestBuffer = nullptr;
 };
@@ -154,6 +200,36 @@ private:
 	size_t myBufSize;
 };
 
+///
+/// @brief Class BulkStreamTransfer is a bulk transfer on a USB 3 stream
+///
+/// The streams have to be allocated on the endpoint first (see
+/// Device::allocStreams), stream IDs then run from 1 to the number
+/// allocated. Unlike BulkTransfer, the endpoint address is used as
+/// given, so this works for either direction.
+///
+class BulkStreamTransfer : public AsyncTransfer
+{
+public:
+	BulkStreamTransfer( libusb_context *ctxt, uint32_t streamID, size_t bufSize );
+	virtual ~BulkStreamTransfer( void );
+
+	virtual void init( libusb_device_handle *handle, uint8_t endPoint );
+
+	uint32_t streamID( void ) const { return myStreamID; }
+
+	// for out endpoints, copies the data into the transfer buffer
+	// and queues it
+	void send( const unsigned char *buffer, int length );
+
+protected:
+	virtual const char *type( void ) const { return "BULK STREAM"; }
+
+private:
+	uint32_t myStreamID;
+	size_t myBufSize;
+};
+
 class ISOTransfer : public AsyncTransfer
 {
 public:
@@ -171,5 +247,72 @@ private:
 	size_t myMaxPacketSize;
 };
 
+///
+/// @brief Class TransferPool holds pre-built transfers per endpoint
+///
+/// The transfers (and their data buffers) are only re-allocated when
+/// the shape requested for an endpoint changes, so a stream can be
+/// stopped and re-started with the same settings without touching
+/// the heap.
+///
+class TransferPool
+{
+public:
+	typedef std::function<void (libusb_transfer *)> Callback;
+
+	TransferPool( libusb_context *ctxt = nullptr );
+	~TransferPool( void );
+
+	TransferPool( const TransferPool & ) = delete;
+	TransferPool &operator=( const TransferPool & ) = delete;
+
+	void setContext( libusb_context *ctxt ) { myContext = ctxt; }
+	// changing the mode causes the transfers to be rebuilt on the
+	// next reserve
+	void setBufferMode( BufferMode m ) { myBufferMode = m; }
+
+	// makes sure there are n transfers of the given shape ready for
+	// the endpoint. The callback is only bound to newly built
+	// transfers. returns true if anything had to be allocated
+	bool reserveBulk( libusb_device_handle *handle, uint8_t endPoint,
+					  size_t n, size_t bufSize, const Callback &cb );
+	bool reserveISO( libusb_device_handle *handle, uint8_t endPoint,
+					 size_t n, int nPackets, size_t maxPacketSize,
+					 const Callback &cb );
+
+	void submitAll( uint8_t endPoint );
+	// cancels everything first, then waits for all the cancellations
+	void cancelAll( uint8_t endPoint );
+	void cancelAll( void );
+
+	size_t size( uint8_t endPoint ) const;
+
+	void addStats( BufferStats &s ) const;
+
+	// releases the transfers, needed when the device handle goes away
+	void clear( void );
+
+private:
+	struct Entry
+	{
+		libusb_device_handle *handle = nullptr;
+		int type = -1;
+		size_t bufSize = 0;
+		int numPackets = 0;
+		size_t maxPacketSize = 0;
+		BufferMode mode = BufferMode::HOST;
+		size_t active = 0;
+		std::vector< std::shared_ptr<AsyncTransfer> > transfers;
+	};
+
+	Entry &prepare( libusb_device_handle *handle, uint8_t endPoint, int type,
+					size_t bufSize, int nPackets, size_t maxPacketSize );
+	void cancelEntry( Entry &e );
+
+	libusb_context *myContext = nullptr;
+	BufferMode myBufferMode = BufferMode::HOST;
+	std::map<uint8_t, Entry> myEndpoints;
+};
+
 } // namespace USB
 
@@ -23,6 +23,7 @@
 //
 
 #include "UVCDevice.h"
+#include "MJPEGDecoder.h"
 #include "Util.h"
 #include "Logger.h"
 
@@ -33,6 +34,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <algorithm>
 #include "Logger.h"
 
 
@@ -64,6 +67,57 @@ static const uint8_t UVC_GUID_FORMAT_Y16[16] = { 'Y',  '1',  '6',  ' ', 0x00, 0x
 static const uint8_t UVC_GUID_FORMAT_BA81[16] = { 'B',  'A',  '8',  '1', 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 };
 static const uint8_t UVC_GUID_FORMAT_GRBG[16] = { 'G',  'R',  'B',  'G', 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 };
 
+// formats identified by a fourcc in the usual GUID template, higher
+// bit depths either unpacked into 16 bits or MIPI packed, and the
+// compressed frame based ones
+struct FourCCFormat
+{
+	char fourcc[4];
+	USB::ImageBuffer::Format format;
+	int bytesPerPixel;
+	int sampleBits;
+};
+
+static const FourCCFormat theFourCCFormats[] =
+{
+	{ { 'Y', '1', '0', ' ' }, USB::ImageBuffer::Format::MONO_16, 2, 10 },
+	{ { 'Y', '1', '2', ' ' }, USB::ImageBuffer::Format::MONO_16, 2, 12 },
+	{ { 'B', 'G', '1', '0' }, USB::ImageBuffer::Format::BAYER_BGGR, 2, 10 },
+	{ { 'G', 'B', '1', '0' }, USB::ImageBuffer::Format::BAYER_GBRG, 2, 10 },
+	{ { 'B', 'A', '1', '0' }, USB::ImageBuffer::Format::BAYER_GRBG, 2, 10 },
+	{ { 'R', 'G', '1', '0' }, USB::ImageBuffer::Format::BAYER_RGGB, 2, 10 },
+	{ { 'B', 'G', '1', '2' }, USB::ImageBuffer::Format::BAYER_BGGR, 2, 12 },
+	{ { 'G', 'B', '1', '2' }, USB::ImageBuffer::Format::BAYER_GBRG, 2, 12 },
+	{ { 'B', 'A', '1', '2' }, USB::ImageBuffer::Format::BAYER_GRBG, 2, 12 },
+	{ { 'R', 'G', '1', '2' }, USB::ImageBuffer::Format::BAYER_RGGB, 2, 12 },
+	{ { 'Y', '1', '0', 'P' }, USB::ImageBuffer::Format::MONO_10P, 0, 10 },
+	{ { 'Y', '1', '2', 'P' }, USB::ImageBuffer::Format::MONO_12P, 0, 12 },
+	{ { 'p', 'B', 'A', 'A' }, USB::ImageBuffer::Format::BAYER_BGGR_10P, 0, 10 },
+	{ { 'p', 'G', 'A', 'A' }, USB::ImageBuffer::Format::BAYER_GBRG_10P, 0, 10 },
+	{ { 'p', 'g', 'A', 'A' }, USB::ImageBuffer::Format::BAYER_GRBG_10P, 0, 10 },
+	{ { 'p', 'R', 'A', 'A' }, USB::ImageBuffer::Format::BAYER_RGGB_10P, 0, 10 },
+	{ { 'p', 'B', 'C', 'C' }, USB::ImageBuffer::Format::BAYER_BGGR_12P, 0, 12 },
+	{ { 'p', 'G', 'C', 'C' }, USB::ImageBuffer::Format::BAYER_GBRG_12P, 0, 12 },
+	{ { 'p', 'g', 'C', 'C' }, USB::ImageBuffer::Format::BAYER_GRBG_12P, 0, 12 },
+	{ { 'p', 'R', 'C', 'C' }, USB::ImageBuffer::Format::BAYER_RGGB_12P, 0, 12 },
+	{ { 'M', 'J', 'P', 'G' }, USB::ImageBuffer::Format::MJPEG, 0, 8 },
+	{ { 'H', '2', '6', '4' }, USB::ImageBuffer::Format::H264, 0, 8 }
+};
+
+static const FourCCFormat *
+findFourCCFormat( const uint8_t guid[16] )
+{
+	// everything after the fourcc is the same as any other
+	if ( memcmp( guid + 4, UVC_GUID_FORMAT_YUY2 + 4, 12 ) != 0 )
+		return nullptr;
+	for ( const FourCCFormat &f: theFourCCFormats )
+	{
+		if ( memcmp( guid, f.fourcc, 4 ) == 0 )
+			return &f;
+	}
+	return nullptr;
+}
+
 static const uint8_t TIS_EXTENSION_BLOCK_SKYRIS_NEWER[16] = { 0x0a, 0xba, 0x49, 0xde, 0x5c, 0x0b, 0x49, 0xd5, 0x8f, 0x71, 0x0b, 0xe4, 0x0f, 0x94, 0xa6, 0x7a };
 static const uint8_t TIS_EXTENSION_BLOCK_NEXIMAGE[16] = { 0x26, 0x52, 0x21, 0x5a, 0x89, 0x32, 0x56, 0x41, 0x89, 0x4a, 0x5c, 0x55, 0x7c, 0xdf, 0x96, 0x64 };
 
@@ -153,6 +207,31 @@ namespace USB
 ////////////////////////////////////////
 
 
+static size_t
+isoBytesPerInterval( libusb_context *ctxt, const struct libusb_endpoint_descriptor &ep )
+{
+	size_t sz = 0;
+	libusb_ss_endpoint_companion_descriptor *comp = nullptr;
+	if ( ctxt && libusb_get_ss_endpoint_companion_descriptor( ctxt, &ep, &comp ) == LIBUSB_SUCCESS && comp )
+	{
+		sz = comp->wBytesPerInterval;
+		libusb_free_ss_endpoint_companion_descriptor( comp );
+	}
+
+	if ( sz == 0 )
+	{
+		// high speed high-bandwidth endpoints encode extra
+		// transactions per microframe in bits 11-12
+		uint16_t w = ep.wMaxPacketSize;
+		sz = size_t( w & 0x7FF ) * size_t( 1 + ( ( w >> 11 ) & 0x3 ) );
+	}
+	return sz;
+}
+
+
+////////////////////////////////////////
+
+
 std::shared_ptr<Device>
 UVCDevice::factory( libusb_device *dev, const struct libusb_device_descriptor &desc )
 {
@@ -207,6 +286,7 @@ UVCDevice::closeHandle( void )
 
 	myControls.clear();
 	myFormats.clear();
+	myVideoTransfers.clear();
 	Device::closeHandle();
 }
 
@@ -246,8 +326,8 @@ UVCDevice::setBinning( int b )
 		roi.w /= b;
 		roi.h /= b;
 
-		myVidStream.reset( roi.w, roi.h, curFrame.bytesPerLine, curFrame.bytesPerPixel, curFrame.format, 3 );
 		myVidStream.setROI( roi );
+		myVidStream.reset( roi.w, roi.h, curFrame.bytesPerLine, curFrame.bytesPerPixel, curFrame.format );
 	}
 }
 
@@ -309,9 +389,11 @@ UVCDevice::setROI( ROI &roi )
 	}
 	
 	const FrameDefinition &curFrame = myFormats[myCurrentFrame];
-//	myVidStream.reset( curFrame.width, curFrame.height, curFrame.bytesPerLine, curFrame.bytesPerPixel, curFrame.format, 3 );
-	myVidStream.reset( curFrame.width, curFrame.height, curFrame.bytesPerLine, curFrame.bytesPerPixel, curFrame.format, 3 );
+//	myVidStream.reset( curFrame.width, curFrame.height, curFrame.bytesPerLine, curFrame.bytesPerPixel, curFrame.format );
+	// the new ROI has to be in place before reset turns the stream
+	// back on, or the producer can pick up the old one
 	myVidStream.setROI( roi );
+	myVidStream.reset( curFrame.width, curFrame.height, curFrame.bytesPerLine, curFrame.bytesPerPixel, curFrame.format );
 	myLastFID = -1;
 
 	std::cout << "roi set to " << roi.x << ", " << roi.y << " " << roi.w << "x" << roi.h << std::endl;
@@ -393,7 +475,14 @@ UVCDevice::startVideo( size_t &frameIndex )
 		frameIndex = curfrm;
 	}
 
-	const FrameDefinition &curFrame = myFormats[curfrm];
+	FrameDefinition &curFrame = myFormats[curfrm];
+	// the probe has the final word on how big compressed frames get
+	if ( ImageBuffer::isCompressed( curFrame.format ) && curFrame.height > 0 && getLen >= 22 )
+	{
+		size_t h = size_t( curFrame.height );
+		int bpl = int( ( size_t( getInfo.dwMaxVideoFrameSize ) + h - 1 ) / h );
+		curFrame.bytesPerLine = std::max( curFrame.bytesPerLine, bpl );
+	}
 
 	ROI roi;
 	roi.x = 0;
@@ -415,6 +504,12 @@ UVCDevice::startVideo( size_t &frameIndex )
 		throw std::runtime_error( "Error starting video" );
 	}
 
+	// UVC 1.1 reports the clock in the probe, 1.0 only in the header
+	uint32_t clockFreq = myClockFrequency;
+	if ( getLen >= 30 && getInfo.dwClockFrequency != 0 )
+		clockFreq = getInfo.dwClockFrequency;
+	myClock.reset( clockFreq );
+
 	// Give things time to coalesce
 	usleep( 100000 );
 
@@ -425,44 +520,52 @@ UVCDevice::startVideo( size_t &frameIndex )
 	if ( bulkSize == 0 )
 		bulkSize = vidFrameSize;
 
+	// re-starting with the same settings re-uses the transfers
+	// (and buffers) from the last run
+	myVideoTransfers.setContext( myContext );
+	myVideoTransfers.setBufferMode( myBufferMode );
+	TransferPool::Callback cb = std::bind( &UVCDevice::handleVideoTransfer, this, std::placeholders::_1 );
+	myPayloadSize = bulkSize;
 	if ( myVideoXferMode == LIBUSB_TRANSFER_TYPE_BULK )
 	{
-		size_t nXfersNeeded = ( vidFrameSize + bulkSize - 1 ) / bulkSize;
+		// pack several payloads into each transfer, they are split
+		// back apart at the payload size boundaries on completion
+		size_t target = std::min( std::max( myBulkTransferSize, bulkSize ), vidFrameSize );
+		size_t xferSize = ( ( target + bulkSize - 1 ) / bulkSize ) * bulkSize;
+		size_t nXfersNeeded = ( vidFrameSize + xferSize - 1 ) / xferSize;
 
 		// make sure we have a few frames ready to go...
 		if ( nXfersNeeded < 2 )// && myUVCVersion > 0x0100 )
 			nXfersNeeded = 2;
 
-		for ( size_t i = 0; i < nXfersNeeded; ++i )
-		{
-			myVideoTransfers.push_back( std::make_shared<BulkTransfer>( myContext, bulkSize ) );
-		}
+		myVideoTransfers.reserveBulk( myHandle, myVideoEndPoint, nXfersNeeded, xferSize, cb );
+		myVideoStreaming = true;
 	}
 	else if ( myVideoXferMode == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS )
 	{
-		int maxPacketSize = libusb_get_max_iso_packet_size( myDevice, myVideoEndPoint );
-		int numPackets = ( vidFrameSize + maxPacketSize - 1 ) / maxPacketSize;
-
-		myVideoTransfers.push_back( std::make_shared<ISOTransfer>( myContext, numPackets, vidFrameSize, maxPacketSize ) );
+		// alt setting 0 has no bandwidth on iso devices, pick the
+		// smallest one that fits the negotiated payload
+		size_t packetSize = 0;
+		int alt = selectISOAltSetting( bulkSize, packetSize );
+		if ( alt < 0 || packetSize == 0 )
+			throw std::runtime_error( "Unable to find isochronous alternate setting for video" );
+
+		check_error( libusb_set_interface_alt_setting( myHandle, myVideoInterface, alt ) );
+
+		// a ring of smaller transfers so there are always some
+		// queued while completed ones are parsed and resubmitted
+		myVideoTransfers.reserveISO( myHandle, myVideoEndPoint,
+									 myISONumTransfers, myISOPacketsPerTransfer,
+									 packetSize, cb );
+		myVideoStreaming = true;
 	}
 	else
 	{
 		error() << "Unknown video xfer mode" << send;
 	}
 
-	if ( ! myVideoTransfers.empty() )
-	{
-		// init everything prior to submitting all at once
-		for ( auto &s: myVideoTransfers )
-		{
-			s->init( myHandle, myVideoEndPoint );
-			s->setCallback( std::bind( &UVCDevice::handleVideoTransfer, this, std::placeholders::_1 ) );
-		}
-
-		// now start them all
-		for ( auto &s: myVideoTransfers )
-			s->submit();
-	}
+	if ( myVideoStreaming )
+		myVideoTransfers.submitAll( myVideoEndPoint );
 }
 
 
@@ -475,18 +578,18 @@ UVCDevice::stopVideo( void )
 	std::unique_lock<std::mutex> myCBMutex;
 
 	myLastFID = -1;
+	mySkippedFrames = 0;
 	myVidStream.clear();
 	myWorkImage.reset();
+	if ( myDecoder )
+		myDecoder->stop();
 
-	if ( myVideoTransfers.empty() )
+	if ( ! myVideoStreaming )
 		return;
 
-	for ( auto &s: myVideoTransfers )
-	{
-		s->cancel();
-		s->wait();
-	}
-	myVideoTransfers.clear();
+	// keep the transfers around for the next start
+	myVideoTransfers.cancelAll( myVideoEndPoint );
+	myVideoStreaming = false;
 
 	// NB: every time this is called it toggles streaming, so only
 	// call as appropriate
@@ -497,6 +600,89 @@ UVCDevice::stopVideo( void )
 ////////////////////////////////////////
 
 
+void
+UVCDevice::setDecodeMJPEG( bool on )
+{
+	if ( on && ! MJPEGDecoder::available() )
+	{
+		warning() << "MJPEG decoding requested, but built without libjpeg-turbo" << send;
+		return;
+	}
+
+	// the decoder has to exist before the event thread can see the
+	// flag
+	if ( on )
+		decoder();
+	myDecodeMJPEG = on;
+}
+
+
+////////////////////////////////////////
+
+
+MJPEGDecoder &
+UVCDevice::decoder( void )
+{
+	std::call_once( myDecoderOnce, [this]{ myDecoder.reset( new MJPEGDecoder ); } );
+	return *myDecoder;
+}
+
+
+////////////////////////////////////////
+
+
+void
+UVCDevice::setISORing( size_t numTransfers, int packetsPerTransfer )
+{
+	myISONumTransfers = std::max( numTransfers, size_t(2) );
+	myISOPacketsPerTransfer = std::max( packetsPerTransfer, 1 );
+}
+
+
+////////////////////////////////////////
+
+
+UVCDevice::ISOStats
+UVCDevice::isoStats( void ) const
+{
+	ISOStats s;
+	s.transfers = myISOTransferCount.load( std::memory_order_relaxed );
+	s.packets = myISOPacketCount.load( std::memory_order_relaxed );
+	s.packetErrors = myISOPacketErrors.load( std::memory_order_relaxed );
+	s.shortPackets = myISOShortPackets.load( std::memory_order_relaxed );
+	s.emptyPackets = myISOEmptyPackets.load( std::memory_order_relaxed );
+	return s;
+}
+
+
+////////////////////////////////////////
+
+
+void
+UVCDevice::resetISOStats( void )
+{
+	myISOTransferCount = 0;
+	myISOPacketCount = 0;
+	myISOPacketErrors = 0;
+	myISOShortPackets = 0;
+	myISOEmptyPackets = 0;
+}
+
+
+////////////////////////////////////////
+
+
+void
+UVCDevice::collectBufferStats( BufferStats &s ) const
+{
+	Device::collectBufferStats( s );
+	myVideoTransfers.addStats( s );
+}
+
+
+////////////////////////////////////////
+
+
 Control &
 UVCDevice::control( const std::string &name )
 {
@@ -527,12 +713,15 @@ UVCDevice::handleEvent( int endpoint, uint8_t *buf, int buflen, libusb_transfer
 void
 UVCDevice::handleVideoTransfer( libusb_transfer *xfer )
 {
-	uint8_t *buf = xfer->buffer;
-	int buflen = xfer->actual_length;
 	AsyncTransfer *transfer = reinterpret_cast<AsyncTransfer *>( xfer->user_data );
 
 	if ( xfer->status == LIBUSB_TRANSFER_COMPLETED )
-		fillFrame( buf, buflen );
+	{
+		if ( xfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS )
+			handleISOTransfer( xfer );
+		else
+			splitBulkPayloads( xfer->buffer, xfer->actual_length );
+	}
 
 	if ( transfer )
 		transfer->submit();
@@ -542,6 +731,135 @@ UVCDevice::handleVideoTransfer( libusb_transfer *xfer )
 ////////////////////////////////////////
 
 
+void
+UVCDevice::handleISOTransfer( libusb_transfer *xfer )
+{
+	// each packet is its own payload (with its own header), and
+	// they sit at fixed offsets in the buffer regardless of how
+	// much actually arrived, so actual_length on the transfer is
+	// meaningless here
+	myISOTransferCount.fetch_add( 1, std::memory_order_relaxed );
+	myISOPacketCount.fetch_add( uint64_t( xfer->num_iso_packets ), std::memory_order_relaxed );
+
+	for ( int p = 0; p < xfer->num_iso_packets; ++p )
+	{
+		const struct libusb_iso_packet_descriptor &pkt = xfer->iso_packet_desc[p];
+		if ( pkt.status != LIBUSB_TRANSFER_COMPLETED )
+		{
+			myISOPacketErrors.fetch_add( 1, std::memory_order_relaxed );
+			continue;
+		}
+
+		if ( pkt.actual_length == 0 )
+		{
+			myISOEmptyPackets.fetch_add( 1, std::memory_order_relaxed );
+			continue;
+		}
+
+		if ( pkt.actual_length < pkt.length )
+			myISOShortPackets.fetch_add( 1, std::memory_order_relaxed );
+
+		uint8_t *buf = libusb_get_iso_packet_buffer_simple( xfer, unsigned(p) );
+		fillFrame( buf, int(pkt.actual_length) );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+void
+UVCDevice::splitBulkPayloads( uint8_t *buf, int buflen )
+{
+	// a bulk transfer keeps filling with payloads until the device
+	// sends a short one, so every payload but the last in a transfer
+	// is exactly the negotiated size and the headers sit on those
+	// boundaries
+	int payload = int( myPayloadSize );
+	if ( payload <= 0 || buflen <= payload )
+	{
+		fillFrame( buf, buflen );
+		return;
+	}
+
+	while ( buflen > 0 )
+	{
+		int n = std::min( buflen, payload );
+		const PayloadHeader *hdr = reinterpret_cast<const PayloadHeader *>( buf );
+		if ( hdr->bLength < 2 || hdr->bLength > 12 || int(hdr->bLength) > n )
+		{
+			warning() << "Lost payload framing in bulk transfer, dropping " << buflen << " bytes" << send;
+			return;
+		}
+
+		fillFrame( buf, n );
+		buf += n;
+		buflen -= n;
+	}
+}
+
+
+////////////////////////////////////////
+
+
+int
+UVCDevice::selectISOAltSetting( size_t payloadSize, size_t &packetSize )
+{
+	packetSize = 0;
+	if ( myConfigs.empty() )
+		return -1;
+
+	const struct libusb_config_descriptor &conf = *(myConfigs[myCurConfig]);
+	int best = -1;
+	size_t bestSize = 0;
+	int largest = -1;
+	size_t largestSize = 0;
+	for ( size_t iface = 0; iface < conf.bNumInterfaces; ++iface )
+	{
+		const struct libusb_interface &curIface = conf.interface[iface];
+		for ( int curset = 0; curset < curIface.num_altsetting; ++curset )
+		{
+			const struct libusb_interface_descriptor &iFaceDesc = curIface.altsetting[curset];
+			if ( int(iFaceDesc.bInterfaceNumber) != myVideoInterface )
+				continue;
+
+			for ( int ep = 0, nep = int(iFaceDesc.bNumEndpoints); ep < nep; ++ep )
+			{
+				const struct libusb_endpoint_descriptor &epDesc = iFaceDesc.endpoint[ep];
+				if ( epDesc.bEndpointAddress != myVideoEndPoint )
+					continue;
+
+				size_t sz = isoBytesPerInterval( myContext, epDesc );
+				if ( sz >= payloadSize && ( best < 0 || sz < bestSize ) )
+				{
+					best = iFaceDesc.bAlternateSetting;
+					bestSize = sz;
+				}
+				if ( sz > largestSize )
+				{
+					largest = iFaceDesc.bAlternateSetting;
+					largestSize = sz;
+				}
+			}
+		}
+	}
+
+	if ( best < 0 )
+	{
+		if ( largest >= 0 )
+			warning() << "No alternate setting fits payload size " << payloadSize << ", using largest (" << largestSize << " bytes)" << send;
+		best = largest;
+		bestSize = largestSize;
+	}
+
+	packetSize = bestSize;
+	return best;
+}
+
+
+////////////////////////////////////////
+
+
 void
 UVCDevice::fillFrame( uint8_t *buf, int buflen )
 {
@@ -554,73 +872,186 @@ UVCDevice::fillFrame( uint8_t *buf, int buflen )
 	bool newFrame = false;
 	bool isEOF = false;
 
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	int64_t nowNS = int64_t( now.tv_sec ) * 1000000000LL + int64_t( now.tv_nsec );
+
+	// header is bLength, flags then PTS and SCR if their flag bits
+	// are set, newer devices may append more which we skip
 	const PayloadHeader *hdr = reinterpret_cast<const PayloadHeader *>( buf );
-	if ( hdr->bLength == 2 || hdr->bLength == 12 )
+	if ( buflen < 2 || hdr->bLength < 2 || hdr->bLength > buflen )
 	{
-		uint8_t status = hdr->bPayloadFlags;
+		error() << "Unknown image data header size: " << int(hdr->bLength) << send;
+		return;
+	}
 
-		int fid = ( status & UVC_STREAM_FID );
-		if ( fid != myLastFID )
-		{
-			newFrame = true;
-			myLastFID = fid;
-		}
+	uint8_t status = hdr->bPayloadFlags;
+	int hdrLen = hdr->bLength;
 
-		if ( ( status & UVC_STREAM_EOF ) != 0 )
-			isEOF = true;
+	int fid = ( status & UVC_STREAM_FID );
+	if ( fid != myLastFID )
+	{
+		newFrame = true;
+		myLastFID = fid;
+		++myFrameSequence;
+	}
+
+	if ( ( status & UVC_STREAM_EOF ) != 0 )
+		isEOF = true;
 
-		buf += hdr->bLength;
-		buflen -= hdr->bLength;
+	bool hasPTS = false;
+	bool hasSCR = false;
+	uint32_t pts = 0;
+	uint32_t stc = 0;
+	uint16_t sof = 0;
+	int off = 2;
+	if ( ( status & UVC_STREAM_PTS ) != 0 && off + 4 <= hdrLen )
+	{
+		memcpy( &pts, buf + off, 4 );
+		off += 4;
+		hasPTS = true;
 	}
-	else
+	if ( ( status & UVC_STREAM_SCR ) != 0 && off + 6 <= hdrLen )
 	{
-		error() << "Unknown image data header size: " << int(hdr->bLength) << send;
-		return;
+		memcpy( &stc, buf + off, 4 );
+		memcpy( &sof, buf + off + 4, 2 );
+		sof &= 0x7FF;
+		hasSCR = true;
+		myClock.addSample( stc, sof, nowNS );
 	}
 
+	buf += hdrLen;
+	buflen -= hdrLen;
+
 	std::unique_lock<std::mutex> myCBMutex;
+	std::shared_ptr<FrameJournal> jnl = std::atomic_load( &myJournal );
 
 	if ( newFrame )
 	{
 		if ( myWorkImage )
 		{
 			if ( ! myWorkImage->empty() )
-			{
-				if ( myImageCB )
-					myImageCB( myWorkImage );
-				else
-					myVidStream.put( myWorkImage );
-
-				myWorkImage = myVidStream.get();
-			}
+				finishFrame( false );
 		}
 		else
 		{
-			myWorkImage = myVidStream.get();
+			myWorkImage = myVidStream.acquire();
+		}
+
+		if ( ! myWorkImage )
+			++mySkippedFrames;
+
+		if ( jnl )
+		{
+			// a frame with no buffer, or that never saw an EOF
+			jnl->commit();
+			const FrameDefinition &curFrame = myFormats[myCurrentFrame];
+			jnl->beginFrame( curFrame.format, curFrame.width, curFrame.height,
+							 curFrame.bytesPerLine, curFrame.bytesPerPixel,
+							 myVidStream.roi(), myFrameSequence, nowNS );
 		}
 	}
 
+	if ( jnl )
+	{
+		jnl->addData( buf, size_t( buflen ) );
+		if ( isEOF && ! myWorkImage )
+			jnl->commit();
+	}
+
+	if ( myWorkImage )
+	{
+		FrameInfo &info = myWorkImage->info();
+		if ( info.payloads == 0 )
+		{
+			info.sequence = myFrameSequence;
+			info.skipped = mySkippedFrames;
+			info.firstPayloadNS = nowNS;
+			mySkippedFrames = 0;
+		}
+		++info.payloads;
+		info.lastPayloadNS = nowNS;
+		if ( ( status & UVC_STREAM_ERR ) != 0 )
+			info.flags |= FrameInfo::ERR_STREAM;
+		if ( hasPTS )
+		{
+			info.pts = pts;
+			info.flags |= FrameInfo::HAS_PTS;
+		}
+		if ( hasSCR )
+		{
+			info.scrSTC = stc;
+			info.scrSOF = sof;
+			info.scrHostNS = nowNS;
+			info.flags |= FrameInfo::HAS_SCR;
+		}
+	}
+
+	// compressed frames are whatever arrives up to the EOF, running
+	// out of room just drops the rest of the frame
+	bool variable = myWorkImage && ImageBuffer::isCompressed( myWorkImage->format() );
 	while ( myWorkImage && buflen > 0 )
 	{
 		int curLeft = buflen;
-		if ( myWorkImage->addData( buf, curLeft ) || isEOF )
+		bool full = myWorkImage->addData( buf, curLeft );
+		if ( full || isEOF )
 		{
-			if ( myImageCB )
-				myImageCB( myWorkImage );
-			else
-				myVidStream.put( myWorkImage );
-
-			myWorkImage = myVidStream.get();
 			// stop processing buffer at this point...
 			if ( curLeft > 0 )
 			{
+				myWorkImage->info().flags |= FrameInfo::ERR_OVERRUN;
 //				warning() << "Skipping rest of buffer -- at eof (" << curLeft << " bytes left)" << send;
 			}
+			if ( isEOF || ! variable )
+				finishFrame( isEOF );
 			break;
 		}
 		buf += buflen - curLeft;
 		buflen = curLeft;
 	}
+
+	// the EOF payload of a compressed frame may be just the header
+	if ( variable && isEOF && buflen == 0 && myWorkImage && ! myWorkImage->empty() )
+		finishFrame( true );
+}
+
+
+////////////////////////////////////////
+
+
+void
+UVCDevice::finishFrame( bool sawEOF )
+{
+	FrameInfo &info = myWorkImage->info();
+	bool compressed = ImageBuffer::isCompressed( myWorkImage->format() );
+	if ( myWorkImage->partial() || ( compressed && ! sawEOF ) )
+		info.flags |= FrameInfo::ERR_SHORT;
+	if ( ( info.flags & FrameInfo::HAS_PTS ) != 0 )
+		info.captureNS = myClock.toHost( info.pts );
+
+	std::shared_ptr<FrameJournal> jnl = std::atomic_load( &myJournal );
+	if ( jnl )
+		jnl->commit( &info );
+
+	std::shared_ptr<Recorder> rec = std::atomic_load( &myRecorder );
+	if ( rec && compressed )
+		rec->write( myWorkImage );
+
+	if ( myDecodeMJPEG && myWorkImage->format() == ImageBuffer::Format::MJPEG )
+	{
+		// the decoder holds on to it until it is handed on
+		myVidStream.done( myWorkImage );
+		myDecoder->submit( myWorkImage );
+	}
+	else if ( myImageCB )
+	{
+		myVidStream.done( myWorkImage );
+		myImageCB( myWorkImage );
+	}
+	else
+		myVidStream.publish( myWorkImage );
+
+	myWorkImage = myVidStream.acquire();
 }
 
 
@@ -697,6 +1128,7 @@ UVCDevice::addFormats( const uint8_t iface, const unsigned char *buffer, int buf
 
 	uint8_t fmtIdx = 0;
 	int bpp = 0;
+	int sampleBits = 0;
 	ImageBuffer::Format fmt = ImageBuffer::Format::UNKNOWN;
 	while ( buflen > 2 && buffer[1] == USB_DT_CS_INTERFACE )
 	{
@@ -707,16 +1139,30 @@ UVCDevice::addFormats( const uint8_t iface, const unsigned char *buffer, int buf
 			case UVC_VS_FORMAT_UNCOMPRESSED:
 			case UVC_VS_FORMAT_FRAME_BASED:
 				skipToNextFmt = false;
-				if ( ! addFormat( fmtIdx, bpp, fmt, buffer, buflen ) )
+				if ( ! addFormat( fmtIdx, bpp, sampleBits, fmt, buffer, buflen ) )
 					skipToNextFmt = true;
 				break;
 			case UVC_VS_FRAME_UNCOMPRESSED:
 				if ( ! skipToNextFmt )
-					addFrameUncompressed( iface, fmtIdx, bpp, fmt, buffer, buflen );
+					addFrameUncompressed( iface, fmtIdx, bpp, sampleBits, fmt, buffer, buflen );
 				break;
 			case UVC_VS_FRAME_FRAME_BASED:
 				if ( ! skipToNextFmt )
-					addFrameFrameBased( iface, fmtIdx, bpp, fmt, buffer, buflen );
+					addFrameFrameBased( iface, fmtIdx, bpp, sampleBits, fmt, buffer, buflen );
+				break;
+			case UVC_VS_FORMAT_MJPEG:
+				if ( buflen >= UVC_DT_FORMAT_MJPEG_SIZE )
+				{
+					const uvc_format_mjpeg *mjpg = reinterpret_cast<const uvc_format_mjpeg *>( buffer );
+					fmtIdx = mjpg->bFormatIndex;
+					bpp = 0;
+					sampleBits = 8;
+					fmt = ImageBuffer::Format::MJPEG;
+				}
+				break;
+			case UVC_VS_FRAME_MJPEG:
+				if ( fmt == ImageBuffer::Format::MJPEG )
+					addFrameMJPEG( iface, fmtIdx, buffer, buflen );
 				break;
 
 			case UVC_VS_STILL_IMAGE_FRAME:
@@ -736,15 +1182,23 @@ UVCDevice::addFormats( const uint8_t iface, const unsigned char *buffer, int buf
 
 
 bool
-UVCDevice::addFormat( uint8_t &fmtidx, int &bpp, ImageBuffer::Format &fmtType, const unsigned char *buffer, int buflen )
+UVCDevice::addFormat( uint8_t &fmtidx, int &bpp, int &sampleBits, ImageBuffer::Format &fmtType, const unsigned char *buffer, int buflen )
 {
 	const uvc_format_uncompressed *fmt = reinterpret_cast<const uvc_format_uncompressed *>( buffer );
 
 	fmtidx = fmt->bFormatIndex;
 	bpp = fmt->bBitsPerPixel / 8;
+	sampleBits = bpp * 8;
 
 	bool ok = true;
-	if ( matchGUID( fmt->guidFormat, UVC_GUID_FORMAT_YUY2 ) )
+	const FourCCFormat *fcc = findFourCCFormat( fmt->guidFormat );
+	if ( fcc )
+	{
+		fmtType = fcc->format;
+		bpp = fcc->bytesPerPixel;
+		sampleBits = fcc->sampleBits;
+	}
+	else if ( matchGUID( fmt->guidFormat, UVC_GUID_FORMAT_YUY2 ) )
 	{
 		info() << "Format claims to be YUY2, but is it?" << send;
 		//nfmt.frameFmt = FrameFormat::YUY2;
@@ -796,7 +1250,7 @@ UVCDevice::addFormat( uint8_t &fmtidx, int &bpp, ImageBuffer::Format &fmtType, c
 
 
 void
-UVCDevice::addFrameUncompressed( uint8_t iface, uint8_t fmtidx, int bpp, ImageBuffer::Format frmfmt, const unsigned char *buffer, int buflen )
+UVCDevice::addFrameUncompressed( uint8_t iface, uint8_t fmtidx, int bpp, int sampleBits, ImageBuffer::Format frmfmt, const unsigned char *buffer, int buflen )
 {
 	const uvc_frame_uncompressed *fmt = reinterpret_cast<const uvc_frame_uncompressed *>( buffer );
 
@@ -807,8 +1261,12 @@ UVCDevice::addFrameUncompressed( uint8_t iface, uint8_t fmtidx, int bpp, ImageBu
 	f.interface = iface;
 	f.format = frmfmt;
 	f.width = int(fmt->wWidth);
-	int bpl = bpp * f.width;
-	if ( myUVCVersion <= 0x0100 )
+	int bpl = static_cast<int>( ImageBuffer::rowBytes( frmfmt, bpp, f.width ) );
+	if ( ImageBuffer::packedBits( frmfmt ) > 0 )
+	{
+		// whole rows of packed pixels, nothing to fix up
+	}
+	else if ( myUVCVersion <= 0x0100 )
 	{
 		f.width *= bpp;
 		bpp = 1;
@@ -820,6 +1278,7 @@ UVCDevice::addFrameUncompressed( uint8_t iface, uint8_t fmtidx, int bpp, ImageBu
 	f.height = int(fmt->wHeight);
 	f.bytesPerLine = bpl;
 	f.bytesPerPixel = bpp;
+	f.sampleBits = sampleBits;
 	f.defaultFrameInterval = fmt->dwDefaultFrameInterval;
 
 	if ( fmt->bFrameIntervalType == 0 )
@@ -851,7 +1310,7 @@ UVCDevice::addFrameUncompressed( uint8_t iface, uint8_t fmtidx, int bpp, ImageBu
 
 
 void
-UVCDevice::addFrameFrameBased( uint8_t iface, uint8_t fmtidx, int bpp, ImageBuffer::Format frmfmt, const unsigned char *buffer, int buflen )
+UVCDevice::addFrameFrameBased( uint8_t iface, uint8_t fmtidx, int bpp, int sampleBits, ImageBuffer::Format frmfmt, const unsigned char *buffer, int buflen )
 {
 	const uvc_frame_frame_based *fmt = reinterpret_cast<const uvc_frame_frame_based *>( buffer );
 
@@ -863,7 +1322,14 @@ UVCDevice::addFrameFrameBased( uint8_t iface, uint8_t fmtidx, int bpp, ImageBuff
 	f.width = int(fmt->wWidth);
 	f.height = int(fmt->wHeight);
 	f.bytesPerLine = fmt->dwBytesPerLine;
+	if ( f.bytesPerLine == 0 )
+		f.bytesPerLine = static_cast<int>( ImageBuffer::rowBytes( frmfmt, bpp, f.width ) );
+	// compressed, no lines and no buffer size given, so assume no
+	// worse than 16 bits per pixel until the probe says otherwise
+	if ( ImageBuffer::isCompressed( frmfmt ) )
+		f.bytesPerLine = f.width * 2;
 	f.bytesPerPixel = bpp;
+	f.sampleBits = sampleBits;
 	f.defaultFrameInterval = fmt->dwDefaultFrameInterval;
 	if ( fmt->bFrameIntervalType == 0 )
 	{
@@ -893,6 +1359,62 @@ UVCDevice::addFrameFrameBased( uint8_t iface, uint8_t fmtidx, int bpp, ImageBuff
 ////////////////////////////////////////
 
 
+void
+UVCDevice::addFrameMJPEG( uint8_t iface, uint8_t fmtidx, const unsigned char *buffer, int buflen )
+{
+	if ( buflen < UVC_DT_FRAME_MJPEG_SIZE(0) )
+		return;
+
+	const uvc_frame_mjpeg *fmt = reinterpret_cast<const uvc_frame_mjpeg *>( buffer );
+
+	FrameDefinition f;
+	f.format_index = fmtidx;
+	f.frame_index = fmt->bFrameIndex;
+	f.interface = iface;
+	f.format = ImageBuffer::Format::MJPEG;
+	f.width = int(fmt->wWidth);
+	f.height = int(fmt->wHeight);
+	// there are no lines, but frames are held as height rows of
+	// this, so size it for the largest frame. UVC 1.5 deprecates
+	// the buffer size, in which case assume no worse than 16 bits
+	// per pixel until the probe says otherwise
+	size_t maxFrame = fmt->dwMaxVideoFrameBufferSize;
+	if ( maxFrame == 0 )
+		maxFrame = size_t( f.width ) * size_t( f.height ) * 2;
+	f.bytesPerLine = f.height > 0 ? int( ( maxFrame + size_t( f.height ) - 1 ) / size_t( f.height ) ) : 0;
+	f.bytesPerPixel = 0;
+	f.sampleBits = 8;
+	f.defaultFrameInterval = fmt->dwDefaultFrameInterval;
+
+	if ( fmt->bFrameIntervalType == 0 )
+	{
+		if ( fmt->bLength < 38 )
+		{
+			error() << "Invalid mjpeg frame specification: interval type 0, expecting frame length at least 38, got " << int(fmt->bLength) << send;
+			return;
+		}
+
+		f.variableFrameInterval = true;
+		f.availableIntervals.resize( 3 );
+		f.availableIntervals[0] = fmt->dwFrameInterval[0];
+		f.availableIntervals[1] = fmt->dwFrameInterval[1];
+		f.availableIntervals[2] = fmt->dwFrameInterval[2];
+	}
+	else
+	{
+		f.variableFrameInterval = false;
+		f.availableIntervals.resize( size_t(fmt->bFrameIntervalType) );
+		for ( size_t i = 0; i < f.availableIntervals.size(); ++i )
+			f.availableIntervals[i] = fmt->dwFrameInterval[i];
+	}
+
+	myFormats.push_back( f );
+}
+
+
+////////////////////////////////////////
+
+
 void
 UVCDevice::addControls( const uint8_t iface, const unsigned char *buffer, int buflen )
 {
@@ -909,6 +1431,7 @@ UVCDevice::addControls( const uint8_t iface, const unsigned char *buffer, int bu
 					{
 						const uvc_header_descriptor *header = reinterpret_cast<const uvc_header_descriptor *>( desc );
 						myUVCVersion = header->bcdUVC;
+						myClockFrequency = header->dwClockFrequency;
 					}
 					break;
 				case UVC_VC_INPUT_TERMINAL:
@@ -1006,7 +1529,7 @@ UVCDevice::parseControls( const uint8_t iface, const uint16_t terminal,
 				tag = "Unknown Unit Test";
 				break;
 		}
-		fkCtrl.init( tag, myHandle, myControlEndPoint, unit, iface, terminal, myContext );
+		fkCtrl.init( tag, myHandle, myControlEndPoint, unit, iface, terminal, myContext, myCache.get() );
 		if ( fkCtrl.valid() )
 			info() << fkCtrl << send;
 	}
@@ -1138,7 +1661,7 @@ UVCDevice::parseControls( const uint8_t iface, const uint16_t terminal,
 			bool skipped = true;
 			try
 			{
-				newCtrl->init( name, myHandle, myControlEndPoint, unit, iface, terminal, myContext );
+				newCtrl->init( name, myHandle, myControlEndPoint, unit, iface, terminal, myContext, myCache.get() );
 				
 				if ( newCtrl->valid() )
 				{
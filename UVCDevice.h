@@ -28,10 +28,16 @@
 
 #include "Device.h"
 #include "Stream.h"
+#include "ClockRecovery.h"
+#include "Recorder.h"
+#include "FrameJournal.h"
 #include "Control.h"
 #include <string>
 #include <vector>
 #include <functional>
+#include <atomic>
+#include <memory>
+#include <mutex>
 
 
 ////////////////////////////////////////
@@ -46,6 +52,8 @@
 namespace USB
 {
 
+class MJPEGDecoder;
+
 // strictly speaking, this is a tiered thing where formats have
 // frames, but collapse here since the primary interest is frames and
 // formats are just collections
@@ -61,6 +69,8 @@ struct FrameDefinition
 	int height;
 	int bytesPerLine;
 	int bytesPerPixel;
+	// significant bits in each sample, i.e. 10 for Y10
+	int sampleBits;
 
 	uint32_t defaultFrameInterval;
 	bool variableFrameInterval;
@@ -73,7 +83,20 @@ struct FrameDefinition
 class UVCDevice : public Device
 {
 public:
-	typedef std::function<void (const std::shared_ptr<ImageBuffer> &imgBuf)> ImageReceivedCallback;
+	// called on the thread handling events, the frame returns to the
+	// stream once the last copy of the reference is dropped
+	typedef std::function<void (const FrameRef &imgBuf)> ImageReceivedCallback;
+
+	struct ISOStats
+	{
+		uint64_t transfers = 0;
+		uint64_t packets = 0;
+		uint64_t packetErrors = 0;
+		// less than the full packet length, normal at the end of a
+		// payload, but a lot of them mid-frame point at bandwidth issues
+		uint64_t shortPackets = 0;
+		uint64_t emptyPackets = 0;
+	};
 
 	static std::shared_ptr<Device> factory( libusb_device *dev, const struct libusb_device_descriptor &desc );
 
@@ -97,6 +120,34 @@ public:
 	void stopVideo( void );
 
 	VideoStream &getVideoStream( void ) { return myVidStream; }
+	// when on, MJPEG frames go to decoder() instead of the video
+	// stream or image callback, and come out of it in order. Stays
+	// off if MJPEGDecoder isn't available
+	void setDecodeMJPEG( bool on );
+	bool decodeMJPEG( void ) const { return myDecodeMJPEG; }
+	// created on first use
+	MJPEGDecoder &decoder( void );
+
+	// compressed frames are also handed to the recorder, and still
+	// go on to the decoder, image callback or video stream as usual
+	void setRecorder( const std::shared_ptr<Recorder> &r = std::shared_ptr<Recorder>() ) { std::atomic_store( &myRecorder, r ); }
+
+	// payloads are also copied straight into the journal as they
+	// arrive, whether or not the stream has a buffer for the frame
+	void setJournal( const std::shared_ptr<FrameJournal> &j = std::shared_ptr<FrameJournal>() ) { std::atomic_store( &myJournal, j ); }
+
+	// device clock to host time mapping, fed from the payload SCRs
+	const ClockRecovery &clock( void ) const { return myClock; }
+
+	// number of isochronous transfers kept in flight, and the number
+	// of packets in each, takes effect on the next startVideo
+	void setISORing( size_t numTransfers, int packetsPerTransfer );
+	ISOStats isoStats( void ) const;
+	void resetISOStats( void );
+
+	// target size of each bulk video transfer, rounded up to a whole
+	// number of payloads, takes effect on the next startVideo
+	void setBulkTransferSize( size_t bytes ) { myBulkTransferSize = bytes; }
 
 	size_t getNumControls( void ) const { return myControls.size(); };
 	Control &control( size_t i ) { return (*myControls[i]); }
@@ -107,7 +158,12 @@ protected:
 	virtual bool handleEvent( int endpoint, uint8_t *buf, int buflen, libusb_transfer *xfer );
 
 	void handleVideoTransfer( libusb_transfer *xfer );
+	void handleISOTransfer( libusb_transfer *xfer );
+	void splitBulkPayloads( uint8_t *buf, int buflen );
+	int selectISOAltSetting( size_t payloadSize, size_t &packetSize );
 	void fillFrame( uint8_t *buf, int buflen );
+	// a compressed frame that ends without its EOF lost its tail
+	void finishFrame( bool sawEOF );
 
 	virtual bool wantInterface( const struct libusb_interface_descriptor &iface );
 
@@ -116,9 +172,10 @@ protected:
 	virtual void parseInterface( uint8_t inum, const struct libusb_interface_descriptor &ifacedesc );
 
 	void addFormats( const uint8_t iface, const unsigned char *buffer, int buflen );
-	bool addFormat( uint8_t &fmtidx, int &bpp, ImageBuffer::Format &fmt, const unsigned char *buffer, int buflen );
-	void addFrameUncompressed( uint8_t iface, uint8_t fmtidx, int bpp, ImageBuffer::Format fmt, const unsigned char *buffer, int buflen );
-	void addFrameFrameBased( uint8_t iface, uint8_t fmtidx, int bpp, ImageBuffer::Format fmt, const unsigned char *buffer, int buflen );
+	bool addFormat( uint8_t &fmtidx, int &bpp, int &sampleBits, ImageBuffer::Format &fmt, const unsigned char *buffer, int buflen );
+	void addFrameUncompressed( uint8_t iface, uint8_t fmtidx, int bpp, int sampleBits, ImageBuffer::Format fmt, const unsigned char *buffer, int buflen );
+	void addFrameFrameBased( uint8_t iface, uint8_t fmtidx, int bpp, int sampleBits, ImageBuffer::Format fmt, const unsigned char *buffer, int buflen );
+	void addFrameMJPEG( uint8_t iface, uint8_t fmtidx, const unsigned char *buffer, int buflen );
 
 	void addControls( const uint8_t iface, const unsigned char *buffer, int buflen );
 	void parseControls( const uint8_t iface, const uint16_t terminal,
@@ -127,6 +184,8 @@ protected:
 
 	virtual void dumpExtraInterfaceInfo( std::ostream &os, const struct libusb_interface_descriptor &iface );
 
+	virtual void collectBufferStats( BufferStats &s ) const;
+
 	void dumpControls( std::ostream &os, const uint8_t type, const uint8_t *bmControls, int bControlSize );
 	void dumpStandardControls( std::ostream &os, const unsigned char *buffer, int buflen, bool skipIfNoCS = false );
 	void dumpFormats( std::ostream &os, const unsigned char *buffer, int buflen );
@@ -206,7 +265,18 @@ protected:
 	std::vector<FrameDefinition> myFormats;
 	size_t myCurrentFrame = 0;
 
-	std::vector<std::shared_ptr<AsyncTransfer>> myVideoTransfers;
+	TransferPool myVideoTransfers;
+	bool myVideoStreaming = false;
+	size_t myPayloadSize = 0;
+	size_t myBulkTransferSize = 4 * 1024 * 1024;
+	size_t myISONumTransfers = 8;
+	int myISOPacketsPerTransfer = 32;
+
+	std::atomic<uint64_t> myISOTransferCount{0};
+	std::atomic<uint64_t> myISOPacketCount{0};
+	std::atomic<uint64_t> myISOPacketErrors{0};
+	std::atomic<uint64_t> myISOShortPackets{0};
+	std::atomic<uint64_t> myISOEmptyPackets{0};
 	VideoStream myVidStream;
 
 	static const int roiOFFSET_X = 0;
@@ -218,9 +288,20 @@ protected:
 	std::shared_ptr<Control> myROIControls[roiNUM_ROI];
 	bool mySupportsROI = false;
 
-	std::shared_ptr<ImageBuffer> myWorkImage;
+	FrameRef myWorkImage;
 
 	int myLastFID = -1;
+	uint64_t myFrameSequence = 0;
+	uint32_t mySkippedFrames = 0;
+
+	uint32_t myClockFrequency = 0;
+	ClockRecovery myClock;
+
+	std::atomic<bool> myDecodeMJPEG{false};
+	std::once_flag myDecoderOnce;
+	std::unique_ptr<MJPEGDecoder> myDecoder;
+	std::shared_ptr<Recorder> myRecorder;
+	std::shared_ptr<FrameJournal> myJournal;
 
 	std::vector<std::shared_ptr<Control>> myControls;
 
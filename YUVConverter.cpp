@@ -0,0 +1,570 @@
+// YUVConverter.cpp -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#include "YUVConverter.h"
+#include <cmath>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
+
+
+////////////////////////////////////////
+
+
+namespace USB
+{
+
+// the row kernels for one instruction set. Each returns how many
+// pixels it did, the scalar code finishes the row
+struct YUVKernels
+{
+	int (*rgbRow)( const YUVConverter::Coeffs &k, const uint8_t *src, bool uyvy, int w, uint8_t *dst, YUVConverter::Layout l );
+	int (*planarRows)( const uint8_t *r0, const uint8_t *r1, bool uyvy, int w,
+					   uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint8_t *uv );
+	int (*lumaRow)( const uint8_t *src, bool uyvy, int w, uint8_t *y );
+};
+
+} // namespace USB
+
+
+////////////////////////////////////////
+
+
+namespace
+{
+
+using USB::YUVConverter;
+typedef YUVConverter::Coeffs Coeffs;
+typedef YUVConverter::Layout Layout;
+
+///
+/// Each channel is worked out in units of 1/4, as a sum of terms
+/// mulhi( x << 5, c ) = 4 * x * c / 8192, with the coefficients in
+/// 3.13 fixed point, which keeps everything inside 16 bits. The
+/// scalar code below does the same arithmetic so the results match.
+///
+static inline int
+mulhi( int a, int b )
+{
+	return ( a * b ) >> 16;
+}
+
+static inline uint8_t
+finish( int v )
+{
+	v = ( v + 2 ) >> 2;
+	return static_cast<uint8_t>( v < 0 ? 0 : ( v > 255 ? 255 : v ) );
+}
+
+static inline void
+pixelRGB( const Coeffs &k, int y, int u, int v, uint8_t *rgb )
+{
+	int y4 = mulhi( ( y - k.yOffset ) << 5, k.yScale );
+	int u5 = ( u - 128 ) << 5;
+	int v5 = ( v - 128 ) << 5;
+	rgb[0] = finish( y4 + mulhi( v5, k.rv ) );
+	rgb[1] = finish( y4 - mulhi( u5, k.gu ) - mulhi( v5, k.gv ) );
+	rgb[2] = finish( y4 + mulhi( u5, k.bu ) );
+}
+
+// scalar conversion of pixels [x, w) of a row
+static void
+rgbTail( const Coeffs &k, const uint8_t *src, bool uyvy, int x, int w, uint8_t *dst, Layout l )
+{
+	const int yo = uyvy ? 1 : 0;
+	const int co = uyvy ? 0 : 1;
+	int bpp = l == Layout::RGB24 ? 3 : 4;
+	for ( ; x < w; ++x )
+	{
+		const uint8_t *pair = src + ( x & ~1 ) * 2;
+		uint8_t rgb[3];
+		pixelRGB( k, src[x * 2 + yo], pair[co], pair[co + 2], rgb );
+		uint8_t *d = dst + x * bpp;
+		if ( l == Layout::BGRA )
+		{
+			d[0] = rgb[2];
+			d[1] = rgb[1];
+			d[2] = rgb[0];
+		}
+		else
+		{
+			d[0] = rgb[0];
+			d[1] = rgb[1];
+			d[2] = rgb[2];
+		}
+		if ( bpp == 4 )
+			d[3] = 255;
+	}
+}
+
+// scalar conversion of pixels [x, w) of a pair of rows to planar
+static void
+planarTail( const uint8_t *r0, const uint8_t *r1, bool uyvy, int x, int w,
+			uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint8_t *uv )
+{
+	const int yo = uyvy ? 1 : 0;
+	const int co = uyvy ? 0 : 1;
+	for ( ; x < w; x += 2 )
+	{
+		const uint8_t *a = r0 + x * 2;
+		const uint8_t *b = r1 + x * 2;
+		y0[x] = a[yo];
+		y0[x + 1] = a[yo + 2];
+		if ( y1 )
+		{
+			y1[x] = b[yo];
+			y1[x + 1] = b[yo + 2];
+		}
+		uint8_t cu = static_cast<uint8_t>( ( a[co] + b[co] + 1 ) >> 1 );
+		uint8_t cv = static_cast<uint8_t>( ( a[co + 2] + b[co + 2] + 1 ) >> 1 );
+		if ( uv )
+		{
+			uv[x] = cu;
+			uv[x + 1] = cv;
+		}
+		else
+		{
+			u[x / 2] = cu;
+			v[x / 2] = cv;
+		}
+	}
+}
+
+
+////////////////////////////////////////
+
+
+namespace scalar
+{
+
+static int rgbRow( const Coeffs &, const uint8_t *, bool, int, uint8_t *, Layout ) { return 0; }
+static int planarRows( const uint8_t *, const uint8_t *, bool, int, uint8_t *, uint8_t *, uint8_t *, uint8_t *, uint8_t * ) { return 0; }
+static int lumaRow( const uint8_t *, bool, int, uint8_t * ) { return 0; }
+
+} // namespace scalar
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#if defined(__clang__)
+# pragma clang attribute push (__attribute__((target("sse2"))), apply_to = function)
+#else
+# pragma GCC push_options
+# pragma GCC target("sse2")
+#endif
+
+namespace sse2
+{
+
+struct Vec
+{
+	static const int W = 16;
+	typedef __m128i V;
+
+	static inline V load( const uint8_t *p ) { return _mm_loadu_si128( reinterpret_cast<const __m128i *>( p ) ); }
+	static inline void store( uint8_t *p, V v ) { _mm_storeu_si128( reinterpret_cast<__m128i *>( p ), v ); }
+	static inline void storeHalf( uint8_t *p, V v ) { _mm_storel_epi64( reinterpret_cast<__m128i *>( p ), v ); }
+	static inline V set16( int16_t x ) { return _mm_set1_epi16( x ); }
+	static inline V set32( int32_t x ) { return _mm_set1_epi32( x ); }
+	static inline V add16( V a, V b ) { return _mm_add_epi16( a, b ); }
+	static inline V sub16( V a, V b ) { return _mm_sub_epi16( a, b ); }
+	static inline V mulhi16( V a, V b ) { return _mm_mulhi_epi16( a, b ); }
+	static inline V min16( V a, V b ) { return _mm_min_epi16( a, b ); }
+	static inline V max16( V a, V b ) { return _mm_max_epi16( a, b ); }
+	static inline V and_( V a, V b ) { return _mm_and_si128( a, b ); }
+	static inline V or_( V a, V b ) { return _mm_or_si128( a, b ); }
+	static inline V avg8( V a, V b ) { return _mm_avg_epu8( a, b ); }
+	template <int N> static inline V slli16( V a ) { return _mm_slli_epi16( a, N ); }
+	template <int N> static inline V srli16( V a ) { return _mm_srli_epi16( a, N ); }
+	template <int N> static inline V srai16( V a ) { return _mm_srai_epi16( a, N ); }
+	template <int N> static inline V srli32( V a ) { return _mm_srli_epi32( a, N ); }
+	static inline V dupEven16( V a ) { return _mm_shufflehi_epi16( _mm_shufflelo_epi16( a, 0xA0 ), 0xA0 ); }
+	static inline V dupOdd16( V a ) { return _mm_shufflehi_epi16( _mm_shufflelo_epi16( a, 0xF5 ), 0xF5 ); }
+	static inline V packus16( V a, V b ) { return _mm_packus_epi16( a, b ); }
+	static inline V packs32( V a, V b ) { return _mm_packs_epi32( a, b ); }
+	static inline void interleave16( V a, V b, V &lo, V &hi )
+	{
+		lo = _mm_unpacklo_epi16( a, b );
+		hi = _mm_unpackhi_epi16( a, b );
+	}
+};
+
+typedef Vec::V V;
+
+#include "YUVKernels.h"
+
+} // namespace sse2
+
+#if defined(__clang__)
+# pragma clang attribute pop
+#else
+# pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+# pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#else
+# pragma GCC push_options
+# pragma GCC target("avx2")
+#endif
+
+namespace avx2
+{
+
+struct Vec
+{
+	static const int W = 32;
+	typedef __m256i V;
+
+	static inline V load( const uint8_t *p ) { return _mm256_loadu_si256( reinterpret_cast<const __m256i *>( p ) ); }
+	static inline void store( uint8_t *p, V v ) { _mm256_storeu_si256( reinterpret_cast<__m256i *>( p ), v ); }
+	static inline void storeHalf( uint8_t *p, V v ) { _mm_storeu_si128( reinterpret_cast<__m128i *>( p ), _mm256_castsi256_si128( v ) ); }
+	static inline V set16( int16_t x ) { return _mm256_set1_epi16( x ); }
+	static inline V set32( int32_t x ) { return _mm256_set1_epi32( x ); }
+	static inline V add16( V a, V b ) { return _mm256_add_epi16( a, b ); }
+	static inline V sub16( V a, V b ) { return _mm256_sub_epi16( a, b ); }
+	static inline V mulhi16( V a, V b ) { return _mm256_mulhi_epi16( a, b ); }
+	static inline V min16( V a, V b ) { return _mm256_min_epi16( a, b ); }
+	static inline V max16( V a, V b ) { return _mm256_max_epi16( a, b ); }
+	static inline V and_( V a, V b ) { return _mm256_and_si256( a, b ); }
+	static inline V or_( V a, V b ) { return _mm256_or_si256( a, b ); }
+	static inline V avg8( V a, V b ) { return _mm256_avg_epu8( a, b ); }
+	template <int N> static inline V slli16( V a ) { return _mm256_slli_epi16( a, N ); }
+	template <int N> static inline V srli16( V a ) { return _mm256_srli_epi16( a, N ); }
+	template <int N> static inline V srai16( V a ) { return _mm256_srai_epi16( a, N ); }
+	template <int N> static inline V srli32( V a ) { return _mm256_srli_epi32( a, N ); }
+	static inline V dupEven16( V a ) { return _mm256_shufflehi_epi16( _mm256_shufflelo_epi16( a, 0xA0 ), 0xA0 ); }
+	static inline V dupOdd16( V a ) { return _mm256_shufflehi_epi16( _mm256_shufflelo_epi16( a, 0xF5 ), 0xF5 ); }
+	// the packs and unpacks work within 128 bit lanes, put things
+	// back in order across the whole vector
+	static inline V packus16( V a, V b ) { return _mm256_permute4x64_epi64( _mm256_packus_epi16( a, b ), 0xD8 ); }
+	static inline V packs32( V a, V b ) { return _mm256_permute4x64_epi64( _mm256_packs_epi32( a, b ), 0xD8 ); }
+	static inline void interleave16( V a, V b, V &lo, V &hi )
+	{
+		V l = _mm256_unpacklo_epi16( a, b );
+		V h = _mm256_unpackhi_epi16( a, b );
+		lo = _mm256_permute2x128_si256( l, h, 0x20 );
+		hi = _mm256_permute2x128_si256( l, h, 0x31 );
+	}
+};
+
+typedef Vec::V V;
+
+#include "YUVKernels.h"
+
+} // namespace avx2
+
+#if defined(__clang__)
+# pragma clang attribute pop
+#else
+# pragma GCC pop_options
+#endif
+
+#endif
+
+
+////////////////////////////////////////
+
+
+static const USB::YUVKernels kScalar = { &scalar::rgbRow, &scalar::planarRows, &scalar::lumaRow };
+#if defined(__x86_64__) || defined(__i386__)
+static const USB::YUVKernels kSSE2 = { &sse2::rgbRow, &sse2::planarRows, &sse2::lumaRow };
+static const USB::YUVKernels kAVX2 = { &avx2::rgbRow, &avx2::planarRows, &avx2::lumaRow };
+#endif
+
+static const USB::YUVKernels *
+detectKernels( void )
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports( "avx2" ) )
+		return &kAVX2;
+	if ( __builtin_cpu_supports( "sse2" ) )
+		return &kSSE2;
+#endif
+	return &kScalar;
+}
+
+// checked once, the answer doesn't change
+static const USB::YUVKernels *
+bestKernels( void )
+{
+	static const USB::YUVKernels *k = detectKernels();
+	return k;
+}
+
+
+////////////////////////////////////////
+
+
+static void
+planar( const uint8_t *src, size_t srcStride, bool uyvy, int w, int h,
+		uint8_t *y, size_t yStride, uint8_t *u, size_t uStride,
+		uint8_t *v, size_t vStride, uint8_t *uv, size_t uvStride )
+{
+	const USB::YUVKernels *k = bestKernels();
+	w &= ~1;
+	for ( int r = 0; r < h; r += 2 )
+	{
+		const uint8_t *r0 = src + static_cast<size_t>( r ) * srcStride;
+		// an odd last row gets chroma of its own
+		bool pair = r + 1 < h;
+		const uint8_t *r1 = pair ? r0 + srcStride : r0;
+		uint8_t *y0 = y + static_cast<size_t>( r ) * yStride;
+		uint8_t *y1 = pair ? y0 + yStride : nullptr;
+		size_t cr = static_cast<size_t>( r / 2 );
+		uint8_t *cu = u ? u + cr * uStride : nullptr;
+		uint8_t *cv = v ? v + cr * vStride : nullptr;
+		uint8_t *cuv = uv ? uv + cr * uvStride : nullptr;
+
+		int x = k->planarRows( r0, r1, uyvy, w, y0, y1, cu, cv, cuv );
+		planarTail( r0, r1, uyvy, x, w, y0, y1, cu, cv, cuv );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+static bool
+roiSource( const USB::ImageBuffer &img, const uint8_t *&src, bool &uyvy )
+{
+	if ( img.format() != USB::ImageBuffer::Format::YUY2 &&
+		 img.format() != USB::ImageBuffer::Format::UYVY )
+		return false;
+
+	const USB::ROI &roi = img.roi();
+	if ( ! img.data() || ( roi.x & 1 ) != 0 || img.bytesPerPixel() != 2 )
+		return false;
+
+	uyvy = img.format() == USB::ImageBuffer::Format::UYVY;
+	src = img.data() + static_cast<size_t>( roi.y ) * img.stride() + static_cast<size_t>( roi.x ) * 2;
+	return true;
+}
+
+} // empty namespace
+
+
+////////////////////////////////////////
+
+
+namespace USB
+{
+
+
+////////////////////////////////////////
+
+
+YUVConverter::YUVConverter( Matrix m, Range r )
+		: myMatrix( m ), myRange( r ), myKernels( bestKernels() )
+{
+	update();
+}
+
+
+////////////////////////////////////////
+
+
+void
+YUVConverter::setMatrix( Matrix m )
+{
+	myMatrix = m;
+	update();
+}
+
+
+////////////////////////////////////////
+
+
+void
+YUVConverter::setRange( Range r )
+{
+	myRange = r;
+	update();
+}
+
+
+////////////////////////////////////////
+
+
+void
+YUVConverter::update( void )
+{
+	double kr, kb;
+	if ( myMatrix == Matrix::BT709 )
+	{
+		kr = 0.2126;
+		kb = 0.0722;
+	}
+	else
+	{
+		kr = 0.299;
+		kb = 0.114;
+	}
+	double kg = 1.0 - kr - kb;
+
+	double ys = 1.0, cs = 1.0;
+	myCoeffs.yOffset = 0;
+	if ( myRange == Range::LIMITED )
+	{
+		ys = 255.0 / 219.0;
+		cs = 255.0 / 224.0;
+		myCoeffs.yOffset = 16;
+	}
+
+	auto q13 = []( double v ) { return static_cast<int16_t>( std::floor( v * 8192.0 + 0.5 ) ); };
+	myCoeffs.yScale = q13( ys );
+	myCoeffs.rv = q13( 2.0 * ( 1.0 - kr ) * cs );
+	myCoeffs.gu = q13( 2.0 * kb * ( 1.0 - kb ) / kg * cs );
+	myCoeffs.gv = q13( 2.0 * kr * ( 1.0 - kr ) / kg * cs );
+	myCoeffs.bu = q13( 2.0 * ( 1.0 - kb ) * cs );
+}
+
+
+////////////////////////////////////////
+
+
+void
+YUVConverter::toRGB( const uint8_t *src, size_t srcStride, bool uyvy, int w, int h,
+					 uint8_t *dst, size_t dstStride, Layout l ) const
+{
+	w &= ~1;
+	for ( int r = 0; r < h; ++r )
+	{
+		const uint8_t *s = src + static_cast<size_t>( r ) * srcStride;
+		uint8_t *d = dst + static_cast<size_t>( r ) * dstStride;
+		int x = myKernels->rgbRow( myCoeffs, s, uyvy, w, d, l );
+		rgbTail( myCoeffs, s, uyvy, x, w, d, l );
+	}
+}
+
+
+////////////////////////////////////////
+
+
+bool
+YUVConverter::toRGB( const ImageBuffer &img, uint8_t *dst, size_t dstStride, Layout l ) const
+{
+	const uint8_t *src;
+	bool uyvy;
+	if ( ! roiSource( img, src, uyvy ) )
+		return false;
+	toRGB( src, img.stride(), uyvy, img.roi().w, img.roi().h, dst, dstStride, l );
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+YUVConverter::toI420( const uint8_t *src, size_t srcStride, bool uyvy, int w, int h,
+					  uint8_t *y, size_t yStride, uint8_t *u, size_t uStride,
+					  uint8_t *v, size_t vStride )
+{
+	planar( src, srcStride, uyvy, w, h, y, yStride, u, uStride, v, vStride, nullptr, 0 );
+}
+
+
+////////////////////////////////////////
+
+
+bool
+YUVConverter::toI420( const ImageBuffer &img, uint8_t *y, size_t yStride,
+					  uint8_t *u, size_t uStride, uint8_t *v, size_t vStride )
+{
+	const uint8_t *src;
+	bool uyvy;
+	if ( ! roiSource( img, src, uyvy ) )
+		return false;
+	toI420( src, img.stride(), uyvy, img.roi().w, img.roi().h, y, yStride, u, uStride, v, vStride );
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+YUVConverter::toNV12( const uint8_t *src, size_t srcStride, bool uyvy, int w, int h,
+					  uint8_t *y, size_t yStride, uint8_t *uv, size_t uvStride )
+{
+	planar( src, srcStride, uyvy, w, h, y, yStride, nullptr, 0, nullptr, 0, uv, uvStride );
+}
+
+
+////////////////////////////////////////
+
+
+bool
+YUVConverter::toNV12( const ImageBuffer &img, uint8_t *y, size_t yStride,
+					  uint8_t *uv, size_t uvStride )
+{
+	const uint8_t *src;
+	bool uyvy;
+	if ( ! roiSource( img, src, uyvy ) )
+		return false;
+	toNV12( src, img.stride(), uyvy, img.roi().w, img.roi().h, y, yStride, uv, uvStride );
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+void
+YUVConverter::toLuma( const uint8_t *src, size_t srcStride, bool uyvy, int w, int h,
+					  uint8_t *y, size_t yStride )
+{
+	const YUVKernels *k = bestKernels();
+	const int yo = uyvy ? 1 : 0;
+	for ( int r = 0; r < h; ++r )
+	{
+		const uint8_t *s = src + static_cast<size_t>( r ) * srcStride;
+		uint8_t *d = y + static_cast<size_t>( r ) * yStride;
+		for ( int x = k->lumaRow( s, uyvy, w, d ); x < w; ++x )
+			d[x] = s[x * 2 + yo];
+	}
+}
+
+
+////////////////////////////////////////
+
+
+bool
+YUVConverter::toLuma( const ImageBuffer &img, uint8_t *y, size_t yStride )
+{
+	const uint8_t *src;
+	bool uyvy;
+	if ( ! roiSource( img, src, uyvy ) )
+		return false;
+	toLuma( src, img.stride(), uyvy, img.roi().w, img.roi().h, y, yStride );
+	return true;
+}
+
+
+////////////////////////////////////////
+
+
+} // namespace USB
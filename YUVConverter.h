@@ -0,0 +1,126 @@
+// YUVConverter.h -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include "Stream.h"
+
+
+////////////////////////////////////////
+
+
+///
+/// @file YUVConverter.h
+///
+/// @author Kimball Thurston
+///
+
+namespace USB
+{
+
+struct YUVKernels;
+
+///
+/// @brief Class YUVConverter unpacks the 4:2:2 formats (YUY2 and
+/// UYVY) to RGB, to the usual planar layouts, or to just luma.
+///
+/// The math is 16 bit fixed point, done with AVX2 or SSE2, whichever
+/// the cpu has, and plain C++ otherwise, all of which give the same
+/// results. The raw versions take a pointer to the first pixel
+/// and the row stride in bytes, so they can run straight on
+/// ImageBuffer::data(), the ImageBuffer versions convert the ROI.
+/// Widths (and the ROI x offset) must be even so pixel pairs share
+/// their chroma.
+///
+class YUVConverter
+{
+public:
+	enum class Matrix
+	{
+		BT601,
+		BT709
+	};
+
+	enum class Range
+	{
+		LIMITED, ///< 16-235 luma, 16-240 chroma
+		FULL
+	};
+
+	enum class Layout
+	{
+		RGB24,
+		RGBA,
+		BGRA
+	};
+
+	YUVConverter( Matrix m = Matrix::BT601, Range r = Range::LIMITED );
+
+	void setMatrix( Matrix m );
+	Matrix matrix( void ) const { return myMatrix; }
+	void setRange( Range r );
+	Range range( void ) const { return myRange; }
+
+	void toRGB( const uint8_t *src, size_t srcStride, bool uyvy, int w, int h,
+				uint8_t *dst, size_t dstStride, Layout l ) const;
+	bool toRGB( const ImageBuffer &img, uint8_t *dst, size_t dstStride, Layout l ) const;
+
+	// chroma is averaged over each pair of rows, the planar layouts
+	// leave the values as they are so matrix and range don't apply
+	static void toI420( const uint8_t *src, size_t srcStride, bool uyvy, int w, int h,
+						uint8_t *y, size_t yStride, uint8_t *u, size_t uStride,
+						uint8_t *v, size_t vStride );
+	static bool toI420( const ImageBuffer &img, uint8_t *y, size_t yStride,
+						uint8_t *u, size_t uStride, uint8_t *v, size_t vStride );
+
+	static void toNV12( const uint8_t *src, size_t srcStride, bool uyvy, int w, int h,
+						uint8_t *y, size_t yStride, uint8_t *uv, size_t uvStride );
+	static bool toNV12( const ImageBuffer &img, uint8_t *y, size_t yStride,
+						uint8_t *uv, size_t uvStride );
+
+	static void toLuma( const uint8_t *src, size_t srcStride, bool uyvy, int w, int h,
+						uint8_t *y, size_t yStride );
+	static bool toLuma( const ImageBuffer &img, uint8_t *y, size_t yStride );
+
+	// 16 bit fixed point, see YUVConverter.cpp
+	struct Coeffs
+	{
+		int16_t yOffset;
+		int16_t yScale;
+		int16_t rv, gu, gv, bu;
+	};
+
+private:
+	void update( void );
+
+	Matrix myMatrix;
+	Range myRange;
+	Coeffs myCoeffs;
+	// picked for the cpu at construction
+	const YUVKernels *myKernels;
+};
+
+} // namespace USB
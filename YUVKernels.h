@@ -0,0 +1,158 @@
+// YUVKernels.h -*- C++ -*-
+
+//
+// Copyright (c) 2014 Kimball Thurston
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+// OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+
+// NB: no include guard, YUVConverter.cpp includes this once per
+// instruction set, inside a namespace that defines Vec and with the
+// matching target enabled. Nothing else should include it.
+
+
+////////////////////////////////////////
+
+
+///
+/// @file YUVKernels.h
+///
+/// @author Kimball Thurston
+///
+
+static inline V
+luma( V a, bool uyvy )
+{
+	return uyvy ? Vec::srli16<8>( a ) : Vec::and_( a, Vec::set16( 0xFF ) );
+}
+
+static inline V
+chroma( V a, bool uyvy )
+{
+	return uyvy ? Vec::and_( a, Vec::set16( 0xFF ) ) : Vec::srli16<8>( a );
+}
+
+static inline V
+finish( V a )
+{
+	a = Vec::srai16<2>( Vec::add16( a, Vec::set16( 2 ) ) );
+	return Vec::min16( Vec::max16( a, Vec::set16( 0 ) ), Vec::set16( 255 ) );
+}
+
+// W/2 pixels to 4 byte pixels in lo (the first half) and hi
+static inline void
+blockRGB( const Coeffs &k, V src, bool uyvy, Layout l, V &lo, V &hi )
+{
+	V c = chroma( src, uyvy );
+	V y4 = Vec::mulhi16( Vec::slli16<5>( Vec::sub16( luma( src, uyvy ), Vec::set16( k.yOffset ) ) ), Vec::set16( k.yScale ) );
+	V u5 = Vec::slli16<5>( Vec::sub16( Vec::dupEven16( c ), Vec::set16( 128 ) ) );
+	V v5 = Vec::slli16<5>( Vec::sub16( Vec::dupOdd16( c ), Vec::set16( 128 ) ) );
+
+	V r = finish( Vec::add16( y4, Vec::mulhi16( v5, Vec::set16( k.rv ) ) ) );
+	V g = finish( Vec::sub16( Vec::sub16( y4, Vec::mulhi16( u5, Vec::set16( k.gu ) ) ),
+							  Vec::mulhi16( v5, Vec::set16( k.gv ) ) ) );
+	V b = finish( Vec::add16( y4, Vec::mulhi16( u5, Vec::set16( k.bu ) ) ) );
+
+	const V alpha = Vec::set16( int16_t( 0xFF00 ) );
+	if ( l == Layout::BGRA )
+		Vec::interleave16( Vec::or_( b, Vec::slli16<8>( g ) ), Vec::or_( r, alpha ), lo, hi );
+	else
+		Vec::interleave16( Vec::or_( r, Vec::slli16<8>( g ) ), Vec::or_( b, alpha ), lo, hi );
+}
+
+static int
+rgbRow( const Coeffs &k, const uint8_t *src, bool uyvy, int w, uint8_t *dst, Layout l )
+{
+	const int n = Vec::W / 2;
+	int x = 0;
+	if ( l == Layout::RGB24 )
+	{
+		// write each pixel as 4 bytes, each overwriting the alpha of
+		// the one before, so stop short of the last pixel in the row
+		uint8_t tmp[Vec::W * 2];
+		for ( ; x + n < w; x += n )
+		{
+			V lo, hi;
+			blockRGB( k, Vec::load( src + x * 2 ), uyvy, l, lo, hi );
+			Vec::store( tmp, lo );
+			Vec::store( tmp + Vec::W, hi );
+			uint8_t *d = dst + x * 3;
+			for ( int i = 0; i < n; ++i )
+				memcpy( d + i * 3, tmp + i * 4, 4 );
+		}
+	}
+	else
+	{
+		for ( ; x + n <= w; x += n )
+		{
+			V lo, hi;
+			blockRGB( k, Vec::load( src + x * 2 ), uyvy, l, lo, hi );
+			Vec::store( dst + x * 4, lo );
+			Vec::store( dst + x * 4 + Vec::W, hi );
+		}
+	}
+	return x;
+}
+
+static int
+planarRows( const uint8_t *r0, const uint8_t *r1, bool uyvy, int w,
+			uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint8_t *uv )
+{
+	// W pixels (two vectors of source) per step
+	const int n = Vec::W;
+	const V low16 = Vec::set32( 0xFFFF );
+	int x = 0;
+	for ( ; x + n <= w; x += n )
+	{
+		V a0 = Vec::load( r0 + x * 2 );
+		V a1 = Vec::load( r0 + x * 2 + Vec::W );
+		V b0 = Vec::load( r1 + x * 2 );
+		V b1 = Vec::load( r1 + x * 2 + Vec::W );
+
+		Vec::store( y0 + x, Vec::packus16( luma( a0, uyvy ), luma( a1, uyvy ) ) );
+		if ( y1 )
+			Vec::store( y1 + x, Vec::packus16( luma( b0, uyvy ), luma( b1, uyvy ) ) );
+
+		V c0 = chroma( Vec::avg8( a0, b0 ), uyvy );
+		V c1 = chroma( Vec::avg8( a1, b1 ), uyvy );
+		if ( uv )
+			Vec::store( uv + x, Vec::packus16( c0, c1 ) );
+		else
+		{
+			V cu = Vec::packs32( Vec::and_( c0, low16 ), Vec::and_( c1, low16 ) );
+			V cv = Vec::packs32( Vec::srli32<16>( c0 ), Vec::srli32<16>( c1 ) );
+			Vec::storeHalf( u + x / 2, Vec::packus16( cu, cu ) );
+			Vec::storeHalf( v + x / 2, Vec::packus16( cv, cv ) );
+		}
+	}
+	return x;
+}
+
+static int
+lumaRow( const uint8_t *src, bool uyvy, int w, uint8_t *y )
+{
+	int x = 0;
+	for ( ; x + Vec::W <= w; x += Vec::W )
+	{
+		V a0 = Vec::load( src + x * 2 );
+		V a1 = Vec::load( src + x * 2 + Vec::W );
+		Vec::store( y + x, Vec::packus16( luma( a0, uyvy ), luma( a1, uyvy ) ) );
+	}
+	return x;
+}